@@ -0,0 +1,138 @@
+#!/bin/sh
+# Copyright (C) 2021 Torge Matthies
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#
+# Author contact info:
+#   E-Mail address: openglfreak@googlemail.com
+#   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D
+
+# Runs the echo benchmark: pipe_client.exe -> winestreamproxy -> echo_server
+# and back, once per combination of pipe mode, message size and connection
+# count. Prints a JSON array with one object per run to stdout.
+#
+# Environment variables:
+#   WINE                 Wine binary (default: wine)
+#   BENCH_PIPE_MODES     Pipe modes to test (default: "message byte")
+#   BENCH_SIZES          Message sizes in bytes (default: 16 B to 1 MiB)
+#   BENCH_CONNECTIONS    Concurrent connection counts (default: 1 to 256)
+#   BENCH_BYTES          Payload per run, used to pick the message count
+#                        (default: 64 MiB)
+#   BENCH_MIN_MESSAGES   Lower bound of messages per connection (default: 4)
+#   BENCH_MAX_MESSAGES   Upper bound of messages per connection
+#                        (default: 2000)
+
+# Find the script directory.
+# https://stackoverflow.com/a/29835459
+: "${script_dir:="$(CDPATH='' cd -- "$(dirname -- "$0")" && pwd -P)"}"
+
+: "${WINE:=wine}"
+: "${BENCH_PIPE_MODES:=message byte}"
+: "${BENCH_SIZES:=16 256 4096 65536 1048576}"
+: "${BENCH_CONNECTIONS:=1 4 16 64 256}"
+: "${BENCH_BYTES:=67108864}"
+: "${BENCH_MIN_MESSAGES:=4}"
+: "${BENCH_MAX_MESSAGES:=2000}"
+
+exe_path="${script_dir}/../winestreamproxy.exe"
+client_path="${script_dir}/pipe_client.exe"
+echo_path="${script_dir}/echo_server"
+
+for file in "${exe_path}" "${client_path}" "${echo_path}"; do
+    if ! [ -e "${file}" ]; then
+        printf 'error: %s not found, run "make bench" first\n' "${file}" >&2
+        exit 1
+    fi
+done
+
+work_dir="$(mktemp -d "${TMPDIR:-/tmp}/winestreamproxy-bench.XXXXXX")" || exit
+socket_path="${work_dir}/echo.sock"
+pipe_name="winestreamproxy-bench-$$"
+clk_tck="$(getconf CLK_TCK)"
+
+echo_pid=''
+proxy_pid=''
+cleanup() {
+    [ -n "${proxy_pid}" ] && kill "${proxy_pid}" 2>/dev/null && wait "${proxy_pid}" 2>/dev/null
+    [ -n "${echo_pid}" ] && kill "${echo_pid}" 2>/dev/null && wait "${echo_pid}" 2>/dev/null
+    rm -rf -- "${work_dir}"
+}
+trap cleanup EXIT
+trap 'exit 130' INT TERM
+
+# Prints the user + system CPU time of a process in clock ticks.
+cpu_ticks() {
+    if [ -n "$1" ] && [ -r "/proc/$1/stat" ]; then
+        # The command name may contain spaces, so count the fields after it.
+        sed 's/^.*) //' "/proc/$1/stat" | awk '{ print $12 + $13 }'
+    else
+        printf '0\n'
+    fi
+}
+
+# Pipe I/O under Wine is partly handled by wineserver, so its time is
+# reported separately.
+wineserver_pid() {
+    pgrep -n -x wineserver 2>/dev/null || :
+}
+
+"${echo_path}" "${socket_path}" &
+echo_pid="$!"
+while ! [ -S "${socket_path}" ]; do
+    if ! kill -0 "${echo_pid}" 2>/dev/null; then
+        printf 'error: echo server failed to start\n' >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+separator=''
+printf '[\n'
+for mode in ${BENCH_PIPE_MODES}; do
+    "${WINE}" "${exe_path}" --foreground --pipe-mode="${mode}" --pipe "${pipe_name}" --socket "${socket_path}" \
+        >"${work_dir}/proxy.log" 2>&1 &
+    proxy_pid="$!"
+    server_pid="$(wineserver_pid)"
+
+    for size in ${BENCH_SIZES}; do
+        for connections in ${BENCH_CONNECTIONS}; do
+            messages="$((BENCH_BYTES / (size * connections)))"
+            [ "${messages}" -lt "${BENCH_MIN_MESSAGES}" ] && messages="${BENCH_MIN_MESSAGES}"
+            [ "${messages}" -gt "${BENCH_MAX_MESSAGES}" ] && messages="${BENCH_MAX_MESSAGES}"
+
+            proxy_before="$(cpu_ticks "${proxy_pid}")"
+            server_before="$(cpu_ticks "${server_pid}")"
+            result="$("${WINE}" "${client_path}" "\\\\.\\pipe\\${pipe_name}" "${size}" "${connections}" \
+                                "${messages}" "${mode}" 2>>"${work_dir}/client.log")"
+            proxy_after="$(cpu_ticks "${proxy_pid}")"
+            server_after="$(cpu_ticks "${server_pid}")"
+
+            if [ -z "${result}" ]; then
+                printf 'warning: run failed: mode=%s size=%s connections=%s\n' \
+                       "${mode}" "${size}" "${connections}" >&2
+                continue
+            fi
+
+            # Append the CPU cost per message to the client's JSON object.
+            printf '%s' "${separator}"
+            printf '%s\n' "${result}" | awk -v proxy="$((proxy_after - proxy_before))" \
+                                            -v server="$((server_after - server_before))" -v hz="${clk_tck}" '{
+                match($0, /"messages":[0-9]+/)
+                n = substr($0, RSTART + 11, RLENGTH - 11) + 0
+                if (n == 0) n = 1
+                sub(/}$/, "")
+                printf("  %s,\"proxy_cpu_us_per_msg\":%.2f,\"wineserver_cpu_us_per_msg\":%.2f}",
+                       $0, proxy * 1000000 / hz / n, server * 1000000 / hz / n)
+            }'
+            separator=',
+'
+        done
+    done
+
+    kill "${proxy_pid}" 2>/dev/null
+    wait "${proxy_pid}" 2>/dev/null
+    proxy_pid=''
+done
+printf '\n]\n'
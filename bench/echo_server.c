@@ -0,0 +1,130 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+/* Native stand-in for the server behind the proxy. Sends everything it receives on a Unix domain socket straight
+   back, one thread per client so that a slow client cannot stall the others. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define ECHO_BUFFER_SIZE 65536
+
+static int echo_write_all(int const fd, char const* buffer, size_t length)
+{
+    while (length)
+    {
+        ssize_t const written = write(fd, buffer, length);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        buffer += written;
+        length -= (size_t)written;
+    }
+    return 1;
+}
+
+static void* echo_client_thread(void* const param)
+{
+    int const fd = (int)(size_t)param;
+    char* const buffer = (char*)malloc(ECHO_BUFFER_SIZE);
+
+    if (buffer)
+    {
+        for (;;)
+        {
+            ssize_t const received = read(fd, buffer, ECHO_BUFFER_SIZE);
+            if (received == -1 && errno == EINTR)
+                continue;
+            if (received <= 0 || !echo_write_all(fd, buffer, (size_t)received))
+                break;
+        }
+        free(buffer);
+    }
+
+    close(fd);
+    return 0;
+}
+
+int main(int const argc, char** const argv)
+{
+    struct sockaddr_un addr;
+    pthread_attr_t attr;
+    int listen_fd;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <socket path>\n", argv[0]);
+        return 2;
+    }
+    if (strlen(argv[1]) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", argv[1]);
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, argv[1]);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1)
+    {
+        perror("socket");
+        return 1;
+    }
+    unlink(argv[1]);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0)
+    {
+        perror(argv[1]);
+        close(listen_fd);
+        return 1;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 65536);
+
+    for (;;)
+    {
+        pthread_t thread;
+        int const fd = accept(listen_fd, 0, 0);
+
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            break;
+        }
+        if (pthread_create(&thread, &attr, echo_client_thread, (void*)(size_t)fd) != 0)
+            close(fd);
+    }
+
+    pthread_attr_destroy(&attr);
+    close(listen_fd);
+    unlink(argv[1]);
+    return 1;
+}
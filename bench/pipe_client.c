@@ -0,0 +1,291 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+/* Load generator that runs inside Wine. Every thread opens its own pipe client, sends a message, waits until the
+   echo of the whole message has arrived and records the round trip time. The results of one run are printed as a
+   single JSON object. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <windef.h>
+#include <winbase.h>
+#include <winerror.h>
+
+#define CONNECT_TIMEOUT_MS 10000
+
+typedef struct bench_client {
+    char const*         pipe_path;
+    BOOL                message_mode;
+    size_t              message_size;
+    size_t              message_count;
+    HANDLE              start_event;
+    HANDLE              thread;
+    LONGLONG*           latencies;      /* Round trip times in performance counter ticks. */
+    size_t              completed;
+    BOOL                failed;
+} bench_client;
+
+static HANDLE bench_open_pipe(char const* const pipe_path, BOOL const message_mode)
+{
+    DWORD const start = GetTickCount();
+    DWORD mode = message_mode ? PIPE_READMODE_MESSAGE : PIPE_READMODE_BYTE;
+
+    for (;;)
+    {
+        HANDLE const pipe = CreateFileA(pipe_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                                        FILE_FLAG_OVERLAPPED, NULL);
+        if (pipe != INVALID_HANDLE_VALUE)
+        {
+            if (!SetNamedPipeHandleState(pipe, &mode, NULL, NULL))
+            {
+                CloseHandle(pipe);
+                return INVALID_HANDLE_VALUE;
+            }
+            return pipe;
+        }
+
+        /* The proxy may still be starting up, or all of its pipe instances are in use right now. */
+        if (GetTickCount() - start >= CONNECT_TIMEOUT_MS)
+            return INVALID_HANDLE_VALUE;
+        if (GetLastError() == ERROR_PIPE_BUSY)
+            WaitNamedPipeA(pipe_path, 100);
+        else if (GetLastError() == ERROR_FILE_NOT_FOUND)
+            Sleep(50);
+        else
+            return INVALID_HANDLE_VALUE;
+    }
+}
+
+/* Writes the message and reads its echo at the same time. Waiting for the write first could deadlock with large
+   messages once every buffer between here and the echo server is full. */
+static BOOL bench_round_trip(HANDLE const pipe, HANDLE const events[2], unsigned char const* const message,
+                             unsigned char* const reply, size_t const size)
+{
+    OVERLAPPED write_overlapped, read_overlapped;
+    DWORD written, read;
+    size_t received = 0;
+    BOOL ok = TRUE;
+
+    ZeroMemory(&write_overlapped, sizeof(write_overlapped));
+    write_overlapped.hEvent = events[0];
+    if (!WriteFile(pipe, message, (DWORD)size, NULL, &write_overlapped) && GetLastError() != ERROR_IO_PENDING)
+        return FALSE;
+
+    while (received < size)
+    {
+        ZeroMemory(&read_overlapped, sizeof(read_overlapped));
+        read_overlapped.hEvent = events[1];
+        if (!ReadFile(pipe, reply + received, (DWORD)(size - received), NULL, &read_overlapped) &&
+            GetLastError() != ERROR_IO_PENDING && GetLastError() != ERROR_MORE_DATA)
+        {
+            ok = FALSE;
+            break;
+        }
+        /* A message larger than the remaining space is completed with ERROR_MORE_DATA, which still moved data. */
+        if (!GetOverlappedResult(pipe, &read_overlapped, &read, TRUE) && GetLastError() != ERROR_MORE_DATA)
+        {
+            ok = FALSE;
+            break;
+        }
+        if (read == 0)
+        {
+            ok = FALSE;
+            break;
+        }
+        received += read;
+    }
+
+    if (!ok)
+        CancelIo(pipe);
+    if (!GetOverlappedResult(pipe, &write_overlapped, &written, TRUE) || written != size)
+        ok = FALSE;
+    return ok;
+}
+
+static DWORD CALLBACK bench_client_thread(LPVOID const param)
+{
+    bench_client* const client = (bench_client*)param;
+    unsigned char* message;
+    unsigned char* reply;
+    HANDLE events[2];
+    HANDLE pipe;
+    size_t i;
+
+    client->failed = TRUE;
+
+    message = (unsigned char*)malloc(client->message_size);
+    reply = (unsigned char*)malloc(client->message_size);
+    events[0] = CreateEventA(NULL, TRUE, FALSE, NULL);
+    events[1] = CreateEventA(NULL, TRUE, FALSE, NULL);
+    pipe = bench_open_pipe(client->pipe_path, client->message_mode);
+    if (!message || !reply || !events[0] || !events[1] || pipe == INVALID_HANDLE_VALUE)
+        goto cleanup;
+
+    for (i = 0; i < client->message_size; ++i)
+        message[i] = (unsigned char)(i * 31 + 7);
+
+    /* Warm up the connection so that the first measured message does not include the connection setup. */
+    if (!bench_round_trip(pipe, events, message, reply, client->message_size))
+        goto cleanup;
+
+    WaitForSingleObject(client->start_event, INFINITE);
+
+    for (i = 0; i < client->message_count; ++i)
+    {
+        LARGE_INTEGER before, after;
+
+        QueryPerformanceCounter(&before);
+        if (!bench_round_trip(pipe, events, message, reply, client->message_size))
+            goto cleanup;
+        QueryPerformanceCounter(&after);
+
+        if (memcmp(message, reply, client->message_size) != 0)
+            goto cleanup;
+        client->latencies[i] = after.QuadPart - before.QuadPart;
+        client->completed = i + 1;
+    }
+    client->failed = FALSE;
+
+cleanup:
+    if (pipe != INVALID_HANDLE_VALUE)
+        CloseHandle(pipe);
+    if (events[1])
+        CloseHandle(events[1]);
+    if (events[0])
+        CloseHandle(events[0]);
+    free(reply);
+    free(message);
+    return 0;
+}
+
+static int bench_compare_latencies(void const* const a, void const* const b)
+{
+    LONGLONG const left = *(LONGLONG const*)a;
+    LONGLONG const right = *(LONGLONG const*)b;
+    return left < right ? -1 : left > right;
+}
+
+/* Nearest-rank percentile in microseconds; the samples are sorted. */
+static double bench_percentile(LONGLONG const* const samples, size_t const count, double const fraction,
+                               double const frequency)
+{
+    size_t rank;
+
+    if (count == 0)
+        return 0.0;
+    rank = (size_t)(fraction * (double)count + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > count)
+        rank = count;
+    return (double)samples[rank - 1] * 1000000.0 / frequency;
+}
+
+static BOOL bench_parse_size(char const* const text, size_t* const out_value)
+{
+    char* end;
+    unsigned long const value = strtoul(text, &end, 10);
+
+    if (*text == '\0' || *end != '\0' || value == 0)
+        return FALSE;
+    *out_value = (size_t)value;
+    return TRUE;
+}
+
+int main(int const argc, char** const argv)
+{
+    bench_client* clients;
+    LONGLONG* samples;
+    LARGE_INTEGER frequency, started, finished;
+    size_t message_size, connection_count, message_count, total = 0, failed = 0, i, j;
+    HANDLE start_event;
+    BOOL message_mode;
+    double elapsed;
+
+    if (argc != 6 || !bench_parse_size(argv[2], &message_size) || !bench_parse_size(argv[3], &connection_count) ||
+        !bench_parse_size(argv[4], &message_count) ||
+        (strcmp(argv[5], "message") != 0 && strcmp(argv[5], "byte") != 0))
+    {
+        fprintf(stderr, "Usage: %s <pipe path> <message size> <connections> <messages per connection> "
+                        "<message|byte>\n", argv[0]);
+        return 2;
+    }
+    message_mode = strcmp(argv[5], "message") == 0;
+
+    clients = (bench_client*)calloc(connection_count, sizeof(bench_client));
+    samples = (LONGLONG*)malloc(sizeof(LONGLONG) * connection_count * message_count);
+    start_event = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!clients || !samples || !start_event)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < connection_count; ++i)
+    {
+        clients[i].pipe_path = argv[1];
+        clients[i].message_mode = message_mode;
+        clients[i].message_size = message_size;
+        clients[i].message_count = message_count;
+        clients[i].start_event = start_event;
+        clients[i].latencies = samples + i * message_count;
+        clients[i].thread = CreateThread(NULL, 65536, bench_client_thread, &clients[i],
+                                         STACK_SIZE_PARAM_IS_A_RESERVATION, NULL);
+        if (!clients[i].thread)
+        {
+            fprintf(stderr, "Failed to start client thread %lu\n", (unsigned long)i);
+            return 1;
+        }
+    }
+
+    /* Let the clients connect and warm up before the clock starts; they wait for the start event afterwards. */
+    Sleep(200);
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&started);
+    SetEvent(start_event);
+    for (i = 0; i < connection_count; ++i)
+    {
+        WaitForSingleObject(clients[i].thread, INFINITE);
+        CloseHandle(clients[i].thread);
+    }
+    QueryPerformanceCounter(&finished);
+
+    /* Compact the samples of all clients so that they can be sorted together. */
+    for (i = 0; i < connection_count; ++i)
+    {
+        for (j = 0; j < clients[i].completed; ++j)
+            samples[total + j] = clients[i].latencies[j];
+        total += clients[i].completed;
+        if (clients[i].failed)
+            ++failed;
+    }
+    qsort(samples, total, sizeof(LONGLONG), bench_compare_latencies);
+
+    elapsed = (double)(finished.QuadPart - started.QuadPart) / (double)frequency.QuadPart;
+    if (elapsed <= 0.0)
+        elapsed = 1e-9;
+
+    printf("{\"pipe_mode\":\"%s\",\"message_size\":%lu,\"connections\":%lu,\"messages\":%lu,\"failed_connections\":%lu,"
+           "\"elapsed_s\":%.6f,\"msgs_per_s\":%.1f,\"mb_per_s\":%.3f,"
+           "\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f}}\n",
+           argv[5], (unsigned long)message_size, (unsigned long)connection_count, (unsigned long)total,
+           (unsigned long)failed, elapsed, (double)total / elapsed,
+           (double)total * (double)message_size / elapsed / 1000000.0,
+           bench_percentile(samples, total, 0.5, (double)frequency.QuadPart),
+           bench_percentile(samples, total, 0.99, (double)frequency.QuadPart),
+           bench_percentile(samples, total, 0.999, (double)frequency.QuadPart));
+
+    CloseHandle(start_event);
+    free(samples);
+    free(clients);
+    return failed ? 1 : 0;
+}
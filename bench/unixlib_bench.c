@@ -0,0 +1,441 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+/* Native test and microbenchmark for the unixlib. The unixlib sources are plain POSIX apart from the Wine handle
+   lookup, so they are compiled straight into this program and can be checked and timed without a Wine prefix.
+   Prints one JSON object with the results, exits with 1 if a check failed. */
+
+#ifndef __stdcall
+#define __stdcall
+#endif
+
+#include "../src/proxy_unixlib/reactor.c"
+#include "../src/proxy_unixlib/socket.c"
+#include "../src/proxy_unixlib/splice.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define BENCH_ITERATIONS 200000
+#define BENCH_WAKE_SAMPLES 20000
+#define BENCH_MESSAGE_SIZE 64
+
+static int bench_failures = 0;
+static char const* bench_separator = "";
+
+#define bench_check(expr) \
+    ((expr) ? (void)0 : (fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr), \
+                         (void)++bench_failures))
+
+static double bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void bench_report(char const* const name, double const ns_per_op, double const syscalls_per_op)
+{
+    printf("%s    \"%s\": {\"ns_per_op\": %.1f, \"syscalls_per_op\": %.2f}", bench_separator, name, ns_per_op,
+           syscalls_per_op);
+    bench_separator = ",\n";
+}
+
+static void bench_socketpair(int fds[2])
+{
+    bench_check(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    bench_check(socket_set_nonblocking(fds[0]) == 0);
+    bench_check(socket_set_nonblocking(fds[1]) == 0);
+}
+
+/* Functional checks of the edge cases the proxy relies on. */
+static void bench_run_checks(void)
+{
+    unsigned char message[BENCH_MESSAGE_SIZE], buffer[BENCH_MESSAGE_SIZE];
+    socket_buffer buffers[2];
+    reactor_event events[4];
+    recv_status status;
+    size_t written, received, pending, count;
+    reactor* r;
+    int fds[2], alive;
+
+    memset(message, 'x', sizeof(message));
+    bench_socketpair(fds);
+
+    /* Nothing queued: recv succeeds with 0 bytes instead of failing. */
+    bench_check(socket_recv(fds[1], buffer, sizeof(buffer), &status, &received, &pending) == 0);
+    bench_check(status == RECV_STATUS_SUCCESS && received == 0);
+
+    /* A buffer that is too small reports the rest as pending. */
+    bench_check(socket_send(fds[0], message, sizeof(message), &written) == 0 && written == sizeof(message));
+    bench_check(socket_recv(fds[1], buffer, 16, &status, &received, &pending) == 0);
+    bench_check(status == RECV_STATUS_MORE_DATA && received == 16 && pending == sizeof(message) - 16);
+    bench_check(socket_recv_part(fds[1], buffer, sizeof(buffer), &status, &received) == 0);
+    bench_check(status == RECV_STATUS_SUCCESS && received == sizeof(message) - 16);
+
+    buffers[0].data = message;
+    buffers[0].length = 10;
+    buffers[1].data = message + 10;
+    buffers[1].length = sizeof(message) - 10;
+    bench_check(socket_writev(fds[0], buffers, 2, &written) == 0 && written == sizeof(message));
+    bench_check(socket_recv_part(fds[1], buffer, sizeof(buffer), &status, &received) == 0);
+    bench_check(received == sizeof(message) && memcmp(buffer, message, sizeof(message)) == 0);
+
+    /* Reactor registrations are one-shot until rearmed. */
+    bench_check(reactor_create(&r) == 0);
+    bench_check(reactor_add(r, fds[1], REACTOR_EVENT_READABLE, &fds[1]) == 0);
+    bench_check(socket_send(fds[0], message, 1, &written) == 0);
+    bench_check(reactor_wait(r, events, 4, 1000, &count) == 0 && count == 1 && events[0].data == &fds[1]);
+    bench_check(reactor_wait(r, events, 4, 0, &count) == 0 && count == 0);
+    bench_check(reactor_rearm(r, fds[1], REACTOR_EVENT_READABLE, &fds[1]) == 0);
+    bench_check(reactor_wait(r, events, 4, 1000, &count) == 0 && count == 1);
+    bench_check(reactor_wake(r) == 0);
+    bench_check(reactor_wait(r, events, 4, 1000, &count) == 0 && count == 0);
+    bench_check(reactor_remove(r, fds[1]) == 0);
+    reactor_destroy(r);
+
+    /* Closing the peer is seen by probe and by recv. */
+    bench_check(socket_probe(fds[1], &alive) == 0 && alive);
+    close(fds[0]);
+    bench_check(socket_recv_part(fds[1], buffer, sizeof(buffer), &status, &received) == 0);
+    bench_check(socket_recv_part(fds[1], buffer, sizeof(buffer), &status, &received) == 0 &&
+                status == RECV_STATUS_CLOSED);
+    bench_check(socket_probe(fds[1], &alive) == 0 && !alive);
+    close(fds[1]);
+}
+
+static void bench_run_socket_calls(void)
+{
+    unsigned char message[BENCH_MESSAGE_SIZE], buffer[BENCH_MESSAGE_SIZE];
+    socket_buffer buffers[4];
+    recv_status status;
+    size_t written, received, pending, i;
+    unsigned long syscalls;
+    double start;
+    int fds[2], alive;
+
+    memset(message, 'x', sizeof(message));
+    for (i = 0; i < 4; ++i)
+    {
+        buffers[i].data = message + i * (BENCH_MESSAGE_SIZE / 4);
+        buffers[i].length = BENCH_MESSAGE_SIZE / 4;
+    }
+    bench_socketpair(fds);
+
+    /* Every send is drained right away so that the socket buffer never fills up. */
+    syscalls = socket_get_syscall_count();
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_ITERATIONS; ++i)
+    {
+        socket_send(fds[0], message, sizeof(message), &written);
+        socket_recv(fds[1], buffer, sizeof(buffer) * 2, &status, &received, &pending);
+    }
+    bench_report("send+recv", (bench_now_ns() - start) / BENCH_ITERATIONS,
+                 (double)(socket_get_syscall_count() - syscalls) / BENCH_ITERATIONS);
+
+    syscalls = socket_get_syscall_count();
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_ITERATIONS; ++i)
+    {
+        socket_send(fds[0], message, sizeof(message), &written);
+        socket_recv(fds[1], buffer, sizeof(buffer), &status, &received, &pending);
+    }
+    bench_report("send+recv_exact_fit", (bench_now_ns() - start) / BENCH_ITERATIONS,
+                 (double)(socket_get_syscall_count() - syscalls) / BENCH_ITERATIONS);
+
+    syscalls = socket_get_syscall_count();
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_ITERATIONS; ++i)
+    {
+        socket_send(fds[0], message, sizeof(message), &written);
+        socket_recv_part(fds[1], buffer, sizeof(buffer), &status, &received);
+    }
+    bench_report("send+recv_part", (bench_now_ns() - start) / BENCH_ITERATIONS,
+                 (double)(socket_get_syscall_count() - syscalls) / BENCH_ITERATIONS);
+
+    syscalls = socket_get_syscall_count();
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_ITERATIONS; ++i)
+    {
+        socket_writev(fds[0], buffers, 4, &written);
+        socket_recv_part(fds[1], buffer, sizeof(buffer), &status, &received);
+    }
+    bench_report("writev4+recv_part", (bench_now_ns() - start) / BENCH_ITERATIONS,
+                 (double)(socket_get_syscall_count() - syscalls) / BENCH_ITERATIONS);
+
+    syscalls = socket_get_syscall_count();
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_ITERATIONS; ++i)
+        socket_recv_part(fds[1], buffer, sizeof(buffer), &status, &received);
+    bench_report("recv_part_empty", (bench_now_ns() - start) / BENCH_ITERATIONS,
+                 (double)(socket_get_syscall_count() - syscalls) / BENCH_ITERATIONS);
+
+    syscalls = socket_get_syscall_count();
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_ITERATIONS; ++i)
+        socket_probe(fds[1], &alive);
+    bench_report("probe", (bench_now_ns() - start) / BENCH_ITERATIONS,
+                 (double)(socket_get_syscall_count() - syscalls) / BENCH_ITERATIONS);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void bench_run_splice(void)
+{
+    unsigned char message[BENCH_MESSAGE_SIZE], buffer[BENCH_MESSAGE_SIZE];
+    splice_channel* channel;
+    recv_status status;
+    size_t written, transferred, received, i;
+    unsigned long syscalls, far_end_syscalls, before;
+    double start, elapsed, far_end_elapsed;
+    int from[2], to[2], keep_boundaries;
+
+    memset(message, 'x', sizeof(message));
+    for (keep_boundaries = 0; keep_boundaries < 2; ++keep_boundaries)
+    {
+        bench_socketpair(from);
+        bench_socketpair(to);
+        bench_check(splice_open(from[1], to[0], keep_boundaries, &channel) == 0);
+
+        /* The send and the receive on the far ends are measured separately, they are not part of the transfer. */
+        syscalls = 0;
+        far_end_syscalls = 0;
+        elapsed = 0.0;
+        far_end_elapsed = 0.0;
+        for (i = 0; i < BENCH_ITERATIONS / 4; ++i)
+        {
+            before = socket_get_syscall_count();
+            start = bench_now_ns();
+            socket_send(from[0], message, sizeof(message), &written);
+            far_end_elapsed += bench_now_ns() - start;
+            far_end_syscalls += socket_get_syscall_count() - before;
+
+            before = socket_get_syscall_count();
+            start = bench_now_ns();
+            splice_transfer(channel, &status, &transferred);
+            elapsed += bench_now_ns() - start;
+            syscalls += socket_get_syscall_count() - before;
+
+            before = socket_get_syscall_count();
+            start = bench_now_ns();
+            socket_recv_part(to[1], buffer, sizeof(buffer), &status, &received);
+            far_end_elapsed += bench_now_ns() - start;
+            far_end_syscalls += socket_get_syscall_count() - before;
+        }
+        bench_check(received == sizeof(message));
+        bench_report(keep_boundaries ? "splice_transfer_copy" : "splice_transfer", elapsed / (BENCH_ITERATIONS / 4),
+                     (double)syscalls / (BENCH_ITERATIONS / 4));
+        bench_report(keep_boundaries ? "splice_far_ends_copy" : "splice_far_ends",
+                     far_end_elapsed / (BENCH_ITERATIONS / 4), (double)far_end_syscalls / (BENCH_ITERATIONS / 4));
+
+        splice_close(channel);
+        close(from[0]);
+        close(from[1]);
+        close(to[0]);
+        close(to[1]);
+    }
+}
+
+static void bench_run_reactor(void)
+{
+    unsigned char byte = 0;
+    reactor_event events[4];
+    size_t count, written, i;
+    reactor* r;
+    unsigned long syscalls;
+    double start;
+    int fds[2];
+
+    bench_socketpair(fds);
+    bench_check(reactor_create(&r) == 0);
+    bench_check(socket_send(fds[0], &byte, 1, &written) == 0);
+    bench_check(reactor_add(r, fds[1], REACTOR_EVENT_READABLE, &fds[1]) == 0);
+
+    /* The socket stays readable, so every wait returns it right away. */
+    syscalls = socket_get_syscall_count();
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_ITERATIONS; ++i)
+    {
+        reactor_wait(r, events, 4, -1, &count);
+        reactor_rearm(r, fds[1], REACTOR_EVENT_READABLE, &fds[1]);
+    }
+    bench_report("reactor_wait+rearm", (bench_now_ns() - start) / BENCH_ITERATIONS,
+                 (double)(socket_get_syscall_count() - syscalls) / BENCH_ITERATIONS);
+
+    syscalls = socket_get_syscall_count();
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_ITERATIONS; ++i)
+        reactor_wake(r);
+    bench_report("reactor_wake_signaled", (bench_now_ns() - start) / BENCH_ITERATIONS,
+                 (double)(socket_get_syscall_count() - syscalls) / BENCH_ITERATIONS);
+
+    reactor_destroy(r);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* Wakeup latency: One thread signals the event and notes the time, the waiting thread measures how long it took to
+   notice. The other threads signal the same event in a loop to create contention. */
+typedef struct bench_wake_state {
+    reactor_wake_event      event;
+    reactor*                reactor;        /* Waits through the reactor if set, polls the event directly otherwise. */
+    double volatile         signaled_at;
+    unsigned long volatile  sequence;
+    unsigned long volatile  acknowledged;
+    int volatile            stop;
+    double*                 samples;
+} bench_wake_state;
+
+static void* bench_wake_contender(void* const param)
+{
+    bench_wake_state* const state = (bench_wake_state*)param;
+    while (!state->stop)
+        reactor_signal_wake_event(state->event);
+    return 0;
+}
+
+static void* bench_wake_waiter(void* const param)
+{
+    bench_wake_state* const state = (bench_wake_state*)param;
+    unsigned long seen = 0;
+
+    while (seen < BENCH_WAKE_SAMPLES)
+    {
+        if (state->reactor)
+        {
+            reactor_event events[4];
+            size_t count;
+            reactor_wait(state->reactor, events, 4, 100, &count);
+        }
+        else
+        {
+            struct pollfd pfd;
+            pfd.fd = state->event.fds[0];
+            pfd.events = POLLIN;
+            poll(&pfd, 1, 100);
+            reactor_reset_wake_event(state->event);
+        }
+
+        /* Wakeups caused by the contenders don't count. */
+        if (__sync_fetch_and_add(&state->sequence, 0) != seen)
+        {
+            state->samples[seen] = bench_now_ns() - state->signaled_at;
+            seen = state->sequence;
+            __sync_synchronize();
+            state->acknowledged = seen;
+        }
+    }
+    return 0;
+}
+
+static int bench_compare_doubles(void const* const a, void const* const b)
+{
+    double const left = *(double const*)a;
+    double const right = *(double const*)b;
+    return left < right ? -1 : left > right;
+}
+
+static void bench_run_wake(char const* const name, reactor_wake_event const event, reactor* const r,
+                           size_t const contenders)
+{
+    pthread_t waiter, threads[8];
+    bench_wake_state state;
+    unsigned long i;
+    size_t j;
+
+    state.event = event;
+    state.reactor = r;
+    state.signaled_at = 0.0;
+    state.sequence = 0;
+    state.acknowledged = 0;
+    state.stop = 0;
+    state.samples = (double*)malloc(sizeof(double) * BENCH_WAKE_SAMPLES);
+    bench_check(state.samples != 0);
+    if (!state.samples)
+        return;
+
+    for (j = 0; j < contenders; ++j)
+        pthread_create(&threads[j], 0, bench_wake_contender, &state);
+    pthread_create(&waiter, 0, bench_wake_waiter, &state);
+
+    for (i = 0; i < BENCH_WAKE_SAMPLES; ++i)
+    {
+        /* Give the waiter a moment to block again, otherwise only the fast path is measured. */
+        while (state.acknowledged != i)
+            sched_yield();
+        state.signaled_at = bench_now_ns();
+        __sync_synchronize();
+        state.sequence = i + 1;
+        if (r)
+            reactor_wake(r);
+        else
+            reactor_signal_wake_event(event);
+    }
+
+    pthread_join(waiter, 0);
+    state.stop = 1;
+    for (j = 0; j < contenders; ++j)
+        pthread_join(threads[j], 0);
+
+    qsort(state.samples, BENCH_WAKE_SAMPLES, sizeof(double), bench_compare_doubles);
+    printf("%s    \"%s\": {\"contenders\": %lu, \"p50_ns\": %.0f, \"p99_ns\": %.0f, \"p999_ns\": %.0f}",
+           bench_separator, name, (unsigned long)contenders, state.samples[BENCH_WAKE_SAMPLES / 2],
+           state.samples[BENCH_WAKE_SAMPLES / 100 * 99], state.samples[BENCH_WAKE_SAMPLES / 1000 * 999]);
+    bench_separator = ",\n";
+    free(state.samples);
+}
+
+static void bench_run_wakes(void)
+{
+    static size_t const contender_counts[] = { 0, 1, 4 };
+    reactor_wake_event event;
+    reactor* r;
+    size_t i;
+    char name[64];
+
+    for (i = 0; i < sizeof(contender_counts) / sizeof(contender_counts[0]); ++i)
+    {
+        bench_check(reactor_create(&r) == 0);
+        sprintf(name, "wake_reactor_%lu", (unsigned long)contender_counts[i]);
+        bench_run_wake(name, r->wake_event, r, contender_counts[i]);
+        reactor_destroy(r);
+
+        bench_check(reactor_create_wake_event(&event) == 0);
+        sprintf(name, "wake_event_%lu", (unsigned long)contender_counts[i]);
+        bench_run_wake(name, event, 0, contender_counts[i]);
+        reactor_close_wake_event(event);
+
+        bench_check(reactor_create_wake_pipe(&event) == 0);
+        sprintf(name, "wake_pipe_%lu", (unsigned long)contender_counts[i]);
+        bench_run_wake(name, event, 0, contender_counts[i]);
+        reactor_close_wake_event(event);
+    }
+}
+
+int main(void)
+{
+    bench_run_checks();
+
+    printf("{\n");
+    bench_run_socket_calls();
+    bench_run_splice();
+    bench_run_reactor();
+    bench_run_wakes();
+    printf("%s    \"failed_checks\": %d\n}\n", bench_separator, bench_failures);
+
+    return bench_failures ? 1 : 0;
+}
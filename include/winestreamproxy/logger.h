@@ -12,6 +12,7 @@
 #ifndef __WINESTREAMPROXY_LOGGER_H__
 #define __WINESTREAMPROXY_LOGGER_H__
 
+#include <stddef.h>
 #ifdef _UNICODE
 #include <wchar.h>
 #endif /* defined(_UNICODE) */
@@ -29,7 +30,13 @@ typedef enum LOG_LEVEL {
     LOG_LEVEL_CRITICAL = 5
 } LOG_LEVEL;
 
+typedef enum LOG_OVERFLOW_POLICY {
+    LOG_OVERFLOW_BLOCK, /* Wait until the writer thread has made room. */
+    LOG_OVERFLOW_DROP   /* Discard the message, the number of dropped messages is logged later. */
+} LOG_OVERFLOW_POLICY;
+
 typedef struct logger_instance logger_instance;
+typedef struct log_async_queue log_async_queue;
 
 typedef int (*log_message_callback)(logger_instance* logger, LOG_LEVEL level, void const* message);
 
@@ -39,6 +46,9 @@ struct logger_instance {
     void* impl_data;
 
     unsigned int enabled_log_levels;
+    log_async_queue* async_queue;
+    unsigned int traced_log_levels;
+    unsigned int recorded_log_levels;   /* enabled_log_levels | traced_log_levels, updated by the macros below. */
 };
 
 extern int log_create_logger(log_message_callback log_message, unsigned char character_size,
@@ -46,11 +56,46 @@ extern int log_create_logger(log_message_callback log_message, unsigned char cha
 #define log_set_callback(logger, callback) ((void)(logger->log_message = callback))
 #define log_get_impl_data(logger, data) (logger->impl_data)
 #define log_set_impl_data(logger, data) ((void)(logger->impl_data = data))
-#define log_enable_level(logger, level) ((void)(logger->enabled_log_levels |= 1U << (level)))
-#define log_disable_level(logger, level) ((void)(logger->enabled_log_levels &= ~(1U << (level))))
-#define log_set_min_level(logger, level) ((void)(logger->enabled_log_levels = ~0U << (level)))
+#define log_update_recorded_levels(logger) \
+    ((void)(logger->recorded_log_levels = logger->enabled_log_levels | logger->traced_log_levels))
+#define log_enable_level(logger, level) \
+    ((void)(logger->enabled_log_levels |= 1U << (level)), log_update_recorded_levels(logger))
+#define log_disable_level(logger, level) \
+    ((void)(logger->enabled_log_levels &= ~(1U << (level))), log_update_recorded_levels(logger))
+#define log_set_min_level(logger, level) \
+    ((void)(logger->enabled_log_levels = ~0U << (level)), log_update_recorded_levels(logger))
+#define log_set_min_trace_level(logger, level) \
+    ((void)(logger->traced_log_levels = ~0U << (level)), log_update_recorded_levels(logger))
 extern void log_destroy_logger(logger_instance* logger);
 
+/* Lets a background thread call the callback, so that logging only copies the formatted message into a queue.
+   log_get_file_and_line and log_get_thread_id describe the logged message in the callback either way. Queued
+   messages are written by log_flush, by log_destroy_logger and when the process exits. */
+extern int log_start_async(logger_instance* logger, size_t queue_length, LOG_OVERFLOW_POLICY overflow_policy);
+extern void log_flush(logger_instance* logger);
+
+/* Records messages at the traced levels, all of them by default, into a binary trace file without formatting them.
+   Every thread collects its messages in a buffer of its own, which is written out when it is full, when a message
+   at LOG_LEVEL_ERROR or above is recorded, by log_flush and when the thread or the process exits. The file is
+   renamed to <path>.old once it grows beyond max_file_size bytes, 0 for no limit. Messages at enabled levels are
+   still passed to the callback. winestreamproxy-tracedump turns trace files back into text. */
+extern int log_start_trace(logger_instance* logger, char const* path, size_t max_file_size);
+#ifdef _UNICODE
+extern int wlog_start_trace(logger_instance* logger, wchar_t const* path, size_t max_file_size);
+#endif /* defined(_UNICODE) */
+
+/* Formats the message on the stack if it fits and passes it on in a single call. Fiber local storage is only touched
+   when the callback is called right away, so that log_get_file_and_line and log_get_thread_id work in it, or when the
+   message is traced. Used by the LOG_* macros. */
+extern int log_write_message(logger_instance* logger, LOG_LEVEL level, char const* file, long line,
+                             char const* format, ...);
+#ifdef _UNICODE
+extern int wlog_write_message(logger_instance* logger, LOG_LEVEL level, wchar_t const* file, long line,
+                              wchar_t const* format, ...);
+#endif /* defined(_UNICODE) */
+
+/* Two-step form of the above, log_init_message keeps the message context in fiber local storage until
+   log_print_message is called. */
 extern int log_init_message(logger_instance* logger, LOG_LEVEL level, char const* file, long line);
 extern int log_print_message(char const* format, ...);
 #ifdef _UNICODE
@@ -59,19 +104,29 @@ extern int wlog_print_message(wchar_t const* format, ...);
 #endif /* defined(_UNICODE) */
 
 extern void log_get_file_and_line(void const** file, long* line);
+extern unsigned long log_get_thread_id(void);
 
 #define LOG_IS_ENABLED(logger, level) (!!((1U << (level)) & (logger)->enabled_log_levels))
+#define LOG_IS_TRACED(logger, level) (!!((1U << (level)) & (logger)->traced_log_levels))
+#define LOG_IS_RECORDED(logger, level) (!!((1U << (level)) & (logger)->recorded_log_levels))
+
+/* Removes the parentheses around the message arguments of the LOG_* macros. */
+#if defined(__GNUC__) || defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wvariadic-macros"
+#endif /* defined(__GNUC__) || defined(__clang__) */
+#define LOG_UNPACK(...) __VA_ARGS__
+#if defined(__GNUC__) || defined(__clang__)
+#pragma GCC diagnostic pop
+#endif /* defined(__GNUC__) || defined(__clang__) */
 
 #define LOG_NARROW(logger, level, message) \
-    (LOG_IS_ENABLED(logger, level) ? ( \
-        log_init_message((logger), (level), __FILE__, __LINE__) ? log_print_message message : 0 \
-    ) : 1)
+    (LOG_IS_RECORDED(logger, level) ? log_write_message((logger), (level), __FILE__, __LINE__, LOG_UNPACK message) : 1)
 #define LOG_MAKE_WIDE_STR2(x) L ## x
 #define LOG_MAKE_WIDE_STR(x) LOG_MAKE_WIDE_STR2(x)
 #define LOG_WIDE(logger, level, message) \
-    (LOG_IS_ENABLED(logger, level) ? ( \
-        wlog_init_message((logger), (level), LOG_MAKE_WIDE_STR(__FILE__), __LINE__) ? wlog_print_message message : 0 \
-    ) : 1)
+    (LOG_IS_RECORDED(logger, level) ? \
+        wlog_write_message((logger), (level), LOG_MAKE_WIDE_STR(__FILE__), __LINE__, LOG_UNPACK message) : 1)
 #ifdef _UNICODE
 #define LOG(logger, level, message) LOG_WIDE(logger, level, message)
 #else /* !defined(_UNICODE) */
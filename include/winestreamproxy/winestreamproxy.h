@@ -23,9 +23,22 @@
 extern "C" {
 #endif /* defined(__cplusplus) */
 
+typedef enum PROXY_PIPE_MODE {
+    PROXY_PIPE_MODE_DEFAULT,    /* The tuning value, or message mode if that is the default too. */
+    PROXY_PIPE_MODE_MESSAGE,    /* Every write is read back as one message. */
+    PROXY_PIPE_MODE_BYTE        /* A stream without boundaries, which needs fewer reads for bulk data. */
+} PROXY_PIPE_MODE;
+
+/* One route: clients of the named pipe are forwarded to the Unix socket, or the other way around if reversed. */
 typedef struct proxy_paths {
     TCHAR const*    named_pipe_path;
     char const*     unix_socket_path;
+    BOOL            reverse;    /* Listen on the Unix socket and connect to the named pipe. */
+    unsigned int    connect_timeout; /* Milliseconds to wait for the server socket, 0 for the tuning value. */
+    BOOL            bulk;           /* Use the bulk profile even if the tuning doesn't. */
+    PROXY_PIPE_MODE pipe_mode;
+    unsigned int    pipe_buffer_size;   /* Bytes of each pipe buffer, 0 for the tuning value. */
+    unsigned int    socket_buffer_size; /* Bytes of SO_SNDBUF and SO_RCVBUF, 0 for the tuning value. */
 } proxy_paths;
 
 extern TCHAR* pipe_name_to_path(logger_instance* logger, TCHAR const* named_pipe_name);
@@ -44,8 +57,39 @@ typedef struct proxy_data proxy_data;
 typedef void (*proxy_state_change_callback)(logger_instance* logger, proxy_data* proxy, PROXY_STATE prev_state,
                                             PROXY_STATE new_state);
 
+typedef struct proxy_tuning {
+    unsigned int    io_worker_count;            /* I/O worker threads kept running, 0 to choose automatically. */
+    unsigned int    io_worker_max;              /* Workers that may run while others are busy, 0 for the default. */
+    unsigned int    io_worker_idle_timeout;     /* Milliseconds until extra workers exit, 0 for the default. */
+    BOOL            splice;                     /* Move data in the kernel if Wine exposes the pipe's host fd. */
+    unsigned int    pipe_write_queue_depth;     /* Pipe writes in flight per connection, 0 for the default. */
+    unsigned int    pipe_write_high_watermark;  /* Queued writes that pause the socket reader, 0 for the depth. */
+    unsigned int    pipe_write_low_watermark;   /* Queued writes that resume the socket reader, 0 for a quarter. */
+    unsigned int    listen_instance_count;      /* Pipe instances per route waiting for clients, 0 for the default. */
+    unsigned int    stop_timeout;               /* Milliseconds to wait for connections to close, 0 for the default. */
+    unsigned int    socket_pool_size;           /* Server sockets per route connected ahead of time, 0 for none. */
+    unsigned int    connect_timeout;            /* Milliseconds to wait for a busy server socket, 0 for the default. */
+    unsigned int    reconnect_timeout;          /* Milliseconds to wait for a lost server to return, 0 to disconnect. */
+    unsigned int    replay_messages;            /* First client messages re-sent after reconnecting. */
+    BOOL            frames;                     /* Pass socket data to the pipe as whole Discord IPC frames. */
+    unsigned int    max_frame_size;             /* Largest frame payload in bytes, 0 for the default. */
+    unsigned int    activity_interval;          /* Milliseconds between presence updates, 0 to send all of them. */
+    BOOL            bulk;                       /* Byte mode and large buffers for throughput rather than latency. */
+    PROXY_PIPE_MODE pipe_mode;                  /* Mode of the named pipes, explicit values override the profile. */
+    unsigned int    pipe_buffer_size;           /* Bytes of each pipe buffer, 0 for the profile's size. */
+    unsigned int    socket_buffer_size;         /* Bytes of SO_SNDBUF and SO_RCVBUF, 0 for the profile's size. */
+    char const*     metrics_socket_path;        /* Unix socket that serves traffic counters, null for none. */
+    unsigned int    log_queue_length;           /* Messages queued for the log writer thread, 0 for the default. */
+    BOOL            log_sync;                   /* Write log messages from the logging thread instead. */
+    BOOL            log_drop;                   /* Drop log messages while the queue is full instead of waiting. */
+    TCHAR const*    trace_file_path;            /* Binary trace file that records all log messages, null for none. */
+    unsigned int    trace_file_size;            /* MiB at which the trace file is rotated, 0 for the default. */
+} proxy_tuning;
+
 typedef struct proxy_parameters {
-    proxy_paths                 paths;
+    proxy_paths const*          routes;     /* Copied by proxy_create, the strings have to outlive the proxy. */
+    unsigned int                route_count;
+    proxy_tuning                tuning;
     HANDLE                      exit_event; /* Must be manual-reset. */
     proxy_state_change_callback state_change_callback;
 } proxy_parameters;
@@ -46,6 +46,15 @@ foreach_reverse() {
     done
 }
 
+# Calls the function in the first parameter with the pipe name and the socket
+# path of every route in the routes setting, in reverse order.
+foreach_route_reverse() {
+    route_func="$1"
+    route_split() { "${route_func}" "${1%%=*}" "${1#*=}"; }
+    split '
+' "${routes}" foreach_reverse route_split
+}
+
 # Define settings helper functions.
 settings_found=false
 load_settings_file() {
@@ -74,7 +83,31 @@ load_settings() {
     check_settings_found
     pipe_name="${WINESTREAMPROXY_PIPE_NAME:-${pipe_name}}"
     socket_path="${WINESTREAMPROXY_SOCKET_PATH:-${socket_path}}"
+    routes="${WINESTREAMPROXY_ROUTES:-${routes}}"
+    reverse="${WINESTREAMPROXY_REVERSE:-${reverse}}"
     system="${WINESTREAMPROXY_SYSTEM:-${system}}"
+    io_workers="${WINESTREAMPROXY_IO_WORKERS:-${io_workers}}"
+    io_max="${WINESTREAMPROXY_IO_MAX:-${io_max}}"
+    splice="${WINESTREAMPROXY_SPLICE:-${splice}}"
+    write_queue="${WINESTREAMPROXY_WRITE_QUEUE:-${write_queue}}"
+    listeners="${WINESTREAMPROXY_LISTENERS:-${listeners}}"
+    socket_pool="${WINESTREAMPROXY_SOCKET_POOL:-${socket_pool}}"
+    connect_timeout="${WINESTREAMPROXY_CONNECT_TIMEOUT:-${connect_timeout}}"
+    reconnect="${WINESTREAMPROXY_RECONNECT:-${reconnect}}"
+    replay="${WINESTREAMPROXY_REPLAY:-${replay}}"
+    frames="${WINESTREAMPROXY_FRAMES:-${frames}}"
+    max_frame="${WINESTREAMPROXY_MAX_FRAME:-${max_frame}}"
+    activity_interval="${WINESTREAMPROXY_ACTIVITY_INTERVAL:-${activity_interval}}"
+    bulk="${WINESTREAMPROXY_BULK:-${bulk}}"
+    pipe_mode="${WINESTREAMPROXY_PIPE_MODE:-${pipe_mode}}"
+    pipe_buffer="${WINESTREAMPROXY_PIPE_BUFFER:-${pipe_buffer}}"
+    socket_buffer="${WINESTREAMPROXY_SOCKET_BUFFER:-${socket_buffer}}"
+    metrics="${WINESTREAMPROXY_METRICS:-${metrics}}"
+    log_queue="${WINESTREAMPROXY_LOG_QUEUE:-${log_queue}}"
+    log_sync="${WINESTREAMPROXY_LOG_SYNC:-${log_sync}}"
+    log_drop="${WINESTREAMPROXY_LOG_DROP:-${log_drop}}"
+    trace_file="${WINESTREAMPROXY_TRACE_FILE:-${trace_file}}"
+    trace_size="${WINESTREAMPROXY_TRACE_SIZE:-${trace_size}}"
 }
 
 # Function that can be used to check the architecture of a Wine prefix.
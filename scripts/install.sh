@@ -110,5 +110,52 @@ cp -- "${dll_path:?}" "${destdir}/${dll_name}"
 
 # Register the service.
 binpath="$(escape_param "C:\\winestreamproxy\\${exe_name}") --pipe $(escape_param "${pipe_name}") --socket $(escape_param "${socket_path}") --svchost"
+route_params=''
+add_route() {
+    route_params=" $(escape_param "$1") $(escape_param "$2")${route_params}"
+}
+foreach_route_reverse add_route
+if [ "${reverse}" = 'true' ]; then
+    binpath="${binpath} --reverse"
+fi
+
+# The trace file is opened through Wine, so it needs a Windows path.
+if [ -n "${trace_file}" ]; then
+    trace_file="$(run_wine 'C:\windows\system32\winepath.exe' -w \
+                           "${trace_file}"; echo x)" || exit
+    trace_file="${trace_file%?x}"
+    trace_file="${trace_file%$(printf '\r')}"  # Work around old Wine bug
+fi
+
+# Pass the tuning settings the same way as start.sh, empty ones are left out.
+add_option() {
+    if [ -n "$2" ]; then
+        binpath="${binpath} $1=$(escape_param "$2")"
+    fi
+}
+add_option --io-workers "${io_workers}"
+add_option --io-max "${io_max}"
+add_option --splice "${splice}"
+add_option --write-queue "${write_queue}"
+add_option --listeners "${listeners}"
+add_option --socket-pool "${socket_pool}"
+add_option --connect-timeout "${connect_timeout}"
+add_option --reconnect "${reconnect}"
+add_option --replay "${replay}"
+add_option --frames "${frames}"
+add_option --max-frame "${max_frame}"
+add_option --activity-interval "${activity_interval}"
+add_option --bulk "${bulk}"
+add_option --pipe-mode "${pipe_mode}"
+add_option --pipe-buffer "${pipe_buffer}"
+add_option --socket-buffer "${socket_buffer}"
+add_option --metrics "${metrics}"
+add_option --log-queue "${log_queue}"
+add_option --log-sync "${log_sync}"
+add_option --log-drop "${log_drop}"
+add_option --trace-file "${trace_file}"
+add_option --trace-size "${trace_size}"
+
+binpath="${binpath}${route_params}"
 run_wine 'C:\windows\system32\sc.exe' create winestreamproxy start= auto \
                                       binpath= "${binpath}" || exit 1
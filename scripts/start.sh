@@ -70,9 +70,9 @@ fi
 # Load settings file.
 load_settings || exit
 
-# Check whether the socket exists.
-if ! [ -e "${socket_path}" ]; then
-    printf 'warning: %s does not exist\n' "${socket_path}" >&2
+# Check whether the socket exists, without the route options that may follow it.
+if ! [ -e "${socket_path%%;*}" ]; then
+    printf 'warning: %s does not exist\n' "${socket_path%%;*}" >&2
 fi
 
 # Find path to the Wine binary.
@@ -99,6 +99,41 @@ if [ x"${__start_dummy_process:-false}" = x'true' ]; then
     start_dummy_process
 fi
 
+# Quotes a string for use in eval.
+quote_param() {
+    printf "'%s'\n" "$(printf '%s\n' "$1" | sed "s/'/'\\\\''/g")"
+}
+
+# Pass the additional routes as pairs of positional parameters.
+route_params=''
+add_route() {
+    route_params="$(quote_param "$1") $(quote_param "$2") ${route_params}"
+}
+foreach_route_reverse add_route
+eval "set -- ${route_params} \${1+\"\$@\"}"
+
+# The trace file is opened through Wine, so it needs a Windows path.
+if [ -n "${trace_file}" ]; then
+    trace_file="$(run_wine 'C:\windows\system32\winepath.exe' -w \
+                           "${trace_file}"; echo x)" || exit
+    trace_file="${trace_file%?x}"
+    trace_file="${trace_file%$(printf '\r')}"  # Work around old Wine bug
+fi
+
 # Start winestreamproxy in the background and wait until the proxy loop is running.
 run_wine "${exe_path}" --pipe "${pipe_name}" --socket "${socket_path}" \
-                       ${system+--system="${system}"} ${1+"$@"}
+                       ${system+--system="${system}"} ${reverse+--reverse="${reverse}"} \
+                       ${io_workers:+--io-workers="${io_workers}"} \
+                       ${io_max:+--io-max="${io_max}"} \
+                       ${splice+--splice="${splice}"} ${write_queue:+--write-queue="${write_queue}"} \
+                       ${listeners:+--listeners="${listeners}"} ${socket_pool:+--socket-pool="${socket_pool}"} \
+                       ${connect_timeout:+--connect-timeout="${connect_timeout}"} \
+                       ${reconnect:+--reconnect="${reconnect}"} ${replay:+--replay="${replay}"} \
+                       ${frames+--frames="${frames}"} ${max_frame:+--max-frame="${max_frame}"} \
+                       ${activity_interval:+--activity-interval="${activity_interval}"} \
+                       ${bulk+--bulk="${bulk}"} ${pipe_mode:+--pipe-mode="${pipe_mode}"} \
+                       ${pipe_buffer:+--pipe-buffer="${pipe_buffer}"} ${socket_buffer:+--socket-buffer="${socket_buffer}"} \
+                       ${metrics:+--metrics="${metrics}"} ${log_queue:+--log-queue="${log_queue}"} \
+                       ${log_sync+--log-sync="${log_sync}"} ${log_drop+--log-drop="${log_drop}"} \
+                       ${trace_file:+--trace-file="${trace_file}"} ${trace_size:+--trace-size="${trace_size}"} \
+                       ${1+"$@"}
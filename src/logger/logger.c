@@ -8,12 +8,14 @@
  *   E-Mail address: openglfreak@googlemail.com
  *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
 
+#include "trace_format.h"
 #include <winestreamproxy/logger.h>
 
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <wchar.h>
 
 #ifndef __WINE__
@@ -26,113 +28,1205 @@
 DWORD fls_index;
 BOOL fls_index_initialized = FALSE;
 
+typedef struct log_trace_buffer log_trace_buffer;
+
 typedef struct fiber_local_data {
     BOOL do_log;
+    BOOL do_trace;
     LOG_LEVEL level;
     void const* file;
     unsigned char file_char_size;
     void const* converted_file;
     long line;
+    DWORD thread_id;
     logger_instance* logger;
+    log_trace_buffer* trace_buffer;
 } fiber_local_data;
 
-void CALLBACK fls_callback(PVOID lpFlsData)
+/* Messages up to this many bytes are stored in the queue slot itself. */
+#define LOG_ASYNC_INLINE_SIZE 256
+/* The writer looks at the queue this often even without being woken up, in milliseconds. */
+#define LOG_ASYNC_IDLE_TIMEOUT 100
+#define LOG_ASYNC_MAX_QUEUES 8
+
+typedef struct log_async_slot {
+    LONG volatile   sequence;       /* Equal to the enqueue position when free, one more when filled. */
+    LOG_LEVEL       level;
+    void const*     file;
+    unsigned char   file_char_size;
+    unsigned char   text_char_size;
+    long            line;
+    DWORD           thread_id;
+    size_t          text_len;       /* In characters, without the terminator. */
+    void*           heap_text;      /* Set if the text didn't fit into inline_text. */
+    union {
+        char        narrow[LOG_ASYNC_INLINE_SIZE];
+        wchar_t     wide[LOG_ASYNC_INLINE_SIZE / sizeof(wchar_t)];
+    } inline_text;
+} log_async_slot;
+
+/* Bounded multi-producer queue of formatted messages, emptied in order by a single writer thread. Producers claim
+   a slot by advancing enqueue_pos and publish it through the slot's sequence, so neither side takes a lock. */
+struct log_async_queue {
+    logger_instance*    logger;
+    log_async_slot*     slots;
+    LONG                mask;
+    LOG_OVERFLOW_POLICY overflow_policy;
+    LONG volatile       enqueue_pos;
+    LONG volatile       dequeue_pos;
+    LONG volatile       dropped;
+    LONG volatile       writer_sleeping;
+    LONG volatile       stopping;
+    HANDLE              wake_event;
+    HANDLE              thread;
+};
+
+/* Flushed when the process exits without destroying its loggers. */
+static log_async_queue* volatile log_async_queues[LOG_ASYNC_MAX_QUEUES];
+static LONG volatile log_async_atexit_registered = 0;
+
+#define LOG_TRACE_MAX_SITES 4096
+#define LOG_TRACE_BUFFER_SIZE 65536
+/* Longer string arguments are cut off, in bytes of UTF-8. */
+#define LOG_TRACE_MAX_STRING 1024
+
+/* Events of one thread that haven't been written to the trace file yet. The data starts with the header of a
+   TRACE_BLOCK_EVENTS block, which is filled in when the buffer is written. */
+struct log_trace_buffer {
+    log_trace_buffer*   next;
+    log_trace_buffer*   prev;
+    CRITICAL_SECTION    lock;   /* Taken by the owning thread for every event, and by threads that flush it. */
+    size_t              used;
+    unsigned char       data[LOG_TRACE_BUFFER_SIZE];
+};
+
+/* A LOG_* call site, identified by its format, file and line. Its id is its index in the site table plus one. */
+typedef struct log_trace_site {
+    void const* volatile    format;         /* Set last, the entry is unused while it is null. */
+    void const*             file;
+    long                    line;
+    BOOL                    preformatted;   /* The message is formatted when logging and recorded as one string. */
+    unsigned char           arg_count;
+    unsigned char           arg_types[TRACE_MAX_ARGS];
+    int                     arg_precisions[TRACE_MAX_ARGS]; /* Of strings, -1 for none, -2 for the previous arg. */
+    size_t                  max_args_size;
+    unsigned char*          definition;     /* The TRACE_BLOCK_SITE block, written again into every new file. */
+    size_t                  definition_size;
+} log_trace_site;
+
+typedef struct log_trace_state {
+    logger_instance*    logger;
+    BOOL volatile       active;
+    CRITICAL_SECTION    list_lock;  /* Guards the buffer list, taken before any buffer lock. */
+    CRITICAL_SECTION    file_lock;  /* Guards the file and additions to the site table, taken last. */
+    log_trace_buffer*   buffers;
+    log_trace_site*     sites;
+    HANDLE              file;
+    LPWSTR              path;
+    LPWSTR              old_path;
+    ULONGLONG           file_size;
+    ULONGLONG           max_file_size;
+} log_trace_state;
+
+/* There is only one trace file per process, the call sites and the thread buffers are shared by all loggers. */
+static log_trace_state log_trace;
+static BOOL log_trace_initialized = FALSE;
+
+static void log_trace_release_buffer(log_trace_buffer* buffer);
+
+void CALLBACK fls_callback(PVOID lpFlsData)
+{
+    if (lpFlsData)
+    {
+        fiber_local_data* const fls_data = (fiber_local_data*)lpFlsData;
+        if (fls_data->trace_buffer)
+            log_trace_release_buffer(fls_data->trace_buffer);
+        HeapFree(GetProcessHeap(), 0, lpFlsData);
+    }
+}
+
+int log_create_logger(log_message_callback const log_message, unsigned char const character_size,
+                      logger_instance** const out_logger)
+{
+    logger_instance* logger;
+
+    if (character_size != sizeof(char) && character_size != sizeof(wchar_t))
+        return 0;
+
+    if (!fls_index_initialized)
+    {
+        fls_index = FlsAlloc(fls_callback);
+        if (fls_index == FLS_OUT_OF_INDEXES)
+            return 0;
+        fls_index_initialized = TRUE;
+    }
+
+    logger = (logger_instance*)HeapAlloc(GetProcessHeap(), 0, sizeof(logger_instance));
+    if (logger == NULL)
+        return 0;
+
+    logger->log_message = log_message;
+    logger->character_size = character_size;
+    logger->impl_data = 0;
+    logger->enabled_log_levels = 0x3C;
+    logger->async_queue = 0;
+    logger->traced_log_levels = 0;
+    logger->recorded_log_levels = 0x3C;
+
+    *out_logger = logger;
+    return 1;
+}
+
+static void log_stop_async(logger_instance* logger);
+static void log_stop_trace(logger_instance* logger);
+
+void log_destroy_logger(logger_instance* const logger)
+{
+    if (logger)
+    {
+        log_stop_async(logger);
+        log_stop_trace(logger);
+        HeapFree(GetProcessHeap(), 0, logger);
+    }
+}
+
+static fiber_local_data* log_get_fls_data(void)
+{
+    fiber_local_data* fls_data;
+
+    if (!fls_index_initialized)
+        return 0;
+
+    fls_data = (fiber_local_data*)FlsGetValue(fls_index);
+    if (fls_data == NULL || fls_data == 0)
+    {
+        if (GetLastError() != ERROR_SUCCESS)
+            return 0;
+        fls_data = (fiber_local_data*)HeapAlloc(GetProcessHeap(), 0, sizeof(fiber_local_data));
+        if (fls_data == NULL)
+            return 0;
+        fls_data->converted_file = 0;
+        fls_data->do_trace = FALSE;
+        fls_data->trace_buffer = 0;
+        if (!FlsSetValue(fls_index, fls_data))
+            return 0;
+    }
+
+    return fls_data;
+}
+
+/* Makes log_get_file_and_line and log_get_thread_id describe the given message. The converted file name is kept
+   while messages keep coming from the same file. */
+static void log_set_message_context(fiber_local_data* const fls_data, logger_instance* const logger,
+                                    LOG_LEVEL const level, void const* const file, unsigned char const file_char_size,
+                                    long const line, DWORD const thread_id)
+{
+    if (fls_data->converted_file && fls_data->file != file)
+    {
+        HeapFree(GetProcessHeap(), 0, (LPVOID)fls_data->converted_file);
+        fls_data->converted_file = 0;
+    }
+
+    fls_data->logger = logger;
+    fls_data->level = level;
+    fls_data->file = file;
+    fls_data->file_char_size = file_char_size;
+    fls_data->line = line;
+    fls_data->thread_id = thread_id;
+    fls_data->do_log = TRUE;
+}
+
+static int log_init_message_impl2(logger_instance* const logger, LOG_LEVEL const level, void const* const file,
+                                  unsigned char const file_char_size, long const line)
+{
+    fiber_local_data* const fls_data = log_get_fls_data();
+
+    if (!fls_data)
+        return 0;
+
+    if (LOG_IS_RECORDED(logger, level))
+    {
+        log_set_message_context(fls_data, logger, level, file, file_char_size, line, GetCurrentThreadId());
+        fls_data->do_log = LOG_IS_ENABLED(logger, level);
+        fls_data->do_trace = LOG_IS_TRACED(logger, level);
+    }
+    else
+    {
+        fls_data->do_log = FALSE;
+        fls_data->do_trace = FALSE;
+    }
+
+    return 1;
+}
+
+static int log_init_message_impl(logger_instance* const logger, LOG_LEVEL const level, void const* const file,
+                                 unsigned char const file_char_size, long const line)
+{
+    DWORD last_error;
+    int ret;
+
+    last_error = GetLastError();
+    ret = log_init_message_impl2(logger, level, file, file_char_size, line);
+    SetLastError(last_error);
+
+    return ret;
+}
+
+int log_init_message(logger_instance* const logger, LOG_LEVEL const level, char const* const file, long const line)
+{
+    return log_init_message_impl(logger, level, file, sizeof(char), line);
+}
+
+/* Converts the message to the logger's character size if needed and passes it to the callback. */
+static int log_deliver(logger_instance* const logger, LOG_LEVEL const level, void const* const text,
+                       unsigned char const text_char_size, int const text_len)
+{
+    int ret = 0;
+
+    if (text_char_size == logger->character_size)
+        ret = logger->log_message(logger, level, text);
+    else if (text_char_size == sizeof(char))
+        do {
+            int wide_len;
+            LPWSTR wide_message;
+
+            wide_len = MultiByteToWideChar(CP_UTF8, 0, (LPCSTR)text, text_len, NULL, 0);
+            if (wide_len == 0)
+                break;
+
+            wide_message = (LPWSTR)HeapAlloc(GetProcessHeap(), 0, sizeof(WCHAR) * (wide_len + 1));
+            if (wide_message == NULL)
+                break;
+
+            if (MultiByteToWideChar(CP_UTF8, 0, (LPCSTR)text, text_len, wide_message, wide_len) != wide_len)
+            {
+                HeapFree(GetProcessHeap(), 0, wide_message);
+                break;
+            }
+
+            wide_message[wide_len] = '\0';
+
+            ret = logger->log_message(logger, level, wide_message);
+
+            HeapFree(GetProcessHeap(), 0, wide_message);
+        } while (0);
+    else if (text_char_size == sizeof(wchar_t))
+        do {
+            int narrow_len;
+            LPSTR narrow_message;
+
+            narrow_len = WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)text, text_len, NULL, 0, NULL, NULL);
+            if (narrow_len == 0)
+                break;
+
+            narrow_message = (LPSTR)HeapAlloc(GetProcessHeap(), 0, sizeof(char) * (narrow_len + 1));
+            if (narrow_message == NULL)
+                break;
+
+            if (WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)text, text_len, narrow_message, narrow_len, NULL, NULL)
+                != narrow_len)
+            {
+                HeapFree(GetProcessHeap(), 0, narrow_message);
+                break;
+            }
+
+            narrow_message[narrow_len] = '\0';
+
+            ret = logger->log_message(logger, level, narrow_message);
+
+            HeapFree(GetProcessHeap(), 0, narrow_message);
+        } while (0);
+
+    return ret;
+}
+
+static unsigned char* log_trace_put_u16(unsigned char* const p, WORD const value)
+{
+    CopyMemory(p, &value, sizeof(value));
+    return p + sizeof(value);
+}
+
+static unsigned char* log_trace_put_u32(unsigned char* const p, DWORD const value)
+{
+    CopyMemory(p, &value, sizeof(value));
+    return p + sizeof(value);
+}
+
+static unsigned char* log_trace_put_u64(unsigned char* const p, ULONGLONG const value)
+{
+    CopyMemory(p, &value, sizeof(value));
+    return p + sizeof(value);
+}
+
+/* Appends to the trace file. The caller holds file_lock. */
+static void log_trace_write(void const* const data, size_t const size)
+{
+    DWORD written;
+
+    if (log_trace.file == INVALID_HANDLE_VALUE)
+        return;
+
+    if (WriteFile(log_trace.file, data, (DWORD)size, &written, NULL))
+        log_trace.file_size += written;
+}
+
+/* Creates the trace file and defines the sites seen so far in it. The caller holds file_lock. */
+static BOOL log_trace_open_file(void)
+{
+    unsigned char header[TRACE_FILE_HEADER_SIZE];
+    LARGE_INTEGER frequency, counter;
+    FILETIME now;
+    unsigned char* p;
+    size_t i;
+
+    log_trace.file = CreateFileW(log_trace.path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                                 CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (log_trace.file == INVALID_HANDLE_VALUE)
+        return FALSE;
+    log_trace.file_size = 0;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    GetSystemTimeAsFileTime(&now);
+
+    CopyMemory(header, TRACE_FILE_MAGIC, 8);
+    p = log_trace_put_u64(header + 8, (ULONGLONG)frequency.QuadPart);
+    p = log_trace_put_u64(p, (ULONGLONG)counter.QuadPart);
+    log_trace_put_u64(p, ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime);
+    log_trace_write(header, sizeof(header));
+
+    for (i = 0; i < LOG_TRACE_MAX_SITES; ++i)
+        if (log_trace.sites[i].format)
+            log_trace_write(log_trace.sites[i].definition, log_trace.sites[i].definition_size);
+
+    return TRUE;
+}
+
+/* Keeps the full file as <path>.old and starts a new one. The caller holds file_lock. */
+static void log_trace_rotate(void)
+{
+    if (log_trace.file == INVALID_HANDLE_VALUE || !log_trace.max_file_size ||
+        log_trace.file_size < log_trace.max_file_size)
+        return;
+
+    CloseHandle(log_trace.file);
+    log_trace.file = INVALID_HANDLE_VALUE;
+    MoveFileExW(log_trace.path, log_trace.old_path, MOVEFILE_REPLACE_EXISTING);
+    log_trace_open_file();
+}
+
+/* Writes the events of a thread to the file. The caller holds the buffer's lock. */
+static void log_trace_flush_buffer(log_trace_buffer* const buffer)
+{
+    unsigned char* p;
+
+    if (buffer->used == TRACE_BLOCK_HEADER_SIZE + TRACE_EVENTS_HEADER_SIZE)
+        return;
+
+    p = log_trace_put_u32(buffer->data, TRACE_BLOCK_EVENTS);
+    log_trace_put_u32(p, (DWORD)(buffer->used - TRACE_BLOCK_HEADER_SIZE));
+
+    EnterCriticalSection(&log_trace.file_lock);
+    log_trace_write(buffer->data, buffer->used);
+    log_trace_rotate();
+    LeaveCriticalSection(&log_trace.file_lock);
+
+    buffer->used = TRACE_BLOCK_HEADER_SIZE + TRACE_EVENTS_HEADER_SIZE;
+}
+
+static void log_trace_flush_all(void)
+{
+    log_trace_buffer* buffer;
+
+    if (!log_trace_initialized)
+        return;
+
+    EnterCriticalSection(&log_trace.list_lock);
+    for (buffer = log_trace.buffers; buffer; buffer = buffer->next)
+    {
+        EnterCriticalSection(&buffer->lock);
+        log_trace_flush_buffer(buffer);
+        LeaveCriticalSection(&buffer->lock);
+    }
+    LeaveCriticalSection(&log_trace.list_lock);
+}
+
+static log_trace_buffer* log_trace_get_buffer(fiber_local_data* const fls_data)
+{
+    log_trace_buffer* buffer = fls_data->trace_buffer;
+
+    if (buffer)
+        return buffer;
+
+    buffer = (log_trace_buffer*)HeapAlloc(GetProcessHeap(), 0, sizeof(log_trace_buffer));
+    if (!buffer)
+        return 0;
+    InitializeCriticalSection(&buffer->lock);
+    log_trace_put_u32(buffer->data + TRACE_BLOCK_HEADER_SIZE, GetCurrentThreadId());
+    buffer->used = TRACE_BLOCK_HEADER_SIZE + TRACE_EVENTS_HEADER_SIZE;
+
+    EnterCriticalSection(&log_trace.list_lock);
+    buffer->prev = 0;
+    buffer->next = log_trace.buffers;
+    if (buffer->next)
+        buffer->next->prev = buffer;
+    log_trace.buffers = buffer;
+    LeaveCriticalSection(&log_trace.list_lock);
+
+    fls_data->trace_buffer = buffer;
+    return buffer;
+}
+
+/* Called when the owning thread exits. */
+static void log_trace_release_buffer(log_trace_buffer* const buffer)
+{
+    EnterCriticalSection(&log_trace.list_lock);
+    if (buffer->prev)
+        buffer->prev->next = buffer->next;
+    else
+        log_trace.buffers = buffer->next;
+    if (buffer->next)
+        buffer->next->prev = buffer->prev;
+
+    EnterCriticalSection(&buffer->lock);
+    log_trace_flush_buffer(buffer);
+    LeaveCriticalSection(&buffer->lock);
+    LeaveCriticalSection(&log_trace.list_lock);
+
+    DeleteCriticalSection(&buffer->lock);
+    HeapFree(GetProcessHeap(), 0, buffer);
+}
+
+/* Returns a UTF-8 copy of the text, which has to be freed. */
+static char* log_trace_to_utf8(void const* const text, unsigned char const char_size, size_t* const out_len)
+{
+    char* utf8_text;
+    int len;
+
+    if (char_size == sizeof(char))
+    {
+        len = (int)strlen((char const*)text) + 1;
+        utf8_text = (char*)HeapAlloc(GetProcessHeap(), 0, len);
+        if (!utf8_text)
+            return 0;
+        CopyMemory(utf8_text, text, len);
+    }
+    else
+    {
+        len = WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)text, -1, NULL, 0, NULL, NULL);
+        if (len == 0)
+            return 0;
+        utf8_text = (char*)HeapAlloc(GetProcessHeap(), 0, len);
+        if (!utf8_text)
+            return 0;
+        if (WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)text, -1, utf8_text, len, NULL, NULL) != len)
+        {
+            HeapFree(GetProcessHeap(), 0, utf8_text);
+            return 0;
+        }
+    }
+
+    *out_len = (size_t)len - 1;
+    return utf8_text;
+}
+
+static void log_trace_add_arg(log_trace_site* const site, unsigned char const type, int const precision)
+{
+    site->arg_types[site->arg_count] = type;
+    site->arg_precisions[site->arg_count] = precision;
+    ++site->arg_count;
+    if (type == TRACE_ARG_STRING || type == TRACE_ARG_WIDE_STRING)
+        site->max_args_size += 4 + LOG_TRACE_MAX_STRING;
+    else
+        site->max_args_size += 8;
+}
+
+/* Parses the format of a new call site and writes its definition. The caller holds file_lock. */
+static BOOL log_trace_add_site(size_t const slot, fiber_local_data const* const fls_data, void const* const format,
+                               unsigned char const format_char_size)
+{
+    log_trace_site* const site = &log_trace.sites[slot];
+    char* utf8_format, * utf8_file;
+    size_t format_len, file_len, pos = 0;
+    trace_format_spec spec;
+    WORD flags = format_char_size == sizeof(char) ? 0 : TRACE_SITE_WIDE;
+    unsigned char* p;
+    int ret;
+
+    utf8_format = log_trace_to_utf8(format, format_char_size, &format_len);
+    if (!utf8_format)
+        return FALSE;
+    utf8_file = log_trace_to_utf8(fls_data->file, fls_data->file_char_size, &file_len);
+    if (!utf8_file)
+    {
+        HeapFree(GetProcessHeap(), 0, utf8_format);
+        return FALSE;
+    }
+
+    site->preformatted = FALSE;
+    site->arg_count = 0;
+    site->max_args_size = 0;
+    while ((ret = trace_format_next(utf8_format, &pos, flags & TRACE_SITE_WIDE, &spec)) == 1)
+    {
+        if (spec.conversion == '%')
+            continue;
+        if (site->arg_count + spec.width_arg + spec.precision_arg + 1 > TRACE_MAX_ARGS)
+        {
+            ret = -1;
+            break;
+        }
+        if (spec.width_arg)
+            log_trace_add_arg(site, TRACE_ARG_INT | TRACE_ARG_SIGNED, -1);
+        if (spec.precision_arg)
+            log_trace_add_arg(site, TRACE_ARG_INT | TRACE_ARG_SIGNED, -1);
+        log_trace_add_arg(site, spec.type, spec.precision_arg ? -2 : spec.precision);
+    }
+
+    /* Messages with arguments that can't be recorded one by one are formatted right away. */
+    if (ret == -1)
+    {
+        site->preformatted = TRUE;
+        site->arg_count = 0;
+        site->max_args_size = 0;
+        log_trace_add_arg(site, TRACE_ARG_STRING, -1);
+        utf8_format[0] = '%';
+        utf8_format[1] = 's';
+        format_len = 2;
+        flags = 0;
+    }
+
+    if (file_len > 0xFFFF)
+        file_len = 0xFFFF;
+    if (format_len > 0xFFFF)
+        format_len = 0xFFFF;
+
+    site->definition_size = TRACE_BLOCK_HEADER_SIZE + TRACE_SITE_HEADER_SIZE + site->arg_count + file_len + format_len;
+    site->definition = (unsigned char*)HeapAlloc(GetProcessHeap(), 0, site->definition_size);
+    if (!site->definition)
+    {
+        HeapFree(GetProcessHeap(), 0, utf8_file);
+        HeapFree(GetProcessHeap(), 0, utf8_format);
+        return FALSE;
+    }
+
+    p = log_trace_put_u32(site->definition, TRACE_BLOCK_SITE);
+    p = log_trace_put_u32(p, (DWORD)(site->definition_size - TRACE_BLOCK_HEADER_SIZE));
+    p = log_trace_put_u32(p, (DWORD)(slot + 1));
+    p = log_trace_put_u32(p, (DWORD)fls_data->line);
+    *p++ = (unsigned char)fls_data->level;
+    *p++ = site->arg_count;
+    p = log_trace_put_u16(p, (WORD)file_len);
+    p = log_trace_put_u16(p, (WORD)format_len);
+    p = log_trace_put_u16(p, flags);
+    CopyMemory(p, site->arg_types, site->arg_count);
+    p += site->arg_count;
+    CopyMemory(p, utf8_file, file_len);
+    p += file_len;
+    CopyMemory(p, utf8_format, format_len);
+
+    HeapFree(GetProcessHeap(), 0, utf8_file);
+    HeapFree(GetProcessHeap(), 0, utf8_format);
+
+    log_trace_write(site->definition, site->definition_size);
+
+    site->file = fls_data->file;
+    site->line = fls_data->line;
+    InterlockedExchangePointer((PVOID volatile*)&site->format, (PVOID)format);
+    return TRUE;
+}
+
+/* Looks up a call site in the table. Sets out_slot to the free slot where it belongs if it isn't there. */
+static log_trace_site* log_trace_find_site(void const* const format, void const* const file, long const line,
+                                           size_t* const out_slot)
+{
+    size_t const hash = (size_t)((ULONG_PTR)format >> 3) ^ ((size_t)line * 0x9E3779B1U);
+    size_t i;
+
+    for (i = 0; i < LOG_TRACE_MAX_SITES; ++i)
+    {
+        size_t const slot = (hash + i) & (LOG_TRACE_MAX_SITES - 1);
+        log_trace_site* const site = &log_trace.sites[slot];
+
+        if (!site->format)
+        {
+            *out_slot = slot;
+            return 0;
+        }
+        if (site->format == format && site->file == file && site->line == line)
+            return site;
+    }
+
+    *out_slot = LOG_TRACE_MAX_SITES;
+    return 0;
+}
+
+static log_trace_site* log_trace_get_site(fiber_local_data const* const fls_data, void const* const format,
+                                          unsigned char const format_char_size)
+{
+    log_trace_site* site;
+    size_t slot;
+
+    site = log_trace_find_site(format, fls_data->file, fls_data->line, &slot);
+    if (site)
+        return site;
+
+    /* Sites are only added while holding the lock, so looking again under it can't miss one. */
+    EnterCriticalSection(&log_trace.file_lock);
+    site = log_trace_find_site(format, fls_data->file, fls_data->line, &slot);
+    if (!site && slot < LOG_TRACE_MAX_SITES && log_trace_add_site(slot, fls_data, format, format_char_size))
+        site = &log_trace.sites[slot];
+    LeaveCriticalSection(&log_trace.file_lock);
+
+    return site;
+}
+
+static unsigned char* log_trace_put_string(unsigned char* const p, char const* const string, int const precision)
+{
+    size_t limit = LOG_TRACE_MAX_STRING;
+    size_t len = 0;
+
+    if (!string)
+        return log_trace_put_u32(p, TRACE_NULL_STRING);
+
+    if (precision >= 0 && (size_t)precision < limit)
+        limit = (size_t)precision;
+    while (len < limit && string[len] != '\0')
+        ++len;
+
+    log_trace_put_u32(p, (DWORD)len);
+    CopyMemory(p + 4, string, len);
+    return p + 4 + len;
+}
+
+static unsigned char* log_trace_put_wide_string(unsigned char* const p, wchar_t const* const string,
+                                                int const precision)
+{
+    /* A UTF-16 code unit takes at most three bytes in UTF-8. */
+    size_t limit = LOG_TRACE_MAX_STRING / 3;
+    size_t len = 0;
+    int utf8_len = 0;
+
+    if (!string)
+        return log_trace_put_u32(p, TRACE_NULL_STRING);
+
+    if (precision >= 0 && (size_t)precision < limit)
+        limit = (size_t)precision;
+    while (len < limit && string[len] != 0)
+        ++len;
+
+    if (len)
+        utf8_len = WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)string, (int)len, (LPSTR)(p + 4), LOG_TRACE_MAX_STRING,
+                                       NULL, NULL);
+
+    log_trace_put_u32(p, (DWORD)utf8_len);
+    return p + 4 + utf8_len;
+}
+
+static unsigned char* log_trace_put_formatted(unsigned char* const p, void const* const format,
+                                              unsigned char const format_char_size, va_list args)
+{
+    wchar_t wide_text[LOG_TRACE_MAX_STRING / 3 + 1];
+    int len;
+
+    if (format_char_size == sizeof(char))
+    {
+        len = vsnprintf((char*)(p + 4), LOG_TRACE_MAX_STRING, (char const*)format, args);
+        if (len < 0)
+            len = 0;
+        else if (len >= LOG_TRACE_MAX_STRING)
+            len = LOG_TRACE_MAX_STRING - 1;
+        log_trace_put_u32(p, (DWORD)len);
+        return p + 4 + len;
+    }
+
+    /* Fails if the text had to be cut off, but the part that fits has been written then. */
+    len = _vsnwprintf(wide_text, LOG_TRACE_MAX_STRING / 3, (wchar_t const*)format, args);
+    if (len < 0)
+        len = LOG_TRACE_MAX_STRING / 3;
+    wide_text[len] = 0;
+    return log_trace_put_wide_string(p, wide_text, -1);
+}
+
+/* Appends the message to the thread's trace buffer with its raw arguments, which are formatted by
+   winestreamproxy-tracedump later. */
+static void log_trace_record(fiber_local_data* const fls_data, void const* const format,
+                             unsigned char const format_char_size, va_list args)
+{
+    log_trace_site* site;
+    log_trace_buffer* buffer;
+    LARGE_INTEGER now;
+    unsigned char* event;
+    unsigned char* p;
+    LONGLONG last_int = -1;
+    size_t i;
+
+    if (!log_trace.active)
+        return;
+
+    site = log_trace_get_site(fls_data, format, format_char_size);
+    if (!site)
+        return;
+    buffer = log_trace_get_buffer(fls_data);
+    if (!buffer)
+        return;
+
+    QueryPerformanceCounter(&now);
+
+    EnterCriticalSection(&buffer->lock);
+
+    if (LOG_TRACE_BUFFER_SIZE - buffer->used < TRACE_EVENT_HEADER_SIZE + site->max_args_size)
+        log_trace_flush_buffer(buffer);
+
+    event = buffer->data + buffer->used;
+    p = event + TRACE_EVENT_HEADER_SIZE;
+    if (site->preformatted)
+        p = log_trace_put_formatted(p, format, format_char_size, args);
+    else
+        for (i = 0; i < site->arg_count; ++i)
+        {
+            unsigned char const type = site->arg_types[i];
+            BOOL const is_signed = (type & TRACE_ARG_SIGNED) != 0;
+            int precision = site->arg_precisions[i];
+
+            if (precision == -2)
+                precision = last_int >= 0 && last_int <= LOG_TRACE_MAX_STRING ? (int)last_int : -1;
+
+            switch (type & ~TRACE_ARG_SIGNED)
+            {
+                case TRACE_ARG_INT:
+                    last_int = is_signed ? (LONGLONG)va_arg(args, int) : (LONGLONG)va_arg(args, unsigned int);
+                    p = log_trace_put_u64(p, (ULONGLONG)last_int);
+                    break;
+                case TRACE_ARG_LONG:
+                    p = log_trace_put_u64(p, is_signed ? (ULONGLONG)(LONGLONG)va_arg(args, long)
+                                                       : (ULONGLONG)va_arg(args, unsigned long));
+                    break;
+                case TRACE_ARG_LONG_LONG:
+                    p = log_trace_put_u64(p, va_arg(args, ULONGLONG));
+                    break;
+                case TRACE_ARG_SIZE:
+                    p = log_trace_put_u64(p, is_signed ? (ULONGLONG)(LONGLONG)va_arg(args, ptrdiff_t)
+                                                       : (ULONGLONG)va_arg(args, size_t));
+                    break;
+                case TRACE_ARG_POINTER:
+                    p = log_trace_put_u64(p, (ULONGLONG)(ULONG_PTR)va_arg(args, void*));
+                    break;
+                case TRACE_ARG_DOUBLE:
+                {
+                    double const value = va_arg(args, double);
+                    CopyMemory(p, &value, sizeof(value));
+                    p += sizeof(value);
+                    break;
+                }
+                case TRACE_ARG_LONG_DOUBLE:
+                {
+                    double const value = (double)va_arg(args, long double);
+                    CopyMemory(p, &value, sizeof(value));
+                    p += sizeof(value);
+                    break;
+                }
+                case TRACE_ARG_STRING:
+                    p = log_trace_put_string(p, va_arg(args, char const*), precision);
+                    break;
+                case TRACE_ARG_WIDE_STRING:
+                    p = log_trace_put_wide_string(p, va_arg(args, wchar_t const*), precision);
+                    break;
+            }
+        }
+
+    log_trace_put_u32(event, (DWORD)(site - log_trace.sites + 1));
+    log_trace_put_u32(event + 4, (DWORD)(p - event - TRACE_EVENT_HEADER_SIZE));
+    log_trace_put_u64(event + 8, (ULONGLONG)now.QuadPart);
+    buffer->used = (size_t)(p - buffer->data);
+
+    LeaveCriticalSection(&buffer->lock);
+
+    /* Whatever led up to an error is what the trace will be read for, so don't let it sit in the buffers. */
+    if (fls_data->level >= LOG_LEVEL_ERROR)
+        log_trace_flush_all();
+}
+
+static int log_start_trace_impl(logger_instance* const logger, LPCWSTR const path, size_t const max_file_size)
+{
+    size_t const path_size = sizeof(WCHAR) * (wcslen(path) + 1);
+    BOOL opened;
+
+    if (!fls_index_initialized || (log_trace_initialized && log_trace.logger))
+        return 0;
+
+    if (!log_trace.sites)
+    {
+        log_trace.sites = (log_trace_site*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+                                                     sizeof(log_trace_site) * LOG_TRACE_MAX_SITES);
+        if (!log_trace.sites)
+            return 0;
+    }
+
+    log_trace.path = (LPWSTR)HeapAlloc(GetProcessHeap(), 0, path_size);
+    if (!log_trace.path)
+        return 0;
+    log_trace.old_path = (LPWSTR)HeapAlloc(GetProcessHeap(), 0, path_size + sizeof(L".old") - sizeof(WCHAR));
+    if (!log_trace.old_path)
+    {
+        HeapFree(GetProcessHeap(), 0, log_trace.path);
+        log_trace.path = 0;
+        return 0;
+    }
+    CopyMemory(log_trace.path, path, path_size);
+    CopyMemory(log_trace.old_path, path, path_size - sizeof(WCHAR));
+    CopyMemory((char*)log_trace.old_path + path_size - sizeof(WCHAR), L".old", sizeof(L".old"));
+    log_trace.max_file_size = max_file_size;
+
+    if (!log_trace_initialized)
+    {
+        InitializeCriticalSection(&log_trace.list_lock);
+        InitializeCriticalSection(&log_trace.file_lock);
+        log_trace_initialized = TRUE;
+        atexit(log_trace_flush_all);
+    }
+
+    EnterCriticalSection(&log_trace.file_lock);
+    opened = log_trace_open_file();
+    LeaveCriticalSection(&log_trace.file_lock);
+    if (!opened)
+    {
+        HeapFree(GetProcessHeap(), 0, log_trace.old_path);
+        HeapFree(GetProcessHeap(), 0, log_trace.path);
+        log_trace.old_path = 0;
+        log_trace.path = 0;
+        return 0;
+    }
+
+    log_trace.logger = logger;
+    log_trace.active = TRUE;
+    logger->traced_log_levels = ~0U;
+    log_update_recorded_levels(logger);
+    return 1;
+}
+
+int log_start_trace(logger_instance* const logger, char const* const path, size_t const max_file_size)
+{
+    int wide_len;
+    LPWSTR wide_path;
+    int ret;
+
+    wide_len = MultiByteToWideChar(CP_ACP, 0, path, -1, NULL, 0);
+    if (wide_len == 0)
+        return 0;
+
+    wide_path = (LPWSTR)HeapAlloc(GetProcessHeap(), 0, sizeof(WCHAR) * wide_len);
+    if (wide_path == NULL)
+        return 0;
+
+    if (MultiByteToWideChar(CP_ACP, 0, path, -1, wide_path, wide_len) != wide_len)
+    {
+        HeapFree(GetProcessHeap(), 0, wide_path);
+        return 0;
+    }
+
+    ret = log_start_trace_impl(logger, wide_path, max_file_size);
+
+    HeapFree(GetProcessHeap(), 0, wide_path);
+    return ret;
+}
+
+#ifdef __cplusplus
+extern "C"
+#endif /* defined(__cplusplus) */
+int wlog_start_trace(logger_instance* const logger, wchar_t const* const path, size_t const max_file_size)
+{
+    return log_start_trace_impl(logger, path, max_file_size);
+}
+
+/* The site table and the thread buffers stay allocated, other threads may still be looking at them. */
+static void log_stop_trace(logger_instance* const logger)
+{
+    if (!log_trace_initialized || log_trace.logger != logger)
+        return;
+
+    logger->traced_log_levels = 0;
+    log_update_recorded_levels(logger);
+    log_trace.active = FALSE;
+    log_trace_flush_all();
+
+    EnterCriticalSection(&log_trace.file_lock);
+    CloseHandle(log_trace.file);
+    log_trace.file = INVALID_HANDLE_VALUE;
+    HeapFree(GetProcessHeap(), 0, log_trace.old_path);
+    HeapFree(GetProcessHeap(), 0, log_trace.path);
+    log_trace.old_path = 0;
+    log_trace.path = 0;
+    log_trace.logger = 0;
+    LeaveCriticalSection(&log_trace.file_lock);
+}
+
+static void log_async_wake(log_async_queue* const queue)
 {
-    if (lpFlsData)
-        HeapFree(GetProcessHeap(), 0, lpFlsData);
+    if (queue->writer_sleeping && InterlockedExchange(&queue->writer_sleeping, 0))
+        SetEvent(queue->wake_event);
 }
 
-int log_create_logger(log_message_callback const log_message, unsigned char const character_size,
-                      logger_instance** const out_logger)
+static BOOL log_async_is_empty(log_async_queue* const queue)
 {
-    logger_instance* logger;
+    LONG const pos = queue->dequeue_pos;
+    log_async_slot* const slot = &queue->slots[pos & queue->mask];
 
-    if (character_size != sizeof(char) && character_size != sizeof(wchar_t))
-        return 0;
+    return InterlockedCompareExchange(&slot->sequence, 0, 0) != (LONG)((ULONG)pos + 1);
+}
 
-    if (!fls_index_initialized)
+/* Copies the message into the queue. Only fails if memory for a long message couldn't be allocated. */
+static int log_async_enqueue(log_async_queue* const queue, fiber_local_data const* const fls_data,
+                             void const* const text, unsigned char const text_char_size, size_t const text_len)
+{
+    size_t const text_size = (text_len + 1) * text_char_size;
+    log_async_slot* slot;
+    void* heap_text = 0;
+    LONG pos;
+
+    if (text_size > LOG_ASYNC_INLINE_SIZE)
     {
-        fls_index = FlsAlloc(fls_callback);
-        if (fls_index == FLS_OUT_OF_INDEXES)
+        heap_text = HeapAlloc(GetProcessHeap(), 0, text_size);
+        if (!heap_text)
             return 0;
-        fls_index_initialized = TRUE;
+        CopyMemory(heap_text, text, text_size);
     }
 
-    logger = (logger_instance*)HeapAlloc(GetProcessHeap(), 0, sizeof(logger_instance));
-    if (logger == NULL)
-        return 0;
+    pos = queue->enqueue_pos;
+    for (;;)
+    {
+        LONG const diff = (LONG)((ULONG)InterlockedCompareExchange(&queue->slots[pos & queue->mask].sequence, 0, 0) -
+                                 (ULONG)pos);
 
-    logger->log_message = log_message;
-    logger->character_size = character_size;
-    logger->impl_data = 0;
-    logger->enabled_log_levels = 0x3C;
+        if (diff == 0)
+        {
+            LONG const prev = InterlockedCompareExchange(&queue->enqueue_pos, (LONG)((ULONG)pos + 1), pos);
+            if (prev == pos)
+                break;
+            pos = prev;
+        }
+        else if (diff < 0)
+        {
+            /* The queue is full. Either give up on the message or wait for the writer to catch up. */
+            if (queue->overflow_policy == LOG_OVERFLOW_DROP || queue->stopping)
+            {
+                InterlockedIncrement(&queue->dropped);
+                if (heap_text)
+                    HeapFree(GetProcessHeap(), 0, heap_text);
+                return 1;
+            }
+            log_async_wake(queue);
+            Sleep(1);
+            pos = queue->enqueue_pos;
+        }
+        else
+            pos = queue->enqueue_pos;
+    }
 
-    *out_logger = logger;
+    slot = &queue->slots[pos & queue->mask];
+    slot->level = fls_data->level;
+    slot->file = fls_data->file;
+    slot->file_char_size = fls_data->file_char_size;
+    slot->text_char_size = text_char_size;
+    slot->line = fls_data->line;
+    slot->thread_id = fls_data->thread_id;
+    slot->text_len = text_len;
+    slot->heap_text = heap_text;
+    if (!heap_text)
+        CopyMemory(&slot->inline_text, text, text_size);
+    InterlockedExchange(&slot->sequence, (LONG)((ULONG)pos + 1));
+
+    log_async_wake(queue);
     return 1;
 }
 
-void log_destroy_logger(logger_instance* const logger)
+/* Passes the oldest queued message to the callback. Must only be called by one thread at a time. */
+static BOOL log_async_dequeue(log_async_queue* const queue, fiber_local_data* const fls_data)
 {
-    if (logger)
-        HeapFree(GetProcessHeap(), 0, logger);
+    LONG const pos = queue->dequeue_pos;
+    log_async_slot* const slot = &queue->slots[pos & queue->mask];
+
+    if (InterlockedCompareExchange(&slot->sequence, 0, 0) != (LONG)((ULONG)pos + 1))
+        return FALSE;
+
+    if (fls_data)
+        log_set_message_context(fls_data, queue->logger, slot->level, slot->file, slot->file_char_size, slot->line,
+                                slot->thread_id);
+    log_deliver(queue->logger, slot->level, slot->heap_text ? slot->heap_text : (void const*)&slot->inline_text,
+                slot->text_char_size, (int)slot->text_len);
+    if (slot->heap_text)
+        HeapFree(GetProcessHeap(), 0, slot->heap_text);
+
+    InterlockedExchange(&slot->sequence, (LONG)((ULONG)pos + (ULONG)queue->mask + 1));
+    InterlockedExchange(&queue->dequeue_pos, (LONG)((ULONG)pos + 1));
+    return TRUE;
 }
 
-static int log_init_message_impl2(logger_instance* const logger, LOG_LEVEL const level, void const* const file,
-                                  unsigned char const file_char_size, long const line)
+static void log_async_report_dropped(log_async_queue* const queue, fiber_local_data* const fls_data,
+                                     LONG const dropped)
 {
-    fiber_local_data* fls_data;
+    char message[64];
+    int message_len;
 
-    if (!fls_index_initialized)
-        return 0;
+    message_len = sprintf(message, "Dropped %ld log messages because the log queue was full", (long)dropped);
+    if (fls_data)
+        log_set_message_context(fls_data, queue->logger, LOG_LEVEL_WARNING, __FILE__, sizeof(char), __LINE__,
+                                GetCurrentThreadId());
+    log_deliver(queue->logger, LOG_LEVEL_WARNING, message, sizeof(char), message_len);
+}
 
-    fls_data = (fiber_local_data*)FlsGetValue(fls_index);
-    if (fls_data == NULL || fls_data == 0)
+static DWORD CALLBACK log_async_writer(LPVOID const param)
+{
+    log_async_queue* const queue = (log_async_queue*)param;
+    fiber_local_data* const fls_data = log_get_fls_data();
+    LONG reported = 0;
+
+    for (;;)
     {
-        if (GetLastError() != ERROR_SUCCESS)
-            return 0;
-        fls_data = (fiber_local_data*)HeapAlloc(GetProcessHeap(), 0, sizeof(fiber_local_data));
-        if (fls_data == NULL)
-            return 0;
-        fls_data->converted_file = 0;
-        if (!FlsSetValue(fls_index, fls_data))
-            return 0;
+        LONG dropped;
+
+        while (log_async_dequeue(queue, fls_data));
+
+        dropped = InterlockedCompareExchange(&queue->dropped, 0, 0);
+        if (dropped != reported)
+        {
+            log_async_report_dropped(queue, fls_data, dropped - reported);
+            reported = dropped;
+        }
+
+        if (queue->stopping && log_async_is_empty(queue))
+            break;
+
+        /* Producers only signal the event while this flag is set, which keeps SetEvent off the logging path. */
+        InterlockedExchange(&queue->writer_sleeping, 1);
+        if (!log_async_is_empty(queue) || queue->stopping)
+        {
+            InterlockedExchange(&queue->writer_sleeping, 0);
+            continue;
+        }
+        WaitForSingleObject(queue->wake_event, LOG_ASYNC_IDLE_TIMEOUT);
+        InterlockedExchange(&queue->writer_sleeping, 0);
     }
 
-    if (fls_data->converted_file)
-        HeapFree(GetProcessHeap(), 0, (LPVOID)fls_data->converted_file);
+    return 0;
+}
 
-    if (LOG_IS_ENABLED(logger, level))
+static void log_async_flush_all(void)
+{
+    size_t i;
+
+    for (i = 0; i < LOG_ASYNC_MAX_QUEUES; ++i)
     {
-        fls_data->logger = logger;
-        fls_data->level = level;
-        fls_data->file = file;
-        fls_data->file_char_size = file_char_size;
-        fls_data->converted_file = 0;
-        fls_data->line = line;
-        fls_data->do_log = TRUE;
+        log_async_queue* const queue = log_async_queues[i];
+        if (queue)
+            log_flush(queue->logger);
     }
-    else
-        fls_data->do_log = FALSE;
+}
+
+int log_start_async(logger_instance* const logger, size_t const queue_length,
+                    LOG_OVERFLOW_POLICY const overflow_policy)
+{
+    log_async_queue* queue;
+    size_t capacity, i;
+
+    if (logger->async_queue || queue_length == 0 || queue_length > 0x10000000)
+        return 0;
+
+    capacity = 1;
+    while (capacity < queue_length)
+        capacity <<= 1;
+
+    queue = (log_async_queue*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(log_async_queue));
+    if (!queue)
+        return 0;
+    queue->slots = (log_async_slot*)HeapAlloc(GetProcessHeap(), 0, sizeof(log_async_slot) * capacity);
+    if (!queue->slots)
+        goto err_alloc_slots;
+    for (i = 0; i < capacity; ++i)
+        queue->slots[i].sequence = (LONG)i;
+    queue->logger = logger;
+    queue->mask = (LONG)(capacity - 1);
+    queue->overflow_policy = overflow_policy;
+
+    queue->wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!queue->wake_event)
+        goto err_create_event;
+    queue->thread = CreateThread(NULL, 0, log_async_writer, queue, 0, NULL);
+    if (!queue->thread)
+        goto err_create_thread;
+
+    for (i = 0; i < LOG_ASYNC_MAX_QUEUES; ++i)
+        if (!InterlockedCompareExchangePointer((PVOID volatile*)&log_async_queues[i], queue, NULL))
+            break;
+    if (!InterlockedExchange(&log_async_atexit_registered, 1))
+        atexit(log_async_flush_all);
 
+    logger->async_queue = queue;
     return 1;
+
+err_create_thread:
+    CloseHandle(queue->wake_event);
+err_create_event:
+    HeapFree(GetProcessHeap(), 0, queue->slots);
+err_alloc_slots:
+    HeapFree(GetProcessHeap(), 0, queue);
+    return 0;
 }
 
-static int log_init_message_impl(logger_instance* const logger, LOG_LEVEL const level, void const* const file,
-                                 unsigned char const file_char_size, long const line)
+void log_flush(logger_instance* const logger)
 {
-    DWORD last_error;
-    int ret;
+    log_async_queue* const queue = logger->async_queue;
+    LONG target;
 
-    last_error = GetLastError();
-    ret = log_init_message_impl2(logger, level, file, file_char_size, line);
-    SetLastError(last_error);
+    if (log_trace_initialized && log_trace.logger == logger)
+        log_trace_flush_all();
 
-    return ret;
+    if (!queue)
+        return;
+
+    target = queue->enqueue_pos;
+    SetEvent(queue->wake_event);
+    while ((LONG)((ULONG)queue->dequeue_pos - (ULONG)target) < 0)
+    {
+        /* The writer may already be gone while the process exits, write the rest from here then. */
+        if (WaitForSingleObject(queue->thread, 1) != WAIT_TIMEOUT)
+        {
+            fiber_local_data* const fls_data = log_get_fls_data();
+            while (log_async_dequeue(queue, fls_data));
+            break;
+        }
+    }
 }
 
-int log_init_message(logger_instance* const logger, LOG_LEVEL const level, char const* const file, long const line)
+static void log_stop_async(logger_instance* const logger)
 {
-    return log_init_message_impl(logger, level, file, sizeof(char), line);
+    log_async_queue* const queue = logger->async_queue;
+    size_t i;
+
+    if (!queue)
+        return;
+
+    InterlockedExchange(&queue->stopping, 1);
+    SetEvent(queue->wake_event);
+    WaitForSingleObject(queue->thread, INFINITE);
+    log_flush(logger);
+
+    for (i = 0; i < LOG_ASYNC_MAX_QUEUES; ++i)
+        InterlockedCompareExchangePointer((PVOID volatile*)&log_async_queues[i], NULL, queue);
+    logger->async_queue = 0;
+
+    CloseHandle(queue->thread);
+    CloseHandle(queue->wake_event);
+    HeapFree(GetProcessHeap(), 0, queue->slots);
+    HeapFree(GetProcessHeap(), 0, queue);
+}
+
+/* Hands a formatted message to the writer thread, or to the callback right away if the logger is synchronous. */
+static int log_submit(fiber_local_data const* const fls_data, void const* const text,
+                      unsigned char const text_char_size, int const text_len)
+{
+    if (fls_data->logger->async_queue)
+        return log_async_enqueue(fls_data->logger->async_queue, fls_data, text, text_char_size, (size_t)text_len);
+    return log_deliver(fls_data->logger, fls_data->level, text, text_char_size, text_len);
 }
 
 int log_print_message(char const* const format, ...)
@@ -150,6 +1244,13 @@ int log_print_message(char const* const format, ...)
     if (fls_data == NULL || fls_data == 0)
         return 0;
 
+    if (fls_data->do_trace)
+    {
+        va_start(args, format);
+        log_trace_record(fls_data, format, sizeof(char), args);
+        va_end(args);
+    }
+
     if (!fls_data->do_log)
         return 1;
 
@@ -157,17 +1258,11 @@ int log_print_message(char const* const format, ...)
     message_len = vsnprintf(0, 0, format, args);
     va_end(args);
     if (message_len < 0)
-    {
-        va_end(args);
         return 0;
-    }
 
     message = (char*)HeapAlloc(GetProcessHeap(), 0, sizeof(char) * (message_len + 1));
     if (message == NULL)
-    {
-        va_end(args);
         return 0;
-    }
 
     va_start(args, format);
     if (vsnprintf(message, message_len + 1, format, args) != message_len)
@@ -178,35 +1273,7 @@ int log_print_message(char const* const format, ...)
     }
     va_end(args);
 
-    ret = 0;
-
-    if (fls_data->logger->character_size == sizeof(char))
-        ret = fls_data->logger->log_message(fls_data->logger, fls_data->level, message);
-    else if (fls_data->logger->character_size == sizeof(wchar_t))
-        do {
-            int wide_len;
-            LPWSTR wide_message;
-
-            wide_len = MultiByteToWideChar(CP_UTF8, 0, message, message_len, NULL, 0);
-            if (wide_len == 0)
-                break;
-
-            wide_message = (LPWSTR)HeapAlloc(GetProcessHeap(), 0, sizeof(WCHAR) * (wide_len + 1));
-            if (wide_message == NULL)
-                break;
-
-            if (MultiByteToWideChar(CP_UTF8, 0, message, message_len, wide_message, wide_len) != wide_len)
-            {
-                HeapFree(GetProcessHeap(), 0, wide_message);
-                break;
-            }
-
-            wide_message[wide_len] = '\0';
-
-            ret = fls_data->logger->log_message(fls_data->logger, fls_data->level, wide_message);
-
-            HeapFree(GetProcessHeap(), 0, wide_message);
-        } while (0);
+    ret = log_submit(fls_data, message, sizeof(char), message_len);
 
     HeapFree(GetProcessHeap(), 0, message);
     return ret;
@@ -239,6 +1306,13 @@ int wlog_print_message(wchar_t const* const format, ...)
     if (fls_data == NULL || fls_data == 0)
         return 0;
 
+    if (fls_data->do_trace)
+    {
+        va_start(args, format);
+        log_trace_record(fls_data, format, sizeof(wchar_t), args);
+        va_end(args);
+    }
+
     if (!fls_data->do_log)
         return 1;
 
@@ -261,38 +1335,157 @@ int wlog_print_message(wchar_t const* const format, ...)
         buffer_size = buffer_size * 2 + 16;
     }
 
-    ret = 0;
+    ret = log_submit(fls_data, message, sizeof(wchar_t), message_len);
 
-    if (fls_data->logger->character_size == sizeof(wchar_t))
-        ret = fls_data->logger->log_message(fls_data->logger, fls_data->level, message);
-    else if (fls_data->logger->character_size == sizeof(char))
-        do {
-            int narrow_len;
-            LPSTR narrow_message;
+    HeapFree(GetProcessHeap(), 0, message);
+    return ret;
+}
 
-            narrow_len = WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)message, message_len, NULL, 0, NULL, NULL);
-            if (narrow_len == 0)
-                break;
+/* Messages up to this many characters are formatted into a buffer on the stack. */
+#define LOG_SCRATCH_SIZE 512
 
-            narrow_message = (LPSTR)HeapAlloc(GetProcessHeap(), 0, sizeof(WCHAR) * (narrow_len + 1));
-            if (narrow_message == NULL)
-                break;
+/* Sets up the context of a message for log_write_message and wlog_write_message. Fiber local storage is only needed
+   if the callback is called on this thread or the message is traced into this thread's buffer, a message that is
+   handed to the writer thread keeps its context in local_data. */
+static fiber_local_data* log_begin_message(logger_instance* const logger, LOG_LEVEL const level, void const* const file,
+                                           unsigned char const file_char_size, long const line,
+                                           fiber_local_data* const local_data)
+{
+    unsigned int const level_bit = 1U << level;
+    fiber_local_data* fls_data = local_data;
 
-            if (WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)message, message_len, narrow_message, narrow_len, NULL, NULL)
-                != narrow_len)
-            {
-                HeapFree(GetProcessHeap(), 0, narrow_message);
-                break;
-            }
+    if ((logger->traced_log_levels & level_bit) || !logger->async_queue)
+    {
+        DWORD const last_error = GetLastError();
+        fls_data = log_get_fls_data();
+        SetLastError(last_error);
+        if (!fls_data)
+            return 0;
+    }
+    else
+        local_data->converted_file = 0;
 
-            narrow_message[narrow_len] = '\0';
+    log_set_message_context(fls_data, logger, level, file, file_char_size, line, GetCurrentThreadId());
+    fls_data->do_log = (logger->enabled_log_levels & level_bit) != 0;
+    fls_data->do_trace = (logger->traced_log_levels & level_bit) != 0;
+    return fls_data;
+}
 
-            ret = fls_data->logger->log_message(fls_data->logger, fls_data->level, narrow_message);
+int log_write_message(logger_instance* const logger, LOG_LEVEL const level, char const* const file, long const line,
+                      char const* const format, ...)
+{
+    fiber_local_data local_data;
+    fiber_local_data* fls_data;
+    char scratch[LOG_SCRATCH_SIZE];
+    char* message = scratch;
+    va_list args;
+    int message_len;
+    int ret;
 
-            HeapFree(GetProcessHeap(), 0, narrow_message);
-        } while (0);
+    if (!LOG_IS_RECORDED(logger, level))
+        return 1;
 
-    HeapFree(GetProcessHeap(), 0, message);
+    fls_data = log_begin_message(logger, level, file, sizeof(char), line, &local_data);
+    if (!fls_data)
+        return 0;
+
+    if (fls_data->do_trace)
+    {
+        va_start(args, format);
+        log_trace_record(fls_data, format, sizeof(char), args);
+        va_end(args);
+    }
+
+    if (!fls_data->do_log)
+        return 1;
+
+    va_start(args, format);
+    message_len = vsnprintf(scratch, LOG_SCRATCH_SIZE, format, args);
+    va_end(args);
+    if (message_len < 0)
+        return 0;
+
+    if (message_len >= LOG_SCRATCH_SIZE)
+    {
+        message = (char*)HeapAlloc(GetProcessHeap(), 0, sizeof(char) * (message_len + 1));
+        if (message == NULL)
+            return 0;
+
+        va_start(args, format);
+        if (vsnprintf(message, message_len + 1, format, args) != message_len)
+        {
+            va_end(args);
+            HeapFree(GetProcessHeap(), 0, message);
+            return 0;
+        }
+        va_end(args);
+    }
+
+    ret = log_submit(fls_data, message, sizeof(char), message_len);
+
+    if (message != scratch)
+        HeapFree(GetProcessHeap(), 0, message);
+    return ret;
+}
+
+#ifdef __cplusplus
+extern "C"
+#endif /* defined(__cplusplus) */
+int wlog_write_message(logger_instance* const logger, LOG_LEVEL const level, wchar_t const* const file,
+                       long const line, wchar_t const* const format, ...)
+{
+    fiber_local_data local_data;
+    fiber_local_data* fls_data;
+    wchar_t scratch[LOG_SCRATCH_SIZE];
+    wchar_t* message = scratch;
+    size_t buffer_size;
+    va_list args;
+    int message_len;
+    int ret;
+
+    if (!LOG_IS_RECORDED(logger, level))
+        return 1;
+
+    fls_data = log_begin_message(logger, level, file, sizeof(wchar_t), line, &local_data);
+    if (!fls_data)
+        return 0;
+
+    if (fls_data->do_trace)
+    {
+        va_start(args, format);
+        log_trace_record(fls_data, format, sizeof(wchar_t), args);
+        va_end(args);
+    }
+
+    if (!fls_data->do_log)
+        return 1;
+
+    /* _vsnwprintf neither reports the needed size nor terminates a message that fills the buffer exactly. */
+    va_start(args, format);
+    message_len = _vsnwprintf(scratch, LOG_SCRATCH_SIZE - 1, format, args);
+    va_end(args);
+
+    buffer_size = LOG_SCRATCH_SIZE;
+    while (message_len < 0)
+    {
+        if (message != scratch)
+            HeapFree(GetProcessHeap(), 0, message);
+        buffer_size = buffer_size * 2 + 16;
+
+        message = (wchar_t*)HeapAlloc(GetProcessHeap(), 0, sizeof(wchar_t) * buffer_size);
+        if (message == NULL)
+            return 0;
+
+        va_start(args, format);
+        message_len = _vsnwprintf(message, buffer_size - 1, format, args);
+        va_end(args);
+    }
+    message[message_len] = 0;
+
+    ret = log_submit(fls_data, message, sizeof(wchar_t), message_len);
+
+    if (message != scratch)
+        HeapFree(GetProcessHeap(), 0, message);
     return ret;
 }
 
@@ -370,3 +1563,17 @@ void log_get_file_and_line(void const** const file, long* const line)
         *file = narrow_file;
     }
 }
+
+unsigned long log_get_thread_id(void)
+{
+    fiber_local_data* fls_data;
+
+    if (!fls_index_initialized)
+        return GetCurrentThreadId();
+
+    fls_data = (fiber_local_data*)FlsGetValue(fls_index);
+    if (fls_data == NULL || fls_data == 0)
+        return GetCurrentThreadId();
+
+    return fls_data->thread_id;
+}
@@ -0,0 +1,191 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+/* Also built natively as part of winestreamproxy-tracedump, so this file must not use the Windows API. */
+
+#include "trace_format.h"
+
+#include <stddef.h>
+
+typedef enum TRACE_LENGTH {
+    TRACE_LENGTH_NONE,
+    TRACE_LENGTH_SHORT,
+    TRACE_LENGTH_LONG,
+    TRACE_LENGTH_LONG_LONG,
+    TRACE_LENGTH_SIZE
+} TRACE_LENGTH;
+
+#define trace_format_is_digit(c) ((c) >= '0' && (c) <= '9')
+#define trace_format_is_flag(c) ((c) == '-' || (c) == '+' || (c) == ' ' || (c) == '#' || (c) == '0' || (c) == '\'')
+
+static unsigned char trace_format_integer_type(TRACE_LENGTH const length)
+{
+    switch (length)
+    {
+        case TRACE_LENGTH_LONG:
+            return TRACE_ARG_LONG;
+        case TRACE_LENGTH_LONG_LONG:
+            return TRACE_ARG_LONG_LONG;
+        case TRACE_LENGTH_SIZE:
+            return TRACE_ARG_SIZE;
+        default:
+            return TRACE_ARG_INT;
+    }
+}
+
+int trace_format_next(char const* const format, size_t* const pos, int const wide, trace_format_spec* const spec)
+{
+    TRACE_LENGTH length = TRACE_LENGTH_NONE;
+    size_t i = *pos;
+
+    while (format[i] != '\0' && format[i] != '%')
+        ++i;
+    if (format[i] == '\0')
+    {
+        *pos = i;
+        return 0;
+    }
+
+    spec->start = i++;
+    spec->width_arg = 0;
+    spec->precision_arg = 0;
+    spec->precision = -1;
+    spec->type = TRACE_ARG_NONE;
+
+    while (trace_format_is_flag(format[i]))
+        ++i;
+
+    if (format[i] == '*')
+    {
+        spec->width_arg = 1;
+        ++i;
+    }
+    else
+        while (trace_format_is_digit(format[i]))
+            ++i;
+
+    if (format[i] == '.')
+    {
+        ++i;
+        if (format[i] == '*')
+        {
+            spec->precision_arg = 1;
+            ++i;
+        }
+        else
+        {
+            spec->precision = 0;
+            while (trace_format_is_digit(format[i]))
+                spec->precision = spec->precision * 10 + (format[i++] - '0');
+        }
+    }
+
+    spec->length_start = i;
+    switch (format[i])
+    {
+        case 'h':
+            ++i;
+            if (format[i] == 'h')
+                ++i;
+            length = TRACE_LENGTH_SHORT;
+            break;
+        case 'l':
+            ++i;
+            if (format[i] == 'l')
+            {
+                ++i;
+                length = TRACE_LENGTH_LONG_LONG;
+            }
+            else
+                length = TRACE_LENGTH_LONG;
+            break;
+        case 'w':
+            ++i;
+            length = TRACE_LENGTH_LONG;
+            break;
+        case 'L':
+        case 'q':
+        case 'j':
+            ++i;
+            length = TRACE_LENGTH_LONG_LONG;
+            break;
+        case 'z':
+        case 't':
+            ++i;
+            length = TRACE_LENGTH_SIZE;
+            break;
+        case 'I':
+            ++i;
+            if (format[i] == '6' && format[i + 1] == '4')
+            {
+                i += 2;
+                length = TRACE_LENGTH_LONG_LONG;
+            }
+            else if (format[i] == '3' && format[i + 1] == '2')
+                i += 2;
+            else
+                length = TRACE_LENGTH_SIZE;
+            break;
+    }
+
+    spec->conversion = format[i];
+    switch (format[i])
+    {
+        case '%':
+            break;
+        case 'd':
+        case 'i':
+            spec->type = trace_format_integer_type(length) | TRACE_ARG_SIGNED;
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            spec->type = trace_format_integer_type(length);
+            break;
+        case 'c':
+        case 'C':
+            /* Both narrow and wide characters are promoted to int. */
+            spec->type = TRACE_ARG_INT;
+            break;
+        case 's':
+            if (length == TRACE_LENGTH_SHORT || (length == TRACE_LENGTH_NONE && !wide))
+                spec->type = TRACE_ARG_STRING;
+            else
+                spec->type = TRACE_ARG_WIDE_STRING;
+            break;
+        case 'S':
+            if (length == TRACE_LENGTH_SHORT || (length == TRACE_LENGTH_NONE && wide))
+                spec->type = TRACE_ARG_STRING;
+            else
+                spec->type = TRACE_ARG_WIDE_STRING;
+            break;
+        case 'p':
+            spec->type = TRACE_ARG_POINTER;
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            spec->type = length == TRACE_LENGTH_LONG_LONG ? TRACE_ARG_LONG_DOUBLE : TRACE_ARG_DOUBLE;
+            break;
+        default:
+            *pos = format[i] != '\0' ? i + 1 : i;
+            return -1;
+    }
+
+    spec->end = i + 1;
+    *pos = i + 1;
+    return 1;
+}
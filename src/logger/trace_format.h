@@ -0,0 +1,83 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#pragma once
+#ifndef __WINESTREAMPROXY_TRACE_FORMAT_H__
+#define __WINESTREAMPROXY_TRACE_FORMAT_H__
+
+#include <stddef.h>
+
+/* Layout of the binary trace files that the logger writes and winestreamproxy-tracedump reads. All integers are
+   little-endian and unaligned.
+
+   A file starts with a header:
+     char[8]  magic              TRACE_FILE_MAGIC
+     u64      counter_frequency  Ticks per second of the event timestamps.
+     u64      counter_start      Timestamp of the moment the file was created.
+     u64      time_start         The same moment as a FILETIME, in 100 ns units since 1601-01-01 UTC.
+   followed by blocks that start with a u32 block type and the u32 size of the rest of the block:
+     TRACE_BLOCK_SITE    u32 site id, i32 line, u8 level, u8 argument count, u16 file name length, u16 format length,
+                         u16 flags, then the argument types, the file name and the format, both UTF-8 without a
+                         terminator.
+     TRACE_BLOCK_EVENTS  u32 thread id, then events of a u32 site id, the u32 size of the arguments, a u64 timestamp
+                         and the arguments.
+   Every site is defined before the first event that refers to it. Integer and pointer arguments take 8 bytes and
+   floating point arguments are stored as doubles. Strings are stored as a u32 length and UTF-8 text, or only
+   TRACE_NULL_STRING for null pointers. */
+
+#define TRACE_FILE_MAGIC "WSPTRACE"
+#define TRACE_FILE_HEADER_SIZE 32
+#define TRACE_BLOCK_HEADER_SIZE 8
+#define TRACE_SITE_HEADER_SIZE 16
+#define TRACE_EVENTS_HEADER_SIZE 4
+#define TRACE_EVENT_HEADER_SIZE 16
+
+#define TRACE_BLOCK_SITE 1
+#define TRACE_BLOCK_EVENTS 2
+
+/* Site flags. */
+#define TRACE_SITE_WIDE 1   /* The format was written for the wide printf functions. */
+
+#define TRACE_NULL_STRING 0xFFFFFFFFUL
+#define TRACE_MAX_ARGS 16
+
+typedef enum TRACE_ARG_TYPE {
+    TRACE_ARG_NONE = 0,
+    TRACE_ARG_INT,
+    TRACE_ARG_LONG,
+    TRACE_ARG_LONG_LONG,
+    TRACE_ARG_SIZE,
+    TRACE_ARG_POINTER,
+    TRACE_ARG_DOUBLE,
+    TRACE_ARG_LONG_DOUBLE,
+    TRACE_ARG_STRING,
+    TRACE_ARG_WIDE_STRING
+} TRACE_ARG_TYPE;
+
+/* Combined with the integer types of conversions that print signed values. */
+#define TRACE_ARG_SIGNED 0x80
+
+typedef struct trace_format_spec {
+    size_t          start;          /* Offset of the '%'. */
+    size_t          length_start;   /* Offset of the length modifier, or of the conversion if there is none. */
+    size_t          end;            /* Offset after the conversion character. */
+    char            conversion;     /* '%' for an escaped percent sign, which takes no argument. */
+    int             width_arg;      /* Whether the width is passed as an argument. */
+    int             precision_arg;  /* Whether the precision is passed as an argument. */
+    int             precision;      /* -1 if there is none or it is passed as an argument. */
+    unsigned char   type;           /* TRACE_ARG_TYPE of the value, possibly with TRACE_ARG_SIGNED. */
+} trace_format_spec;
+
+/* Finds the next conversion of a printf format, starting at *pos, and moves *pos past it. Formats of the wide printf
+   functions have to be converted to UTF-8 and passed with wide set, which swaps %s and %S like msvcrt does. Returns
+   1 if a conversion was found, 0 at the end of the format and -1 for conversions that can't be traced, like %n. */
+extern int trace_format_next(char const* format, size_t* pos, int wide, trace_format_spec* spec);
+
+#endif /* !defined(__WINESTREAMPROXY_TRACE_FORMAT_H__) */
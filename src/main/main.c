@@ -10,9 +10,11 @@
 
 #include "argparser.h"
 #include "double_spawn.h"
+#include "misc.h"
 #include "service.h"
 #include "standalone.h"
 #include <winestreamproxy/logger.h>
+#include <winestreamproxy/winestreamproxy.h>
 
 #include <assert.h>
 #include <stddef.h>
@@ -67,9 +69,36 @@ typedef struct main_option_values {
     unsigned int verbose;
     int foreground;
     int system;
+    int reverse;
     int svchost;
     TCHAR const* pipe_name;
     TCHAR const* socket_path;
+    int io_workers;
+    int io_max;
+    int io_idle;
+    int splice;
+    int write_queue;
+    int write_high;
+    int write_low;
+    int listeners;
+    int stop_timeout;
+    int socket_pool;
+    int connect_timeout;
+    int reconnect;
+    int replay;
+    int frames;
+    int max_frame;
+    int activity_interval;
+    int bulk;
+    TCHAR const* pipe_mode;
+    int pipe_buffer;
+    int socket_buffer;
+    TCHAR const* metrics;
+    int log_queue;
+    int log_sync;
+    int log_drop;
+    TCHAR const* trace_file;
+    int trace_size;
 } main_option_values;
 
 typedef struct main_positionals {
@@ -83,9 +112,36 @@ argparser_option_list_entry main_arg_option_list[] = {
     { _T("v"),  _T("verbose"),      ARGPARSER_OPTION_TYPE_ACCUMULATOR,  0, offsetof(main_option_values, verbose) },
     { _T("f"),  _T("foreground"),   ARGPARSER_OPTION_TYPE_BOOLEAN,      0, offsetof(main_option_values, foreground) },
     { _T("y"),  _T("system"),       ARGPARSER_OPTION_TYPE_BOOLEAN,      0, offsetof(main_option_values, system) },
+    { _T("r"),  _T("reverse"),      ARGPARSER_OPTION_TYPE_BOOLEAN,      0, offsetof(main_option_values, reverse) },
     { 0,        _T("svchost"),      ARGPARSER_OPTION_TYPE_BOOLEAN,      0, offsetof(main_option_values, svchost) },
     { _T("p"),  _T("pipe"),         ARGPARSER_OPTION_TYPE_STRING,       0, offsetof(main_option_values, pipe_name) },
     { _T("s"),  _T("socket"),       ARGPARSER_OPTION_TYPE_STRING,       0, offsetof(main_option_values, socket_path) },
+    { 0,        _T("io-workers"),   ARGPARSER_OPTION_TYPE_INTEGER,      0, offsetof(main_option_values, io_workers) },
+    { 0,        _T("io-max"),       ARGPARSER_OPTION_TYPE_INTEGER,      0, offsetof(main_option_values, io_max) },
+    { 0,        _T("io-idle"),      ARGPARSER_OPTION_TYPE_INTEGER,      0, offsetof(main_option_values, io_idle) },
+    { 0,        _T("splice"),       ARGPARSER_OPTION_TYPE_BOOLEAN,      0, offsetof(main_option_values, splice) },
+    { 0,        _T("write-queue"),  ARGPARSER_OPTION_TYPE_INTEGER,      0, offsetof(main_option_values, write_queue) },
+    { 0,        _T("write-high"),   ARGPARSER_OPTION_TYPE_INTEGER,      0, offsetof(main_option_values, write_high) },
+    { 0,        _T("write-low"),    ARGPARSER_OPTION_TYPE_INTEGER,      0, offsetof(main_option_values, write_low) },
+    { 0,        _T("listeners"),    ARGPARSER_OPTION_TYPE_INTEGER,      0, offsetof(main_option_values, listeners) },
+    { 0,        _T("stop-wait"),    ARGPARSER_OPTION_TYPE_INTEGER,      0, offsetof(main_option_values, stop_timeout) },
+    { 0,        _T("socket-pool"),  ARGPARSER_OPTION_TYPE_INTEGER,      0, offsetof(main_option_values, socket_pool) },
+    { 0,        _T("connect-timeout"), ARGPARSER_OPTION_TYPE_INTEGER,   0, offsetof(main_option_values, connect_timeout) },
+    { 0,        _T("reconnect"),    ARGPARSER_OPTION_TYPE_INTEGER,      0, offsetof(main_option_values, reconnect) },
+    { 0,        _T("replay"),       ARGPARSER_OPTION_TYPE_INTEGER,      0, offsetof(main_option_values, replay) },
+    { 0,        _T("frames"),       ARGPARSER_OPTION_TYPE_BOOLEAN,      0, offsetof(main_option_values, frames) },
+    { 0,        _T("max-frame"),    ARGPARSER_OPTION_TYPE_INTEGER,      0, offsetof(main_option_values, max_frame) },
+    { 0,        _T("activity-interval"), ARGPARSER_OPTION_TYPE_INTEGER, 0, offsetof(main_option_values, activity_interval) },
+    { 0,        _T("bulk"),         ARGPARSER_OPTION_TYPE_BOOLEAN,      0, offsetof(main_option_values, bulk) },
+    { 0,        _T("pipe-mode"),    ARGPARSER_OPTION_TYPE_STRING,       0, offsetof(main_option_values, pipe_mode) },
+    { 0,        _T("pipe-buffer"),  ARGPARSER_OPTION_TYPE_INTEGER,      0, offsetof(main_option_values, pipe_buffer) },
+    { 0,        _T("socket-buffer"), ARGPARSER_OPTION_TYPE_INTEGER,    0, offsetof(main_option_values, socket_buffer) },
+    { 0,        _T("metrics"),      ARGPARSER_OPTION_TYPE_STRING,       0, offsetof(main_option_values, metrics) },
+    { 0,        _T("log-queue"),    ARGPARSER_OPTION_TYPE_INTEGER,      0, offsetof(main_option_values, log_queue) },
+    { 0,        _T("log-sync"),     ARGPARSER_OPTION_TYPE_BOOLEAN,      0, offsetof(main_option_values, log_sync) },
+    { 0,        _T("log-drop"),     ARGPARSER_OPTION_TYPE_BOOLEAN,      0, offsetof(main_option_values, log_drop) },
+    { 0,        _T("trace-file"),   ARGPARSER_OPTION_TYPE_STRING,       0, offsetof(main_option_values, trace_file) },
+    { 0,        _T("trace-size"),   ARGPARSER_OPTION_TYPE_INTEGER,      0, offsetof(main_option_values, trace_size) },
     { 0,        0,                  (ARGPARSER_OPTION_TYPE)0,           0, 0 }
 };
 
@@ -171,17 +227,83 @@ static void print_help(TCHAR const* const arg0)
         exe = _T("winestreamproxy.exe.so");
 
     _tprintf(
-        _T("Usage: %s [options] <pipe name> <socket name>\n")
+        _T("Usage: %s [options] <pipe name> <socket name> [<pipe name> <socket name>...]\n")
         _T("\n")
         _T("-h, --help             Show this help message and exit\n")
         _T("    --version          Show the version number and exit\n")
         _T("-v, --verbose          Be more verbose (can be specified multiple times)\n")
         _T("-f, --foreground       Do not daemonize\n")
         _T("-y, --system           Exit when all other processes have exited\n")
-        _T("-p, --pipe <name>      Explicitly specify the pipe name\n")
-        _T("-s, --socket <path>    Explicitly specify the socket path\n"),
+        _T("-r, --reverse          Listen on the sockets and forward their clients to the pipes\n"),
         exe
     );
+    _fputts(
+        _T("-p, --pipe <name>      Explicitly specify the pipe name\n")
+        _T("-s, --socket <path>    Explicitly specify the socket path\n")
+        _T("    --io-workers <n>   Number of I/O worker threads kept running (default: automatic)\n")
+        _T("    --io-max <n>       I/O worker threads while others are busy (default: twice --io-workers)\n")
+        _T("    --io-idle <ms>     Idle time after which extra I/O workers exit (default: 30000)\n"),
+        stdout
+    );
+    _fputts(
+        _T("    --splice           Move data between pipe and socket in the kernel if possible\n")
+        _T("    --write-queue <n>  Pipe writes in flight per connection (default: 8)\n")
+        _T("    --write-high <n>   Queued pipe writes that pause reading from the socket (default: queue size)\n")
+        _T("    --write-low <n>    Queued pipe writes that resume reading from the socket (default: queue size / 4)\n"),
+        stdout
+    );
+    _fputts(
+        _T("    --listeners <n>    Pipe instances waiting for clients at once (default: 4)\n")
+        _T("    --stop-wait <ms>   Time to wait for connections to close when stopping (default: 10000)\n")
+        _T("    --socket-pool <n>  Server sockets per route connected before clients need them (default: 0)\n")
+        _T("    --connect-timeout <ms>\n")
+        _T("                       Time to wait for a busy server socket (default: 5000)\n"),
+        stdout
+    );
+    _fputts(
+        _T("    --reconnect <ms>   Keep clients connected for this long while the server restarts (default: 0)\n")
+        _T("    --replay <n>       First client messages sent again after reconnecting (default: 0, at most 4)\n")
+        _T("    --frames           Write Discord IPC frames from the socket to the pipe one per message\n")
+        _T("    --max-frame <n>    Largest frame payload in bytes before the connection is closed (default: 4 MiB)\n"),
+        stdout
+    );
+    _fputts(
+        _T("    --activity-interval <ms>\n")
+        _T("                       Send at most one presence update per interval, only the newest (default: 0)\n"),
+        stdout
+    );
+    _fputts(
+        _T("    --bulk             Tune for throughput: byte mode pipes, 64 KiB pipe and 256 KiB socket buffers\n")
+        _T("    --pipe-mode <mode> Named pipe mode, message or byte (default: message, byte with --bulk)\n")
+        _T("    --pipe-buffer <n>  Size of the pipe buffers in bytes (default: 1024)\n")
+        _T("    --socket-buffer <n>\n")
+        _T("                       Size of the socket send and receive buffers in bytes (default: system default)\n"),
+        stdout
+    );
+    _fputts(
+        _T("    --metrics <path>   Serve traffic counters in the Prometheus text format on this Unix socket\n"),
+        stdout
+    );
+    _fputts(
+        _T("    --log-queue <n>    Log messages buffered for the background log writer (default: 1024)\n")
+        _T("    --log-sync         Write log messages from the logging thread instead of a background thread\n")
+        _T("    --log-drop         Drop log messages while the log queue is full instead of waiting\n"),
+        stdout
+    );
+    _fputts(
+        _T("    --trace-file <path>\n")
+        _T("                       Record log messages of all levels into this binary trace file without formatting\n")
+        _T("                       them, winestreamproxy-tracedump turns it into text\n")
+        _T("    --trace-size <n>   Size in MiB at which the trace file is renamed to <path>.old (default: 64)\n"),
+        stdout
+    );
+    _fputts(
+        _T("\n")
+        _T("A socket path may be followed by options that override the settings above for its route, separated by\n")
+        _T("';', e.g. \"<path>;bulk;pipe-mode=message\". Route options: bulk, pipe-mode=<mode>, pipe-buffer=<n>,\n")
+        _T("socket-buffer=<n>, connect-timeout=<ms>\n"),
+        stdout
+    );
 }
 
 #ifdef __cplusplus
@@ -192,7 +314,12 @@ int _tmain(int const argc, TCHAR* argv[])
     logger_instance* early_logger;
     main_option_values optvals;
     main_positionals positionals;
-    size_t i;
+    proxy_tuning tuning;
+    PROXY_PIPE_MODE pipe_mode;
+    TCHAR const** route_args;
+    proxy_paths* routes;
+    size_t route_count, i;
+    int ret;
 
     if (!log_create_logger(early_log_message, (unsigned char)sizeof(TCHAR), &early_logger))
     {
@@ -253,21 +380,227 @@ int _tmain(int const argc, TCHAR* argv[])
             return 1;
         }
     }
-    if (positionals.positionals_count > i)
+    /* Any further positional parameters are pairs of pipe name and socket path for additional routes. */
+    if ((positionals.positionals_count - i) % 2 != 0)
     {
-        LOG_CRITICAL(early_logger, (_T("Too many positional parameters")));
+        LOG_CRITICAL(early_logger, (
+            _T("Missing socket path for pipe %s"),
+            positionals.positionals[positionals.positionals_count - 1]
+        ));
         print_help(argc >= 1 ? argv[0] : 0);
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
         log_destroy_logger(early_logger);
-        return 0;
+        return 1;
+    }
+
+    if (optvals.io_workers < 0 || optvals.io_max < 0 || optvals.io_idle < 0)
+    {
+        LOG_CRITICAL(early_logger, (_T("Invalid I/O worker settings")));
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
+        log_destroy_logger(early_logger);
+        return 1;
+    }
+
+    if (optvals.write_queue < 0 || optvals.write_high < 0 || optvals.write_low < 0)
+    {
+        LOG_CRITICAL(early_logger, (_T("Invalid pipe write queue size")));
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
+        log_destroy_logger(early_logger);
+        return 1;
+    }
+
+    if (optvals.listeners < 0)
+    {
+        LOG_CRITICAL(early_logger, (_T("Invalid number of listening pipe instances")));
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
+        log_destroy_logger(early_logger);
+        return 1;
+    }
+
+    if (optvals.socket_pool < 0)
+    {
+        LOG_CRITICAL(early_logger, (_T("Invalid socket pool size: %d"), optvals.socket_pool));
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
+        log_destroy_logger(early_logger);
+        return 1;
+    }
+
+    if (optvals.connect_timeout < 0)
+    {
+        LOG_CRITICAL(early_logger, (_T("Invalid connect timeout: %d"), optvals.connect_timeout));
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
+        log_destroy_logger(early_logger);
+        return 1;
+    }
+
+    if (optvals.reconnect < 0)
+    {
+        LOG_CRITICAL(early_logger, (_T("Invalid reconnect timeout: %d"), optvals.reconnect));
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
+        log_destroy_logger(early_logger);
+        return 1;
+    }
+
+    if (optvals.replay < 0)
+    {
+        LOG_CRITICAL(early_logger, (_T("Invalid number of replayed messages: %d"), optvals.replay));
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
+        log_destroy_logger(early_logger);
+        return 1;
+    }
+
+    if (optvals.max_frame < 0)
+    {
+        LOG_CRITICAL(early_logger, (_T("Invalid maximum frame size: %d"), optvals.max_frame));
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
+        log_destroy_logger(early_logger);
+        return 1;
     }
 
+    if (optvals.activity_interval < 0)
+    {
+        LOG_CRITICAL(early_logger, (_T("Invalid activity interval: %d"), optvals.activity_interval));
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
+        log_destroy_logger(early_logger);
+        return 1;
+    }
+
+    if (optvals.pipe_mode)
+    {
+        if (_tcsicmp(optvals.pipe_mode, _T("message")) == 0)
+            pipe_mode = PROXY_PIPE_MODE_MESSAGE;
+        else if (_tcsicmp(optvals.pipe_mode, _T("byte")) == 0)
+            pipe_mode = PROXY_PIPE_MODE_BYTE;
+        else
+        {
+            LOG_CRITICAL(early_logger, (_T("Invalid pipe mode: %s"), optvals.pipe_mode));
+            HeapFree(GetProcessHeap(), 0, positionals.positionals);
+            log_destroy_logger(early_logger);
+            return 1;
+        }
+    }
+    else
+        pipe_mode = PROXY_PIPE_MODE_DEFAULT;
+
+    if (optvals.pipe_buffer < 0 || optvals.socket_buffer < 0)
+    {
+        LOG_CRITICAL(early_logger, (
+            _T("Invalid buffer size: %d"),
+            optvals.pipe_buffer < 0 ? optvals.pipe_buffer : optvals.socket_buffer
+        ));
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
+        log_destroy_logger(early_logger);
+        return 1;
+    }
+
+    if (optvals.log_queue < 0)
+    {
+        LOG_CRITICAL(early_logger, (_T("Invalid log queue length: %d"), optvals.log_queue));
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
+        log_destroy_logger(early_logger);
+        return 1;
+    }
+
+    if (optvals.trace_size < 0)
+    {
+        LOG_CRITICAL(early_logger, (_T("Invalid trace file size: %d"), optvals.trace_size));
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
+        log_destroy_logger(early_logger);
+        return 1;
+    }
+
+    if (optvals.stop_timeout < 0)
+    {
+        LOG_CRITICAL(early_logger, (_T("Invalid stop timeout: %d"), optvals.stop_timeout));
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
+        log_destroy_logger(early_logger);
+        return 1;
+    }
+
+    RtlZeroMemory(&tuning, sizeof(tuning));
+    tuning.io_worker_count = (unsigned int)optvals.io_workers;
+    tuning.io_worker_max = (unsigned int)optvals.io_max;
+    tuning.io_worker_idle_timeout = (unsigned int)optvals.io_idle;
+    tuning.splice = optvals.splice ? TRUE : FALSE;
+    tuning.pipe_write_queue_depth = (unsigned int)optvals.write_queue;
+    tuning.pipe_write_high_watermark = (unsigned int)optvals.write_high;
+    tuning.pipe_write_low_watermark = (unsigned int)optvals.write_low;
+    tuning.listen_instance_count = (unsigned int)optvals.listeners;
+    tuning.stop_timeout = (unsigned int)optvals.stop_timeout;
+    tuning.socket_pool_size = (unsigned int)optvals.socket_pool;
+    tuning.connect_timeout = (unsigned int)optvals.connect_timeout;
+    tuning.reconnect_timeout = (unsigned int)optvals.reconnect;
+    tuning.replay_messages = (unsigned int)optvals.replay;
+    tuning.frames = optvals.frames ? TRUE : FALSE;
+    tuning.max_frame_size = (unsigned int)optvals.max_frame;
+    tuning.activity_interval = (unsigned int)optvals.activity_interval;
+    tuning.bulk = optvals.bulk ? TRUE : FALSE;
+    tuning.pipe_mode = pipe_mode;
+    tuning.pipe_buffer_size = (unsigned int)optvals.pipe_buffer;
+    tuning.socket_buffer_size = (unsigned int)optvals.socket_buffer;
+    tuning.log_queue_length = (unsigned int)optvals.log_queue;
+    tuning.log_sync = optvals.log_sync ? TRUE : FALSE;
+    tuning.log_drop = optvals.log_drop ? TRUE : FALSE;
+    tuning.trace_file_path = optvals.trace_file;
+    tuning.trace_file_size = (unsigned int)optvals.trace_size;
+
+    route_count = 1 + (positionals.positionals_count - i) / 2;
+    route_args = (TCHAR const**)HeapAlloc(GetProcessHeap(), 0, sizeof(TCHAR const*) * route_count * 2);
+    if (!route_args)
+    {
+        LOG_CRITICAL(early_logger, (
+            _T("Failed to allocate %lu bytes"),
+            (unsigned long)(sizeof(TCHAR const*) * route_count * 2)
+        ));
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
+        log_destroy_logger(early_logger);
+        return 1;
+    }
+    route_args[0] = optvals.pipe_name;
+    route_args[1] = optvals.socket_path;
+    RtlCopyMemory(&route_args[2], &positionals.positionals[i], sizeof(TCHAR const*) * (route_count - 1) * 2);
+
+    /* The routes are made again by the proxy process, this only reports invalid route options before going to the
+       background. */
+    if (!make_routes(early_logger, route_args, route_count, optvals.reverse ? TRUE : FALSE, &routes))
+    {
+        HeapFree(GetProcessHeap(), 0, route_args);
+        HeapFree(GetProcessHeap(), 0, positionals.positionals);
+        log_destroy_logger(early_logger);
+        return 1;
+    }
+    free_routes(route_args, routes, route_count);
+
+#ifdef _UNICODE
+    if (optvals.metrics)
+    {
+        tuning.metrics_socket_path = wide_to_narrow(early_logger, optvals.metrics);
+        if (!tuning.metrics_socket_path)
+        {
+            HeapFree(GetProcessHeap(), 0, route_args);
+            HeapFree(GetProcessHeap(), 0, positionals.positionals);
+            log_destroy_logger(early_logger);
+            return 1;
+        }
+    }
+#else
+    tuning.metrics_socket_path = optvals.metrics;
+#endif
+
     HeapFree(GetProcessHeap(), 0, positionals.positionals);
     log_destroy_logger(early_logger);
 
     if (optvals.svchost)
-        return service_main(optvals.verbose, optvals.foreground, optvals.system, optvals.pipe_name,
-                            optvals.socket_path);
+        ret = service_main(optvals.verbose, optvals.foreground, optvals.system, optvals.reverse, &tuning, route_args,
+                           route_count);
     else
-        return standalone_main(optvals.verbose, optvals.foreground, optvals.system, optvals.pipe_name,
-                               optvals.socket_path);
+        ret = standalone_main(optvals.verbose, optvals.foreground, optvals.system, optvals.reverse, &tuning,
+                              route_args, route_count);
+
+#ifdef _UNICODE
+    if (tuning.metrics_socket_path)
+        HeapFree(GetProcessHeap(), 0, (char*)tuning.metrics_socket_path);
+#endif
+    HeapFree(GetProcessHeap(), 0, route_args);
+    return ret;
 }
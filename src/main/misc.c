@@ -10,6 +10,10 @@
 
 #include "misc.h"
 #include <winestreamproxy/logger.h>
+#include <winestreamproxy/winestreamproxy.h>
+
+#include <limits.h>
+#include <stddef.h>
 
 #include <tchar.h>
 #include <windef.h>
@@ -32,6 +36,209 @@ void lower_process_priority(logger_instance* const logger)
     LOG_TRACE(logger, (_T("Lowered the process priority")));
 }
 
+#define DEFAULT_LOG_QUEUE_LENGTH 1024
+
+void start_async_logging(logger_instance* const logger, proxy_tuning const* const tuning)
+{
+    size_t const queue_length = tuning->log_queue_length ? tuning->log_queue_length : DEFAULT_LOG_QUEUE_LENGTH;
+
+    if (tuning->log_sync)
+        return;
+
+    if (!log_start_async(logger, queue_length, tuning->log_drop ? LOG_OVERFLOW_DROP : LOG_OVERFLOW_BLOCK))
+    {
+        LOG_WARNING(logger, (_T("Could not start the log writer thread, logging synchronously")));
+        return;
+    }
+
+    LOG_TRACE(logger, (_T("Started the log writer thread with room for %lu messages"), (unsigned long)queue_length));
+}
+
+#define DEFAULT_TRACE_FILE_SIZE 64
+
+void start_tracing(logger_instance* const logger, proxy_tuning const* const tuning)
+{
+    size_t const max_file_size = (size_t)(tuning->trace_file_size ? tuning->trace_file_size : DEFAULT_TRACE_FILE_SIZE)
+                                 << 20;
+    int started;
+
+    if (!tuning->trace_file_path)
+        return;
+
+#ifdef _UNICODE
+    started = wlog_start_trace(logger, tuning->trace_file_path, max_file_size);
+#else
+    started = log_start_trace(logger, tuning->trace_file_path, max_file_size);
+#endif
+    if (!started)
+    {
+        LOG_ERROR(logger, (_T("Could not open the trace file %s: Error %d"), tuning->trace_file_path, GetLastError()));
+        return;
+    }
+
+    LOG_DEBUG(logger, (_T("Recording log messages into %s"), tuning->trace_file_path));
+}
+
+static BOOL route_option_is(TCHAR const* const option, size_t const length, TCHAR const* const name)
+{
+    return length == _tcslen(name) && _tcsnicmp(option, name, length) == 0;
+}
+
+static BOOL parse_route_number(TCHAR const* const value, size_t const length, unsigned int* const out_number)
+{
+    unsigned int number = 0;
+    size_t i;
+
+    if (!length)
+        return FALSE;
+
+    for (i = 0; i < length; ++i)
+    {
+        if (value[i] < _T('0') || value[i] > _T('9') || number > (UINT_MAX - (value[i] - _T('0'))) / 10)
+            return FALSE;
+        number = number * 10 + (value[i] - _T('0'));
+    }
+
+    *out_number = number;
+    return TRUE;
+}
+
+/* Overrides the tuning for one route, e.g. "bulk;pipe-mode=message". */
+static BOOL parse_route_options(logger_instance* const logger, TCHAR const* option, proxy_paths* const route)
+{
+    while (TRUE)
+    {
+        size_t const length = _tcscspn(option, _T(";"));
+        size_t const name_length = _tcscspn(option, _T("=;"));
+        TCHAR const* const value = name_length < length ? option + name_length + 1 : option + length;
+        size_t const value_length = length - (size_t)(value - option);
+        BOOL valid = TRUE;
+
+        if (route_option_is(option, length, _T("bulk")))
+            route->bulk = TRUE;
+        else if (route_option_is(option, name_length, _T("pipe-mode")))
+        {
+            if (route_option_is(value, value_length, _T("message")))
+                route->pipe_mode = PROXY_PIPE_MODE_MESSAGE;
+            else if (route_option_is(value, value_length, _T("byte")))
+                route->pipe_mode = PROXY_PIPE_MODE_BYTE;
+            else
+                valid = FALSE;
+        }
+        else if (route_option_is(option, name_length, _T("pipe-buffer")))
+            valid = parse_route_number(value, value_length, &route->pipe_buffer_size);
+        else if (route_option_is(option, name_length, _T("socket-buffer")))
+            valid = parse_route_number(value, value_length, &route->socket_buffer_size);
+        else if (route_option_is(option, name_length, _T("connect-timeout")))
+            valid = parse_route_number(value, value_length, &route->connect_timeout);
+        /* Empty options, e.g. after a trailing ';', are ignored. */
+        else if (length)
+            valid = FALSE;
+
+        if (!valid)
+        {
+            LOG_CRITICAL(logger, (_T("Invalid route option: %.*s"), (int)length, option));
+            return FALSE;
+        }
+
+        if (!option[length])
+            return TRUE;
+        option += length + 1;
+    }
+}
+
+BOOL make_routes(logger_instance* const logger, TCHAR const* const* const route_args, size_t const route_count,
+                 BOOL const reverse, proxy_paths** const out_routes)
+{
+    proxy_paths* routes;
+    size_t i;
+
+    routes = (proxy_paths*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(proxy_paths) * route_count);
+    if (!routes)
+    {
+        LOG_CRITICAL(logger, (_T("Failed to allocate %lu bytes"), (unsigned long)(sizeof(proxy_paths) * route_count)));
+        return FALSE;
+    }
+
+    for (i = 0; i < route_count; ++i)
+    {
+        TCHAR const* const pipe_arg = route_args[i * 2];
+        TCHAR const* const socket_arg = route_args[i * 2 + 1];
+        TCHAR const* const options = _tcschr(socket_arg, _T(';'));
+        TCHAR* socket_path;
+
+        if (pipe_arg[0] != _T('\\') || pipe_arg[1] != _T('\\'))
+        {
+            routes[i].named_pipe_path = pipe_name_to_path(logger, pipe_arg);
+            if (!routes[i].named_pipe_path)
+                break;
+        }
+        else
+            routes[i].named_pipe_path = pipe_arg;
+
+        /* The route options follow the socket path. */
+        if (options)
+        {
+            socket_path = (TCHAR*)HeapAlloc(GetProcessHeap(), 0, sizeof(TCHAR) * (options - socket_arg + 1));
+            if (!socket_path)
+            {
+                LOG_CRITICAL(logger, (
+                    _T("Failed to allocate %lu bytes"),
+                    (unsigned long)(sizeof(TCHAR) * (options - socket_arg + 1))
+                ));
+                break;
+            }
+            RtlCopyMemory(socket_path, socket_arg, sizeof(TCHAR) * (options - socket_arg));
+            socket_path[options - socket_arg] = _T('\0');
+        }
+        else
+            socket_path = (TCHAR*)socket_arg;
+
+#ifdef _UNICODE
+        routes[i].unix_socket_path = wide_to_narrow(logger, socket_path);
+        if (socket_path != socket_arg)
+            HeapFree(GetProcessHeap(), 0, socket_path);
+        if (!routes[i].unix_socket_path)
+            break;
+#else
+        routes[i].unix_socket_path = socket_path;
+#endif
+
+        routes[i].reverse = reverse;
+
+        if (options && !parse_route_options(logger, options + 1, &routes[i]))
+            break;
+    }
+
+    if (i < route_count)
+    {
+        free_routes(route_args, routes, route_count);
+        return FALSE;
+    }
+
+    *out_routes = routes;
+    return TRUE;
+}
+
+void free_routes(TCHAR const* const* const route_args, proxy_paths* const routes, size_t const route_count)
+{
+    size_t i;
+
+    for (i = 0; i < route_count; ++i)
+    {
+#ifdef _UNICODE
+        if (routes[i].unix_socket_path)
+#else
+        if (routes[i].unix_socket_path && routes[i].unix_socket_path != route_args[i * 2 + 1])
+#endif
+            HeapFree(GetProcessHeap(), 0, (char*)routes[i].unix_socket_path);
+        if (routes[i].named_pipe_path && routes[i].named_pipe_path != route_args[i * 2])
+            deallocate_path(routes[i].named_pipe_path);
+    }
+
+    HeapFree(GetProcessHeap(), 0, routes);
+}
+
 #ifdef _UNICODE
 
 LPSTR wide_to_narrow(logger_instance* const logger, LPCWCH const wide_path)
@@ -13,9 +13,13 @@
 #define __WINESTREAMPROXY_MAIN_MISC_H__
 
 #include <winestreamproxy/logger.h>
+#include <winestreamproxy/winestreamproxy.h>
 
-#ifdef _UNICODE
+#include <stddef.h>
+
+#include <tchar.h>
 #include <windef.h>
+#ifdef _UNICODE
 #include <winnt.h>
 #endif
 
@@ -24,6 +28,16 @@ extern "C" {
 #endif /* defined(__cplusplus) */
 
 extern void lower_process_priority(logger_instance* logger);
+/* Moves writing the log messages to a background thread unless the tuning asks for synchronous logging. */
+extern void start_async_logging(logger_instance* logger, proxy_tuning const* tuning);
+/* Records all log messages into the tuning's trace file, if there is one. */
+extern void start_tracing(logger_instance* logger, proxy_tuning const* tuning);
+
+/* route_args holds a pipe name or path and a socket path for every route. The socket path may be followed by route
+   options, separated by ';'. */
+extern BOOL make_routes(logger_instance* logger, TCHAR const* const* route_args, size_t route_count, BOOL reverse,
+                        proxy_paths** out_routes);
+extern void free_routes(TCHAR const* const* route_args, proxy_paths* routes, size_t route_count);
 
 #ifdef _UNICODE
 extern LPSTR wide_to_narrow(logger_instance* logger, LPCWCH wide_path);
@@ -22,8 +22,10 @@
 #include <winsvc.h>
 
 unsigned int verbose;
-TCHAR const* pipe_arg;
-TCHAR const* socket_arg;
+int reverse;
+proxy_tuning tuning;
+TCHAR const* const* route_args;
+size_t route_count;
 
 static logger_instance* logger;
 /*HANDLE service_event_source;*/
@@ -79,11 +81,11 @@ static int svc_log_message(logger_instance* const logger, LOG_LEVEL const level,
 
         log_get_file_and_line((void const**)&file, &line);
         _ftprintf(level >= LOG_LEVEL_ERROR ? stderr : stdout, LOG_MESSAGE_LINE1_FMT LOG_MESSAGE_LINE2_FMT,
-                  svc_log_level_prefixes[level], (unsigned int)GetCurrentThreadId(), (TCHAR const*)message, file, line);
+                  svc_log_level_prefixes[level], (unsigned int)log_get_thread_id(), (TCHAR const*)message, file, line);
     }
     else
         _ftprintf(level >= LOG_LEVEL_ERROR ? stderr : stdout, LOG_MESSAGE_LINE1_FMT, svc_log_level_prefixes[level],
-                  (unsigned int)GetCurrentThreadId(), (TCHAR const*)message);
+                  (unsigned int)log_get_thread_id(), (TCHAR const*)message);
 
     return 1;
 }
@@ -139,8 +141,8 @@ void WINAPI service_ctrl_handler(DWORD control)
 void CALLBACK service_proc(DWORD const argc, LPTSTR* const argv)
 {
     LOG_LEVEL log_level;
-    BOOL deallocate_pipe_path;
     proxy_parameters params;
+    proxy_paths* routes;
     proxy_data* proxy;
 
     (void)argc;
@@ -170,6 +172,8 @@ void CALLBACK service_proc(DWORD const argc, LPTSTR* const argv)
     log_set_min_level(logger, log_level);
 
     LOG_TRACE(logger, (_T("Created main logger")));
+    start_async_logging(logger, &tuning);
+    start_tracing(logger, &tuning);
 
     service_status_handle = RegisterServiceCtrlHandler(service_name, service_ctrl_handler);
     if (service_status_handle == 0)
@@ -184,31 +188,16 @@ void CALLBACK service_proc(DWORD const argc, LPTSTR* const argv)
     if (SetServiceStatus(service_status_handle , &service_status) == 0)
         LOG_ERROR(logger, (_T("Failed to set service status to starting: Error %d"), GetLastError()));*/
 
-    if (pipe_arg[0] != _T('\\') || pipe_arg[1] != _T('\\'))
-    {
-        params.paths.named_pipe_path = pipe_name_to_path(logger, pipe_arg);
-        if (!params.paths.named_pipe_path)
-            goto err_name2path;
-        deallocate_pipe_path = TRUE;
-    }
-    else
-    {
-        params.paths.named_pipe_path = pipe_arg;
-        deallocate_pipe_path = FALSE;
-    }
-
-#ifdef _UNICODE
-    params.paths.unix_socket_path = wide_to_narrow(logger, socket_arg);
-    if (!params.paths.unix_socket_path)
-        goto err_wide2narrow;
-#else
-    params.paths.unix_socket_path = socket_arg;
-#endif
+    if (!make_routes(logger, route_args, route_count, reverse ? TRUE : FALSE, &routes))
+        goto err_make_routes;
+    params.routes = routes;
+    params.route_count = (unsigned int)route_count;
 
     params.exit_event = CreateEvent(NULL, TRUE, FALSE, NULL);
     if (!params.exit_event)
         goto err_create_event;
 
+    params.tuning = tuning;
     params.state_change_callback = service_set_status_running;
 
     if (!proxy_create(logger, params, &proxy))
@@ -227,20 +216,15 @@ void CALLBACK service_proc(DWORD const argc, LPTSTR* const argv)
 err_proxy_create:
     CloseHandle(params.exit_event);
 err_create_event:
-#ifdef _UNICODE
-    HeapFree(GetProcessHeap(), 0, (char*)params.paths.unix_socket_path);
-err_wide2narrow:
-#endif
-    if (deallocate_pipe_path)
-        deallocate_path(params.paths.named_pipe_path);
-err_name2path:
+    free_routes(route_args, routes, route_count);
+err_make_routes:
     service_set_status_stopped(logger);
 err_register:
     log_destroy_logger(logger);
 }
 
-int service_main(unsigned int const _verbose, int const foreground, int const system, TCHAR const* const _pipe_arg,
-                 TCHAR const* const _socket_arg)
+int service_main(unsigned int const _verbose, int const foreground, int const system, int const _reverse,
+                 proxy_tuning const* const _tuning, TCHAR const* const* const _route_args, size_t const _route_count)
 {
     if (foreground)
     {
@@ -252,8 +236,10 @@ int service_main(unsigned int const _verbose, int const foreground, int const sy
         svc_log_message(0, LOG_LEVEL_INFO, _T("Services are always system processes, ignoring -y/--system parameter"));
 
     verbose = _verbose;
-    pipe_arg = _pipe_arg;
-    socket_arg = _socket_arg;
+    reverse = _reverse;
+    tuning = *_tuning;
+    route_args = _route_args;
+    route_count = _route_count;
 
     return !!StartServiceCtrlDispatcher(service_table);
 }
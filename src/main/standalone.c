@@ -16,6 +16,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <ntdef.h>
 #include <ntstatus.h>
@@ -65,11 +66,11 @@ static int log_message(logger_instance* const logger, LOG_LEVEL const level, voi
 
         log_get_file_and_line((void const**)&file, &line);
         _ftprintf(level >= LOG_LEVEL_ERROR ? stderr : stdout, LOG_MESSAGE_LINE1_FMT LOG_MESSAGE_LINE2_FMT,
-                  log_level_prefixes[level], (unsigned int)GetCurrentThreadId(), (TCHAR const*)message, file, line);
+                  log_level_prefixes[level], (unsigned int)log_get_thread_id(), (TCHAR const*)message, file, line);
     }
     else
         _ftprintf(level >= LOG_LEVEL_ERROR ? stderr : stdout, LOG_MESSAGE_LINE1_FMT, log_level_prefixes[level],
-                  (unsigned int)GetCurrentThreadId(), (TCHAR const*)message);
+                  (unsigned int)log_get_thread_id(), (TCHAR const*)message);
 
     return 1;
 }
@@ -226,38 +227,24 @@ void signal_handler(int const signal)
 }
 
 static int standalone_main_3(logger_instance* const logger, BOOL const is_ds_child, int const system,
-                             TCHAR const* const pipe_arg, TCHAR const* const socket_arg)
+                             int const reverse, proxy_tuning const* const tuning,
+                             TCHAR const* const* const route_args, size_t const route_count)
 {
-    BOOL deallocate_pipe_path;
     proxy_parameters params;
+    proxy_paths* routes;
     proxy_data* proxy;
     int ret = 1;
 
-    if (pipe_arg[0] != _T('\\') || pipe_arg[1] != _T('\\'))
-    {
-        params.paths.named_pipe_path = pipe_name_to_path(logger, pipe_arg);
-        if (!params.paths.named_pipe_path)
-            goto err_name2path;
-        deallocate_pipe_path = TRUE;
-    }
-    else
-    {
-        params.paths.named_pipe_path = pipe_arg;
-        deallocate_pipe_path = FALSE;
-    }
-
-#ifdef _UNICODE
-    params.paths.unix_socket_path = wide_to_narrow(logger, socket_arg);
-    if (!params.paths.unix_socket_path)
-        goto err_wide2narrow;
-#else
-    params.paths.unix_socket_path = socket_arg;
-#endif
+    if (!make_routes(logger, route_args, route_count, reverse ? TRUE : FALSE, &routes))
+        goto err_make_routes;
+    params.routes = routes;
+    params.route_count = (unsigned int)route_count;
 
     params.exit_event = CreateEvent(NULL, TRUE, FALSE, NULL);
     if (!params.exit_event)
         goto err_create_event;
 
+    params.tuning = *tuning;
     params.state_change_callback = is_ds_child ? state_change_callback : 0;
 
     if (!proxy_create(logger, params, &proxy))
@@ -282,18 +269,14 @@ err_make_system:
 err_proxy_create:
     CloseHandle(params.exit_event);
 err_create_event:
-#ifdef _UNICODE
-    HeapFree(GetProcessHeap(), 0, (char*)params.paths.unix_socket_path);
-err_wide2narrow:
-#endif
-    if (deallocate_pipe_path)
-        deallocate_path(params.paths.named_pipe_path);
-err_name2path:
+    free_routes(route_args, routes, route_count);
+err_make_routes:
     return ret;
 }
 
-static int standalone_main_2(unsigned int const verbose, int const system, TCHAR const* const pipe_arg,
-                             TCHAR const* const socket_arg)
+static int standalone_main_2(unsigned int const verbose, int const system, int const reverse,
+                             proxy_tuning const* const tuning, TCHAR const* const* const route_args,
+                             size_t const route_count)
 {
     logger_instance* logger;
     LOG_LEVEL log_level;
@@ -317,8 +300,10 @@ static int standalone_main_2(unsigned int const verbose, int const system, TCHAR
     else
         log_level = (LOG_LEVEL)0;
     log_set_min_level(logger, log_level);
+    start_async_logging(logger, tuning);
+    start_tracing(logger, tuning);
 
-    ret = standalone_main_3(logger, TRUE, system, pipe_arg, socket_arg);
+    ret = standalone_main_3(logger, TRUE, system, reverse, tuning, route_args, route_count);
 
     log_destroy_logger(logger);
     return ret;
@@ -329,10 +314,13 @@ int double_spawn_proc(void* aux_data, size_t aux_data_size)
     char* p;
     unsigned int verbose;
     int system;
-    TCHAR const* pipe_name, * socket_path;
-    size_t pipe_name_len, socket_path_len;
+    int reverse;
+    proxy_tuning tuning;
+    size_t route_count, arg_len, i;
+    TCHAR const** route_args;
+    int ret;
 
-    if (aux_data_size < sizeof(unsigned int) + 2)
+    if (aux_data_size < sizeof(unsigned int) + sizeof(int) * 2 + sizeof(proxy_tuning) + sizeof(size_t))
         return 1;
 
     p = (char*)aux_data;
@@ -345,33 +333,70 @@ int double_spawn_proc(void* aux_data, size_t aux_data_size)
     p += sizeof(int);
     aux_data_size -= sizeof(int);
 
-    pipe_name = (TCHAR const*)p;
-    pipe_name_len = _tcsnlen(pipe_name, aux_data_size);
-    p += (pipe_name_len + 1) * sizeof(TCHAR);
-    aux_data_size -= (pipe_name_len + 1) * sizeof(TCHAR);
+    reverse = *(int*)p;
+    p += sizeof(int);
+    aux_data_size -= sizeof(int);
+
+    RtlCopyMemory(&tuning, p, sizeof(proxy_tuning));
+    p += sizeof(proxy_tuning);
+    aux_data_size -= sizeof(proxy_tuning);
+
+    RtlCopyMemory(&route_count, p, sizeof(size_t));
+    p += sizeof(size_t);
+    aux_data_size -= sizeof(size_t);
+
+    route_args = (TCHAR const**)HeapAlloc(GetProcessHeap(), 0, sizeof(TCHAR const*) * route_count * 2);
+    if (!route_args)
+        return 1;
+
+    /* Every route is a pipe name followed by a socket path, both null-terminated. */
+    for (i = 0; i < route_count * 2; ++i)
+    {
+        route_args[i] = (TCHAR const*)p;
+        arg_len = _tcsnlen(route_args[i], aux_data_size / sizeof(TCHAR));
+        p += (arg_len + 1) * sizeof(TCHAR);
+        aux_data_size -= (arg_len + 1) * sizeof(TCHAR);
+    }
+
+    if (aux_data_size == 0)
+    {
+        HeapFree(GetProcessHeap(), 0, route_args);
+        return 1;
+    }
+    tuning.metrics_socket_path = *p ? p : 0;
+    arg_len = strnlen(p, aux_data_size - 1) + 1;
+    p += arg_len;
+    aux_data_size -= arg_len;
 
-    socket_path = (TCHAR const*)p;
-    socket_path_len = _tcsnlen(socket_path, aux_data_size);
-    p += (socket_path_len + 1) * sizeof(TCHAR);
-    aux_data_size -= (socket_path_len + 1) * sizeof(TCHAR);
+    if (aux_data_size < sizeof(TCHAR))
+    {
+        HeapFree(GetProcessHeap(), 0, route_args);
+        return 1;
+    }
+    tuning.trace_file_path = *(TCHAR const*)p ? (TCHAR const*)p : 0;
+    aux_data_size -= (_tcsnlen((TCHAR const*)p, aux_data_size / sizeof(TCHAR) - 1) + 1) * sizeof(TCHAR);
 
     assert(aux_data_size == 0);
 
-    return standalone_main_2(verbose, system, pipe_name, socket_path);
+    ret = standalone_main_2(verbose, system, reverse, &tuning, route_args, route_count);
+
+    HeapFree(GetProcessHeap(), 0, route_args);
+    return ret;
 }
 
-int put_in_background(logger_instance* logger, unsigned int const verbose, int const system,
-                      TCHAR const* const pipe_arg, TCHAR const* const socket_arg)
+int put_in_background(logger_instance* logger, unsigned int const verbose, int const system, int const reverse,
+                      proxy_tuning const* const tuning, TCHAR const* const* const route_args,
+                      size_t const route_count)
 {
-    size_t pipe_name_len, socket_path_len;
-    size_t data_size;
-    char* data;
-
-    pipe_name_len = _tcslen(pipe_arg);
-    socket_path_len = _tcslen(socket_arg);
-
-    data_size = sizeof(unsigned int) + sizeof(int) + (pipe_name_len + 1) * sizeof(TCHAR)
-                + (socket_path_len + 1) * sizeof(TCHAR);
+    size_t data_size, i;
+    char* data, * p;
+
+    data_size = sizeof(unsigned int) + sizeof(int) * 2 + sizeof(proxy_tuning) + sizeof(size_t);
+    for (i = 0; i < route_count * 2; ++i)
+        data_size += (_tcslen(route_args[i]) + 1) * sizeof(TCHAR);
+    /* The strings that the tuning points to don't survive the spawn, so they are copied too. */
+    data_size += tuning->metrics_socket_path ? strlen(tuning->metrics_socket_path) + 1 : 1;
+    data_size += tuning->trace_file_path ? (_tcslen(tuning->trace_file_path) + 1) * sizeof(TCHAR) : sizeof(TCHAR);
     data = (char*)HeapAlloc(GetProcessHeap(), 0, data_size);
     if (!data)
     {
@@ -380,11 +405,35 @@ int put_in_background(logger_instance* logger, unsigned int const verbose, int c
         return 1;
     }
 
-    *(unsigned int*)data = verbose;
-    *(int*)(data + sizeof(unsigned int)) = system;
-    RtlCopyMemory(data + sizeof(unsigned int) + sizeof(int), pipe_arg, (pipe_name_len + 1) * sizeof(TCHAR));
-    RtlCopyMemory(data + sizeof(unsigned int) + sizeof(int) + (pipe_name_len + 1) * sizeof(TCHAR), socket_arg,
-                    (socket_path_len + 1) * sizeof(TCHAR));
+    p = data;
+    *(unsigned int*)p = verbose;
+    p += sizeof(unsigned int);
+    *(int*)p = system;
+    p += sizeof(int);
+    *(int*)p = reverse;
+    p += sizeof(int);
+    RtlCopyMemory(p, tuning, sizeof(proxy_tuning));
+    p += sizeof(proxy_tuning);
+    RtlCopyMemory(p, &route_count, sizeof(size_t));
+    p += sizeof(size_t);
+    for (i = 0; i < route_count * 2; ++i)
+    {
+        size_t const arg_size = (_tcslen(route_args[i]) + 1) * sizeof(TCHAR);
+
+        RtlCopyMemory(p, route_args[i], arg_size);
+        p += arg_size;
+    }
+    if (tuning->metrics_socket_path)
+    {
+        RtlCopyMemory(p, tuning->metrics_socket_path, strlen(tuning->metrics_socket_path) + 1);
+        p += strlen(tuning->metrics_socket_path) + 1;
+    }
+    else
+        *p++ = '\0';
+    if (tuning->trace_file_path)
+        RtlCopyMemory(p, tuning->trace_file_path, (_tcslen(tuning->trace_file_path) + 1) * sizeof(TCHAR));
+    else
+        *(TCHAR*)p = _T('\0');
 
     double_spawn_fork(logger, double_spawn_proc, data, data_size);
 
@@ -392,8 +441,8 @@ int put_in_background(logger_instance* logger, unsigned int const verbose, int c
     return 0;
 }
 
-int standalone_main(unsigned int const verbose, int const foreground, int const system, TCHAR const* const pipe_arg,
-                    TCHAR const* const socket_arg)
+int standalone_main(unsigned int const verbose, int const foreground, int const system, int const reverse,
+                    proxy_tuning const* const tuning, TCHAR const* const* const route_args, size_t const route_count)
 {
     logger_instance* logger;
     LOG_LEVEL log_level;
@@ -421,9 +470,13 @@ int standalone_main(unsigned int const verbose, int const foreground, int const
     LOG_TRACE(logger, (_T("Created main logger")));
 
     if (foreground)
-        ret = standalone_main_3(logger, FALSE, system, pipe_arg, socket_arg);
+    {
+        start_async_logging(logger, tuning);
+        start_tracing(logger, tuning);
+        ret = standalone_main_3(logger, FALSE, system, reverse, tuning, route_args, route_count);
+    }
     else
-        ret = put_in_background(logger, verbose, system, pipe_arg, socket_arg);
+        ret = put_in_background(logger, verbose, system, reverse, tuning, route_args, route_count);
 
     log_destroy_logger(logger);
     return ret;
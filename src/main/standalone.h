@@ -12,14 +12,18 @@
 #ifndef __WINESTREAMPROXY_MAIN_STANDALONE_H__
 #define __WINESTREAMPROXY_MAIN_STANDALONE_H__
 
+#include <winestreamproxy/winestreamproxy.h>
+
+#include <stddef.h>
+
 #include <windef.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif /* defined(__cplusplus) */
 
-extern int standalone_main(unsigned int verbose, int foreground, int system, TCHAR const* pipe_arg,
-                           TCHAR const* socket_arg);
+extern int standalone_main(unsigned int verbose, int foreground, int system, int reverse, proxy_tuning const* tuning,
+                           TCHAR const* const* route_args, size_t route_count);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,305 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#include "activity.h"
+#include "buffer_pool.h"
+#include "connection.h"
+#include "io_engine.h"
+#include "metrics.h"
+#include "socket.h"
+#include <winestreamproxy/logger.h>
+
+#include <stddef.h>
+
+#include <tchar.h>
+#include <windef.h>
+#include <winbase.h>
+#include <winnt.h>
+
+#define InterlockedRead(x) InterlockedCompareExchange((x), 0, 0)
+
+static char const activity_command_key[] = "\"cmd\"";
+static char const activity_command_value[] = "\"SET_ACTIVITY\"";
+
+static bool activity_is_space(unsigned char const c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool activity_starts_with(unsigned char const* const data, size_t const length, char const* const prefix,
+                                 size_t const prefix_length)
+{
+    size_t i;
+
+    if (length < prefix_length)
+        return false;
+    for (i = 0; i < prefix_length; ++i)
+        if (data[i] != (unsigned char)prefix[i])
+            return false;
+    return true;
+}
+
+/* Checks for a frame whose JSON payload has "cmd": "SET_ACTIVITY". Only the first "cmd" key followed by a colon is
+   looked at, which is the command itself in every client seen so far. */
+static bool activity_is_update(unsigned char const* const message, size_t const length)
+{
+    unsigned char const* payload;
+    size_t payload_length, i;
+
+    if (length < SOCKET_FRAME_HEADER_SIZE || socket_frame_read_u32(message) != SOCKET_FRAME_OPCODE_FRAME ||
+        (size_t)socket_frame_read_u32(&message[4]) != length - SOCKET_FRAME_HEADER_SIZE)
+        return false;
+
+    payload = &message[SOCKET_FRAME_HEADER_SIZE];
+    payload_length = length - SOCKET_FRAME_HEADER_SIZE;
+    for (i = 0; i < payload_length; ++i)
+    {
+        size_t j;
+
+        if (!activity_starts_with(&payload[i], payload_length - i, activity_command_key,
+                                  sizeof(activity_command_key) - 1))
+            continue;
+
+        j = i + sizeof(activity_command_key) - 1;
+        while (j < payload_length && activity_is_space(payload[j]))
+            ++j;
+        if (j == payload_length || payload[j] != ':')
+            continue;
+        ++j;
+        while (j < payload_length && activity_is_space(payload[j]))
+            ++j;
+
+        return activity_starts_with(&payload[j], payload_length - j, activity_command_value,
+                                    sizeof(activity_command_value) - 1);
+    }
+
+    return false;
+}
+
+static void CALLBACK activity_timer_proc(PTP_CALLBACK_INSTANCE const instance, PVOID const context,
+                                         PTP_TIMER const timer)
+{
+    connection_data* const conn = (connection_data*)context;
+
+    (void)timer;
+
+    /* Cancelled by connection_close, which has taken over the reference. */
+    if (!InterlockedExchange(&conn->activity.timer_due, FALSE))
+        return;
+
+    /* The update is sent by an I/O worker. */
+    if (!io_engine_post(conn->proxy->logger, &conn->proxy->engine, (ULONG_PTR)conn, &conn->activity.flush_op))
+    {
+        /* connection_close waits for the callbacks of the timer, which must not include this one. */
+        DisassociateCurrentThreadFromCallback(instance);
+        connection_close(conn);
+        connection_release(conn);
+    }
+}
+
+/* Must be called with the lock held. */
+static void activity_schedule(connection_data* const conn, DWORD const delay)
+{
+    activity_data* const activity = &conn->activity;
+    ULARGE_INTEGER due;
+    FILETIME due_time;
+
+    if (activity->timer_armed)
+        return;
+
+    /* Negative due times are relative, in 100 nanosecond units. */
+    due.QuadPart = (ULONGLONG)(-((LONGLONG)delay * 10000));
+    due_time.dwLowDateTime = due.u.LowPart;
+    due_time.dwHighDateTime = due.u.HighPart;
+
+    /* The reference is released once the posted operation has been handled. */
+    activity->timer_armed = true;
+    connection_acquire(conn);
+    InterlockedExchange(&activity->timer_due, TRUE);
+    SetThreadpoolTimer(activity->timer, &due_time, 0, 0);
+    /* connection_close may have cancelled the timer before it was set. */
+    if (InterlockedRead(&conn->closing))
+        activity_cancel(conn);
+}
+
+void activity_initialize(logger_instance* const logger, connection_data* const conn, DWORD const interval)
+{
+    activity_data* const activity = &conn->activity;
+
+    if (!interval)
+        return;
+
+    activity->timer = CreateThreadpoolTimer(activity_timer_proc, conn, NULL);
+    if (!activity->timer)
+    {
+        LOG_WARNING(logger, (_T("Could not create activity timer, sending every update: Error %d"), GetLastError()));
+        return;
+    }
+
+    InitializeCriticalSection(&activity->lock);
+    activity->interval = interval;
+    activity->pending = 0;
+    activity->pending_size = 0;
+    activity->pending_length = 0;
+    activity->last_sent = 0;
+    activity->timer_armed = false;
+    activity->timer_due = FALSE;
+    activity->flush_op.type = IO_OPERATION_TYPE_ACTIVITY_FLUSH;
+    activity->enabled = true;
+}
+
+void activity_cancel(connection_data* const conn)
+{
+    activity_data* const activity = &conn->activity;
+
+    if (!activity->enabled)
+        return;
+
+    SetThreadpoolTimer(activity->timer, NULL, 0, 0);
+    WaitForThreadpoolTimerCallbacks(activity->timer, TRUE);
+    if (InterlockedExchange(&activity->timer_due, FALSE))
+        connection_release(conn);
+}
+
+void activity_finalize(connection_data* const conn)
+{
+    activity_data* const activity = &conn->activity;
+
+    if (!activity->enabled)
+        return;
+
+    CloseThreadpoolTimer(activity->timer);
+    if (activity->pending)
+        buffer_pool_free(activity->pending);
+    DeleteCriticalSection(&activity->lock);
+    activity->enabled = false;
+}
+
+bool activity_hold(logger_instance* const logger, connection_data* const conn, unsigned char** const inout_buffer,
+                   size_t* const inout_buffer_size, size_t const message_length)
+{
+    activity_data* const activity = &conn->activity;
+    unsigned char* new_buffer;
+    size_t new_buffer_size;
+    ULONGLONG now;
+
+    if (!activity->enabled || !activity_is_update(*inout_buffer, message_length))
+        return false;
+
+    EnterCriticalSection(&activity->lock);
+
+    now = GetTickCount64();
+    if (!activity->pending && !activity->timer_armed && now - activity->last_sent >= activity->interval)
+    {
+        activity->last_sent = now;
+        LeaveCriticalSection(&activity->lock);
+        InterlockedIncrement(&conn->route->activities_forwarded);
+        return false;
+    }
+
+    /* The held update takes over the buffer, the pipe reader continues with a new one. */
+    new_buffer = buffer_pool_alloc(logger, *inout_buffer_size, &new_buffer_size);
+    if (!new_buffer)
+    {
+        LeaveCriticalSection(&activity->lock);
+        return false;
+    }
+
+    if (activity->pending)
+    {
+        LOG_DEBUG(logger, (_T("Replacing activity update that was held back")));
+        buffer_pool_free(activity->pending);
+        InterlockedIncrement(&conn->route->activities_coalesced);
+        metrics_count_discarded(conn, 1);
+    }
+    activity->pending = *inout_buffer;
+    activity->pending_size = *inout_buffer_size;
+    activity->pending_length = message_length;
+    *inout_buffer = new_buffer;
+    *inout_buffer_size = new_buffer_size;
+
+    activity_schedule(conn, now - activity->last_sent < activity->interval
+                                ? (DWORD)(activity->last_sent + activity->interval - now) : 0);
+
+    LeaveCriticalSection(&activity->lock);
+
+    return true;
+}
+
+void activity_flush(logger_instance* const logger, connection_data* const conn)
+{
+    activity_data* const activity = &conn->activity;
+    unsigned char* buffer;
+    size_t buffer_size, length;
+    SOCKET_SEND_RET ret;
+
+    /* The timer stays marked as armed until the update has been sent, so that a newer one waits a whole interval. */
+    EnterCriticalSection(&activity->lock);
+    buffer = activity->pending;
+    buffer_size = activity->pending_size;
+    length = activity->pending_length;
+    activity->pending = 0;
+    LeaveCriticalSection(&activity->lock);
+
+    if (!buffer || InterlockedRead(&conn->closing))
+    {
+        if (buffer)
+            buffer_pool_free(buffer);
+        EnterCriticalSection(&activity->lock);
+        activity->timer_armed = false;
+        LeaveCriticalSection(&activity->lock);
+        return;
+    }
+
+    ret = socket_send_extra_message(logger, conn, &buffer, &buffer_size, length);
+    if (ret == SOCKET_SEND_RET_FAILURE)
+    {
+        buffer_pool_free(buffer);
+        connection_close(conn);
+        return;
+    }
+
+    EnterCriticalSection(&activity->lock);
+
+    activity->timer_armed = false;
+    if (ret == SOCKET_SEND_RET_BLOCKED)
+    {
+        /* The socket is backed up, so try again later unless a newer update has replaced this one already. */
+        if (activity->pending)
+        {
+            buffer_pool_free(buffer);
+            InterlockedIncrement(&conn->route->activities_coalesced);
+            metrics_count_discarded(conn, 1);
+        }
+        else
+        {
+            activity->pending = buffer;
+            activity->pending_size = buffer_size;
+            activity->pending_length = length;
+        }
+        activity_schedule(conn, activity->interval);
+    }
+    else
+    {
+        /* The buffer is either the sent update or the replacement from the send queue. */
+        buffer_pool_free(buffer);
+        activity->last_sent = GetTickCount64();
+        if (activity->pending)
+            activity_schedule(conn, activity->interval);
+    }
+
+    LeaveCriticalSection(&activity->lock);
+
+    if (ret != SOCKET_SEND_RET_BLOCKED)
+    {
+        InterlockedIncrement(&conn->route->activities_forwarded);
+        connection_count_message(conn, METRICS_DIRECTION_PIPE_TO_SOCKET, length);
+    }
+}
@@ -0,0 +1,41 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#pragma once
+#ifndef __WINESTREAMPROXY_PROXY_ACTIVITY_H__
+#define __WINESTREAMPROXY_PROXY_ACTIVITY_H__
+
+#include "data/connection_data.h"
+#include "../bool.h"
+#include <winestreamproxy/logger.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/* An interval of 0 leaves coalescing disabled, every update is sent right away then. */
+extern void activity_initialize(logger_instance* logger, connection_data* conn, DWORD interval);
+extern void activity_finalize(connection_data* conn);
+/* Cancels a pending flush and waits for a running timer callback. Called when the connection is closed. */
+extern void activity_cancel(connection_data* conn);
+/* Takes a SET_ACTIVITY frame from the pipe if another update has been sent less than an interval ago, and replaces
+   the buffer with a new one. Returns false if the message has to be sent as usual. */
+extern bool activity_hold(logger_instance* logger, connection_data* conn, unsigned char** inout_buffer,
+                          size_t* inout_buffer_size, size_t message_length);
+/* Sends the update that is being held back, once the interval has passed. */
+extern void activity_flush(logger_instance* logger, connection_data* conn);
+
+#ifdef __cplusplus
+}
+#endif /* defined(__cplusplus) */
+
+#endif /* !defined(__WINESTREAMPROXY_PROXY_ACTIVITY_H__) */
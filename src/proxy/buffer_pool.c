@@ -0,0 +1,305 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#include "buffer_pool.h"
+#include <winestreamproxy/logger.h>
+
+#include <stddef.h>
+
+#include <tchar.h>
+#include <windef.h>
+#include <winbase.h>
+#include <winnt.h>
+
+#define InterlockedRead(x) InterlockedCompareExchange((x), 0, 0)
+
+/* Number of buffers of each size class kept by every thread before they are returned to the shared free list. */
+#define BUFFER_POOL_THREAD_CACHE_SIZE 8
+/* Maximum number of bytes kept in the shared free list of each size class. */
+#define BUFFER_POOL_SHARED_LIMIT ((size_t)4 << 20)
+#define BUFFER_POOL_SHARED_MIN_COUNT 4
+
+#define BUFFER_POOL_OVERSIZED_CLASS ((unsigned int)-1)
+
+/* Precedes the data of every buffer. */
+typedef union buffer_header {
+    SLIST_ENTRY     entry;      /* While the buffer is in a shared free list. */
+    unsigned int    size_class; /* While the buffer is in use or in a thread cache. */
+    ULONGLONG       align[2];   /* Keeps the buffer data aligned like the process heap would. */
+} buffer_header;
+
+typedef struct buffer_pool_thread_cache {
+    unsigned int    counts[BUFFER_POOL_CLASS_COUNT];
+    buffer_header*  buffers[BUFFER_POOL_CLASS_COUNT][BUFFER_POOL_THREAD_CACHE_SIZE];
+} buffer_pool_thread_cache;
+
+typedef struct buffer_pool_class {
+    SLIST_HEADER    free_list;
+    LONG volatile   thread_cache_hits;
+    LONG volatile   shared_hits;
+    LONG volatile   misses;
+} buffer_pool_class;
+
+static buffer_pool_class buffer_pool_classes[BUFFER_POOL_CLASS_COUNT];
+static LONG volatile buffer_pool_oversized;
+static DWORD buffer_pool_fls_index = FLS_OUT_OF_INDEXES;
+static INIT_ONCE buffer_pool_initonce = INIT_ONCE_STATIC_INIT;
+
+#define buffer_pool_class_size(size_class) ((size_t)1 << ((size_class) + BUFFER_POOL_MIN_SIZE_SHIFT))
+
+static unsigned int buffer_pool_size_to_class(size_t const size)
+{
+    unsigned int size_class = 0;
+
+    if (size > BUFFER_POOL_MAX_SIZE)
+        return BUFFER_POOL_OVERSIZED_CLASS;
+    while (buffer_pool_class_size(size_class) < size)
+        ++size_class;
+    return size_class;
+}
+
+static void buffer_pool_push_shared(unsigned int const size_class, buffer_header* const header)
+{
+    buffer_pool_class* const pool_class = &buffer_pool_classes[size_class];
+    size_t limit;
+
+    limit = BUFFER_POOL_SHARED_LIMIT / buffer_pool_class_size(size_class);
+    if (limit < BUFFER_POOL_SHARED_MIN_COUNT)
+        limit = BUFFER_POOL_SHARED_MIN_COUNT;
+
+    if (QueryDepthSList(&pool_class->free_list) >= limit)
+        HeapFree(GetProcessHeap(), 0, header);
+    else
+        InterlockedPushEntrySList(&pool_class->free_list, &header->entry);
+}
+
+/* Called when a thread exits. */
+static void CALLBACK buffer_pool_flush_thread_cache(PVOID const data)
+{
+    buffer_pool_thread_cache* const cache = (buffer_pool_thread_cache*)data;
+    unsigned int size_class;
+
+    if (!cache)
+        return;
+
+    for (size_class = 0; size_class < BUFFER_POOL_CLASS_COUNT; ++size_class)
+        while (cache->counts[size_class])
+            buffer_pool_push_shared(size_class, cache->buffers[size_class][--cache->counts[size_class]]);
+
+    HeapFree(GetProcessHeap(), 0, cache);
+}
+
+static BOOL CALLBACK buffer_pool_initialize_once(PINIT_ONCE const init_once, PVOID const param, PVOID* const ctx)
+{
+    unsigned int size_class;
+
+    (void)init_once;
+    (void)param;
+    (void)ctx;
+
+    for (size_class = 0; size_class < BUFFER_POOL_CLASS_COUNT; ++size_class)
+        InitializeSListHead(&buffer_pool_classes[size_class].free_list);
+
+    /* Without thread caches, all buffers go through the shared free lists. */
+    buffer_pool_fls_index = FlsAlloc(buffer_pool_flush_thread_cache);
+
+    return TRUE;
+}
+
+bool buffer_pool_initialize(logger_instance* const logger)
+{
+    if (!InitOnceExecuteOnce(&buffer_pool_initonce, buffer_pool_initialize_once, 0, 0))
+    {
+        LOG_CRITICAL(logger, (_T("Could not initialize buffer pool")));
+        return false;
+    }
+
+    if (buffer_pool_fls_index == FLS_OUT_OF_INDEXES)
+        LOG_WARNING(logger, (_T("Could not allocate fiber local storage, buffer pool thread caches disabled")));
+
+    return true;
+}
+
+static buffer_pool_thread_cache* buffer_pool_get_thread_cache(void)
+{
+    buffer_pool_thread_cache* cache;
+
+    if (buffer_pool_fls_index == FLS_OUT_OF_INDEXES)
+        return 0;
+
+    cache = (buffer_pool_thread_cache*)FlsGetValue(buffer_pool_fls_index);
+    if (cache)
+        return cache;
+
+    cache = (buffer_pool_thread_cache*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(buffer_pool_thread_cache));
+    if (!cache)
+        return 0;
+    if (!FlsSetValue(buffer_pool_fls_index, cache))
+    {
+        HeapFree(GetProcessHeap(), 0, cache);
+        return 0;
+    }
+
+    return cache;
+}
+
+unsigned char* buffer_pool_alloc(logger_instance* const logger, size_t const size, size_t* const out_capacity)
+{
+    buffer_pool_thread_cache* cache;
+    buffer_pool_class* pool_class;
+    unsigned int size_class;
+    buffer_header* header;
+    size_t capacity;
+
+    size_class = buffer_pool_size_to_class(size);
+    if (size_class == BUFFER_POOL_OVERSIZED_CLASS)
+    {
+        InterlockedIncrement(&buffer_pool_oversized);
+        capacity = size;
+        header = (buffer_header*)HeapAlloc(GetProcessHeap(), 0, sizeof(buffer_header) + capacity);
+        if (!header)
+        {
+            LOG_ERROR(logger, (_T("Failed to allocate %lu bytes"), (unsigned long)(sizeof(buffer_header) + capacity)));
+            return 0;
+        }
+        header->size_class = BUFFER_POOL_OVERSIZED_CLASS;
+        *out_capacity = capacity;
+        return (unsigned char*)(header + 1);
+    }
+
+    pool_class = &buffer_pool_classes[size_class];
+    capacity = buffer_pool_class_size(size_class);
+
+    cache = buffer_pool_get_thread_cache();
+    if (cache && cache->counts[size_class])
+    {
+        InterlockedIncrement(&pool_class->thread_cache_hits);
+        header = cache->buffers[size_class][--cache->counts[size_class]];
+    }
+    else if ((header = (buffer_header*)InterlockedPopEntrySList(&pool_class->free_list)))
+        InterlockedIncrement(&pool_class->shared_hits);
+    else
+    {
+        InterlockedIncrement(&pool_class->misses);
+        header = (buffer_header*)HeapAlloc(GetProcessHeap(), 0, sizeof(buffer_header) + capacity);
+        if (!header)
+        {
+            LOG_ERROR(logger, (_T("Failed to allocate %lu bytes"), (unsigned long)(sizeof(buffer_header) + capacity)));
+            return 0;
+        }
+    }
+
+    header->size_class = size_class;
+    *out_capacity = capacity;
+    return (unsigned char*)(header + 1);
+}
+
+unsigned char* buffer_pool_realloc(logger_instance* const logger, unsigned char* const buffer, size_t const used,
+                                   size_t const new_size, size_t* const out_capacity)
+{
+    unsigned char* new_buffer;
+
+    new_buffer = buffer_pool_alloc(logger, new_size, out_capacity);
+    if (!new_buffer)
+        return 0;
+
+    if (buffer)
+    {
+        RtlCopyMemory(new_buffer, buffer, used);
+        buffer_pool_free(buffer);
+    }
+
+    return new_buffer;
+}
+
+void buffer_pool_free(unsigned char* const buffer)
+{
+    buffer_pool_thread_cache* cache;
+    buffer_header* header;
+    unsigned int size_class;
+
+    if (!buffer)
+        return;
+
+    header = (buffer_header*)buffer - 1;
+    size_class = header->size_class;
+    if (size_class == BUFFER_POOL_OVERSIZED_CLASS)
+    {
+        HeapFree(GetProcessHeap(), 0, header);
+        return;
+    }
+
+    cache = buffer_pool_get_thread_cache();
+    if (cache && cache->counts[size_class] < BUFFER_POOL_THREAD_CACHE_SIZE)
+        cache->buffers[size_class][cache->counts[size_class]++] = header;
+    else
+        buffer_pool_push_shared(size_class, header);
+}
+
+void buffer_pool_trim(void)
+{
+    unsigned int size_class;
+
+    for (size_class = 0; size_class < BUFFER_POOL_CLASS_COUNT; ++size_class)
+    {
+        SLIST_ENTRY* entry = InterlockedFlushSList(&buffer_pool_classes[size_class].free_list);
+
+        while (entry)
+        {
+            SLIST_ENTRY* const next = entry->Next;
+            HeapFree(GetProcessHeap(), 0, entry);
+            entry = next;
+        }
+    }
+}
+
+void buffer_pool_get_stats(buffer_pool_stats* const out_stats)
+{
+    unsigned int size_class;
+
+    for (size_class = 0; size_class < BUFFER_POOL_CLASS_COUNT; ++size_class)
+    {
+        buffer_pool_class* const pool_class = &buffer_pool_classes[size_class];
+        buffer_pool_class_stats* const stats = &out_stats->classes[size_class];
+
+        stats->size = buffer_pool_class_size(size_class);
+        stats->thread_cache_hits = (unsigned long)InterlockedRead(&pool_class->thread_cache_hits);
+        stats->shared_hits = (unsigned long)InterlockedRead(&pool_class->shared_hits);
+        stats->misses = (unsigned long)InterlockedRead(&pool_class->misses);
+        stats->pooled = QueryDepthSList(&pool_class->free_list);
+    }
+    out_stats->oversized = (unsigned long)InterlockedRead(&buffer_pool_oversized);
+}
+
+void buffer_pool_log_stats(logger_instance* const logger)
+{
+    buffer_pool_stats stats;
+    unsigned int size_class;
+
+    if (!LOG_IS_ENABLED(logger, LOG_LEVEL_DEBUG))
+        return;
+
+    buffer_pool_get_stats(&stats);
+
+    for (size_class = 0; size_class < BUFFER_POOL_CLASS_COUNT; ++size_class)
+    {
+        buffer_pool_class_stats const* const class_stats = &stats.classes[size_class];
+
+        if (!class_stats->thread_cache_hits && !class_stats->shared_hits && !class_stats->misses)
+            continue;
+        LOG_DEBUG(logger, (
+            _T("Buffer pool class %lu: %lu thread cache hits, %lu shared hits, %lu misses, %lu pooled"),
+            (unsigned long)class_stats->size, class_stats->thread_cache_hits, class_stats->shared_hits,
+            class_stats->misses, class_stats->pooled
+        ));
+    }
+    if (stats.oversized)
+        LOG_DEBUG(logger, (_T("Buffer pool: %lu oversized allocations"), stats.oversized));
+}
@@ -0,0 +1,62 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#pragma once
+#ifndef __WINESTREAMPROXY_PROXY_BUFFER_POOL_H__
+#define __WINESTREAMPROXY_PROXY_BUFFER_POOL_H__
+
+#include "../bool.h"
+#include <winestreamproxy/logger.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/* Buffers are pooled in power-of-two size classes from BUFFER_POOL_MIN_SIZE to BUFFER_POOL_MAX_SIZE bytes.
+   Bigger buffers are allocated from and returned to the process heap directly. */
+#define BUFFER_POOL_MIN_SIZE_SHIFT 10
+#define BUFFER_POOL_MAX_SIZE_SHIFT 20
+#define BUFFER_POOL_MIN_SIZE ((size_t)1 << BUFFER_POOL_MIN_SIZE_SHIFT)
+#define BUFFER_POOL_MAX_SIZE ((size_t)1 << BUFFER_POOL_MAX_SIZE_SHIFT)
+#define BUFFER_POOL_CLASS_COUNT (BUFFER_POOL_MAX_SIZE_SHIFT - BUFFER_POOL_MIN_SIZE_SHIFT + 1)
+
+typedef struct buffer_pool_class_stats {
+    size_t          size;
+    unsigned long   thread_cache_hits;  /* Served from the cache of the allocating thread. */
+    unsigned long   shared_hits;        /* Served from the process-wide free list. */
+    unsigned long   misses;             /* Allocated from the process heap. */
+    unsigned long   pooled;             /* Buffers currently in the process-wide free list. */
+} buffer_pool_class_stats;
+
+typedef struct buffer_pool_stats {
+    buffer_pool_class_stats classes[BUFFER_POOL_CLASS_COUNT];
+    unsigned long           oversized;  /* Allocations bigger than the largest size class. */
+} buffer_pool_stats;
+
+extern bool buffer_pool_initialize(logger_instance* logger);
+/* Returns a buffer of at least size bytes and stores its actual size in out_capacity. */
+extern unsigned char* buffer_pool_alloc(logger_instance* logger, size_t size, size_t* out_capacity);
+/* Moves the first used bytes of the buffer into a buffer of at least new_size bytes. The old buffer is released,
+   unless the allocation fails. */
+extern unsigned char* buffer_pool_realloc(logger_instance* logger, unsigned char* buffer, size_t used,
+                                          size_t new_size, size_t* out_capacity);
+extern void buffer_pool_free(unsigned char* buffer);
+/* Returns the buffers in the process-wide free lists to the process heap. */
+extern void buffer_pool_trim(void);
+extern void buffer_pool_get_stats(buffer_pool_stats* out_stats);
+extern void buffer_pool_log_stats(logger_instance* logger);
+
+#ifdef __cplusplus
+}
+#endif /* defined(__cplusplus) */
+
+#endif /* !defined(__WINESTREAMPROXY_PROXY_BUFFER_POOL_H__) */
@@ -0,0 +1,163 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#include "buffer_sizer.h"
+#include "buffer_pool.h"
+
+#include <stddef.h>
+
+#include <windef.h>
+#include <winbase.h>
+#include <winnt.h>
+
+#define InterlockedRead(x) InterlockedCompareExchange((x), 0, 0)
+
+/* The buffer is sized for this percentage of the recent messages, bigger ones make it grow temporarily. */
+#define BUFFER_SIZER_PERCENTILE 90
+/* The counts are halved once this many messages have been seen, so that old traffic fades out. */
+#define BUFFER_SIZER_WINDOW 64
+/* Milliseconds a buffer has to be bigger than needed before it is made smaller again. */
+#define BUFFER_SIZER_SHRINK_DELAY 10000
+
+static unsigned int buffer_sizer_bucket(size_t const length)
+{
+    unsigned int bucket;
+
+    for (bucket = 0; bucket < BUFFER_SIZER_BUCKET_COUNT - 1; ++bucket)
+        if (length <= (BUFFER_POOL_MIN_SIZE << bucket))
+            break;
+    return bucket;
+}
+
+static size_t buffer_sizer_target(buffer_sizer const* const sizer)
+{
+    unsigned long count;
+    unsigned int bucket;
+    size_t size;
+
+    count = 0;
+    for (bucket = 0; bucket < BUFFER_SIZER_BUCKET_COUNT - 1; ++bucket)
+    {
+        count += sizer->counts[bucket];
+        if (count * 100 >= sizer->total * BUFFER_SIZER_PERCENTILE)
+            break;
+    }
+
+    /* Messages beyond the pooled sizes are rare enough to get a buffer of their own each time. */
+    size = bucket < BUFFER_SIZER_BUCKET_COUNT - 1 ? BUFFER_POOL_MIN_SIZE << bucket : BUFFER_POOL_MAX_SIZE;
+    return size < sizer->min_size ? sizer->min_size : size;
+}
+
+static void buffer_sizer_update_peak(buffer_sizer_stats* const stats, size_t const size)
+{
+    LONG const value = size > 0x7FFFFFFF ? 0x7FFFFFFF : (LONG)size;
+    LONG current;
+
+    do {
+        current = InterlockedRead(&stats->peak_size);
+        if (value <= current)
+            return;
+    } while (InterlockedCompareExchange(&stats->peak_size, value, current) != current);
+}
+
+void buffer_sizer_initialize(buffer_sizer* const sizer, size_t const min_size, buffer_sizer_stats* const stats)
+{
+    unsigned int i;
+    size_t size;
+
+    for (i = 0; i < BUFFER_SIZER_BUCKET_COUNT; ++i)
+        sizer->counts[i] = 0;
+    sizer->total = 0;
+
+    /* Round up to the size the pool hands out, otherwise every pooled buffer would look too big. */
+    size = BUFFER_POOL_MIN_SIZE;
+    while (size < min_size && size < BUFFER_POOL_MAX_SIZE)
+        size *= 2;
+    sizer->min_size = size < min_size ? min_size : size;
+
+    sizer->last_needed = 0;
+    sizer->stats = stats;
+    sizer->received = FALSE;
+    sizer->oversized = FALSE;
+    buffer_sizer_update_peak(stats, sizer->min_size);
+}
+
+size_t buffer_sizer_grow(buffer_sizer* const sizer, size_t const current_size, size_t const needed)
+{
+    size_t size;
+
+    /* Doubling keeps the number of resizes logarithmic if messages grow a little at a time. */
+    size = current_size ? current_size : BUFFER_POOL_MIN_SIZE;
+    while (size < needed)
+        size *= 2;
+
+    InterlockedIncrement(&sizer->stats->grows);
+    buffer_sizer_update_peak(sizer->stats, size);
+    InterlockedExchange(&sizer->oversized, size > sizer->min_size);
+    return size;
+}
+
+size_t buffer_sizer_record(buffer_sizer* const sizer, size_t const length, size_t const current_size)
+{
+    ULONGLONG const now = GetTickCount64();
+    size_t target, size;
+
+    InterlockedExchange(&sizer->received, TRUE);
+
+    ++sizer->counts[buffer_sizer_bucket(length)];
+    if (++sizer->total >= BUFFER_SIZER_WINDOW)
+    {
+        unsigned int i;
+
+        sizer->total = 0;
+        for (i = 0; i < BUFFER_SIZER_BUCKET_COUNT; ++i)
+        {
+            sizer->counts[i] /= 2;
+            sizer->total += sizer->counts[i];
+        }
+    }
+
+    target = buffer_sizer_target(sizer);
+    if (length > target)
+        sizer->last_needed = now;
+
+    size = current_size;
+    if (current_size < target)
+    {
+        buffer_sizer_update_peak(sizer->stats, target);
+        size = target;
+    }
+    else if (current_size > target && now - sizer->last_needed >= BUFFER_SIZER_SHRINK_DELAY)
+    {
+        InterlockedIncrement(&sizer->stats->shrinks);
+        sizer->last_needed = now;
+        size = target;
+    }
+
+    InterlockedExchange(&sizer->oversized, size > sizer->min_size);
+    return size;
+}
+
+bool buffer_sizer_idle(buffer_sizer* const sizer)
+{
+    return !InterlockedExchange(&sizer->received, FALSE) && InterlockedRead(&sizer->oversized);
+}
+
+size_t buffer_sizer_shrink_idle(buffer_sizer* const sizer, size_t const current_size)
+{
+    if (InterlockedRead(&sizer->received) || current_size <= sizer->min_size)
+        return current_size;
+
+    /* The histogram is kept, so the next message makes the buffer grow back to the size of the recent ones. */
+    InterlockedIncrement(&sizer->stats->shrinks);
+    InterlockedExchange(&sizer->oversized, FALSE);
+    sizer->last_needed = GetTickCount64();
+    return sizer->min_size;
+}
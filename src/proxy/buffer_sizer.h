@@ -0,0 +1,44 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#pragma once
+#ifndef __WINESTREAMPROXY_PROXY_BUFFER_SIZER_H__
+#define __WINESTREAMPROXY_PROXY_BUFFER_SIZER_H__
+
+#include "data/buffer_sizer_data.h"
+#include "../bool.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/* Milliseconds between two idle checks. A buffer is made smaller once no message arrived for a whole interval. */
+#define BUFFER_SIZER_IDLE_INTERVAL 10000
+
+/* Buffers never get smaller than min_size. */
+extern void buffer_sizer_initialize(buffer_sizer* sizer, size_t min_size, buffer_sizer_stats* stats);
+/* Returns the size to grow a buffer of current_size to when a message of needed bytes doesn't fit. */
+extern size_t buffer_sizer_grow(buffer_sizer* sizer, size_t current_size, size_t needed);
+/* Counts a received message and returns the size the buffer for the next one should have. That is current_size,
+   unless the buffer is smaller than most recent messages or has been bigger than them for a while. */
+extern size_t buffer_sizer_record(buffer_sizer* sizer, size_t length, size_t current_size);
+/* Returns true if the buffer is bigger than needed and no message has arrived since the last call. Can be called
+   from any thread, the owner of the buffer calls buffer_sizer_shrink_idle then. */
+extern bool buffer_sizer_idle(buffer_sizer* sizer);
+/* Returns the size an idle buffer of current_size should be shrunk to, current_size if a message came in since. */
+extern size_t buffer_sizer_shrink_idle(buffer_sizer* sizer, size_t current_size);
+
+#ifdef __cplusplus
+}
+#endif /* defined(__cplusplus) */
+
+#endif /* !defined(__WINESTREAMPROXY_PROXY_BUFFER_SIZER_H__) */
@@ -8,113 +8,298 @@
  *   E-Mail address: openglfreak@googlemail.com
  *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
 
+#include "activity.h"
+#include "buffer_sizer.h"
 #include "connection.h"
-#include "misc.h"
+#include "connection_list.h"
+#include "io_engine.h"
+#include "metrics.h"
 #include "pipe.h"
 #include "proxy.h"
 #include "socket.h"
-#include "thread.h"
 #include <winestreamproxy/logger.h>
 
 #include <tchar.h>
-#include <unistd.h>
 #include <windef.h>
 #include <winbase.h>
 #include <winnt.h>
 
-bool pipe_handler_thunk(logger_instance* const logger, void* const void_conn)
+#define InterlockedRead(x) InterlockedCompareExchange((x), 0, 0)
+
+void connection_initialize(proxy_data* const proxy, connection_data* const conn)
 {
-    return pipe_handler(logger, (connection_data*)void_conn);
+    conn->proxy = proxy;
+    conn->pipe.handle = INVALID_HANDLE_VALUE;
+    conn->pipe.fd = -1;
+    conn->pipe.splice = 0;
+    io_engine_init_watch(&conn->pipe.watch, conn, &conn->pipe.readable_op, &conn->pipe.writable_op);
+    conn->socket.fd = -1;
+    conn->socket.splice = 0;
+    conn->socket.connect_timer = 0;
+    conn->socket.connect_timer_due = FALSE;
+    io_engine_init_watch(&conn->socket.watch, conn, &conn->socket.readable_op, &conn->socket.writable_op);
+    conn->activity.enabled = false;
+    metrics_reset(&conn->metrics);
+    conn->refcount = 1;
+    conn->closing = FALSE;
+    conn->forwarded_any = FALSE;
+    conn->idle_timer = 0;
+    conn->idle_timer_due = FALSE;
+    conn->idle_op.type = IO_OPERATION_TYPE_BUFFER_IDLE;
 }
 
-void pipe_cleanup_thunk(logger_instance* const logger, thread_data* const data, void* const void_conn)
+static void CALLBACK connection_idle_timer_proc(PTP_CALLBACK_INSTANCE const instance, PVOID const context,
+                                                PTP_TIMER const timer)
 {
-    (void)data;
+    connection_data* const conn = (connection_data*)context;
 
-    pipe_cleanup(logger, (connection_data*)void_conn);
+    (void)timer;
+
+    /* Cancelled by connection_close, which has taken over the reference. */
+    if (!InterlockedExchange(&conn->idle_timer_due, FALSE))
+        return;
+
+    /* The buffers are swapped by an I/O worker. */
+    if (!io_engine_post(conn->proxy->logger, &conn->proxy->engine, (ULONG_PTR)conn, &conn->idle_op))
+    {
+        /* connection_close waits for the callbacks of the timer, which must not include this one. */
+        DisassociateCurrentThreadFromCallback(instance);
+        connection_close(conn);
+        connection_release(conn);
+    }
 }
 
-bool pipe_stop_thread_thunk(logger_instance* const logger, thread_data* const data)
+static void connection_cancel_idle_check(connection_data* const conn)
 {
-    return pipe_stop_thread(logger, container_of(data, pipe_data, thread));
-}
+    if (!conn->idle_timer)
+        return;
 
-thread_description pipe_thread_description = {
-    pipe_handler_thunk,
-    pipe_cleanup_thunk,
-    pipe_stop_thread_thunk
-};
+    SetThreadpoolTimer(conn->idle_timer, NULL, 0, 0);
+    WaitForThreadpoolTimerCallbacks(conn->idle_timer, TRUE);
+    if (InterlockedExchange(&conn->idle_timer_due, FALSE))
+        connection_release(conn);
+}
 
-bool socket_handler_thunk(logger_instance* const logger, void* const void_conn)
+static void connection_schedule_idle_check(connection_data* const conn)
 {
-    return socket_handler(logger, (connection_data*)void_conn);
+    ULARGE_INTEGER due;
+    FILETIME due_time;
+
+    if (!conn->idle_timer)
+        return;
+
+    /* Negative due times are relative, in 100 nanosecond units. */
+    due.QuadPart = (ULONGLONG)(-((LONGLONG)BUFFER_SIZER_IDLE_INTERVAL * 10000));
+    due_time.dwLowDateTime = due.u.LowPart;
+    due_time.dwHighDateTime = due.u.HighPart;
+
+    /* The reference is released once the posted operation has been handled. */
+    connection_acquire(conn);
+    InterlockedExchange(&conn->idle_timer_due, TRUE);
+    SetThreadpoolTimer(conn->idle_timer, &due_time, 0, 0);
+    /* connection_close may have cancelled the timer before it was set. */
+    if (InterlockedRead(&conn->closing))
+        connection_cancel_idle_check(conn);
 }
 
-void socket_cleanup_thunk(logger_instance* const logger, thread_data* const data, void* const void_conn)
+/* Runs without traffic, so that buffers don't stay big until the next message arrives. */
+static void connection_check_idle(logger_instance* const logger, connection_data* const conn)
 {
-    (void)data;
+    if (InterlockedRead(&conn->closing))
+        return;
 
-    socket_cleanup(logger, (connection_data*)void_conn);
+    pipe_shrink_idle_buffer(logger, conn);
+    socket_shrink_idle_buffer(logger, conn);
+    connection_schedule_idle_check(conn);
 }
 
-bool socket_stop_thread_thunk(logger_instance* const logger, thread_data* const data)
+bool connection_start(connection_data* const conn)
 {
-    return socket_stop_thread(logger, container_of(data, socket_data, thread));
-}
+    logger_instance* const logger = conn->proxy->logger;
 
-thread_description socket_thread_description = {
-    socket_handler_thunk,
-    socket_cleanup_thunk,
-    socket_stop_thread_thunk
-};
+    LOG_TRACE(logger, (_T("Starting connection")));
 
-void connection_initialize(proxy_data* const proxy, connection_data* const conn)
-{
-    conn->proxy = proxy;
-}
+    if (conn->proxy->parameters.tuning.frames)
+        socket_enable_framing(&conn->socket, conn->proxy->parameters.tuning.max_frame_size);
+    activity_initialize(logger, conn, conn->proxy->parameters.tuning.activity_interval);
+    buffer_sizer_initialize(&conn->pipe.read_sizer, conn->route->pipe_buffer_size, &conn->route->pipe_buffers);
+    buffer_sizer_initialize(&conn->socket.recv_sizer, conn->socket.recv_buffer_size, &conn->route->socket_buffers);
+    conn->idle_timer = CreateThreadpoolTimer(connection_idle_timer_proc, conn, NULL);
+    if (!conn->idle_timer)
+        LOG_WARNING(logger, (
+            _T("Could not create idle timer, buffers only shrink when messages arrive: Error %d"),
+            GetLastError()
+        ));
+    if (conn->route->socket_buffer_size)
+        socket_set_buffer_size(logger, conn->socket.fd, conn->route->socket_buffer_size);
+    metrics_connection_started(conn);
 
-bool connection_prepare_threads(connection_data* const conn)
-{
-    LOG_TRACE(conn->proxy->logger, (_T("Preparing connection threads")));
+    /* Falls back to reading the pipe with ReadFile if the pipe data can't be spliced. Spliced data bypasses the
+       send queue, which holds the client messages while reconnecting, the frame parser and the activity filter. */
+    if (conn->proxy->parameters.tuning.splice && !conn->socket.reconnect && !conn->socket.framing &&
+        !conn->activity.enabled)
+        pipe_enable_splice(logger, conn);
 
-    if (!thread_prepare(conn->proxy->logger, &pipe_thread_description, &conn->pipe.thread, conn))
+    /* The watches hold a reference until the socket watcher has dropped them. */
+    connection_acquire(conn);
+    if (!io_engine_watch(logger, &conn->proxy->engine, &conn->socket.watch, conn->socket.fd,
+                         REACTOR_EVENT_READABLE))
+    {
+        connection_release(conn);
         return false;
+    }
 
-    if (!thread_prepare(conn->proxy->logger, &socket_thread_description, &conn->socket.thread, conn))
+    if (conn->pipe.splice)
     {
-        thread_dispose(conn->proxy->logger, &pipe_thread_description, &conn->pipe.thread);
-        return false;
+        connection_acquire(conn);
+        if (!io_engine_watch(logger, &conn->proxy->engine, &conn->pipe.watch, conn->pipe.fd,
+                             REACTOR_EVENT_READABLE))
+        {
+            connection_release(conn);
+            return false;
+        }
     }
+    else if (!pipe_start_read(logger, conn))
+        return false;
 
-    LOG_TRACE(conn->proxy->logger, (_T("Prepared connection threads")));
+    connection_schedule_idle_check(conn);
+
+    LOG_TRACE(logger, (_T("Started connection")));
 
     return true;
 }
 
-bool connection_launch_threads(connection_data* const conn)
+void connection_acquire(connection_data* const conn)
 {
-    LOG_TRACE(conn->proxy->logger, (_T("Launching connection threads")));
+    InterlockedIncrement(&conn->refcount);
+}
 
-    if (thread_run(conn->proxy->logger, &pipe_thread_description, &conn->pipe.thread) == THREAD_RUN_ERROR_OTHER)
-        return false;
+void connection_release(connection_data* const conn)
+{
+    logger_instance* logger;
+
+    if (InterlockedDecrement(&conn->refcount) != 0)
+        return;
+
+    logger = conn->proxy->logger;
 
-    if (thread_run(conn->proxy->logger, &socket_thread_description, &conn->socket.thread) == THREAD_RUN_ERROR_OTHER)
+    LOG_TRACE(logger, (_T("Cleaning up connection")));
+
+    activity_finalize(conn);
+    proxy_connect_finalize(conn);
+    if (conn->idle_timer)
+        CloseThreadpoolTimer(conn->idle_timer);
+    /* Client messages that are still queued never reach the server. */
+    if (conn->socket.send_queue && conn->socket.send_count)
+        metrics_count_discarded(conn, conn->socket.send_count);
+    metrics_connection_finished(conn);
+    socket_disconnect(logger, &conn->socket);
+    pipe_close_server(logger, &conn->pipe);
+    connection_list_deallocate_entry(logger, &conn->proxy->conn_list, conn);
+
+    LOG_TRACE(logger, (_T("Cleaned up connection")));
+}
+
+void connection_dispatch(logger_instance* const logger, connection_data* const conn, io_operation* const op,
+                         DWORD const error, DWORD const bytes_transferred)
+{
+    switch (op->type)
     {
-        thread_stop(conn->proxy->logger, &pipe_thread_description, &conn->pipe.thread);
-        return false;
+        case IO_OPERATION_TYPE_PIPE_CONNECT:
+            proxy_accept_completed(conn, error);
+            break;
+        case IO_OPERATION_TYPE_PIPE_READ:
+            pipe_read_completed(logger, conn, error, bytes_transferred);
+            break;
+        case IO_OPERATION_TYPE_PIPE_WRITE:
+            pipe_write_completed(logger, conn, op, error, bytes_transferred);
+            break;
+        case IO_OPERATION_TYPE_PIPE_READABLE:
+            pipe_readable(logger, conn);
+            break;
+        case IO_OPERATION_TYPE_PIPE_WRITABLE:
+            pipe_writable(logger, conn);
+            break;
+        case IO_OPERATION_TYPE_SOCKET_READABLE:
+            socket_readable(logger, conn);
+            break;
+        case IO_OPERATION_TYPE_SOCKET_WRITABLE:
+            socket_writable(logger, conn);
+            break;
+        case IO_OPERATION_TYPE_SOCKET_ACCEPT:
+            proxy_socket_acceptable(conn);
+            break;
+        case IO_OPERATION_TYPE_SOCKET_CONNECT:
+            proxy_connect_retry(conn);
+            break;
+        case IO_OPERATION_TYPE_ACTIVITY_FLUSH:
+            activity_flush(logger, conn);
+            break;
+        case IO_OPERATION_TYPE_METRICS_ACCEPT:
+            metrics_acceptable(conn);
+            break;
+        case IO_OPERATION_TYPE_METRICS_WRITABLE:
+            metrics_writable(conn);
+            break;
+        case IO_OPERATION_TYPE_BUFFER_IDLE:
+            connection_check_idle(logger, conn);
+            break;
+        default:
+            LOG_ERROR(logger, (_T("Unknown I/O operation type %d"), (int)op->type));
     }
 
-    LOG_TRACE(conn->proxy->logger, (_T("Launched connection threads")));
+    /* Release the reference taken when the operation was started. */
+    connection_release(conn);
+}
 
-    return true;
+void connection_count_message(connection_data* const conn, METRICS_DIRECTION const direction, size_t const bytes)
+{
+    proxy_route* const route = conn->route;
+    LARGE_INTEGER now;
+    LONGLONG elapsed_us;
+    LONG max_us;
+
+    metrics_count_message(conn, direction, bytes);
+
+    if (InterlockedExchange(&conn->forwarded_any, TRUE))
+        return;
+
+    QueryPerformanceCounter(&now);
+    elapsed_us = (now.QuadPart - conn->accepted_at.QuadPart) * 1000000 / conn->proxy->counter_frequency.QuadPart;
+    if (elapsed_us > 0x7FFFFFFF)
+        elapsed_us = 0x7FFFFFFF;
+
+    LOG_DEBUG(conn->proxy->logger, (
+        _T("First message forwarded %lu us after the client connected"),
+        (unsigned long)elapsed_us
+    ));
+
+    InterlockedIncrement(&route->first_message_count);
+    InterlockedExchangeAdd64(&route->first_message_total_us, elapsed_us);
+    do {
+        max_us = InterlockedCompareExchange(&route->first_message_max_us, 0, 0);
+        if ((LONG)elapsed_us <= max_us)
+            break;
+    } while (InterlockedCompareExchange(&route->first_message_max_us, (LONG)elapsed_us, max_us) != max_us);
 }
 
 void connection_close(connection_data* const conn)
 {
+    if (InterlockedExchange(&conn->closing, TRUE))
+        return;
+
     LOG_TRACE(conn->proxy->logger, (_T("Closing connection")));
 
-    thread_dispose(conn->proxy->logger, &pipe_thread_description, &conn->pipe.thread);
-    thread_dispose(conn->proxy->logger, &socket_thread_description, &conn->socket.thread);
+    /* Timers that are due would post to the engine after it has been stopped. */
+    proxy_cancel_connect_retry(conn);
+    activity_cancel(conn);
+    connection_cancel_idle_check(conn);
+    if (conn->pipe.handle != INVALID_HANDLE_VALUE)
+        CancelIoEx(conn->pipe.handle, NULL);
+    io_engine_unwatch(conn->proxy->logger, &conn->proxy->engine, &conn->pipe.watch);
+    io_engine_unwatch(conn->proxy->logger, &conn->proxy->engine, &conn->socket.watch);
 
     LOG_TRACE(conn->proxy->logger, (_T("Closed connection")));
+
+    connection_release(conn);
 }
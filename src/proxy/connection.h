@@ -17,17 +17,22 @@
 #include "../bool.h"
 #include <winestreamproxy/logger.h>
 
+#include <windef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* defined(__cplusplus) */
 
-extern thread_description pipe_thread_description;
-extern thread_description socket_thread_description;
-
 extern void connection_initialize(proxy_data* proxy, connection_data* conn);
-extern bool connection_prepare_threads(connection_data* conn);
-extern bool connection_launch_threads(connection_data* conn);
+extern bool connection_start(connection_data* conn);
+extern void connection_acquire(connection_data* conn);
+/* Cleans up the connection when the last reference is released. */
+extern void connection_release(connection_data* conn);
+extern void connection_dispatch(logger_instance* logger, connection_data* conn, io_operation* op, DWORD error,
+                                DWORD bytes_transferred);
 extern void connection_close(connection_data* conn);
+/* Counts a message, or a chunk of spliced data, passed in the given direction. */
+extern void connection_count_message(connection_data* conn, METRICS_DIRECTION direction, size_t bytes);
 
 #ifdef __cplusplus
 }
@@ -13,26 +13,61 @@
 #include "../bool.h"
 #include <winestreamproxy/logger.h>
 
-#include <assert.h>
+#include <stddef.h>
 
 #include <tchar.h>
 #include <windef.h>
 #include <winbase.h>
 #include <winnt.h>
 
-/* This implementation is not 100% thread-safe, but it suffices for our use-case. */
-
 bool connection_list_initialize(logger_instance* const logger, connection_list* const connection_list)
 {
     LOG_TRACE(logger, (_T("Initializing connection list")));
 
+    connection_list->empty_event = CreateEvent(NULL, TRUE, TRUE, NULL);
+    if (!connection_list->empty_event)
+    {
+        LOG_CRITICAL(logger, (_T("Could not create connection list event: Error %d"), GetLastError()));
+        return false;
+    }
+
     InitializeCriticalSection(&connection_list->lock);
+    connection_list->start = 0;
+    connection_list->end = 0;
+    connection_list->free_entries = 0;
+    connection_list->slabs = 0;
+    connection_list->count = 0;
 
     LOG_TRACE(logger, (_T("Initialized connection list")));
 
     return true;
 }
 
+/* Called with the lock held. */
+static bool connection_list_add_slab(logger_instance* const logger, connection_list* const connection_list)
+{
+    connection_list_slab* slab;
+    unsigned int i;
+
+    slab = (connection_list_slab*)HeapAlloc(GetProcessHeap(), 0, sizeof(connection_list_slab));
+    if (!slab)
+    {
+        LOG_CRITICAL(logger, (_T("Could not allocate connection data (%lu bytes)"), sizeof(connection_list_slab)));
+        return false;
+    }
+
+    slab->next = connection_list->slabs;
+    connection_list->slabs = slab;
+
+    for (i = 0; i < CONNECTION_LIST_SLAB_SIZE; ++i)
+    {
+        slab->entries[i].next = connection_list->free_entries;
+        connection_list->free_entries = &slab->entries[i];
+    }
+
+    return true;
+}
+
 bool connection_list_allocate_entry(logger_instance* const logger, connection_list* const connection_list,
                                     connection_data** const out_connection)
 {
@@ -42,13 +77,16 @@ bool connection_list_allocate_entry(logger_instance* const logger, connection_li
 
     EnterCriticalSection(&connection_list->lock);
 
-    entry = (connection_list_entry*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(connection_list_entry));
-    if (!entry)
+    if (!connection_list->free_entries && !connection_list_add_slab(logger, connection_list))
     {
-        LOG_CRITICAL(logger, (_T("Could not allocate connection data (%lu bytes)"), sizeof(connection_list_entry)));
-        return FALSE;
+        LeaveCriticalSection(&connection_list->lock);
+        return false;
     }
 
+    entry = connection_list->free_entries;
+    connection_list->free_entries = entry->next;
+    RtlZeroMemory(entry, sizeof(connection_list_entry));
+
     end = connection_list->end;
     entry->previous = end;
     if (!end)
@@ -57,12 +95,15 @@ bool connection_list_allocate_entry(logger_instance* const logger, connection_li
         end->next = entry;
     connection_list->end = entry;
 
+    if (connection_list->count++ == 0)
+        ResetEvent(connection_list->empty_event);
+
     LeaveCriticalSection(&connection_list->lock);
 
     LOG_TRACE(logger, (_T("Allocated connection object")));
 
     *out_connection = &entry->connection;
-    return TRUE;
+    return true;
 }
 
 void connection_list_deallocate_entry(logger_instance* const logger, connection_list* const connection_list,
@@ -85,43 +126,75 @@ void connection_list_deallocate_entry(logger_instance* const logger, connection_
     if (entry->next)
         entry->next->previous = entry->previous;
 
-    LeaveCriticalSection(&connection_list->lock);
+    entry->previous = 0;
+    entry->next = connection_list->free_entries;
+    connection_list->free_entries = entry;
 
-    HeapFree(GetProcessHeap(), 0, entry);
+    if (--connection_list->count == 0)
+        SetEvent(connection_list->empty_event);
+
+    LeaveCriticalSection(&connection_list->lock);
 
     LOG_TRACE(logger, (_T("Deallocated connection object")));
 }
 
-void connection_list_deallocate(logger_instance* logger, connection_list* const connection_list)
+bool connection_list_wait_empty(logger_instance* const logger, connection_list* const connection_list,
+                                DWORD const timeout)
 {
-    connection_list_entry* start;
-
-    LOG_TRACE(logger, (_T("Deallocating connection list")));
+    DWORD wait_result;
 
-    EnterCriticalSection(&connection_list->lock);
+    LOG_TRACE(logger, (_T("Waiting for all connections to be cleaned up")));
 
-    start = connection_list->start;
-    connection_list->start = 0;
-    connection_list->end = 0;
+    wait_result = WaitForSingleObject(connection_list->empty_event, timeout);
+    switch (wait_result)
+    {
+        case WAIT_OBJECT_0:
+            LOG_TRACE(logger, (_T("All connections have been cleaned up")));
+            return true;
+        case WAIT_TIMEOUT:
+            break;
+        case WAIT_FAILED:
+            LOG_ERROR(logger, (_T("Waiting for connection cleanup failed: Error %d"), GetLastError()));
+            break;
+        default:
+            LOG_ERROR(logger, (_T("Unexpected WaitForSingleObject return value: %d"), wait_result));
+    }
 
-    LeaveCriticalSection(&connection_list->lock);
+    return false;
+}
 
-    assert(!start || !start->previous);
+unsigned int connection_list_count(connection_list* const connection_list)
+{
+    unsigned int count;
 
-    while (start)
-    {
-        connection_list_entry* next = start->next;
-        HeapFree(GetProcessHeap(), 0, start);
-        start = next;
-    }
+    EnterCriticalSection(&connection_list->lock);
+    count = connection_list->count;
+    LeaveCriticalSection(&connection_list->lock);
 
-    LOG_TRACE(logger, (_T("Deallocated connection list")));
+    return count;
 }
 
 void connection_list_finalize(logger_instance* const logger, connection_list* const connection_list)
 {
+    connection_list_slab* slab;
+
     LOG_TRACE(logger, (_T("Finalizing connection list")));
 
+    /* Abandoned connections may still have I/O pending on their memory and deallocate their entry once it completes,
+       so the entries, the lock and the event are leaked instead. */
+    if (connection_list->count)
+    {
+        LOG_WARNING(logger, (_T("Leaking connection data of %u abandoned connections"), connection_list->count));
+        return;
+    }
+
+    while ((slab = connection_list->slabs))
+    {
+        connection_list->slabs = slab->next;
+        HeapFree(GetProcessHeap(), 0, slab);
+    }
+
+    CloseHandle(connection_list->empty_event);
     DeleteCriticalSection(&connection_list->lock);
 
     LOG_TRACE(logger, (_T("Finalized connection list")));
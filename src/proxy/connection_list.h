@@ -35,7 +35,9 @@ extern bool connection_list_allocate_entry(logger_instance* logger, connection_l
                                            connection_data** out_connection);
 extern void connection_list_deallocate_entry(logger_instance* logger, connection_list* connection_list,
                                              connection_data* connection);
-extern void connection_list_deallocate(logger_instance* logger, connection_list* connection_list);
+/* Waits until the last entry has been deallocated. Returns false if the timeout expired first. */
+extern bool connection_list_wait_empty(logger_instance* logger, connection_list* connection_list, DWORD timeout);
+extern unsigned int connection_list_count(connection_list* connection_list);
 extern void connection_list_finalize(logger_instance* logger, connection_list* connection_list);
 
 #ifdef __cplusplus
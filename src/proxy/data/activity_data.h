@@ -0,0 +1,38 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#pragma once
+#ifndef __WINESTREAMPROXY_PROXY_DATA_ACTIVITY_DATA_H__
+#define __WINESTREAMPROXY_PROXY_DATA_ACTIVITY_DATA_H__
+
+#include "io_engine_data.h"
+#include "../../bool.h"
+
+#include <stddef.h>
+
+#include <windef.h>
+#include <winbase.h>
+
+/* Rich presence updates of a connection that are held back so that at most one is sent per interval. */
+typedef struct activity_data {
+    bool                enabled;
+    DWORD               interval;       /* Milliseconds between two updates sent to the server. */
+    CRITICAL_SECTION    lock;
+    unsigned char*      pending;        /* Newest update that hasn't been sent yet, null if there is none. */
+    size_t              pending_size;
+    size_t              pending_length;
+    ULONGLONG           last_sent;      /* GetTickCount64 value of the last update sent. */
+    PTP_TIMER           timer;
+    bool                timer_armed;    /* Set from scheduling the update until it has been sent. */
+    LONG                timer_due;      /* Set while the timer holds a reference to the connection. */
+    io_operation        flush_op;       /* Posted by the timer. */
+} activity_data;
+
+#endif /* !defined(__WINESTREAMPROXY_PROXY_DATA_ACTIVITY_DATA_H__) */
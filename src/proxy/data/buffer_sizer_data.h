@@ -0,0 +1,44 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#pragma once
+#ifndef __WINESTREAMPROXY_PROXY_DATA_BUFFER_SIZER_DATA_H__
+#define __WINESTREAMPROXY_PROXY_DATA_BUFFER_SIZER_DATA_H__
+
+#include "../buffer_pool.h"
+
+#include <stddef.h>
+
+#include <windef.h>
+#include <winbase.h>
+
+/* One bucket per size class of the buffer pool, plus one for messages that are bigger than all of them. */
+#define BUFFER_SIZER_BUCKET_COUNT (BUFFER_POOL_CLASS_COUNT + 1)
+
+/* Shared by all connections of a route, updated with interlocked operations. */
+typedef struct buffer_sizer_stats {
+    LONG volatile   grows;          /* Buffers enlarged because a message didn't fit. */
+    LONG volatile   shrinks;        /* Buffers made smaller after having been too big for a while. */
+    LONG volatile   peak_size;      /* Largest buffer of any connection. */
+} buffer_sizer_stats;
+
+/* Sizes the receive buffer of one direction of a connection after the messages that have been seen recently. */
+typedef struct buffer_sizer {
+    unsigned long       counts[BUFFER_SIZER_BUCKET_COUNT];
+    unsigned long       total;
+    size_t              min_size;
+    ULONGLONG           last_needed;    /* GetTickCount64 value of the last message bigger than the target size. */
+    buffer_sizer_stats* stats;
+    /* Read by the idle check, which runs without traffic on another thread. */
+    LONG volatile       received;       /* Set for every message, cleared by the idle check. */
+    LONG volatile       oversized;      /* The buffer is bigger than min_size. */
+} buffer_sizer;
+
+#endif /* !defined(__WINESTREAMPROXY_PROXY_DATA_BUFFER_SIZER_DATA_H__) */
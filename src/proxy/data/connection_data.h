@@ -12,20 +12,36 @@
 #ifndef __WINESTREAMPROXY_PROXY_DATA_CONNECTION_DATA_H__
 #define __WINESTREAMPROXY_PROXY_DATA_CONNECTION_DATA_H__
 
+#include "activity_data.h"
+#include "io_engine_data.h"
+#include "metrics_data.h"
 #include "pipe_data.h"
 #include "socket_data.h"
 
 #include <windef.h>
+#include <winbase.h>
 
 typedef struct connection_data {
-    struct proxy_data* proxy;
+    struct proxy_data*  proxy;
+    struct proxy_route* route;
 
-    pipe_data   pipe;
-    socket_data socket;
+    pipe_data       pipe;
+    socket_data     socket;
+    activity_data   activity;
+    metrics_connection metrics;
 
-    /* Used internally by the pipe and socket threads to make sure that
-       clean-up is only done once. */
-    LONG volatile   do_cleanup;
+    /* One reference is held by the proxy until the connection is closed, and one by every
+       pending operation. The connection is cleaned up when the last reference is released. */
+    LONG volatile   refcount;
+    LONG volatile   closing;
+
+    LARGE_INTEGER   accepted_at;        /* When the client connected, to measure the time to the first message. */
+    LONG volatile   forwarded_any;
+
+    /* Shrinks receive buffers that have been bigger than needed while no messages came in. */
+    PTP_TIMER       idle_timer;
+    LONG volatile   idle_timer_due;     /* Set while the timer holds a reference to the connection. */
+    io_operation    idle_op;            /* Posted by the timer. */
 } connection_data;
 
 #endif /* !defined(__WINESTREAMPROXY_PROXY_DATA_CONNECTION_DATA_H__) */
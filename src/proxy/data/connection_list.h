@@ -14,17 +14,35 @@
 
 #include "connection_data.h"
 
+#include <windef.h>
+#include <winbase.h>
+
+/* Number of entries allocated at once. */
+#define CONNECTION_LIST_SLAB_SIZE 16
+
 typedef struct connection_list_entry connection_list_entry;
 struct connection_list_entry {
     connection_list_entry*  previous;
-    connection_list_entry*  next;
+    connection_list_entry*  next;       /* Also links unused entries. */
     struct connection_data  connection;
 };
 
+typedef struct connection_list_slab connection_list_slab;
+struct connection_list_slab {
+    connection_list_slab*   next;
+    connection_list_entry   entries[CONNECTION_LIST_SLAB_SIZE];
+};
+
+/* Entries are carved from slabs that are kept until the list is finalized, so connecting clients don't go
+   through the heap. */
 typedef struct connection_list {
     CRITICAL_SECTION        lock;
     connection_list_entry*  start;
     connection_list_entry*  end;
+    connection_list_entry*  free_entries;
+    connection_list_slab*   slabs;
+    unsigned int            count;
+    HANDLE                  empty_event;    /* Manual-reset, signaled while the list has no entries. */
 } connection_list;
 
 #endif /* !defined(__WINESTREAMPROXY_PROXY_DATA_CONNECTION_LIST_H__) */
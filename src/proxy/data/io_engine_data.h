@@ -0,0 +1,93 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#pragma once
+#ifndef __WINESTREAMPROXY_PROXY_DATA_IO_ENGINE_DATA_H__
+#define __WINESTREAMPROXY_PROXY_DATA_IO_ENGINE_DATA_H__
+
+#include "thread_data.h"
+#include "../../bool.h"
+#include "../../proxy_unixlib/socket.h"
+
+#include <stddef.h>
+
+#include <windef.h>
+#include <winbase.h>
+
+typedef enum IO_OPERATION_TYPE {
+    IO_OPERATION_TYPE_PIPE_CONNECT = 1,
+    IO_OPERATION_TYPE_PIPE_READ,
+    IO_OPERATION_TYPE_PIPE_WRITE,
+    IO_OPERATION_TYPE_PIPE_READABLE,
+    IO_OPERATION_TYPE_PIPE_WRITABLE,
+    IO_OPERATION_TYPE_SOCKET_READABLE,
+    IO_OPERATION_TYPE_SOCKET_WRITABLE,
+    IO_OPERATION_TYPE_SOCKET_ACCEPT,
+    IO_OPERATION_TYPE_SOCKET_CONNECT,
+    IO_OPERATION_TYPE_ACTIVITY_FLUSH,
+    IO_OPERATION_TYPE_METRICS_ACCEPT,
+    IO_OPERATION_TYPE_METRICS_WRITABLE,
+    IO_OPERATION_TYPE_BUFFER_IDLE
+} IO_OPERATION_TYPE;
+
+/* An asynchronous operation whose completion is delivered through the completion port.
+   The completion key is always the connection the operation belongs to. */
+typedef struct io_operation {
+    OVERLAPPED          overlapped;
+    IO_OPERATION_TYPE   type;
+} io_operation;
+
+/* A Unix fd registered with the socket reactor. Readiness is reported once, then the watch has to be re-armed. */
+typedef struct io_watch io_watch;
+struct io_watch {
+    io_watch*               next;       /* Link in the list of removed watches. */
+    struct connection_data* conn;       /* Referenced while the watch is registered. */
+    io_operation*           op;         /* Posted to the completion port when the fd becomes readable. */
+    io_operation*           write_op;   /* Posted when the fd becomes writable, if not null. */
+    int                     fd;
+    int                     armed;      /* The REACTOR_EVENT_* flags the fd is currently watched for. */
+    bool                    registered;
+    bool                    removed;    /* Released by the watcher thread after its current batch of events. */
+};
+
+typedef enum IO_WORKER_STATE {
+    IO_WORKER_STATE_FREE = 0,
+    IO_WORKER_STATE_RUNNING,
+    IO_WORKER_STATE_RETIRED     /* Exited after being idle, the thread still has to be disposed. */
+} IO_WORKER_STATE;
+
+typedef struct io_worker {
+    struct io_engine_data*  engine;
+    thread_data             thread;
+    IO_WORKER_STATE         state;      /* Protected by the engine's worker_lock. */
+} io_worker;
+
+/* Workers are started on demand while all of them are busy and trimmed again after being idle for a while.
+   Idle workers wait on the completion port, so the same threads serve all connections. */
+typedef struct io_engine_data {
+    HANDLE              port;
+    unsigned int        min_workers;
+    unsigned int        max_workers;
+    DWORD               idle_timeout;   /* Milliseconds until a worker above the minimum exits. */
+    io_worker*          workers;        /* max_workers slots. */
+    CRITICAL_SECTION    worker_lock;
+    unsigned int        live_workers;
+    unsigned int        peak_workers;
+    bool                stopping;
+    LONG volatile       idle_workers;
+
+    CRITICAL_SECTION    watch_lock;
+    reactor*            reactor;
+    io_watch*           removed_watches;
+    LONG volatile       watcher_exiting;
+    thread_data         watcher_thread;
+} io_engine_data;
+
+#endif /* !defined(__WINESTREAMPROXY_PROXY_DATA_IO_ENGINE_DATA_H__) */
@@ -0,0 +1,54 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#pragma once
+#ifndef __WINESTREAMPROXY_PROXY_DATA_METRICS_DATA_H__
+#define __WINESTREAMPROXY_PROXY_DATA_METRICS_DATA_H__
+
+#include <stddef.h>
+
+#include <windef.h>
+#include <winbase.h>
+
+typedef enum METRICS_DIRECTION {
+    METRICS_DIRECTION_PIPE_TO_SOCKET,
+    METRICS_DIRECTION_SOCKET_TO_PIPE,
+    METRICS_DIRECTION_COUNT
+} METRICS_DIRECTION;
+
+/* Traffic of one connection, or of all closed connections of a route. Updated with interlocked operations only, so
+   that the stats endpoint can read them while the I/O workers are running. */
+typedef struct metrics_counters {
+    LONG volatile       messages[METRICS_DIRECTION_COUNT];
+    LONGLONG volatile   bytes[METRICS_DIRECTION_COUNT];
+    LONG volatile       reallocations;  /* Receive buffers that were resized. */
+    LONG volatile       more_data;      /* Messages that didn't fit into the receive buffer at first. */
+    LONG volatile       discarded;      /* Messages that were dropped instead of forwarded. */
+} metrics_counters;
+
+typedef struct metrics_connection {
+    metrics_counters    counters;
+    LONG volatile       id;             /* Assigned when the connection starts, 0 before and after. */
+    LARGE_INTEGER       started_at;
+
+    /* Only used by clients of the stats socket that didn't take the whole text at once. */
+    char*               text;           /* The part of the text that hasn't been sent yet. */
+    size_t              text_length;
+    size_t              text_sent;
+} metrics_connection;
+
+typedef struct metrics_route {
+    metrics_counters    closed;         /* Sums of the connections that have been cleaned up. */
+    LONG volatile       closed_count;
+    LONGLONG volatile   lifetime_total_ms;
+    LONG volatile       lifetime_max_ms;
+} metrics_route;
+
+#endif /* !defined(__WINESTREAMPROXY_PROXY_DATA_METRICS_DATA_H__) */
@@ -12,19 +12,52 @@
 #ifndef __WINESTREAMPROXY_PROXY_DATA_PIPE_DATA_H__
 #define __WINESTREAMPROXY_PROXY_DATA_PIPE_DATA_H__
 
-#include "thread_data.h"
+#include "buffer_sizer_data.h"
+#include "io_engine_data.h"
 #include "../../bool.h"
+#include "../../proxy_unixlib/socket.h"
+
+#include <stddef.h>
 
 #include <windef.h>
 #include <winbase.h>
 
+/* An overlapped write to the pipe. The buffer is owned by the write until it has completed. */
+typedef struct pipe_write {
+    io_operation    op;
+    unsigned char*  buffer;
+    bool            done;
+} pipe_write;
+
 typedef struct pipe_data {
-    HANDLE      handle;
-    OVERLAPPED  read_overlapped;
-    bool        read_is_overlapped;
-    OVERLAPPED  write_overlapped;
-    bool        write_is_overlapped;
-    thread_data thread;
+    HANDLE              handle;
+    bool                client;                 /* Opened with CreateFile instead of being a server instance. */
+    io_operation        connect_op;
+
+    io_operation        read_op;
+    unsigned char*      read_buffer;
+    size_t              read_buffer_size;
+    size_t              read_length;            /* Length of the partial message read so far. */
+    buffer_sizer        read_sizer;
+    LONG volatile       read_shrinking;         /* The read was cancelled to put a smaller buffer under it. */
+
+    /* Writes are queued in a ring and retired in order, even though they can complete out of order. */
+    CRITICAL_SECTION    write_lock;
+    pipe_write*         writes;
+    unsigned int        write_queue_depth;
+    unsigned int        write_high_watermark;   /* The socket reader is paused at this many queued writes... */
+    unsigned int        write_low_watermark;    /* ...and resumed once no more than this many are left. */
+    unsigned int        write_head;             /* Oldest queued write. */
+    unsigned int        write_count;
+    unsigned int        write_peak;             /* Highest number of writes that were queued at once. */
+    bool                reader_paused;
+
+    /* Only used if the data is spliced in the unixlib instead of going through ReadFile. */
+    int                 fd;
+    io_watch            watch;
+    io_operation        readable_op;
+    io_operation        writable_op;            /* Posted while socket data waits for room in the pipe. */
+    splice_channel*     splice;                 /* Pipe to socket. */
 } pipe_data;
 
 #endif /* !defined(__WINESTREAMPROXY_PROXY_DATA_PIPE_DATA_H__) */
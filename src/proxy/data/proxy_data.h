@@ -12,20 +12,73 @@
 #ifndef __WINESTREAMPROXY_PROXY_DATA_PROXY_DATA_H__
 #define __WINESTREAMPROXY_PROXY_DATA_PROXY_DATA_H__
 
+#include "buffer_sizer_data.h"
 #include "connection_list.h"
+#include "io_engine_data.h"
+#include "metrics_data.h"
+#include "socket_data.h"
+#include "socket_pool_data.h"
+#include "../../bool.h"
 #include <winestreamproxy/logger.h>
 #include <winestreamproxy/winestreamproxy.h>
 
 #include <windef.h>
 #include <winbase.h>
 
+/* All routes share the connection list, the I/O engine and the buffer pool. */
+typedef struct proxy_route {
+    struct proxy_data*  proxy;
+    proxy_paths         paths;
+    LONG                listener_target;
+    LONG volatile       listener_count;     /* Pipe instances currently waiting for a client. */
+    LONG volatile       accepted;           /* Clients that connected to the pipe. */
+    socket_pool         socket_pool;        /* Pre-connected server sockets of forward routes. */
+    LONG volatile       first_message_count;
+    LONGLONG volatile   first_message_total_us; /* Time from client connect to the first forwarded message. */
+    LONG volatile       first_message_max_us;
+
+    bool                pipe_message_mode;
+    DWORD               pipe_buffer_size;   /* Bytes of each pipe buffer and the initial read buffer. */
+    int                 socket_buffer_size; /* Bytes of SO_SNDBUF and SO_RCVBUF, 0 for the system default. */
+
+    DWORD               connect_timeout;    /* Milliseconds until connecting to the server is given up. */
+    LONG volatile       connects;           /* Successful connects to the server, without pooled sockets. */
+    LONGLONG volatile   connect_total_us;
+    LONG volatile       connect_max_us;
+    LONG volatile       connect_failures;
+    LONG volatile       connect_timeouts;
+
+    DWORD               reconnect_timeout;  /* Milliseconds a lost server has to come back, 0 to disconnect. */
+    LONG volatile       reconnects;
+    LONG volatile       reconnect_failures;
+
+    /* Discord IPC frames per opcode, the last slot counts unknown opcodes. */
+    LONG volatile       frames_from_socket[SOCKET_FRAME_OPCODE_COUNT + 1];
+    LONG volatile       frames_from_pipe[SOCKET_FRAME_OPCODE_COUNT + 1];
+
+    LONG volatile       activities_forwarded;   /* SET_ACTIVITY frames sent to the server. */
+    LONG volatile       activities_coalesced;   /* SET_ACTIVITY frames dropped for a newer one. */
+
+    buffer_sizer_stats  pipe_buffers;       /* Read buffers for pipe messages. */
+    buffer_sizer_stats  socket_buffers;     /* Receive buffers for socket messages. */
+
+    metrics_route       metrics;
+} proxy_route;
+
 /* Already typedef'd in winestreamproxy.h. */
 struct proxy_data {
     logger_instance*    logger;
-    proxy_parameters    parameters;
+    proxy_parameters    parameters;         /* The routes are copied to the array below. */
+    proxy_route*        routes;
+    unsigned int        route_count;
     LONG volatile       is_running;
     connection_list     conn_list;
-    OVERLAPPED          accept_overlapped;
+    CRITICAL_SECTION    listen_lock;
+    bool                accepting;          /* Cleared under listen_lock when the proxy stops. */
+    io_engine_data      engine;
+    LONG volatile       peak_write_queue_depth; /* Most pipe writes that were in flight on one connection. */
+    LONG volatile       next_connection_id;     /* Last id given to a connection, for the stats endpoint. */
+    LARGE_INTEGER       counter_frequency;
 };
 
 #endif /* !defined(__WINESTREAMPROXY_PROXY_DATA_PROXY_DATA_H__) */
@@ -12,21 +12,80 @@
 #ifndef __WINESTREAMPROXY_PROXY_DATA_SOCKET_DATA_H__
 #define __WINESTREAMPROXY_PROXY_DATA_SOCKET_DATA_H__
 
-#include "thread_data.h"
+#include "buffer_sizer_data.h"
+#include "io_engine_data.h"
+#include "../../bool.h"
 #include "../../proxy_unixlib/socket.h"
 
+#include <stddef.h>
+
 #include <windef.h>
 #include <winbase.h>
 
-#ifdef __linux__
-#define socket_use_eventfd
-#endif
+/* Upper bound of the handshake messages that are kept for reconnecting. */
+#define SOCKET_MAX_REPLAY_MESSAGES 4
+
+/* Discord IPC frames start with a little-endian 32-bit opcode and payload length. */
+#define SOCKET_FRAME_HEADER_SIZE 8
+/* Handshake, frame, close, ping and pong are counted separately, unknown opcodes together. */
+#define SOCKET_FRAME_OPCODE_COUNT 5
+#define SOCKET_FRAME_OPCODE_FRAME 1
+
+/* Data that couldn't be written to the socket yet. */
+typedef struct socket_send_chunk {
+    unsigned char*  buffer;     /* Pool buffer owned by the send queue. */
+    size_t          offset;     /* Bytes already written. */
+    size_t          length;
+} socket_send_chunk;
 
 typedef struct socket_data {
     void*               address;
     int                 fd;
-    thread_exit_event   event;
-    thread_data         thread;
+    bool                listening;          /* Accepts clients instead of carrying data. */
+
+    io_watch            watch;
+    io_operation        readable_op;
+    unsigned char*      recv_buffer;
+    size_t              recv_buffer_size;
+    buffer_sizer        recv_sizer;
+    LONG volatile       recv_busy;          /* Set while the receive buffer is in use, by the reader or idle check. */
+
+    /* Flushed with writev when the socket becomes writable. */
+    io_operation        writable_op;
+    CRITICAL_SECTION    send_lock;
+    socket_send_chunk*  send_queue;
+    unsigned int        send_head;
+    unsigned int        send_count;
+    bool                pipe_reader_paused; /* The pipe is read again once the queue has drained. */
+    unsigned int        send_limit;         /* Queued messages that pause the pipe reader. */
+
+    /* Only used if the connection survives the server going away. The first messages of the client are kept and
+       sent again after reconnecting, the slots they take up in the send queue are kept free for that. */
+    bool                reconnect;
+    bool                lost;               /* Protected by send_lock. Messages are queued instead of sent. */
+    bool                reconnecting;       /* Owned by the connect stage. */
+    socket_send_chunk   replay[SOCKET_MAX_REPLAY_MESSAGES];
+    unsigned int        replay_limit;
+    unsigned int        replay_count;
+    unsigned int        replay_written;     /* Kept messages that have been written completely. */
+
+    splice_channel*     splice;             /* Socket to pipe, if the pipe data is spliced. */
+
+    /* Only used if the socket data is split into frames, each of which is written to the pipe as one message. */
+    bool                framing;
+    size_t              max_frame_size;     /* Payload bytes, bigger frames close the connection. */
+    unsigned char       frame_header[SOCKET_FRAME_HEADER_SIZE];
+    unsigned char*      frame_buffer;       /* Allocated once the header is complete, header included. */
+    size_t              frame_length;       /* Full length of the current frame, 0 until the header is complete. */
+    size_t              frame_received;
+
+    /* Only used while connecting to the server. */
+    io_operation        connect_op;         /* Posted by the retry timer. */
+    PTP_TIMER           connect_timer;
+    LONG                connect_timer_due;  /* Set while the timer holds a reference to the connection. */
+    ULONGLONG           connect_deadline;   /* GetTickCount64 value after which the attempt is given up. */
+    DWORD               connect_retry_delay;
+    LARGE_INTEGER       connect_started;
 } socket_data;
 
 #endif /* !defined(__WINESTREAMPROXY_PROXY_DATA_SOCKET_DATA_H__) */
@@ -0,0 +1,34 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#pragma once
+#ifndef __WINESTREAMPROXY_PROXY_DATA_SOCKET_POOL_DATA_H__
+#define __WINESTREAMPROXY_PROXY_DATA_SOCKET_POOL_DATA_H__
+
+#include "../../bool.h"
+
+#include <windef.h>
+#include <winbase.h>
+
+/* Sockets that are connected to the server before a pipe client needs them. */
+typedef struct socket_pool {
+    unsigned int        size;           /* 0 if the pool is disabled. */
+    void*               address;
+    CRITICAL_SECTION    lock;
+    int*                fds;            /* Ring of connected sockets, oldest first. */
+    unsigned int        head;
+    unsigned int        count;
+    bool                filling;        /* Only one thread connects new sockets at a time. */
+    LONG volatile       hits;           /* Clients that got a socket from the pool. */
+    LONG volatile       misses;         /* Clients that had to wait for a new connection. */
+    LONG volatile       stale;          /* Pooled sockets that were closed by the server before being used. */
+} socket_pool;
+
+#endif /* !defined(__WINESTREAMPROXY_PROXY_DATA_SOCKET_POOL_DATA_H__) */
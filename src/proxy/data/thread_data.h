@@ -35,11 +35,11 @@ typedef bool (*thread_stop_func)(logger_instance* logger, thread_data* data);
 typedef struct thread_description {
     thread_proc_func    thread_proc;    /* The function to execute in the thread. */
     thread_cleanup_func cleanup_func;   /* Called while stopping the thread. */
-    thread_stop_func    stop_func;      /* Called to stop a thread in running state. */
+    thread_stop_func    stop_func;      /* Called to signal a thread in running state to stop. */
 } thread_description;
 
 struct thread_data {
-    HANDLE          handle;         /* The thread handle. */
+    HANDLE          handle;         /* The thread handle. Closed by thread_dispose. */
     LONG volatile   status;         /* Status of the thread, values from THREAD_STATUS. */
     HANDLE          trigger_event;  /* Used to communicate with the thread. Can be used arbitrarily */
                                     /* while the thread is running, e.g. to signal the thread to stop.*/
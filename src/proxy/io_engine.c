@@ -0,0 +1,573 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#include "connection.h"
+#include "io_engine.h"
+#include "misc.h"
+#include "socket.h"
+#include "thread.h"
+#include "../proxy_unixlib/socket.h"
+#include <winestreamproxy/logger.h>
+
+#include <stddef.h>
+
+#include <tchar.h>
+#include <windef.h>
+#include <winbase.h>
+#include <winnt.h>
+
+#define InterlockedRead(x) InterlockedCompareExchange((x), 0, 0)
+
+#define IO_ENGINE_MIN_AUTO_WORKERS 2
+#define IO_ENGINE_MAX_AUTO_WORKERS 8
+#define IO_ENGINE_MAX_WORKERS 64
+#define IO_ENGINE_DEFAULT_IDLE_TIMEOUT 30000
+
+/* Completion key of the packets that tell a worker thread to exit. */
+#define IO_ENGINE_EXIT_KEY 0
+
+static void io_engine_grow(logger_instance* logger, io_engine_data* engine);
+
+/* Lets an idle worker exit if there are more than the minimum. Never trims while stopping, so that every running
+   worker receives one of the exit packets. */
+static bool io_worker_retire(io_worker* const worker)
+{
+    io_engine_data* const engine = worker->engine;
+    bool retire;
+
+    EnterCriticalSection(&engine->worker_lock);
+    retire = !engine->stopping && engine->live_workers > engine->min_workers;
+    if (retire)
+    {
+        worker->state = IO_WORKER_STATE_RETIRED;
+        --engine->live_workers;
+    }
+    LeaveCriticalSection(&engine->worker_lock);
+
+    return retire;
+}
+
+static bool io_worker_proc(logger_instance* const logger, void* const param)
+{
+    io_worker* const worker = (io_worker*)param;
+    io_engine_data* const engine = worker->engine;
+    DWORD const timeout = engine->max_workers > engine->min_workers ? engine->idle_timeout : INFINITE;
+
+    LOG_TRACE(logger, (_T("Entering I/O worker loop")));
+
+    while (true)
+    {
+        DWORD bytes_transferred;
+        ULONG_PTR key;
+        OVERLAPPED* overlapped;
+        BOOL success;
+
+        InterlockedIncrement(&engine->idle_workers);
+        success = GetQueuedCompletionStatus(engine->port, &bytes_transferred, &key, &overlapped, timeout);
+        InterlockedDecrement(&engine->idle_workers);
+        if (!overlapped)
+        {
+            if (!success)
+            {
+                if (GetLastError() == WAIT_TIMEOUT)
+                {
+                    if (io_worker_retire(worker))
+                    {
+                        LOG_DEBUG(logger, (_T("Trimming idle I/O worker")));
+                        break;
+                    }
+                    continue;
+                }
+                LOG_ERROR(logger, (_T("GetQueuedCompletionStatus failed: Error %d"), GetLastError()));
+                return false;
+            }
+            if (key == IO_ENGINE_EXIT_KEY)
+                break;
+            continue;
+        }
+
+        /* Handlers may take a while, e.g. while a synchronous log callback writes to a slow console. Keep a worker
+           available for the other connections in the meantime. */
+        if (InterlockedRead(&engine->idle_workers) == 0)
+            io_engine_grow(logger, engine);
+
+        connection_dispatch(logger, (connection_data*)key, container_of(overlapped, io_operation, overlapped),
+                            success ? ERROR_SUCCESS : GetLastError(), bytes_transferred);
+    }
+
+    LOG_TRACE(logger, (_T("Exited I/O worker loop")));
+
+    return true;
+}
+
+static void io_worker_cleanup(logger_instance* const logger, thread_data* const data, void* const param)
+{
+    (void)logger;
+    (void)data;
+    (void)param;
+}
+
+static bool io_worker_stop(logger_instance* const logger, thread_data* const data)
+{
+    io_worker* const worker = container_of(data, io_worker, thread);
+
+    if (!PostQueuedCompletionStatus(worker->engine->port, 0, IO_ENGINE_EXIT_KEY, NULL))
+    {
+        LOG_ERROR(logger, (_T("Could not post exit packet to I/O worker: Error %d"), GetLastError()));
+        return false;
+    }
+
+    return true;
+}
+
+static thread_description io_worker_thread_description = {
+    io_worker_proc,
+    io_worker_cleanup,
+    io_worker_stop
+};
+
+/* Number of socket events fetched from the reactor at once. */
+#define IO_WATCHER_BATCH_SIZE 64
+
+static void io_watcher_post(logger_instance* const logger, io_engine_data* const engine, io_watch* const watch,
+                            io_operation* const op)
+{
+    connection_acquire(watch->conn);
+    if (!io_engine_post(logger, engine, (ULONG_PTR)watch->conn, op))
+        connection_release(watch->conn);
+}
+
+static bool io_watcher_proc(logger_instance* const logger, void* const param)
+{
+    io_engine_data* const engine = (io_engine_data*)param;
+    reactor_event events[IO_WATCHER_BATCH_SIZE];
+    bool ret = true;
+
+    LOG_TRACE(logger, (_T("Entering socket watcher loop")));
+
+    while (true)
+    {
+        io_watch* removed, * watch;
+        size_t count, i;
+
+        /* The sockets of removed watches can't be in the current batch anymore, so they may be closed now. */
+        EnterCriticalSection(&engine->watch_lock);
+        removed = engine->removed_watches;
+        engine->removed_watches = 0;
+        LeaveCriticalSection(&engine->watch_lock);
+
+        while (removed)
+        {
+            watch = removed;
+            removed = removed->next;
+            connection_release(watch->conn);
+        }
+
+        if (InterlockedRead(&engine->watcher_exiting))
+            break;
+
+        if (!socket_reactor_wait(logger, engine->reactor, events, IO_WATCHER_BATCH_SIZE, -1, &count))
+        {
+            ret = false;
+            break;
+        }
+
+        EnterCriticalSection(&engine->watch_lock);
+
+        for (i = 0; i < count; ++i)
+        {
+            int fired;
+
+            watch = (io_watch*)events[i].data;
+            if (watch->removed)
+                continue;
+
+            /* The whole fd is disabled after an event, so keep watching for the events that didn't fire. */
+            fired = events[i].events & watch->armed;
+            watch->armed &= ~fired;
+            if (watch->armed)
+                socket_reactor_rearm(logger, engine->reactor, watch->fd, watch->armed, watch);
+
+            if (fired & REACTOR_EVENT_READABLE)
+                io_watcher_post(logger, engine, watch, watch->op);
+            if ((fired & REACTOR_EVENT_WRITABLE) && watch->write_op)
+                io_watcher_post(logger, engine, watch, watch->write_op);
+        }
+
+        LeaveCriticalSection(&engine->watch_lock);
+    }
+
+    LOG_TRACE(logger, (_T("Exited socket watcher loop")));
+
+    return ret;
+}
+
+static void io_watcher_cleanup(logger_instance* const logger, thread_data* const data, void* const param)
+{
+    (void)logger;
+    (void)data;
+    (void)param;
+}
+
+static bool io_watcher_stop(logger_instance* const logger, thread_data* const data)
+{
+    io_engine_data* const engine = container_of(data, io_engine_data, watcher_thread);
+
+    InterlockedExchange(&engine->watcher_exiting, TRUE);
+    return socket_reactor_wake(logger, engine->reactor);
+}
+
+static thread_description io_watcher_thread_description = {
+    io_watcher_proc,
+    io_watcher_cleanup,
+    io_watcher_stop
+};
+
+static unsigned int io_engine_auto_worker_count(void)
+{
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    if (info.dwNumberOfProcessors < IO_ENGINE_MIN_AUTO_WORKERS)
+        return IO_ENGINE_MIN_AUTO_WORKERS;
+    if (info.dwNumberOfProcessors > IO_ENGINE_MAX_AUTO_WORKERS)
+        return IO_ENGINE_MAX_AUTO_WORKERS;
+    return (unsigned int)info.dwNumberOfProcessors;
+}
+
+/* Starts a worker in a free slot. Called with worker_lock held. */
+static bool io_engine_start_worker(logger_instance* const logger, io_engine_data* const engine)
+{
+    io_worker* worker;
+    unsigned int i;
+
+    for (i = 0; i < engine->max_workers; ++i)
+        if (engine->workers[i].state != IO_WORKER_STATE_RUNNING)
+            break;
+    if (i == engine->max_workers)
+        return false;
+    worker = &engine->workers[i];
+
+    /* The thread of a retired worker has left its loop already, so this doesn't wait long. Waiting first keeps
+       thread_dispose from posting an exit packet that another worker would pick up. */
+    if (worker->state == IO_WORKER_STATE_RETIRED)
+    {
+        thread_wait(logger, &io_worker_thread_description, &worker->thread);
+        thread_dispose(logger, &io_worker_thread_description, &worker->thread);
+        worker->state = IO_WORKER_STATE_FREE;
+    }
+
+    worker->engine = engine;
+    if (!thread_prepare(logger, &io_worker_thread_description, &worker->thread, worker))
+        return false;
+    worker->state = IO_WORKER_STATE_RUNNING;
+    ++engine->live_workers;
+    if (thread_run(logger, &io_worker_thread_description, &worker->thread) != THREAD_RUN_ERROR_SUCCESS)
+    {
+        thread_dispose(logger, &io_worker_thread_description, &worker->thread);
+        worker->state = IO_WORKER_STATE_FREE;
+        --engine->live_workers;
+        return false;
+    }
+
+    if (engine->live_workers > engine->peak_workers)
+        engine->peak_workers = engine->live_workers;
+
+    return true;
+}
+
+static void io_engine_grow(logger_instance* const logger, io_engine_data* const engine)
+{
+    EnterCriticalSection(&engine->worker_lock);
+
+    if (!engine->stopping && engine->live_workers < engine->max_workers &&
+        InterlockedRead(&engine->idle_workers) == 0)
+    {
+        if (io_engine_start_worker(logger, engine))
+            LOG_DEBUG(logger, (_T("All I/O workers busy, started worker %u"), engine->live_workers));
+    }
+
+    LeaveCriticalSection(&engine->worker_lock);
+}
+
+bool io_engine_initialize(logger_instance* const logger, io_engine_data* const engine,
+                          proxy_tuning const* const tuning)
+{
+    unsigned int min_workers, max_workers;
+
+    LOG_TRACE(logger, (_T("Initializing I/O engine")));
+
+    min_workers = tuning->io_worker_count;
+    if (min_workers == 0)
+        min_workers = io_engine_auto_worker_count();
+    else if (min_workers > IO_ENGINE_MAX_WORKERS)
+    {
+        LOG_WARNING(logger, (_T("Limiting I/O worker count to %u"), (unsigned int)IO_ENGINE_MAX_WORKERS));
+        min_workers = IO_ENGINE_MAX_WORKERS;
+    }
+
+    max_workers = tuning->io_worker_max ? tuning->io_worker_max : min_workers * 2;
+    if (max_workers < min_workers)
+        max_workers = min_workers;
+    else if (max_workers > IO_ENGINE_MAX_WORKERS)
+        max_workers = IO_ENGINE_MAX_WORKERS;
+
+    engine->workers = (io_worker*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(io_worker) * max_workers);
+    if (!engine->workers)
+    {
+        LOG_CRITICAL(logger, (_T("Failed to allocate %lu bytes"), (unsigned long)(sizeof(io_worker) * max_workers)));
+        return false;
+    }
+    engine->min_workers = min_workers;
+    engine->max_workers = max_workers;
+    engine->idle_timeout = tuning->io_worker_idle_timeout ? tuning->io_worker_idle_timeout
+                                                          : IO_ENGINE_DEFAULT_IDLE_TIMEOUT;
+    engine->live_workers = 0;
+    engine->peak_workers = 0;
+    engine->stopping = false;
+    engine->idle_workers = 0;
+
+    /* Only the minimum runs concurrently, additional workers take over while others are blocked. */
+    engine->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, min_workers);
+    if (!engine->port)
+    {
+        LOG_CRITICAL(logger, (_T("Could not create I/O completion port: Error %d"), GetLastError()));
+        HeapFree(GetProcessHeap(), 0, engine->workers);
+        return false;
+    }
+
+    if (!socket_reactor_create(logger, &engine->reactor))
+    {
+        CloseHandle(engine->port);
+        HeapFree(GetProcessHeap(), 0, engine->workers);
+        return false;
+    }
+
+    InitializeCriticalSection(&engine->worker_lock);
+    InitializeCriticalSection(&engine->watch_lock);
+    engine->removed_watches = 0;
+    engine->watcher_exiting = FALSE;
+
+    LOG_TRACE(logger, (_T("Initialized I/O engine with %u to %u workers"), min_workers, max_workers));
+
+    return true;
+}
+
+bool io_engine_start(logger_instance* const logger, io_engine_data* const engine)
+{
+    unsigned int i;
+
+    LOG_TRACE(logger, (_T("Starting I/O engine")));
+
+    if (!thread_prepare(logger, &io_watcher_thread_description, &engine->watcher_thread, engine))
+        return false;
+    if (thread_run(logger, &io_watcher_thread_description, &engine->watcher_thread) != THREAD_RUN_ERROR_SUCCESS)
+    {
+        thread_dispose(logger, &io_watcher_thread_description, &engine->watcher_thread);
+        return false;
+    }
+
+    EnterCriticalSection(&engine->worker_lock);
+    for (i = 0; i < engine->min_workers; ++i)
+        if (!io_engine_start_worker(logger, engine))
+            break;
+    LeaveCriticalSection(&engine->worker_lock);
+
+    if (i < engine->min_workers)
+    {
+        io_engine_stop(logger, engine);
+        return false;
+    }
+
+    LOG_TRACE(logger, (_T("Started I/O engine")));
+
+    return true;
+}
+
+void io_engine_stop(logger_instance* const logger, io_engine_data* const engine)
+{
+    unsigned int i;
+
+    LOG_TRACE(logger, (_T("Stopping I/O engine")));
+
+    thread_dispose(logger, &io_watcher_thread_description, &engine->watcher_thread);
+
+    /* No worker is started or retired after this, so the states are stable. */
+    EnterCriticalSection(&engine->worker_lock);
+    engine->stopping = true;
+    LeaveCriticalSection(&engine->worker_lock);
+
+    for (i = 0; i < engine->max_workers; ++i)
+        if (engine->workers[i].state == IO_WORKER_STATE_RUNNING)
+            thread_stop(logger, &io_worker_thread_description, &engine->workers[i].thread);
+    for (i = 0; i < engine->max_workers; ++i)
+    {
+        if (engine->workers[i].state == IO_WORKER_STATE_FREE)
+            continue;
+        thread_dispose(logger, &io_worker_thread_description, &engine->workers[i].thread);
+        engine->workers[i].state = IO_WORKER_STATE_FREE;
+    }
+    engine->live_workers = 0;
+
+    LOG_DEBUG(logger, (
+        _T("Ran up to %u of %u I/O workers at once"),
+        engine->peak_workers,
+        engine->max_workers
+    ));
+
+    LOG_TRACE(logger, (_T("Stopped I/O engine")));
+}
+
+void io_engine_finalize(logger_instance* const logger, io_engine_data* const engine, bool const abandoned)
+{
+    LOG_TRACE(logger, (_T("Finalizing I/O engine")));
+
+    /* Abandoned connections still have I/O pending on the port, so it is leaked along with them. */
+    if (!abandoned)
+    {
+        DeleteCriticalSection(&engine->watch_lock);
+        CloseHandle(engine->port);
+    }
+    DeleteCriticalSection(&engine->worker_lock);
+    socket_reactor_destroy(logger, engine->reactor);
+    HeapFree(GetProcessHeap(), 0, engine->workers);
+
+    LOG_TRACE(logger, (_T("Finalized I/O engine")));
+}
+
+bool io_engine_associate(logger_instance* const logger, io_engine_data* const engine, HANDLE const handle,
+                         ULONG_PTR const key)
+{
+    if (CreateIoCompletionPort(handle, engine->port, key, 0) != engine->port)
+    {
+        LOG_ERROR(logger, (_T("Could not associate handle with I/O completion port: Error %d"), GetLastError()));
+        return false;
+    }
+
+    return true;
+}
+
+bool io_engine_post(logger_instance* const logger, io_engine_data* const engine, ULONG_PTR const key,
+                    io_operation* const op)
+{
+    if (!PostQueuedCompletionStatus(engine->port, 0, key, &op->overlapped))
+    {
+        LOG_ERROR(logger, (_T("Could not post completion packet: Error %d"), GetLastError()));
+        return false;
+    }
+
+    return true;
+}
+
+void io_engine_init_watch(io_watch* const watch, struct connection_data* const conn, io_operation* const op,
+                          io_operation* const write_op)
+{
+    watch->next = 0;
+    watch->conn = conn;
+    watch->op = op;
+    watch->write_op = write_op;
+    watch->fd = -1;
+    watch->armed = 0;
+    watch->registered = false;
+    watch->removed = false;
+}
+
+bool io_engine_watch(logger_instance* const logger, io_engine_data* const engine, io_watch* const watch, int const fd,
+                     int const events)
+{
+    bool ret;
+
+    LOG_TRACE(logger, (_T("Adding fd to reactor")));
+
+    EnterCriticalSection(&engine->watch_lock);
+
+    watch->fd = fd;
+    watch->armed = events;
+    ret = socket_reactor_add(logger, engine->reactor, fd, events, watch);
+    watch->registered = ret;
+    watch->removed = false;
+
+    LeaveCriticalSection(&engine->watch_lock);
+
+    return ret;
+}
+
+void io_engine_arm(logger_instance* const logger, io_engine_data* const engine, io_watch* const watch,
+                   int const events)
+{
+    EnterCriticalSection(&engine->watch_lock);
+
+    if (watch->registered && !watch->removed && watch->fd != -1 && (watch->armed | events) != watch->armed)
+    {
+        watch->armed |= events;
+        socket_reactor_rearm(logger, engine->reactor, watch->fd, watch->armed, watch);
+    }
+
+    LeaveCriticalSection(&engine->watch_lock);
+}
+
+bool io_engine_move_watch(logger_instance* const logger, io_engine_data* const engine, io_watch* const watch,
+                          int const fd, int const events)
+{
+    bool ret, wake = false;
+
+    EnterCriticalSection(&engine->watch_lock);
+
+    ret = watch->registered && !watch->removed;
+    if (ret)
+    {
+        LOG_TRACE(logger, (_T("Moving reactor watch to another fd")));
+
+        if (watch->fd != -1)
+            socket_reactor_remove(logger, engine->reactor, watch->fd);
+        watch->fd = fd;
+        watch->armed = fd != -1 ? events : 0;
+        if (fd != -1 && !socket_reactor_add(logger, engine->reactor, fd, events, watch))
+        {
+            /* The reference is released by the watcher thread, like that of an unwatched fd. */
+            watch->removed = true;
+            watch->next = engine->removed_watches;
+            engine->removed_watches = watch;
+            ret = false;
+            wake = true;
+        }
+    }
+
+    LeaveCriticalSection(&engine->watch_lock);
+
+    if (wake)
+        socket_reactor_wake(logger, engine->reactor);
+
+    return ret;
+}
+
+void io_engine_unwatch(logger_instance* const logger, io_engine_data* const engine, io_watch* const watch)
+{
+    bool wake;
+
+    EnterCriticalSection(&engine->watch_lock);
+
+    wake = watch->registered && !watch->removed;
+    if (wake)
+    {
+        LOG_TRACE(logger, (_T("Removing fd from reactor")));
+
+        if (watch->fd != -1)
+            socket_reactor_remove(logger, engine->reactor, watch->fd);
+        watch->removed = true;
+        watch->next = engine->removed_watches;
+        engine->removed_watches = watch;
+    }
+
+    LeaveCriticalSection(&engine->watch_lock);
+
+    if (wake)
+        socket_reactor_wake(logger, engine->reactor);
+}
@@ -0,0 +1,53 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#pragma once
+#ifndef __WINESTREAMPROXY_PROXY_IO_ENGINE_H__
+#define __WINESTREAMPROXY_PROXY_IO_ENGINE_H__
+
+#include "data/io_engine_data.h"
+#include "../bool.h"
+#include <winestreamproxy/logger.h>
+#include <winestreamproxy/winestreamproxy.h>
+
+#include <windef.h>
+#include <winbase.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+extern bool io_engine_initialize(logger_instance* logger, io_engine_data* engine, proxy_tuning const* tuning);
+extern bool io_engine_start(logger_instance* logger, io_engine_data* engine);
+extern void io_engine_stop(logger_instance* logger, io_engine_data* engine);
+/* Pass abandoned if connections are left that weren't cleaned up after stopping. */
+extern void io_engine_finalize(logger_instance* logger, io_engine_data* engine, bool abandoned);
+
+extern bool io_engine_associate(logger_instance* logger, io_engine_data* engine, HANDLE handle, ULONG_PTR key);
+extern bool io_engine_post(logger_instance* logger, io_engine_data* engine, ULONG_PTR key, io_operation* op);
+
+/* The socket watcher reports readiness by posting the operations of the watch. Every event is reported once, then
+   it has to be armed again. A registered watch holds a reference to its connection, which is released after the
+   watch has been removed. */
+extern void io_engine_init_watch(io_watch* watch, struct connection_data* conn, io_operation* op,
+                                 io_operation* write_op);
+extern bool io_engine_watch(logger_instance* logger, io_engine_data* engine, io_watch* watch, int fd, int events);
+extern void io_engine_arm(logger_instance* logger, io_engine_data* engine, io_watch* watch, int events);
+/* Points a registered watch at another fd, or at none if fd is -1, keeping its reference. Fails if the watch has
+   been removed in the meantime. */
+extern bool io_engine_move_watch(logger_instance* logger, io_engine_data* engine, io_watch* watch, int fd,
+                                 int events);
+extern void io_engine_unwatch(logger_instance* logger, io_engine_data* engine, io_watch* watch);
+
+#ifdef __cplusplus
+}
+#endif /* defined(__cplusplus) */
+
+#endif /* !defined(__WINESTREAMPROXY_PROXY_IO_ENGINE_H__) */
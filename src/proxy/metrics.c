@@ -0,0 +1,658 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#include "metrics.h"
+#include "connection.h"
+#include "connection_list.h"
+#include "io_engine.h"
+#include "socket.h"
+#include "data/proxy_data.h"
+#include <winestreamproxy/logger.h>
+#include <winestreamproxy/winestreamproxy.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <tchar.h>
+#include <windef.h>
+#include <winbase.h>
+#include <winnt.h>
+
+#define InterlockedRead(x) InterlockedCompareExchange((x), 0, 0)
+#define InterlockedRead64(x) InterlockedExchangeAdd64((x), 0)
+
+#define METRICS_INITIAL_TEXT_SIZE 4096
+/* Upper bound of the clients served per readiness report. */
+#define METRICS_ACCEPT_BATCH_SIZE 16
+
+static char const* const metrics_direction_names[METRICS_DIRECTION_COUNT] = {
+    "pipe_to_socket",
+    "socket_to_pipe"
+};
+
+/* Discord IPC opcodes by value, the last entry is for unknown ones. */
+static char const* const metrics_opcode_names[SOCKET_FRAME_OPCODE_COUNT + 1] = {
+    "handshake",
+    "frame",
+    "close",
+    "ping",
+    "pong",
+    "unknown"
+};
+
+/* Plain copy of a metrics_counters structure. */
+typedef struct metrics_values {
+    double          messages[METRICS_DIRECTION_COUNT];
+    double          bytes[METRICS_DIRECTION_COUNT];
+    double          reallocations;
+    double          more_data;
+    double          discarded;
+} metrics_values;
+
+typedef struct metrics_route_values {
+    metrics_values  totals;
+    unsigned long   active;
+} metrics_route_values;
+
+typedef struct metrics_connection_values {
+    unsigned int    route;
+    unsigned long   id;
+    double          age_seconds;
+    metrics_values  values;
+} metrics_connection_values;
+
+typedef struct metrics_text {
+    char*           data;
+    size_t          length;
+    size_t          size;
+    bool            failed;
+} metrics_text;
+
+void metrics_reset(metrics_connection* const metrics)
+{
+    RtlZeroMemory(&metrics->counters, sizeof(metrics->counters));
+    metrics->id = 0;
+    metrics->text = 0;
+    metrics->text_length = 0;
+    metrics->text_sent = 0;
+}
+
+void metrics_connection_started(connection_data* const conn)
+{
+    QueryPerformanceCounter(&conn->metrics.started_at);
+    InterlockedExchange(&conn->metrics.id, InterlockedIncrement(&conn->proxy->next_connection_id));
+}
+
+static void metrics_update_max(LONG volatile* const max, LONG const value)
+{
+    LONG current;
+
+    do {
+        current = InterlockedRead(max);
+        if (value <= current)
+            return;
+    } while (InterlockedCompareExchange(max, value, current) != current);
+}
+
+void metrics_connection_finished(connection_data* const conn)
+{
+    metrics_counters* const counters = &conn->metrics.counters;
+    metrics_route* route;
+    LARGE_INTEGER now;
+    LONGLONG lifetime_ms;
+    unsigned int i;
+
+    if (conn->metrics.text)
+    {
+        HeapFree(GetProcessHeap(), 0, conn->metrics.text);
+        conn->metrics.text = 0;
+    }
+
+    if (!InterlockedRead(&conn->metrics.id))
+        return;
+    route = &conn->route->metrics;
+
+    QueryPerformanceCounter(&now);
+    lifetime_ms = (now.QuadPart - conn->metrics.started_at.QuadPart) * 1000 / conn->proxy->counter_frequency.QuadPart;
+
+    /* Snapshots are taken with the list locked, so they see the connection either as open or as closed. */
+    connection_list_lock(&conn->proxy->conn_list);
+    for (i = 0; i < METRICS_DIRECTION_COUNT; ++i)
+    {
+        InterlockedExchangeAdd(&route->closed.messages[i], InterlockedRead(&counters->messages[i]));
+        InterlockedExchangeAdd64(&route->closed.bytes[i], InterlockedRead64(&counters->bytes[i]));
+    }
+    InterlockedExchangeAdd(&route->closed.reallocations, InterlockedRead(&counters->reallocations));
+    InterlockedExchangeAdd(&route->closed.more_data, InterlockedRead(&counters->more_data));
+    InterlockedExchangeAdd(&route->closed.discarded, InterlockedRead(&counters->discarded));
+    InterlockedIncrement(&route->closed_count);
+    InterlockedExchangeAdd64(&route->lifetime_total_ms, lifetime_ms);
+    metrics_update_max(&route->lifetime_max_ms, lifetime_ms > 0x7FFFFFFF ? 0x7FFFFFFF : (LONG)lifetime_ms);
+    InterlockedExchange(&conn->metrics.id, 0);
+    connection_list_unlock(&conn->proxy->conn_list);
+}
+
+void metrics_count_message(connection_data* const conn, METRICS_DIRECTION const direction, size_t const bytes)
+{
+    InterlockedIncrement(&conn->metrics.counters.messages[direction]);
+    InterlockedExchangeAdd64(&conn->metrics.counters.bytes[direction], (LONGLONG)bytes);
+}
+
+void metrics_count_reallocation(connection_data* const conn)
+{
+    InterlockedIncrement(&conn->metrics.counters.reallocations);
+}
+
+void metrics_count_more_data(connection_data* const conn)
+{
+    InterlockedIncrement(&conn->metrics.counters.more_data);
+}
+
+void metrics_count_discarded(connection_data* const conn, unsigned int const messages)
+{
+    InterlockedExchangeAdd(&conn->metrics.counters.discarded, (LONG)messages);
+}
+
+static void metrics_read_counters(metrics_counters* const counters, metrics_values* const values)
+{
+    unsigned int i;
+
+    for (i = 0; i < METRICS_DIRECTION_COUNT; ++i)
+    {
+        values->messages[i] += (double)(unsigned long)InterlockedRead(&counters->messages[i]);
+        values->bytes[i] += (double)InterlockedRead64(&counters->bytes[i]);
+    }
+    values->reallocations += (double)(unsigned long)InterlockedRead(&counters->reallocations);
+    values->more_data += (double)(unsigned long)InterlockedRead(&counters->more_data);
+    values->discarded += (double)(unsigned long)InterlockedRead(&counters->discarded);
+}
+
+static void metrics_append(metrics_text* const text, char const* const format, ...)
+{
+    va_list args;
+    int length;
+
+    if (text->failed)
+        return;
+
+    va_start(args, format);
+    length = vsnprintf(0, 0, format, args);
+    va_end(args);
+    if (length < 0)
+    {
+        text->failed = true;
+        return;
+    }
+
+    if (text->length + (size_t)length + 1 > text->size)
+    {
+        size_t new_size = text->size ? text->size : METRICS_INITIAL_TEXT_SIZE;
+        char* new_data;
+
+        while (text->length + (size_t)length + 1 > new_size)
+            new_size *= 2;
+        new_data = text->data ? (char*)HeapReAlloc(GetProcessHeap(), 0, text->data, new_size)
+                              : (char*)HeapAlloc(GetProcessHeap(), 0, new_size);
+        if (!new_data)
+        {
+            text->failed = true;
+            return;
+        }
+        text->data = new_data;
+        text->size = new_size;
+    }
+
+    va_start(args, format);
+    vsnprintf(&text->data[text->length], (size_t)length + 1, format, args);
+    va_end(args);
+    text->length += (size_t)length;
+}
+
+/* Label values may not contain raw backslashes, quotes or line breaks. */
+static void metrics_append_label_value(metrics_text* const text, char const* value)
+{
+    for (; *value; ++value)
+    {
+        if (*value == '\\' || *value == '"')
+            metrics_append(text, "\\%c", *value);
+        else if (*value == '\n')
+            metrics_append(text, "\\n");
+        else
+            metrics_append(text, "%c", *value);
+    }
+}
+
+static void metrics_append_family(metrics_text* const text, char const* const name, char const* const type,
+                                  char const* const help)
+{
+    metrics_append(text, "# HELP winestreamproxy_%s %s\n# TYPE winestreamproxy_%s %s\n", name, help, name, type);
+}
+
+static void metrics_format_routes(proxy_data* const proxy, metrics_route_values const* const routes,
+                                  metrics_text* const text)
+{
+    unsigned int i, direction;
+
+    metrics_append_family(text, "route_info", "gauge", "Routes of the proxy, always 1.");
+    for (i = 0; i < proxy->route_count; ++i)
+    {
+        metrics_append(text, "winestreamproxy_route_info{route=\"%u\",socket=\"", i);
+        metrics_append_label_value(text, proxy->routes[i].paths.unix_socket_path);
+        metrics_append(text, "\",reverse=\"%s\"} 1\n", proxy->routes[i].paths.reverse ? "true" : "false");
+    }
+
+    metrics_append_family(text, "clients_accepted_total", "counter", "Clients that connected.");
+    for (i = 0; i < proxy->route_count; ++i)
+        metrics_append(text, "winestreamproxy_clients_accepted_total{route=\"%u\"} %lu\n", i,
+                       (unsigned long)InterlockedRead(&proxy->routes[i].accepted));
+
+    metrics_append_family(text, "connections_active", "gauge", "Connections that are forwarding data.");
+    for (i = 0; i < proxy->route_count; ++i)
+        metrics_append(text, "winestreamproxy_connections_active{route=\"%u\"} %lu\n", i, routes[i].active);
+
+    metrics_append_family(text, "connections_closed_total", "counter", "Connections that have been closed.");
+    for (i = 0; i < proxy->route_count; ++i)
+        metrics_append(text, "winestreamproxy_connections_closed_total{route=\"%u\"} %lu\n", i,
+                       (unsigned long)InterlockedRead(&proxy->routes[i].metrics.closed_count));
+
+    metrics_append_family(text, "connection_lifetime_seconds_sum", "counter", "Lifetime of the closed connections.");
+    for (i = 0; i < proxy->route_count; ++i)
+        metrics_append(text, "winestreamproxy_connection_lifetime_seconds_sum{route=\"%u\"} %.3f\n", i,
+                       (double)InterlockedRead64(&proxy->routes[i].metrics.lifetime_total_ms) / 1000.0);
+
+    metrics_append_family(text, "connection_lifetime_seconds_max", "gauge", "Longest lifetime of a closed connection.");
+    for (i = 0; i < proxy->route_count; ++i)
+        metrics_append(text, "winestreamproxy_connection_lifetime_seconds_max{route=\"%u\"} %.3f\n", i,
+                       (double)InterlockedRead(&proxy->routes[i].metrics.lifetime_max_ms) / 1000.0);
+
+    metrics_append_family(text, "messages_total", "counter", "Messages forwarded.");
+    for (i = 0; i < proxy->route_count; ++i)
+        for (direction = 0; direction < METRICS_DIRECTION_COUNT; ++direction)
+            metrics_append(text, "winestreamproxy_messages_total{route=\"%u\",direction=\"%s\"} %.0f\n", i,
+                           metrics_direction_names[direction], routes[i].totals.messages[direction]);
+
+    metrics_append_family(text, "bytes_total", "counter", "Bytes forwarded.");
+    for (i = 0; i < proxy->route_count; ++i)
+        for (direction = 0; direction < METRICS_DIRECTION_COUNT; ++direction)
+            metrics_append(text, "winestreamproxy_bytes_total{route=\"%u\",direction=\"%s\"} %.0f\n", i,
+                           metrics_direction_names[direction], routes[i].totals.bytes[direction]);
+
+    metrics_append_family(text, "reallocations_total", "counter", "Receive buffers that were resized.");
+    for (i = 0; i < proxy->route_count; ++i)
+        metrics_append(text, "winestreamproxy_reallocations_total{route=\"%u\"} %.0f\n", i,
+                       routes[i].totals.reallocations);
+
+    metrics_append_family(text, "more_data_total", "counter", "Messages that didn't fit into the receive buffer.");
+    for (i = 0; i < proxy->route_count; ++i)
+        metrics_append(text, "winestreamproxy_more_data_total{route=\"%u\"} %.0f\n", i, routes[i].totals.more_data);
+
+    metrics_append_family(text, "discarded_total", "counter", "Messages dropped instead of forwarded.");
+    for (i = 0; i < proxy->route_count; ++i)
+        metrics_append(text, "winestreamproxy_discarded_total{route=\"%u\"} %.0f\n", i, routes[i].totals.discarded);
+}
+
+/* One series per route of a LONG counter in proxy_route at the offset. */
+static void metrics_append_route_counter(proxy_data* const proxy, metrics_text* const text, char const* const name,
+                                         char const* const type, char const* const help, size_t const offset)
+{
+    unsigned int i;
+
+    metrics_append_family(text, name, type, help);
+    for (i = 0; i < proxy->route_count; ++i)
+        metrics_append(text, "winestreamproxy_%s{route=\"%u\"} %lu\n", name, i,
+                       (unsigned long)InterlockedRead((LONG volatile*)((char*)&proxy->routes[i] + offset)));
+}
+
+/* Counters that the routes keep next to the traffic of their connections. */
+static void metrics_format_route_stats(proxy_data* const proxy, metrics_text* const text)
+{
+    unsigned int i, opcode;
+
+    metrics_append_route_counter(proxy, text, "socket_pool_hits_total", "counter",
+                                 "Clients that got a pre-connected server socket.",
+                                 offsetof(proxy_route, socket_pool.hits));
+    metrics_append_route_counter(proxy, text, "socket_pool_misses_total", "counter",
+                                 "Clients that had to wait for a new server connection.",
+                                 offsetof(proxy_route, socket_pool.misses));
+    metrics_append_route_counter(proxy, text, "socket_pool_stale_total", "counter",
+                                 "Pooled sockets that the server closed before they were used.",
+                                 offsetof(proxy_route, socket_pool.stale));
+
+    metrics_append_route_counter(proxy, text, "first_message_latency_seconds_count", "counter",
+                                 "Clients that had a message forwarded.", offsetof(proxy_route, first_message_count));
+    metrics_append_family(text, "first_message_latency_seconds_sum", "counter",
+                          "Time from client connect to the first forwarded message.");
+    for (i = 0; i < proxy->route_count; ++i)
+        metrics_append(text, "winestreamproxy_first_message_latency_seconds_sum{route=\"%u\"} %.6f\n", i,
+                       (double)InterlockedRead64(&proxy->routes[i].first_message_total_us) / 1000000.0);
+    metrics_append_family(text, "first_message_latency_seconds_max", "gauge",
+                          "Longest time from client connect to the first forwarded message.");
+    for (i = 0; i < proxy->route_count; ++i)
+        metrics_append(text, "winestreamproxy_first_message_latency_seconds_max{route=\"%u\"} %.6f\n", i,
+                       (double)InterlockedRead(&proxy->routes[i].first_message_max_us) / 1000000.0);
+
+    metrics_append_route_counter(proxy, text, "server_connects_total", "counter",
+                                 "Connections to the server, without pooled sockets.", offsetof(proxy_route, connects));
+    metrics_append_family(text, "server_connect_seconds_sum", "counter", "Time taken to connect to the server.");
+    for (i = 0; i < proxy->route_count; ++i)
+        metrics_append(text, "winestreamproxy_server_connect_seconds_sum{route=\"%u\"} %.6f\n", i,
+                       (double)InterlockedRead64(&proxy->routes[i].connect_total_us) / 1000000.0);
+    metrics_append_family(text, "server_connect_seconds_max", "gauge", "Longest time taken to connect to the server.");
+    for (i = 0; i < proxy->route_count; ++i)
+        metrics_append(text, "winestreamproxy_server_connect_seconds_max{route=\"%u\"} %.6f\n", i,
+                       (double)InterlockedRead(&proxy->routes[i].connect_max_us) / 1000000.0);
+    metrics_append_route_counter(proxy, text, "server_connect_failures_total", "counter",
+                                 "Clients that were closed because connecting to the server failed.",
+                                 offsetof(proxy_route, connect_failures));
+    metrics_append_route_counter(proxy, text, "server_connect_timeouts_total", "counter",
+                                 "Clients that were closed because the server didn't accept in time.",
+                                 offsetof(proxy_route, connect_timeouts));
+
+    metrics_append_route_counter(proxy, text, "server_reconnects_total", "counter",
+                                 "Clients that were reconnected to a restarted server.",
+                                 offsetof(proxy_route, reconnects));
+    metrics_append_route_counter(proxy, text, "server_reconnect_failures_total", "counter",
+                                 "Clients whose server didn't come back in time.",
+                                 offsetof(proxy_route, reconnect_failures));
+
+    metrics_append_family(text, "frames_total", "counter", "Discord IPC frames forwarded.");
+    for (i = 0; i < proxy->route_count; ++i)
+        for (opcode = 0; opcode <= SOCKET_FRAME_OPCODE_COUNT; ++opcode)
+        {
+            metrics_append(text, "winestreamproxy_frames_total{route=\"%u\",source=\"socket\",opcode=\"%s\"} %lu\n",
+                           i, metrics_opcode_names[opcode],
+                           (unsigned long)InterlockedRead(&proxy->routes[i].frames_from_socket[opcode]));
+            metrics_append(text, "winestreamproxy_frames_total{route=\"%u\",source=\"pipe\",opcode=\"%s\"} %lu\n",
+                           i, metrics_opcode_names[opcode],
+                           (unsigned long)InterlockedRead(&proxy->routes[i].frames_from_pipe[opcode]));
+        }
+
+    metrics_append_route_counter(proxy, text, "activities_forwarded_total", "counter",
+                                 "Rich presence updates sent to the server.",
+                                 offsetof(proxy_route, activities_forwarded));
+    metrics_append_route_counter(proxy, text, "activities_coalesced_total", "counter",
+                                 "Rich presence updates dropped for a newer one.",
+                                 offsetof(proxy_route, activities_coalesced));
+
+    metrics_append_family(text, "buffer_grows_total", "counter", "Receive buffers enlarged for a bigger message.");
+    for (i = 0; i < proxy->route_count; ++i)
+    {
+        metrics_append(text, "winestreamproxy_buffer_grows_total{route=\"%u\",buffer=\"pipe_read\"} %lu\n", i,
+                       (unsigned long)InterlockedRead(&proxy->routes[i].pipe_buffers.grows));
+        metrics_append(text, "winestreamproxy_buffer_grows_total{route=\"%u\",buffer=\"socket_receive\"} %lu\n", i,
+                       (unsigned long)InterlockedRead(&proxy->routes[i].socket_buffers.grows));
+    }
+    metrics_append_family(text, "buffer_shrinks_total", "counter", "Receive buffers made smaller again.");
+    for (i = 0; i < proxy->route_count; ++i)
+    {
+        metrics_append(text, "winestreamproxy_buffer_shrinks_total{route=\"%u\",buffer=\"pipe_read\"} %lu\n", i,
+                       (unsigned long)InterlockedRead(&proxy->routes[i].pipe_buffers.shrinks));
+        metrics_append(text, "winestreamproxy_buffer_shrinks_total{route=\"%u\",buffer=\"socket_receive\"} %lu\n", i,
+                       (unsigned long)InterlockedRead(&proxy->routes[i].socket_buffers.shrinks));
+    }
+    metrics_append_family(text, "buffer_peak_bytes", "gauge", "Largest receive buffer of any connection.");
+    for (i = 0; i < proxy->route_count; ++i)
+    {
+        metrics_append(text, "winestreamproxy_buffer_peak_bytes{route=\"%u\",buffer=\"pipe_read\"} %lu\n", i,
+                       (unsigned long)InterlockedRead(&proxy->routes[i].pipe_buffers.peak_size));
+        metrics_append(text, "winestreamproxy_buffer_peak_bytes{route=\"%u\",buffer=\"socket_receive\"} %lu\n", i,
+                       (unsigned long)InterlockedRead(&proxy->routes[i].socket_buffers.peak_size));
+    }
+}
+
+static void metrics_format_connections(metrics_connection_values const* const conns, unsigned int const count,
+                                       metrics_text* const text)
+{
+    unsigned int i, direction;
+
+    metrics_append_family(text, "connection_age_seconds", "gauge", "Time since the connection started.");
+    for (i = 0; i < count; ++i)
+        metrics_append(text, "winestreamproxy_connection_age_seconds{route=\"%u\",connection=\"%lu\"} %.3f\n",
+                       conns[i].route, conns[i].id, conns[i].age_seconds);
+
+    metrics_append_family(text, "connection_messages_total", "counter", "Messages forwarded by the connection.");
+    for (i = 0; i < count; ++i)
+        for (direction = 0; direction < METRICS_DIRECTION_COUNT; ++direction)
+            metrics_append(text,
+                           "winestreamproxy_connection_messages_total{route=\"%u\",connection=\"%lu\",direction=\"%s\"}"
+                           " %.0f\n",
+                           conns[i].route, conns[i].id, metrics_direction_names[direction],
+                           conns[i].values.messages[direction]);
+
+    metrics_append_family(text, "connection_bytes_total", "counter", "Bytes forwarded by the connection.");
+    for (i = 0; i < count; ++i)
+        for (direction = 0; direction < METRICS_DIRECTION_COUNT; ++direction)
+            metrics_append(text,
+                           "winestreamproxy_connection_bytes_total{route=\"%u\",connection=\"%lu\",direction=\"%s\"}"
+                           " %.0f\n",
+                           conns[i].route, conns[i].id, metrics_direction_names[direction],
+                           conns[i].values.bytes[direction]);
+}
+
+/* Returns the text to be freed with HeapFree, or null if it couldn't be allocated. */
+static char* metrics_format(proxy_data* const proxy, size_t* const out_length)
+{
+    metrics_route_values* routes;
+    metrics_connection_values* conns;
+    connection_list_entry* entry;
+    metrics_text text;
+    unsigned int i, conn_count, conn_capacity;
+    LARGE_INTEGER now;
+
+    routes = (metrics_route_values*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+                                              sizeof(metrics_route_values) * proxy->route_count);
+    if (!routes)
+        return 0;
+
+    connection_list_lock(&proxy->conn_list);
+
+    conn_capacity = connection_list_count(&proxy->conn_list);
+    conns = (metrics_connection_values*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+                                                  sizeof(metrics_connection_values) * (conn_capacity + 1));
+    if (!conns)
+    {
+        connection_list_unlock(&proxy->conn_list);
+        HeapFree(GetProcessHeap(), 0, routes);
+        return 0;
+    }
+
+    QueryPerformanceCounter(&now);
+    for (i = 0; i < proxy->route_count; ++i)
+        metrics_read_counters(&proxy->routes[i].metrics.closed, &routes[i].totals);
+    conn_count = 0;
+    for (entry = connection_list_start(&proxy->conn_list); entry && conn_count < conn_capacity;
+         entry = connection_list_next(entry))
+    {
+        connection_data* const conn = &entry->connection;
+        metrics_connection_values* const values = &conns[conn_count];
+        LONG const id = InterlockedRead(&conn->metrics.id);
+
+        if (!id)
+            continue;
+
+        values->route = (unsigned int)(conn->route - proxy->routes);
+        values->id = (unsigned long)id;
+        values->age_seconds = (double)(now.QuadPart - conn->metrics.started_at.QuadPart) /
+                              (double)proxy->counter_frequency.QuadPart;
+        metrics_read_counters(&conn->metrics.counters, &values->values);
+        metrics_read_counters(&conn->metrics.counters, &routes[values->route].totals);
+        ++routes[values->route].active;
+        ++conn_count;
+    }
+
+    connection_list_unlock(&proxy->conn_list);
+
+    text.data = 0;
+    text.length = 0;
+    text.size = 0;
+    text.failed = false;
+    metrics_format_routes(proxy, routes, &text);
+    metrics_format_route_stats(proxy, &text);
+    metrics_format_connections(conns, conn_count, &text);
+
+    HeapFree(GetProcessHeap(), 0, conns);
+    HeapFree(GetProcessHeap(), 0, routes);
+
+    if (text.failed)
+    {
+        if (text.data)
+            HeapFree(GetProcessHeap(), 0, text.data);
+        return 0;
+    }
+    *out_length = text.length;
+    return text.data;
+}
+
+bool metrics_listen(proxy_data* const proxy, char const* const unix_socket_path)
+{
+    logger_instance* const logger = proxy->logger;
+    connection_data* conn;
+
+    if (!connection_list_allocate_entry(logger, &proxy->conn_list, &conn))
+        return false;
+
+    /* The listener has no route, the connection only carries the listening socket. */
+    connection_initialize(proxy, conn);
+    conn->route = 0;
+
+    if (!socket_listen(logger, unix_socket_path, &conn->socket))
+    {
+        connection_close(conn);
+        return false;
+    }
+    conn->socket.readable_op.type = IO_OPERATION_TYPE_METRICS_ACCEPT;
+
+    /* The watch holds a reference until the socket watcher has dropped it. */
+    connection_acquire(conn);
+    if (!io_engine_watch(logger, &proxy->engine, &conn->socket.watch, conn->socket.fd, REACTOR_EVENT_READABLE))
+    {
+        connection_release(conn);
+        connection_close(conn);
+        return false;
+    }
+
+    LOG_INFO(logger, (_T("Serving metrics on the stats socket")));
+
+    return true;
+}
+
+/* Keeps the rest of the text for a client whose socket is full, and sends it once the client has read the rest. The
+   fd is owned by the new connection afterwards. */
+static void metrics_serve_later(proxy_data* const proxy, int const fd, char const* const text, size_t const length)
+{
+    logger_instance* const logger = proxy->logger;
+    connection_data* conn;
+
+    /* Connections that are added after the proxy has started stopping would never be closed. */
+    EnterCriticalSection(&proxy->listen_lock);
+    if (!proxy->accepting || !connection_list_allocate_entry(logger, &proxy->conn_list, &conn))
+    {
+        LeaveCriticalSection(&proxy->listen_lock);
+        socket_close_handle_fd(fd);
+        return;
+    }
+    connection_initialize(proxy, conn);
+    conn->route = 0;
+    LeaveCriticalSection(&proxy->listen_lock);
+
+    conn->socket.fd = fd;
+    conn->socket.writable_op.type = IO_OPERATION_TYPE_METRICS_WRITABLE;
+    conn->metrics.text = (char*)HeapAlloc(GetProcessHeap(), 0, length);
+    if (!conn->metrics.text)
+    {
+        LOG_ERROR(logger, (_T("Failed to allocate %lu bytes"), (unsigned long)length));
+        connection_close(conn);
+        return;
+    }
+    RtlCopyMemory(conn->metrics.text, text, length);
+    conn->metrics.text_length = length;
+    conn->metrics.text_sent = 0;
+
+    /* The watch holds a reference until the socket watcher has dropped it. */
+    connection_acquire(conn);
+    if (!io_engine_watch(logger, &proxy->engine, &conn->socket.watch, fd, REACTOR_EVENT_WRITABLE))
+    {
+        connection_release(conn);
+        connection_close(conn);
+    }
+}
+
+void metrics_acceptable(connection_data* const listener)
+{
+    proxy_data* const proxy = listener->proxy;
+    char* text;
+    size_t length, written;
+    unsigned int i;
+
+    if (InterlockedRead(&listener->closing))
+        return;
+
+    text = 0;
+    length = 0;
+    for (i = 0; i < METRICS_ACCEPT_BATCH_SIZE; ++i)
+    {
+        int fd;
+
+        if (!socket_accept(proxy->logger, &listener->socket, &fd))
+        {
+            LOG_ERROR(proxy->logger, (_T("Stats socket stopped accepting clients")));
+            connection_close(listener);
+            break;
+        }
+        if (fd == -1)
+            break;
+
+        /* Clients that come in together get the same snapshot. */
+        if (!text)
+            text = metrics_format(proxy, &length);
+        if (!text)
+            LOG_ERROR(proxy->logger, (_T("Could not format metrics")));
+        else if (socket_send_nonblocking(proxy->logger, fd, (unsigned char const*)text, length, &written) &&
+                 written < length)
+        {
+            metrics_serve_later(proxy, fd, text + written, length - written);
+            continue;
+        }
+        socket_close_handle_fd(fd);
+    }
+
+    if (text)
+        HeapFree(GetProcessHeap(), 0, text);
+    if (!InterlockedRead(&listener->closing))
+        io_engine_arm(proxy->logger, &proxy->engine, &listener->socket.watch, REACTOR_EVENT_READABLE);
+}
+
+void metrics_writable(connection_data* const conn)
+{
+    metrics_connection* const metrics = &conn->metrics;
+    size_t written;
+
+    if (InterlockedRead(&conn->closing))
+        return;
+
+    if (!socket_send_nonblocking(conn->proxy->logger, conn->socket.fd,
+                                 (unsigned char const*)&metrics->text[metrics->text_sent],
+                                 metrics->text_length - metrics->text_sent, &written))
+    {
+        connection_close(conn);
+        return;
+    }
+
+    metrics->text_sent += written;
+    if (metrics->text_sent < metrics->text_length)
+    {
+        io_engine_arm(conn->proxy->logger, &conn->proxy->engine, &conn->socket.watch, REACTOR_EVENT_WRITABLE);
+        return;
+    }
+
+    /* Closing the socket tells the client that the text is complete. */
+    connection_close(conn);
+}
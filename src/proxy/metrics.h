@@ -0,0 +1,49 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#pragma once
+#ifndef __WINESTREAMPROXY_PROXY_METRICS_H__
+#define __WINESTREAMPROXY_PROXY_METRICS_H__
+
+#include "data/connection_data.h"
+#include "data/metrics_data.h"
+#include "../bool.h"
+#include <winestreamproxy/logger.h>
+#include <winestreamproxy/winestreamproxy.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+extern void metrics_reset(metrics_connection* metrics);
+/* Gives the connection an id and starts measuring its lifetime. */
+extern void metrics_connection_started(connection_data* conn);
+/* Adds the counters of a connection that is being cleaned up to its route, or frees the unsent text of a stats
+   client. */
+extern void metrics_connection_finished(connection_data* conn);
+
+extern void metrics_count_message(connection_data* conn, METRICS_DIRECTION direction, size_t bytes);
+extern void metrics_count_reallocation(connection_data* conn);
+extern void metrics_count_more_data(connection_data* conn);
+extern void metrics_count_discarded(connection_data* conn, unsigned int messages);
+
+/* Serves the counters in the Prometheus text format to every client of the Unix socket. */
+extern bool metrics_listen(proxy_data* proxy, char const* unix_socket_path);
+extern void metrics_acceptable(connection_data* listener);
+/* Continues sending the text to a stats client that didn't take all of it at once. */
+extern void metrics_writable(connection_data* conn);
+
+#ifdef __cplusplus
+}
+#endif /* defined(__cplusplus) */
+
+#endif /* !defined(__WINESTREAMPROXY_PROXY_METRICS_H__) */
@@ -8,12 +8,15 @@
  *   E-Mail address: openglfreak@googlemail.com
  *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
 
+#include "activity.h"
+#include "buffer_pool.h"
+#include "buffer_sizer.h"
 #include "connection.h"
-#include "connection_list.h"
+#include "io_engine.h"
+#include "metrics.h"
 #include "misc.h"
 #include "pipe.h"
 #include "socket.h"
-#include "thread.h"
 #include <winestreamproxy/logger.h>
 
 #include <stddef.h>
@@ -25,15 +28,20 @@
 
 #define InterlockedRead(x) InterlockedCompareExchange((x), 0, 0)
 
-#define STARTING_BUFFER_SIZE 1024
+#define DEFAULT_WRITE_QUEUE_DEPTH 8
+#define MAX_WRITE_QUEUE_DEPTH 1024
+#define PIPE_BUSY_ATTEMPTS 3
+#define PIPE_BUSY_TIMEOUT 1000
 
-bool pipe_create_server(logger_instance* const logger, pipe_data* const pipe, TCHAR const* const pipe_path)
+bool pipe_create_server(logger_instance* const logger, pipe_data* const pipe, TCHAR const* const pipe_path,
+                        bool const message_mode, DWORD const buffer_size)
 {
+    DWORD const mode = message_mode ? PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE : PIPE_TYPE_BYTE | PIPE_READMODE_BYTE;
+
     LOG_TRACE(logger, (_T("Creating named pipe server %s"), pipe_path));
 
-    pipe->handle = CreateNamedPipe(pipe_path, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
-                                   PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
-                                   PIPE_UNLIMITED_INSTANCES, STARTING_BUFFER_SIZE, STARTING_BUFFER_SIZE, 0, NULL);
+    pipe->handle = CreateNamedPipe(pipe_path, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED, mode | PIPE_WAIT,
+                                   PIPE_UNLIMITED_INSTANCES, buffer_size, buffer_size, 0, NULL);
     if (pipe->handle == INVALID_HANDLE_VALUE)
     {
         LOG_CRITICAL(logger, (_T("Could not create named pipe %s: Error %d"), pipe_path, GetLastError()));
@@ -45,328 +53,511 @@ bool pipe_create_server(logger_instance* const logger, pipe_data* const pipe, TC
     return true;
 }
 
-bool pipe_server_start_accept(logger_instance* const logger, pipe_data* const pipe, bool* const out_is_async,
-                              OVERLAPPED* const inout_accept_overlapped)
+bool pipe_open_client(logger_instance* const logger, pipe_data* const pipe, TCHAR const* const pipe_path,
+                      bool const message_mode)
+{
+    DWORD mode, last_error;
+    unsigned int attempt;
+
+    LOG_TRACE(logger, (_T("Opening named pipe %s"), pipe_path));
+
+    for (attempt = 0; ; ++attempt)
+    {
+        pipe->handle = CreateFile(pipe_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                                  FILE_FLAG_OVERLAPPED, NULL);
+        if (pipe->handle != INVALID_HANDLE_VALUE)
+            break;
+
+        /* All instances are busy. This blocks the I/O worker, but the engine starts another one if needed. */
+        last_error = GetLastError();
+        if (last_error != ERROR_PIPE_BUSY || attempt == PIPE_BUSY_ATTEMPTS ||
+            !WaitNamedPipe(pipe_path, PIPE_BUSY_TIMEOUT))
+        {
+            LOG_ERROR(logger, (_T("Could not open named pipe %s: Error %d"), pipe_path, last_error));
+            return false;
+        }
+    }
+    pipe->client = true;
+
+    /* Byte mode pipes refuse message reads, they are read like a stream then. */
+    mode = PIPE_READMODE_MESSAGE;
+    if (!message_mode || !SetNamedPipeHandleState(pipe->handle, &mode, NULL, NULL))
+        LOG_DEBUG(logger, (_T("Reading pipe in byte mode")));
+
+    LOG_TRACE(logger, (_T("Opened named pipe")));
+
+    return true;
+}
+
+bool pipe_start_accept(logger_instance* const logger, connection_data* const conn)
 {
+    pipe_data* const pipe = &conn->pipe;
     DWORD last_error;
 
     LOG_TRACE(logger, (_T("Starting asynchronous wait for pipe client connection")));
 
-    if (ConnectNamedPipe(pipe->handle, inout_accept_overlapped) != 0 ||
-        (last_error = GetLastError()) == ERROR_PIPE_CONNECTED)
+    /* The reference is released once the completion packet has been handled. */
+    connection_acquire(conn);
+    RtlZeroMemory(&pipe->connect_op.overlapped, sizeof(pipe->connect_op.overlapped));
+    pipe->connect_op.type = IO_OPERATION_TYPE_PIPE_CONNECT;
+    if (ConnectNamedPipe(pipe->handle, &pipe->connect_op.overlapped) != 0 ||
+        (last_error = GetLastError()) == ERROR_IO_PENDING)
     {
-        LOG_TRACE(logger, (_T("Pipe connection finished synchronously")));
-        *out_is_async = false;
+        LOG_TRACE(logger, (_T("Continuing waiting for pipe connection asynchronously")));
         return true;
     }
-    else if (last_error == ERROR_IO_PENDING)
+    else if (last_error == ERROR_PIPE_CONNECTED)
     {
-        LOG_TRACE(logger, (_T("Continuing waiting for pipe connection asynchronously")));
-        *out_is_async = true;
-        return true;
+        /* The client connected before ConnectNamedPipe was called, no completion packet is queued for that. */
+        LOG_TRACE(logger, (_T("Pipe connection finished synchronously")));
+        if (io_engine_post(logger, &conn->proxy->engine, (ULONG_PTR)conn, &pipe->connect_op))
+            return true;
+        connection_release(conn);
+        return false;
     }
 
     LOG_CRITICAL(logger, (_T("Error %d while waiting for connection"), last_error));
+    connection_release(conn);
 
     return false;
 }
 
-bool pipe_prepare(logger_instance* const logger, pipe_data* const pipe)
+static void pipe_configure_write_queue(pipe_data* const pipe, proxy_tuning const* const tuning)
 {
+    unsigned int depth, high, low;
+
+    depth = tuning->pipe_write_queue_depth ? tuning->pipe_write_queue_depth : DEFAULT_WRITE_QUEUE_DEPTH;
+    if (depth > MAX_WRITE_QUEUE_DEPTH)
+        depth = MAX_WRITE_QUEUE_DEPTH;
+
+    high = tuning->pipe_write_high_watermark;
+    if (!high || high > depth)
+        high = depth;
+
+    low = tuning->pipe_write_low_watermark ? tuning->pipe_write_low_watermark : depth / 4;
+    if (low >= high)
+        low = high - 1;
+
+    pipe->write_queue_depth = depth;
+    pipe->write_high_watermark = high;
+    pipe->write_low_watermark = low;
+}
+
+bool pipe_prepare(logger_instance* const logger, pipe_data* const pipe, proxy_tuning const* const tuning,
+                  size_t const read_buffer_size)
+{
+    unsigned int i;
+
     LOG_TRACE(logger, (_T("Preparing pipe data")));
 
-    pipe->read_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-    if (!pipe->read_overlapped.hEvent)
-    {
-        LOG_CRITICAL(logger, (_T("Could not create a pipe read overlapped event: Error %d"), GetLastError()));
+    pipe->read_op.type = IO_OPERATION_TYPE_PIPE_READ;
+    pipe->readable_op.type = IO_OPERATION_TYPE_PIPE_READABLE;
+    pipe->writable_op.type = IO_OPERATION_TYPE_PIPE_WRITABLE;
+
+    pipe->read_buffer = buffer_pool_alloc(logger, read_buffer_size, &pipe->read_buffer_size);
+    if (!pipe->read_buffer)
         return false;
-    }
+    pipe->read_length = 0;
+    pipe->read_shrinking = FALSE;
 
-    pipe->write_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-    if (!pipe->write_overlapped.hEvent)
+    pipe_configure_write_queue(pipe, tuning);
+    pipe->writes = (pipe_write*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+                                          sizeof(pipe_write) * pipe->write_queue_depth);
+    if (!pipe->writes)
     {
-        LOG_CRITICAL(logger, (_T("Could not create a pipe write overlapped event: Error %d"), GetLastError()));
-        CloseHandle(pipe->write_overlapped.hEvent);
+        LOG_CRITICAL(logger, (
+            _T("Failed to allocate %lu bytes"),
+            (unsigned long)(sizeof(pipe_write) * pipe->write_queue_depth)
+        ));
         return false;
     }
+    for (i = 0; i < pipe->write_queue_depth; ++i)
+        pipe->writes[i].op.type = IO_OPERATION_TYPE_PIPE_WRITE;
+    InitializeCriticalSection(&pipe->write_lock);
+    pipe->write_head = 0;
+    pipe->write_count = 0;
+    pipe->write_peak = 0;
+    pipe->reader_paused = false;
 
     LOG_TRACE(logger, (_T("Prepared pipe data")));
 
     return true;
 }
 
-bool pipe_server_wait_accept(logger_instance* const logger, pipe_data* const pipe, HANDLE const exit_event,
-                             OVERLAPPED* const inout_accept_overlapped)
+bool pipe_close_server(logger_instance* const logger, pipe_data* const pipe)
 {
-    HANDLE wait_handles[2];
-    DWORD wait_result;
-
-    (void)pipe;
-
-    LOG_TRACE(logger, (_T("Waiting for asynchronous pipe connection to finish")));
+    LOG_TRACE(logger, (_T("Closing pipe server")));
 
-    wait_handles[0] = inout_accept_overlapped->hEvent;
-    wait_handles[1] = exit_event;
+    if (pipe->handle != INVALID_HANDLE_VALUE)
+    {
+        FlushFileBuffers(pipe->handle);
+        if (!pipe->client)
+            DisconnectNamedPipe(pipe->handle);
+        CloseHandle(pipe->handle);
+        pipe->handle = INVALID_HANDLE_VALUE;
+    }
+    if (pipe->read_buffer)
+    {
+        buffer_pool_free(pipe->read_buffer);
+        pipe->read_buffer = 0;
+    }
+    if (pipe->writes)
+    {
+        unsigned int i;
 
-    do {
-        wait_result = \
-            WaitForMultipleObjects(sizeof(wait_handles) / sizeof(wait_handles[0]), wait_handles, FALSE, INFINITE);
-    } while (wait_result == WAIT_TIMEOUT);
+        LOG_DEBUG(logger, (
+            _T("Pipe write queue peaked at %u of %u writes"),
+            pipe->write_peak,
+            pipe->write_queue_depth
+        ));
 
-    switch (wait_result)
+        for (i = 0; i < pipe->write_queue_depth; ++i)
+            if (pipe->writes[i].buffer)
+                buffer_pool_free(pipe->writes[i].buffer);
+        DeleteCriticalSection(&pipe->write_lock);
+        HeapFree(GetProcessHeap(), 0, pipe->writes);
+        pipe->writes = 0;
+    }
+    if (pipe->splice)
     {
-        case WAIT_OBJECT_0:
-            LOG_INFO(logger, (_T("Pipe client connected")));
-            return true;
-        case WAIT_OBJECT_0 + 1:
-            LOG_TRACE(logger, (_T("Received exit signal")));
-            break;
-        case WAIT_FAILED:
-            LOG_ERROR(logger, (_T("WaitForMultipleObjects failed: Error %d"), GetLastError()));
-            break;
-        default:
-            LOG_ERROR(logger, (_T("Unexpected WaitForMultipleObjects return value: %d"), wait_result));
+        socket_splice_close(pipe->splice);
+        pipe->splice = 0;
+    }
+    if (pipe->fd != -1)
+    {
+        socket_close_handle_fd(pipe->fd);
+        pipe->fd = -1;
     }
 
-    return false;
+    LOG_TRACE(logger, (_T("Closed pipe server")));
+
+    return true;
 }
 
-bool pipe_close_server(logger_instance* const logger, pipe_data* const pipe)
+bool pipe_enable_splice(logger_instance* const logger, connection_data* const conn)
 {
-    LOG_TRACE(logger, (_T("Closing pipe server")));
+    pipe_data* const pipe = &conn->pipe;
+    bool message_mode;
 
-    if (pipe->read_is_overlapped)
-        CancelIoEx(pipe->handle, &pipe->read_overlapped);
-    CloseHandle(pipe->read_overlapped.hEvent);
-    if (pipe->write_is_overlapped)
-        CancelIoEx(pipe->handle, &pipe->write_overlapped);
-    CloseHandle(pipe->write_overlapped.hEvent);
-    FlushFileBuffers(pipe->handle);
-    DisconnectNamedPipe(pipe->handle);
-    CloseHandle(pipe->handle);
+    if (!socket_get_handle_fd(logger, pipe->handle, &pipe->fd, &message_mode))
+    {
+        LOG_DEBUG(logger, (_T("Pipe has no host fd, not splicing")));
+        pipe->fd = -1;
+        return false;
+    }
 
-    LOG_TRACE(logger, (_T("Closed pipe server")));
+    /* A stream host fd doesn't tell where the messages of a message mode route end, so only ReadFile keeps them
+       intact then. */
+    if (conn->route->pipe_message_mode && !message_mode)
+    {
+        LOG_DEBUG(logger, (_T("Host fd of message mode pipe has no message boundaries, not splicing")));
+        socket_close_handle_fd(pipe->fd);
+        pipe->fd = -1;
+        return false;
+    }
+
+    /* Splicing would merge or split messages, so message mode pipes get one write per message instead. */
+    if (!socket_splice_open(logger, pipe->fd, conn->socket.fd, message_mode, &pipe->splice))
+        pipe->splice = 0;
+    else if (!socket_splice_open(logger, conn->socket.fd, pipe->fd, message_mode, &conn->socket.splice))
+    {
+        socket_splice_close(pipe->splice);
+        pipe->splice = 0;
+        conn->socket.splice = 0;
+    }
+
+    if (!pipe->splice)
+    {
+        socket_close_handle_fd(pipe->fd);
+        pipe->fd = -1;
+        return false;
+    }
+
+    LOG_DEBUG(logger, (_T("Splicing pipe data (%s mode)"), message_mode ? _T("message") : _T("byte")));
 
     return true;
 }
 
-void pipe_cleanup(logger_instance* const logger, connection_data* const conn)
+void pipe_readable(logger_instance* const logger, connection_data* const conn)
 {
-    LOG_TRACE(logger, (_T("Cleaning up after pipe thread")));
+    size_t transferred;
+    bool closed, blocked;
+
+    if (InterlockedRead(&conn->closing))
+        return;
 
-    if (InterlockedIncrement(&conn->do_cleanup) >= 2)
+    if (!socket_splice_transfer(logger, conn->pipe.splice, &closed, &blocked, &transferred))
     {
-        LOG_DEBUG(logger, (_T("Socket thread exited, closing pipe")));
-        socket_disconnect(logger, &conn->socket);
-        pipe_close_server(logger, &conn->pipe);
-        connection_list_deallocate_entry(logger, &conn->proxy->conn_list, conn);
+        connection_close(conn);
+        return;
     }
-    else
+    if (closed)
+    {
+        LOG_INFO(logger, (_T("Pipe client closed connection")));
+        connection_close(conn);
+        return;
+    }
+
+    if (transferred)
     {
-        LOG_DEBUG(logger, (_T("Socket thread is still running, not closing pipe")));
-        thread_dispose(logger, &socket_thread_description, &conn->socket.thread);
+        LOG_DEBUG(logger, (_T("Spliced %lu bytes from pipe to socket"), (unsigned long)transferred));
+        connection_count_message(conn, METRICS_DIRECTION_PIPE_TO_SOCKET, transferred);
     }
 
-    LOG_TRACE(logger, (_T("Cleaned up after pipe thread")));
+    /* The pipe isn't read again until the socket has taken the rest, socket_writable continues then. */
+    if (blocked)
+        io_engine_arm(logger, &conn->proxy->engine, &conn->socket.watch, REACTOR_EVENT_WRITABLE);
+    else
+        io_engine_arm(logger, &conn->proxy->engine, &conn->pipe.watch, REACTOR_EVENT_READABLE);
 }
 
-bool pipe_stop_thread(logger_instance* const logger, pipe_data* const pipe)
+void pipe_writable(logger_instance* const logger, connection_data* const conn)
 {
-    bool ret = true;
+    /* Only armed while spliced socket data waits for room in the pipe. */
+    socket_readable(logger, conn);
+}
 
-    LOG_TRACE(logger, (_T("Stopping pipe thread")));
+bool pipe_start_read(logger_instance* const logger, connection_data* const conn)
+{
+    pipe_data* const pipe = &conn->pipe;
+    size_t const remaining = pipe->read_buffer_size - pipe->read_length;
+    DWORD last_error;
+
+    LOG_TRACE(logger, (_T("Starting asynchronous read from pipe")));
+
+    if ((DWORD)remaining != remaining)
+    {
+        LOG_ERROR(logger, (_T("Pipe read buffer too big: %lu bytes"), (unsigned long)remaining));
+        return false;
+    }
 
-    if (!SetEvent(pipe->thread.trigger_event))
-        ret = false;
-    if (!thread_wait(logger, &pipe_thread_description, &pipe->thread))
-        ret = false;
+    /* The reference is released once the completion packet has been handled. Completion
+       packets are also queued for reads that finish synchronously. */
+    connection_acquire(conn);
+    RtlZeroMemory(&pipe->read_op.overlapped, sizeof(pipe->read_op.overlapped));
+    if (!ReadFile(pipe->handle, &pipe->read_buffer[pipe->read_length], (DWORD)remaining, NULL,
+                  &pipe->read_op.overlapped) &&
+        (last_error = GetLastError()) != ERROR_IO_PENDING && last_error != ERROR_MORE_DATA)
+    {
+        if (last_error == ERROR_BROKEN_PIPE)
+            LOG_INFO(logger, (_T("Pipe client closed connection")));
+        else
+            LOG_ERROR(logger, (_T("Reading from pipe failed: Error %d"), last_error));
+        connection_release(conn);
+        return false;
+    }
 
-    LOG_TRACE(logger, (_T("Stopped pipe thread")));
+    /* The connection may have been closed after the check in the completion handler, in which case
+       the cancellation could have happened before the read was issued. */
+    if (InterlockedRead(&conn->closing))
+        CancelIoEx(pipe->handle, &pipe->read_op.overlapped);
 
-    return ret;
+    return true;
 }
 
-typedef enum PIPE_RECV_MSG_RET {
-    PIPE_RECV_MSG_RET_SUCCESS,
-    PIPE_RECV_MSG_RET_FAILURE,
-    PIPE_RECV_MSG_RET_SHUTDOWN,
-    PIPE_RECV_MSG_RET_EXIT
-} PIPE_RECV_MSG_RET;
+/* The buffer has to be empty, so that nothing needs to be copied. */
+static void pipe_resize_read_buffer(logger_instance* const logger, connection_data* const conn, size_t new_size)
+{
+    pipe_data* const pipe = &conn->pipe;
+    unsigned char* new_buffer;
+
+    if (new_size == pipe->read_buffer_size)
+        return;
+
+    new_buffer = buffer_pool_alloc(logger, new_size, &new_size);
+    if (!new_buffer)
+        return;
+
+    LOG_DEBUG(logger, (
+        _T("Resizing pipe read buffer from %lu to %lu bytes"),
+        (unsigned long)pipe->read_buffer_size,
+        (unsigned long)new_size
+    ));
+    buffer_pool_free(pipe->read_buffer);
+    pipe->read_buffer = new_buffer;
+    pipe->read_buffer_size = new_size;
+    metrics_count_reallocation(conn);
+}
 
-static PIPE_RECV_MSG_RET pipe_receive_message(logger_instance* const logger, pipe_data* const pipe,
-                                         unsigned char** const inout_buffer, size_t* const inout_buffer_size,
-                                         size_t* const out_message_length)
+void pipe_shrink_idle_buffer(logger_instance* const logger, connection_data* const conn)
 {
-    HANDLE wait_handles[2];
-    size_t message_length;
-    DWORD bytes_read;
+    pipe_data* const pipe = &conn->pipe;
 
-    LOG_TRACE(logger, (_T("Waiting for and reading message from pipe")));
+    if (pipe->splice || !buffer_sizer_idle(&pipe->read_sizer))
+        return;
 
-    if (!*inout_buffer)
-    {
-        *inout_buffer_size = STARTING_BUFFER_SIZE;
-        *inout_buffer = (unsigned char*)HeapAlloc(GetProcessHeap(), 0, sizeof(unsigned char) * STARTING_BUFFER_SIZE);
-        if (!*inout_buffer)
-        {
-            LOG_ERROR(logger, (
-                _T("Failed to allocate %lu bytes"),
-                (unsigned long)(sizeof(unsigned char) * STARTING_BUFFER_SIZE)
-            ));
-            return PIPE_RECV_MSG_RET_FAILURE;
-        }
-    }
+    /* pipe_read_completed puts the smaller buffer in place once the read has been cancelled. If there is no read
+       pending, because the reader is paused or its completion is queued already, the buffer is left alone. */
+    LOG_TRACE(logger, (_T("Cancelling idle pipe read")));
+    InterlockedExchange(&pipe->read_shrinking, TRUE);
+    if (!CancelIoEx(pipe->handle, &pipe->read_op.overlapped))
+        InterlockedExchange(&pipe->read_shrinking, FALSE);
+}
 
-    wait_handles[0] = pipe->read_overlapped.hEvent;
-    wait_handles[1] = pipe->thread.trigger_event;
+void pipe_read_completed(logger_instance* const logger, connection_data* const conn, DWORD const error,
+                         DWORD const bytes_read)
+{
+    pipe_data* const pipe = &conn->pipe;
+    SOCKET_SEND_RET send_ret;
+    size_t message_length, next_buffer_size;
 
-    message_length = 0;
-    pipe->read_is_overlapped = false;
+    pipe->read_length += bytes_read;
 
-    while (true)
+    switch (error)
     {
-        BOOL success;
-        DWORD last_error;
-
-        bytes_read = 0;
-        if (pipe->read_is_overlapped)
-        {
-            success = GetOverlappedResult(pipe->handle, &pipe->read_overlapped, &bytes_read, FALSE);
-            pipe->read_is_overlapped = false;
-        }
-        else
-        {
-            success = ReadFile(pipe->handle, &(*inout_buffer)[message_length], *inout_buffer_size - message_length,
-                               &bytes_read, &pipe->read_overlapped);
-        }
-        message_length += bytes_read;
-        if (success)
-        {
-            *out_message_length = message_length;
+        case ERROR_SUCCESS:
             break;
-        }
+        case ERROR_OPERATION_ABORTED:
+            if (!InterlockedExchange(&pipe->read_shrinking, FALSE) || InterlockedRead(&conn->closing))
+            {
+                LOG_TRACE(logger, (_T("Pipe read cancelled")));
+                return;
+            }
 
-        switch (last_error = GetLastError())
+            /* Cancelled by the idle check. A partially read message keeps the buffer it is in. */
+            if (!pipe->read_length)
+                pipe_resize_read_buffer(logger, conn,
+                                        buffer_sizer_shrink_idle(&pipe->read_sizer, pipe->read_buffer_size));
+            if (!pipe_start_read(logger, conn))
+                connection_close(conn);
+            return;
+        case ERROR_BROKEN_PIPE:
+            LOG_INFO(logger, (_T("Pipe client closed connection")));
+            connection_close(conn);
+            return;
+        case ERROR_MORE_DATA:
         {
-            case ERROR_BROKEN_PIPE:
-                LOG_INFO(logger, (_T("Pipe server closed connection")));
-                return PIPE_RECV_MSG_RET_SHUTDOWN;
-            case ERROR_IO_PENDING:
+            DWORD remaining;
+            size_t new_buffer_size;
+            unsigned char* new_buffer;
+
+            if (!PeekNamedPipe(pipe->handle, NULL, 0, NULL, NULL, &remaining))
             {
-                DWORD wait_result;
-
-                pipe->read_is_overlapped = true;
-
-                do {
-                    wait_result = WaitForMultipleObjects(2, wait_handles, FALSE, INFINITE);
-                } while (wait_result == WAIT_TIMEOUT);
-
-                switch (wait_result)
-                {
-                    case WAIT_OBJECT_0:
-                        continue;
-                    case WAIT_OBJECT_0 + 1:
-                        LOG_DEBUG(logger, (_T("Pipe thread: Received exit event")));
-                        CancelIoEx(pipe->handle, &pipe->read_overlapped);
-                        return PIPE_RECV_MSG_RET_EXIT;
-                    case WAIT_FAILED:
-                        LOG_ERROR(logger, (_T("Error %d while waiting for pipe handles"), GetLastError()));
-                        return PIPE_RECV_MSG_RET_FAILURE;
-                    default:
-                        LOG_ERROR(logger, (_T("Unknown return value from WaitForMultipleObjects")));
-                        return PIPE_RECV_MSG_RET_FAILURE;
-                }
+                LOG_ERROR(logger, (_T("Error %d while getting remaining message length"), GetLastError()));
+                connection_close(conn);
+                return;
             }
-            case ERROR_MORE_DATA:
+
+            metrics_count_more_data(conn);
+            metrics_count_reallocation(conn);
+            new_buffer_size = buffer_sizer_grow(&pipe->read_sizer, pipe->read_buffer_size,
+                                                pipe->read_length + remaining);
+            new_buffer = buffer_pool_realloc(logger, pipe->read_buffer, pipe->read_length, new_buffer_size,
+                                             &new_buffer_size);
+            if (!new_buffer)
             {
-                DWORD remaining;
-                size_t new_buffer_size;
-                unsigned char* new_buffer;
-
-                success = PeekNamedPipe(pipe->handle, NULL, 0, NULL, NULL, &remaining);
-                if (!success)
-                {
-                    LOG_ERROR(logger, (_T("Error %d while getting remaining message length"), GetLastError()));
-                    return PIPE_RECV_MSG_RET_FAILURE;
-                }
-
-                new_buffer_size = message_length + remaining;
-                new_buffer = (unsigned char*)HeapReAlloc(GetProcessHeap(), 0, *inout_buffer, new_buffer_size);
-                if (!new_buffer)
-                {
-                    LOG_ERROR(logger, (
-                        _T("Failed to resize incoming pipe data buffer from %lu to %lu bytes"),
-                        (unsigned long)*inout_buffer_size,
-                        (unsigned long)new_buffer_size
-                    ));
-                    return PIPE_RECV_MSG_RET_FAILURE;
-                }
-                *inout_buffer = new_buffer;
-                *inout_buffer_size = new_buffer_size;
-                continue;
+                LOG_ERROR(logger, (
+                    _T("Failed to resize incoming pipe data buffer from %lu to %lu bytes"),
+                    (unsigned long)pipe->read_buffer_size,
+                    (unsigned long)(pipe->read_length + remaining)
+                ));
+                connection_close(conn);
+                return;
             }
-            default:
-                LOG_ERROR(logger, (_T("Reading from pipe failed: Error %d"), last_error));
-                return PIPE_RECV_MSG_RET_FAILURE;
+            pipe->read_buffer = new_buffer;
+            pipe->read_buffer_size = new_buffer_size;
+
+            if (InterlockedRead(&conn->closing) || !pipe_start_read(logger, conn))
+                connection_close(conn);
+            return;
         }
+        default:
+            LOG_ERROR(logger, (_T("Reading from pipe failed: Error %d"), error));
+            connection_close(conn);
+            return;
     }
 
     LOG_TRACE(logger, (_T("Read message from pipe")));
 
-    return PIPE_RECV_MSG_RET_SUCCESS;
-}
-
-bool pipe_handler(logger_instance* const logger, connection_data* const conn)
-{
-    unsigned char* buffer;
-    size_t buffer_size;
-    bool ret;
+    if (LOG_IS_ENABLED(logger, LOG_LEVEL_DEBUG))
+    {
+        LOG_DEBUG(logger, (_T("Passing %lu bytes from pipe to socket"), (unsigned long)pipe->read_length));
+        dbg_output_bytes(logger, _T("Message from pipe: "), pipe->read_buffer, pipe->read_length);
+    }
 
-    LOG_TRACE(logger, (_T("Entering pipe handler loop")));
+    /* A blocked socket may restart the pipe read from another thread, so the read state has to be reset first. */
+    message_length = pipe->read_length;
+    pipe->read_length = 0;
+    next_buffer_size = buffer_sizer_record(&pipe->read_sizer, message_length, pipe->read_buffer_size);
 
-    buffer = 0;
-    buffer_size = 0;
-    while (true)
+    /* Held back presence updates are sent by the activity timer. */
+    if (!activity_hold(logger, conn, &pipe->read_buffer, &pipe->read_buffer_size, message_length))
     {
-        size_t message_length;
-        PIPE_RECV_MSG_RET recv_ret;
-
-        recv_ret = pipe_receive_message(logger, &conn->pipe, &buffer, &buffer_size, &message_length);
-        if (recv_ret != PIPE_RECV_MSG_RET_SUCCESS)
+        send_ret = socket_send_message(logger, conn, &pipe->read_buffer, &pipe->read_buffer_size, message_length);
+        if (send_ret == SOCKET_SEND_RET_FAILURE)
         {
-            ret = recv_ret != PIPE_RECV_MSG_RET_FAILURE;
-            break;
+            connection_close(conn);
+            return;
         }
 
-        if (LOG_IS_ENABLED(logger, LOG_LEVEL_DEBUG))
+        connection_count_message(conn, METRICS_DIRECTION_PIPE_TO_SOCKET, message_length);
+
+        if (send_ret == SOCKET_SEND_RET_BLOCKED)
         {
-            LOG_DEBUG(logger, (_T("Passing %lu bytes from pipe to socket"), message_length));
-            dbg_output_bytes(logger, _T("Message from pipe: "), buffer, message_length);
+            LOG_DEBUG(logger, (_T("Pausing pipe reader until the socket has drained")));
+            return;
         }
+    }
+
+    /* The buffer is empty between two messages, so resizing doesn't need to copy anything. */
+    pipe_resize_read_buffer(logger, conn, next_buffer_size);
+
+    if (InterlockedRead(&conn->closing) || !pipe_start_read(logger, conn))
+        connection_close(conn);
+}
+
+/* Releases the completed writes at the head of the queue. Must be called with the write lock held. */
+static void pipe_retire_writes(pipe_data* const pipe)
+{
+    while (pipe->write_count && pipe->writes[pipe->write_head].done)
+    {
+        pipe_write* const write = &pipe->writes[pipe->write_head];
 
-        if (!socket_send_message(logger, &conn->socket, buffer, message_length))
+        if (write->buffer)
         {
-            ret = InterlockedRead(&conn->socket.thread.status) >= THREAD_STATUS_STOPPING;
-            break;
+            buffer_pool_free(write->buffer);
+            write->buffer = 0;
         }
+        write->done = false;
+        pipe->write_head = (pipe->write_head + 1) % pipe->write_queue_depth;
+        --pipe->write_count;
     }
+}
 
-    if (buffer)
-        HeapFree(GetProcessHeap(), 0, buffer);
+static void pipe_update_peak_write_queue_depth(proxy_data* const proxy, unsigned int const depth)
+{
+    LONG peak;
 
-    LOG_TRACE(logger, (_T("Exited pipe handler loop")));
+    do {
+        peak = InterlockedRead(&proxy->peak_write_queue_depth);
+        if ((LONG)depth <= peak)
+            return;
+    } while (InterlockedCompareExchange(&proxy->peak_write_queue_depth, (LONG)depth, peak) != peak);
+}
 
-    return ret;
+unsigned int pipe_get_write_queue_length(connection_data* const conn)
+{
+    unsigned int length;
+
+    EnterCriticalSection(&conn->pipe.write_lock);
+    length = conn->pipe.write_count;
+    LeaveCriticalSection(&conn->pipe.write_lock);
+
+    return length;
 }
 
-bool pipe_send_message(logger_instance* const logger, pipe_data* const pipe, unsigned char const* const message,
+bool pipe_send_message(logger_instance* const logger, connection_data* const conn, unsigned char* const buffer,
                        size_t const message_length)
 {
-    DWORD bytes_written;
+    pipe_data* const pipe = &conn->pipe;
+    pipe_write* write;
+    unsigned int queued;
+    DWORD last_error;
+    bool paused, new_peak = false;
 
     LOG_TRACE(logger, (_T("Sending message to pipe")));
 
-    if (InterlockedRead(&pipe->thread.status) >= THREAD_STATUS_STOPPING)
+    if (InterlockedRead(&conn->closing))
     {
         LOG_ERROR(logger, (_T("Can't send message to closed pipe")));
         return false;
@@ -382,39 +573,109 @@ bool pipe_send_message(logger_instance* const logger, pipe_data* const pipe, uns
         return false;
     }
 
-    if (pipe->write_is_overlapped)
+    EnterCriticalSection(&pipe->write_lock);
+    if (pipe->write_count == pipe->write_queue_depth)
     {
-        BOOL prev_ret;
-
-        prev_ret = GetOverlappedResult(pipe->handle, &pipe->write_overlapped, &bytes_written, FALSE);
-        pipe->write_is_overlapped = false;
-        if (!prev_ret)
-        {
-            LOG_ERROR(logger, (_T("Error in previous pipe write: Error %d"), GetLastError()));
-            return false;
-        }
+        LeaveCriticalSection(&pipe->write_lock);
+        LOG_ERROR(logger, (_T("Pipe write queue is full")));
+        return false;
     }
-
-    if (!WriteFile(pipe->handle, message, (DWORD)message_length, NULL, &pipe->write_overlapped))
+    write = &pipe->writes[(pipe->write_head + pipe->write_count) % pipe->write_queue_depth];
+    write->buffer = buffer;
+    write->done = false;
+    if (++pipe->write_count > pipe->write_peak)
     {
-        DWORD last_error;
+        pipe->write_peak = pipe->write_count;
+        new_peak = true;
+    }
+    queued = pipe->write_count;
+    LeaveCriticalSection(&pipe->write_lock);
 
-        last_error = GetLastError();
-        if (last_error == ERROR_IO_PENDING)
-        {
-            LOG_TRACE(logger, (_T("Continuing sending message to pipe client asynchronously")));
+    if (new_peak)
+        pipe_update_peak_write_queue_depth(conn->proxy, queued);
 
-            pipe->write_is_overlapped = true;
-            return true;
-        }
-        else if (last_error == ERROR_NO_DATA || last_error == ERROR_BROKEN_PIPE)
+    connection_acquire(conn);
+    RtlZeroMemory(&write->op.overlapped, sizeof(write->op.overlapped));
+    if (!WriteFile(pipe->handle, buffer, (DWORD)message_length, NULL, &write->op.overlapped) &&
+        (last_error = GetLastError()) != ERROR_IO_PENDING)
+    {
+        if (last_error == ERROR_NO_DATA || last_error == ERROR_BROKEN_PIPE)
             LOG_ERROR(logger, (_T("Could not send data to pipe: Pipe disconnected")));
         else
             LOG_ERROR(logger, (_T("Sending message to pipe failed with error %d"), last_error));
+
+        /* The buffer stays with the caller. */
+        EnterCriticalSection(&pipe->write_lock);
+        write->buffer = 0;
+        write->done = true;
+        pipe_retire_writes(pipe);
+        LeaveCriticalSection(&pipe->write_lock);
+
+        connection_release(conn);
         return false;
     }
 
-    LOG_TRACE(logger, (_T("Sent message to pipe")));
+    if (InterlockedRead(&conn->closing))
+        CancelIoEx(pipe->handle, &write->op.overlapped);
+
+    /* Keep reading from the socket unless the pipe client has fallen behind. Writes that completed in the meantime
+       have already been retired, so the count is current. */
+    EnterCriticalSection(&pipe->write_lock);
+    paused = pipe->write_count >= pipe->write_high_watermark;
+    pipe->reader_paused = paused;
+    queued = pipe->write_count;
+    LeaveCriticalSection(&pipe->write_lock);
+
+    LOG_TRACE(logger, (_T("Queued message for pipe, %u writes in flight"), queued));
+
+    if (paused)
+        LOG_DEBUG(logger, (_T("Pausing socket reader with %u pipe writes queued"), queued));
+    else
+        io_engine_arm(logger, &conn->proxy->engine, &conn->socket.watch, REACTOR_EVENT_READABLE);
 
     return true;
 }
+
+void pipe_write_completed(logger_instance* const logger, connection_data* const conn, io_operation* const op,
+                          DWORD const error, DWORD const bytes_written)
+{
+    pipe_data* const pipe = &conn->pipe;
+    pipe_write* const write = container_of(op, pipe_write, op);
+    bool resume;
+
+    (void)bytes_written;
+
+    EnterCriticalSection(&pipe->write_lock);
+    write->done = true;
+    pipe_retire_writes(pipe);
+    resume = pipe->reader_paused && pipe->write_count <= pipe->write_low_watermark;
+    if (resume)
+        pipe->reader_paused = false;
+    LeaveCriticalSection(&pipe->write_lock);
+
+    switch (error)
+    {
+        case ERROR_SUCCESS:
+            break;
+        case ERROR_OPERATION_ABORTED:
+            LOG_TRACE(logger, (_T("Pipe write cancelled")));
+            return;
+        case ERROR_NO_DATA:
+        case ERROR_BROKEN_PIPE:
+            LOG_ERROR(logger, (_T("Could not send data to pipe: Pipe disconnected")));
+            connection_close(conn);
+            return;
+        default:
+            LOG_ERROR(logger, (_T("Sending message to pipe failed with error %d"), error));
+            connection_close(conn);
+            return;
+    }
+
+    LOG_TRACE(logger, (_T("Sent message to pipe")));
+
+    if (resume)
+    {
+        LOG_DEBUG(logger, (_T("Resuming socket reader")));
+        io_engine_arm(logger, &conn->proxy->engine, &conn->socket.watch, REACTOR_EVENT_READABLE);
+    }
+}
@@ -16,6 +16,7 @@
 #include "data/pipe_data.h"
 #include "../bool.h"
 #include <winestreamproxy/logger.h>
+#include <winestreamproxy/winestreamproxy.h>
 
 #include <windef.h>
 #include <winbase.h>
@@ -25,20 +26,36 @@
 extern "C" {
 #endif /* defined(__cplusplus) */
 
-extern bool pipe_create_server(logger_instance* logger, pipe_data* pipe, TCHAR const* pipe_path);
-extern bool pipe_server_start_accept(logger_instance* logger, pipe_data* pipe, bool* out_is_async,
-                                     OVERLAPPED* inout_accept_overlapped);
-extern bool pipe_prepare(logger_instance* logger, pipe_data* pipe_data);
-extern bool pipe_server_wait_accept(logger_instance* logger, pipe_data* pipe, HANDLE exit_event,
-                                    OVERLAPPED* inout_accept_overlapped);
+extern bool pipe_create_server(logger_instance* logger, pipe_data* pipe, TCHAR const* pipe_path, bool message_mode,
+                               DWORD buffer_size);
+/* Connects to an existing pipe server for reverse routes. Everything after that is the same as for a server. Without
+   message_mode, even a message mode pipe is read as a stream. */
+extern bool pipe_open_client(logger_instance* logger, pipe_data* pipe, TCHAR const* pipe_path, bool message_mode);
+/* The read buffer grows beyond read_buffer_size if a message doesn't fit. */
+extern bool pipe_prepare(logger_instance* logger, pipe_data* pipe_data, proxy_tuning const* tuning,
+                         size_t read_buffer_size);
+/* Waits for a client through the completion port, the pipe has to be associated with it already. */
+extern bool pipe_start_accept(logger_instance* logger, connection_data* conn);
 extern bool pipe_close_server(logger_instance* logger, pipe_data* pipe);
-extern void pipe_cleanup(logger_instance* logger, connection_data* conn);
 
-extern bool pipe_stop_thread(logger_instance* logger, pipe_data* pipe); /* Only called if thread is running. */
-extern bool pipe_handler(logger_instance* logger, connection_data* conn);
+/* Tries to move the pipe data through the unixlib, leaves the pipe untouched on failure. */
+extern bool pipe_enable_splice(logger_instance* logger, connection_data* conn);
+extern void pipe_readable(logger_instance* logger, connection_data* conn);
+extern void pipe_writable(logger_instance* logger, connection_data* conn);
 
-extern bool pipe_send_message(logger_instance* logger, pipe_data* pipe, unsigned char const* message,
+extern bool pipe_start_read(logger_instance* logger, connection_data* conn);
+extern void pipe_read_completed(logger_instance* logger, connection_data* conn, DWORD error, DWORD bytes_read);
+/* Called by the idle check. Cancels the pending read if its buffer has been bigger than needed for a while, the
+   read is issued again with a smaller buffer. */
+extern void pipe_shrink_idle_buffer(logger_instance* logger, connection_data* conn);
+
+/* Queues an overlapped write and takes ownership of the pool buffer on success. The socket watch is re-armed unless
+   the write queue has reached its high watermark, in which case it is re-armed once it has drained. */
+extern bool pipe_send_message(logger_instance* logger, connection_data* conn, unsigned char* buffer,
                               size_t message_length);
+extern void pipe_write_completed(logger_instance* logger, connection_data* conn, io_operation* op, DWORD error,
+                                 DWORD bytes_written);
+extern unsigned int pipe_get_write_queue_length(connection_data* conn);
 
 #ifdef __cplusplus
 }
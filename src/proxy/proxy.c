@@ -8,11 +8,15 @@
  *   E-Mail address: openglfreak@googlemail.com
  *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
 
+#include "buffer_pool.h"
 #include "connection.h"
 #include "connection_list.h"
+#include "io_engine.h"
+#include "metrics.h"
 #include "pipe.h"
 #include "proxy.h"
 #include "socket.h"
+#include "socket_pool.h"
 #include <winestreamproxy/logger.h>
 #include <winestreamproxy/winestreamproxy.h>
 
@@ -23,18 +27,107 @@
 #include <winbase.h>
 #include <winnt.h>
 
+#define InterlockedRead(x) InterlockedCompareExchange((x), 0, 0)
+
+#define DEFAULT_LISTEN_INSTANCE_COUNT 4
+#define DEFAULT_STOP_TIMEOUT 10000
+#define DEFAULT_CONNECT_TIMEOUT 5000
+#define DEFAULT_PIPE_BUFFER_SIZE 1024
+/* The bulk profile trades memory per connection for fewer reads and wakeups when large amounts of data are moved. */
+#define BULK_PIPE_BUFFER_SIZE 65536
+#define BULK_SOCKET_BUFFER_SIZE 262144
+#define MAX_BUFFER_SIZE 16777216
+#define CONNECT_RETRY_MIN_DELAY 1
+#define CONNECT_RETRY_MAX_DELAY 64
+/* A restarting server takes seconds rather than milliseconds, so don't keep polling at the connect rate. */
+#define RECONNECT_RETRY_MAX_DELAY 1000
+
+/* Explicit settings of the route come first, then those of the tuning, then the profile. */
+static void proxy_configure_buffers(logger_instance* const logger, proxy_route* const route,
+                                    proxy_tuning const* const tuning)
+{
+    proxy_paths const* const paths = &route->paths;
+    bool const bulk = paths->bulk || tuning->bulk;
+    PROXY_PIPE_MODE pipe_mode;
+    unsigned int pipe_buffer_size, socket_buffer_size;
+
+    pipe_mode = paths->pipe_mode != PROXY_PIPE_MODE_DEFAULT ? paths->pipe_mode : tuning->pipe_mode;
+    if (pipe_mode == PROXY_PIPE_MODE_DEFAULT)
+        pipe_mode = bulk ? PROXY_PIPE_MODE_BYTE : PROXY_PIPE_MODE_MESSAGE;
+
+    pipe_buffer_size = paths->pipe_buffer_size ? paths->pipe_buffer_size : tuning->pipe_buffer_size;
+    if (!pipe_buffer_size)
+        pipe_buffer_size = bulk ? BULK_PIPE_BUFFER_SIZE : DEFAULT_PIPE_BUFFER_SIZE;
+
+    socket_buffer_size = paths->socket_buffer_size ? paths->socket_buffer_size : tuning->socket_buffer_size;
+    if (!socket_buffer_size && bulk)
+        socket_buffer_size = BULK_SOCKET_BUFFER_SIZE;
+
+    if (pipe_buffer_size > MAX_BUFFER_SIZE || socket_buffer_size > MAX_BUFFER_SIZE)
+    {
+        LOG_WARNING(logger, (_T("Limiting the buffers of %s to %lu bytes"), paths->named_pipe_path,
+                             (unsigned long)MAX_BUFFER_SIZE));
+        if (pipe_buffer_size > MAX_BUFFER_SIZE)
+            pipe_buffer_size = MAX_BUFFER_SIZE;
+        if (socket_buffer_size > MAX_BUFFER_SIZE)
+            socket_buffer_size = MAX_BUFFER_SIZE;
+    }
+
+    route->pipe_message_mode = pipe_mode == PROXY_PIPE_MODE_MESSAGE;
+    route->pipe_buffer_size = pipe_buffer_size;
+    route->socket_buffer_size = (int)socket_buffer_size;
+
+    LOG_DEBUG(logger, (
+        _T("Route %s: %s mode pipe with %lu byte buffers, %lu byte socket buffers"),
+        paths->named_pipe_path,
+        route->pipe_message_mode ? _T("message") : _T("byte"),
+        (unsigned long)pipe_buffer_size,
+        (unsigned long)socket_buffer_size
+    ));
+}
+
+/* Without an explicit count, the default number of instances is split between the routes so that adding routes
+   doesn't multiply the memory that idle instances take up. */
+static LONG proxy_listener_target(proxy_tuning const* const tuning, unsigned int const route_count)
+{
+    if (tuning->listen_instance_count)
+        return (LONG)tuning->listen_instance_count;
+    if (route_count >= DEFAULT_LISTEN_INSTANCE_COUNT)
+        return 1;
+    return (LONG)(DEFAULT_LISTEN_INSTANCE_COUNT / route_count);
+}
+
+static void proxy_finalize_routes(proxy_data* const proxy)
+{
+    unsigned int i;
+
+    for (i = 0; i < proxy->route_count; ++i)
+        socket_pool_finalize(&proxy->routes[i].socket_pool);
+    HeapFree(GetProcessHeap(), 0, proxy->routes);
+}
+
 BOOL proxy_create(logger_instance* const logger, proxy_parameters const parameters, proxy_data** const out_proxy)
 {
     proxy_data* proxy;
+    unsigned int i;
 
     LOG_TRACE(logger, (_T("Creating proxy object")));
 
+    if (!parameters.route_count)
+    {
+        LOG_CRITICAL(logger, (_T("No routes given")));
+        return FALSE;
+    }
+
     if (!socket_init_unixlib())
     {
         LOG_CRITICAL(logger, (_T("Could not initialize unixlib")));
         return FALSE;
     }
 
+    if (!buffer_pool_initialize(logger))
+        return FALSE;
+
     proxy = (proxy_data*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(proxy_data));
     if (!proxy)
     {
@@ -44,23 +137,78 @@ BOOL proxy_create(logger_instance* const logger, proxy_parameters const paramete
 
     proxy->logger = logger;
     proxy->parameters = parameters;
+    proxy->parameters.routes = 0;
+    if (proxy->parameters.tuning.replay_messages > SOCKET_MAX_REPLAY_MESSAGES)
+    {
+        LOG_WARNING(logger, (_T("Limiting replayed message count to %u"), (unsigned int)SOCKET_MAX_REPLAY_MESSAGES));
+        proxy->parameters.tuning.replay_messages = SOCKET_MAX_REPLAY_MESSAGES;
+    }
+    QueryPerformanceFrequency(&proxy->counter_frequency);
+
+    proxy->routes = (proxy_route*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+                                            sizeof(proxy_route) * parameters.route_count);
+    if (!proxy->routes)
+    {
+        LOG_CRITICAL(logger, (
+            _T("Could not allocate routes (%lu bytes)"),
+            (unsigned long)(sizeof(proxy_route) * parameters.route_count)
+        ));
+        HeapFree(GetProcessHeap(), 0, proxy);
+        return FALSE;
+    }
+    proxy->route_count = parameters.route_count;
+    for (i = 0; i < proxy->route_count; ++i)
+    {
+        proxy->routes[i].proxy = proxy;
+        proxy->routes[i].paths = parameters.routes[i];
+        /* The backlog of a listening socket already queues any number of clients. */
+        if (parameters.routes[i].reverse)
+            proxy->routes[i].listener_target = 1;
+        else
+            proxy->routes[i].listener_target = proxy_listener_target(&parameters.tuning, parameters.route_count);
+
+        if (parameters.routes[i].connect_timeout)
+            proxy->routes[i].connect_timeout = parameters.routes[i].connect_timeout;
+        else if (parameters.tuning.connect_timeout)
+            proxy->routes[i].connect_timeout = parameters.tuning.connect_timeout;
+        else
+            proxy->routes[i].connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+
+        proxy_configure_buffers(logger, &proxy->routes[i], &parameters.tuning);
+
+        /* The server of a reverse route is the pipe, which has no way to take a client back. */
+        if (!parameters.routes[i].reverse)
+            proxy->routes[i].reconnect_timeout = parameters.tuning.reconnect_timeout;
+
+        if (!socket_pool_initialize(logger, &proxy->routes[i].socket_pool, parameters.routes[i].unix_socket_path,
+                                    parameters.routes[i].reverse ? 0 : parameters.tuning.socket_pool_size))
+        {
+            LOG_CRITICAL(logger, (_T("Could not initialize socket pool")));
+            proxy_finalize_routes(proxy);
+            HeapFree(GetProcessHeap(), 0, proxy);
+            return FALSE;
+        }
+    }
 
     if (!connection_list_initialize(logger, &proxy->conn_list))
     {
         LOG_CRITICAL(logger, (_T("Could not initialize connection list")));
+        proxy_finalize_routes(proxy);
         HeapFree(GetProcessHeap(), 0, proxy);
         return FALSE;
     }
 
-    proxy->accept_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-    if (!proxy->accept_overlapped.hEvent)
+    if (!io_engine_initialize(logger, &proxy->engine, &proxy->parameters.tuning))
     {
-        LOG_CRITICAL(logger, (_T("Could not create an event for asynchronous connecting")));
+        LOG_CRITICAL(logger, (_T("Could not initialize I/O engine")));
         connection_list_finalize(logger, &proxy->conn_list);
+        proxy_finalize_routes(proxy);
         HeapFree(GetProcessHeap(), 0, proxy);
         return FALSE;
     }
 
+    InitializeCriticalSection(&proxy->listen_lock);
+
     LOG_TRACE(logger, (_T("Created proxy object")));
 
     *out_proxy = proxy;
@@ -75,130 +223,705 @@ void proxy_destroy(proxy_data* const proxy)
 
     LOG_TRACE(logger, (_T("Destroying proxy object")));
 
-    CloseHandle(proxy->accept_overlapped.hEvent);
+    io_engine_finalize(logger, &proxy->engine, connection_list_count(&proxy->conn_list) != 0);
+    DeleteCriticalSection(&proxy->listen_lock);
     connection_list_finalize(logger, &proxy->conn_list);
+    buffer_pool_trim();
 
+    proxy_finalize_routes(proxy);
     HeapFree(GetProcessHeap(), 0, proxy);
 
     LOG_TRACE(logger, (_T("Destroyed proxy object")));
 }
 
-static bool handle_new_connection(logger_instance* const logger, connection_data* const conn)
+static void proxy_update_max(LONG volatile* const max, LONG const value)
 {
-    LOG_TRACE(logger, (_T("Handling new client connection")));
+    LONG current;
 
-    if (!socket_connect(logger, &conn->socket))
-        return false;
+    do {
+        current = InterlockedRead(max);
+        if (value <= current)
+            return;
+    } while (InterlockedCompareExchange(max, value, current) != current);
+}
 
-    LOG_INFO(logger, (_T("Connected to server socket")));
+/* Hands a connection whose server socket is connected over to the I/O engine. */
+static void proxy_server_connected(connection_data* const conn)
+{
+    proxy_data* const proxy = conn->proxy;
 
-    if (!connection_launch_threads(conn))
-        return false;
+    /* Like a failed connect, this only costs the client its connection, the listeners keep running. */
+    if (!connection_start(conn))
+    {
+        InterlockedIncrement(&conn->route->connect_failures);
+        connection_close(conn);
+        return;
+    }
 
-    LOG_TRACE(logger, (_T("Threads signaled to start")));
+    LOG_TRACE(proxy->logger, (_T("Connection handed to I/O engine")));
 
-    return true;
+    /* The client has its socket already, so the pool is refilled off its critical path. */
+    socket_pool_fill(proxy->logger, &conn->route->socket_pool);
 }
 
-void proxy_enter_loop(proxy_data* const proxy)
+static void CALLBACK proxy_connect_timer_proc(PTP_CALLBACK_INSTANCE const instance, PVOID const context,
+                                              PTP_TIMER const timer)
 {
-    PROXY_STATE state;
-    connection_data* conn, * prev_conn;
-    bool is_async, first_loop = true;
+    connection_data* const conn = (connection_data*)context;
 
-    state = PROXY_STATE_CREATED;
+    (void)timer;
 
-    if (InterlockedCompareExchange(&proxy->is_running, TRUE, FALSE) != FALSE)
-    {
-        LOG_CRITICAL(proxy->logger, (_T("Refusing to start proxy loop twice")));
+    /* Cancelled by connection_close, which has taken over the reference. */
+    if (!InterlockedExchange(&conn->socket.connect_timer_due, FALSE))
         return;
+
+    /* The attempt itself is made by an I/O worker. */
+    if (!io_engine_post(conn->proxy->logger, &conn->proxy->engine, (ULONG_PTR)conn, &conn->socket.connect_op))
+    {
+        /* connection_close waits for the callbacks of the timer, which must not include this one. */
+        DisassociateCurrentThreadFromCallback(instance);
+        connection_close(conn);
+        connection_release(conn);
     }
+}
 
-    if (proxy->parameters.state_change_callback)
+void proxy_cancel_connect_retry(connection_data* const conn)
+{
+    socket_data* const socket = &conn->socket;
+
+    if (!socket->connect_timer)
+        return;
+
+    SetThreadpoolTimer(socket->connect_timer, NULL, 0, 0);
+    WaitForThreadpoolTimerCallbacks(socket->connect_timer, TRUE);
+    if (InterlockedExchange(&socket->connect_timer_due, FALSE))
+        connection_release(conn);
+}
+
+/* The timer is kept until the connection is cleaned up, so that connection_close never sees it closed. */
+void proxy_connect_finalize(connection_data* const conn)
+{
+    if (conn->socket.connect_timer)
     {
-        proxy->parameters.state_change_callback(proxy->logger, proxy, state, PROXY_STATE_STARTING);
-        state = PROXY_STATE_STARTING;
+        CloseThreadpoolTimer(conn->socket.connect_timer);
+        conn->socket.connect_timer = 0;
     }
+}
 
-    LOG_TRACE(proxy->logger, (_T("Starting proxy loop")));
+/* Unix sockets can't be waited on while the server's backlog is full, so the connect is retried with a growing delay
+   until the route's timeout has passed. */
+static bool proxy_schedule_connect_retry(connection_data* const conn)
+{
+    socket_data* const socket = &conn->socket;
+    ULONGLONG const now = GetTickCount64();
+    ULARGE_INTEGER due;
+    FILETIME due_time;
+    DWORD delay, max_delay;
 
-    for (prev_conn = 0;; prev_conn = conn)
+    if (!socket->connect_timer)
     {
-        bool stop = false;
+        socket->connect_timer = CreateThreadpoolTimer(proxy_connect_timer_proc, conn, NULL);
+        if (!socket->connect_timer)
+        {
+            LOG_ERROR(conn->proxy->logger, (_T("Could not create connect timer: Error %d"), GetLastError()));
+            return false;
+        }
+    }
 
-        if (!connection_list_allocate_entry(proxy->logger, &proxy->conn_list, &conn))
-            stop = true;
+    max_delay = socket->reconnecting ? RECONNECT_RETRY_MAX_DELAY : CONNECT_RETRY_MAX_DELAY;
+    delay = socket->connect_retry_delay ? socket->connect_retry_delay * 2 : CONNECT_RETRY_MIN_DELAY;
+    if (delay > max_delay)
+        delay = max_delay;
+    socket->connect_retry_delay = delay;
+    if (now + delay > socket->connect_deadline)
+        delay = (DWORD)(socket->connect_deadline - now);
+
+    /* Negative due times are relative, in 100 nanosecond units. */
+    due.QuadPart = (ULONGLONG)(-((LONGLONG)delay * 10000));
+    due_time.dwLowDateTime = due.u.LowPart;
+    due_time.dwHighDateTime = due.u.HighPart;
+
+    /* The reference is released once the posted operation has been handled. */
+    connection_acquire(conn);
+    InterlockedExchange(&socket->connect_timer_due, TRUE);
+    SetThreadpoolTimer(socket->connect_timer, &due_time, 0, 0);
+    /* connection_close may have looked at the timer before it was set. */
+    if (InterlockedRead(&conn->closing))
+        proxy_cancel_connect_retry(conn);
 
-        if (!stop)
-            connection_initialize(proxy, conn);
+    return true;
+}
+
+/* Gives the reconnected server the kept and queued client messages. */
+static void proxy_server_reconnected(connection_data* const conn)
+{
+    proxy_data* const proxy = conn->proxy;
+    socket_data* const socket = &conn->socket;
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+    LOG_INFO(proxy->logger, (
+        _T("Reconnected to server socket after %lu ms"),
+        (unsigned long)((now.QuadPart - socket->connect_started.QuadPart) * 1000 / proxy->counter_frequency.QuadPart)
+    ));
+    InterlockedIncrement(&conn->route->reconnects);
+
+    socket->reconnecting = false;
+    if (conn->route->socket_buffer_size)
+        socket_set_buffer_size(proxy->logger, socket->fd, conn->route->socket_buffer_size);
+    if (!socket_attach(proxy->logger, conn))
+        connection_close(conn);
+}
 
-        if (!stop && !pipe_create_server(proxy->logger, &conn->pipe, proxy->parameters.paths.named_pipe_path))
+static void proxy_connect_step(connection_data* const conn)
+{
+    proxy_data* const proxy = conn->proxy;
+    proxy_route* const route = conn->route;
+    socket_data* const socket = &conn->socket;
+    LARGE_INTEGER now;
+    LONGLONG elapsed_us;
+    bool connected;
+
+    if (!socket_connect_step(proxy->logger, socket, &connected))
+    {
+        /* A restarting server refuses connections or hasn't created its socket yet, so keep trying. Otherwise only
+           this client loses its connection, the other clients and routes are not affected. */
+        if (!socket->reconnecting)
         {
-            connection_list_deallocate_entry(proxy->logger, &proxy->conn_list, conn);
-            stop = true;
+            LOG_ERROR(proxy->logger, (
+                _T("Could not connect to the server socket of %s"),
+                route->paths.named_pipe_path
+            ));
+            InterlockedIncrement(&route->connect_failures);
+            connection_close(conn);
+            return;
         }
+        connected = false;
+    }
 
-        if (!stop && !pipe_server_start_accept(proxy->logger, &conn->pipe, &is_async, &proxy->accept_overlapped))
+    if (!connected)
+    {
+        if (GetTickCount64() >= socket->connect_deadline && socket->reconnecting)
         {
-            pipe_close_server(proxy->logger, &conn->pipe);
-            connection_list_deallocate_entry(proxy->logger, &proxy->conn_list, conn);
-            stop = true;
+            LOG_ERROR(proxy->logger, (
+                _T("The server of %s did not come back within %lu ms"),
+                route->paths.named_pipe_path,
+                (unsigned long)route->reconnect_timeout
+            ));
+            InterlockedIncrement(&route->reconnect_failures);
+            connection_close(conn);
         }
-
-        if (prev_conn)
+        /* A server that is alive but doesn't accept in time only costs this client its connection. */
+        else if (GetTickCount64() >= socket->connect_deadline)
+        {
+            LOG_ERROR(proxy->logger, (
+                _T("Timed out connecting to the server socket of %s after %lu ms"),
+                route->paths.named_pipe_path,
+                (unsigned long)route->connect_timeout
+            ));
+            InterlockedIncrement(&route->connect_timeouts);
+            connection_close(conn);
+        }
+        else if (!proxy_schedule_connect_retry(conn))
         {
-            if (stop || !handle_new_connection(proxy->logger, prev_conn))
-            {
-                connection_close(prev_conn);
-                break;
-            }
+            InterlockedIncrement(&route->connect_failures);
+            connection_close(conn);
         }
+        return;
+    }
+
+    if (socket->reconnecting)
+    {
+        proxy_server_reconnected(conn);
+        return;
+    }
+
+    QueryPerformanceCounter(&now);
+    elapsed_us = (now.QuadPart - socket->connect_started.QuadPart) * 1000000 / proxy->counter_frequency.QuadPart;
+    if (elapsed_us > 0x7FFFFFFF)
+        elapsed_us = 0x7FFFFFFF;
+    InterlockedIncrement(&route->connects);
+    InterlockedExchangeAdd64(&route->connect_total_us, elapsed_us);
+    proxy_update_max(&route->connect_max_us, (LONG)elapsed_us);
+
+    LOG_INFO(proxy->logger, (_T("Connected to server socket in %lu us"), (unsigned long)elapsed_us));
+
+    proxy_server_connected(conn);
+}
+
+void proxy_connect_retry(connection_data* const conn)
+{
+    if (InterlockedRead(&conn->closing))
+        return;
+
+    proxy_connect_step(conn);
+}
+
+void proxy_server_lost(connection_data* const conn)
+{
+    proxy_data* const proxy = conn->proxy;
+    proxy_route* const route = conn->route;
+    socket_data* const socket = &conn->socket;
+
+    if (!socket->reconnect || InterlockedRead(&conn->closing))
+    {
+        connection_close(conn);
+        return;
+    }
+
+    LOG_INFO(proxy->logger, (
+        _T("Lost the server of %s, reconnecting for up to %lu ms"),
+        route->paths.named_pipe_path,
+        (unsigned long)route->reconnect_timeout
+    ));
+
+    socket_detach(proxy->logger, conn);
+
+    QueryPerformanceCounter(&socket->connect_started);
+    socket->connect_deadline = GetTickCount64() + route->reconnect_timeout;
+    socket->connect_retry_delay = 0;
+    socket->reconnecting = true;
+    proxy_connect_step(conn);
+}
+
+/* Connects the client to the server without blocking the worker, which goes back to the completion port while the
+   server is busy. */
+static void proxy_connect_server(connection_data* const conn)
+{
+    logger_instance* const logger = conn->proxy->logger;
+    socket_data* const socket = &conn->socket;
+
+    LOG_TRACE(logger, (_T("Handling new client connection")));
+
+    socket->fd = socket_pool_take(logger, &conn->route->socket_pool);
+    if (socket->fd != -1)
+    {
+        LOG_INFO(logger, (_T("Using pre-connected server socket")));
+        proxy_server_connected(conn);
+        return;
+    }
+
+    QueryPerformanceCounter(&socket->connect_started);
+    socket->connect_deadline = GetTickCount64() + conn->route->connect_timeout;
+    socket->connect_retry_delay = 0;
+    proxy_connect_step(conn);
+}
+
+/* Creates a pipe instance that waits for a client through the completion port. Called with listen_lock held. */
+static bool proxy_add_listener(proxy_route* const route)
+{
+    proxy_data* const proxy = route->proxy;
+    logger_instance* const logger = proxy->logger;
+    connection_data* conn;
+
+    if (!connection_list_allocate_entry(logger, &proxy->conn_list, &conn))
+        return false;
+
+    connection_initialize(proxy, conn);
+    conn->route = route;
+
+    if (!pipe_create_server(logger, &conn->pipe, route->paths.named_pipe_path, route->pipe_message_mode,
+                            route->pipe_buffer_size) ||
+        !pipe_prepare(logger, &conn->pipe, &proxy->parameters.tuning, route->pipe_buffer_size) ||
+        !socket_prepare(logger, route->paths.unix_socket_path, &conn->socket) ||
+        !io_engine_associate(logger, &proxy->engine, conn->pipe.handle, (ULONG_PTR)conn))
+    {
+        connection_close(conn);
+        return false;
+    }
+    if (route->reconnect_timeout)
+        socket_enable_reconnect(&conn->socket, proxy->parameters.tuning.replay_messages);
+
+    InterlockedIncrement(&route->listener_count);
+    if (!pipe_start_accept(logger, conn))
+    {
+        InterlockedDecrement(&route->listener_count);
+        connection_close(conn);
+        return false;
+    }
 
-        if (stop)
+    return true;
+}
+
+/* Creates the socket that reverse routes accept their clients on. Called with listen_lock held. */
+static bool proxy_add_socket_listener(proxy_route* const route)
+{
+    proxy_data* const proxy = route->proxy;
+    logger_instance* const logger = proxy->logger;
+    connection_data* conn;
+
+    if (!connection_list_allocate_entry(logger, &proxy->conn_list, &conn))
+        return false;
+
+    connection_initialize(proxy, conn);
+    conn->route = route;
+
+    if (!socket_listen(logger, route->paths.unix_socket_path, &conn->socket))
+    {
+        connection_close(conn);
+        return false;
+    }
+
+    /* The watch holds a reference until the socket watcher has dropped it. */
+    connection_acquire(conn);
+    if (!io_engine_watch(logger, &proxy->engine, &conn->socket.watch, conn->socket.fd, REACTOR_EVENT_READABLE))
+    {
+        connection_release(conn);
+        connection_close(conn);
+        return false;
+    }
+
+    InterlockedIncrement(&route->listener_count);
+    LOG_INFO(logger, (_T("Accepting socket clients for %s"), route->paths.named_pipe_path));
+
+    return true;
+}
+
+/* Tops the listeners of a route up to the configured count. Returns false if none are left. */
+static bool proxy_fill_listeners(proxy_route* const route)
+{
+    proxy_data* const proxy = route->proxy;
+    bool ret;
+
+    EnterCriticalSection(&proxy->listen_lock);
+
+    while (proxy->accepting && InterlockedRead(&route->listener_count) < route->listener_target)
+        if (route->paths.reverse ? !proxy_add_socket_listener(route) : !proxy_add_listener(route))
             break;
+    ret = !proxy->accepting || InterlockedRead(&route->listener_count) != 0;
+
+    LeaveCriticalSection(&proxy->listen_lock);
+
+    return ret;
+}
+
+void proxy_accept_completed(connection_data* const conn, DWORD const error)
+{
+    proxy_data* const proxy = conn->proxy;
+    proxy_route* const route = conn->route;
 
-        if (!pipe_prepare(proxy->logger, &conn->pipe))
-            stop = true;
+    InterlockedDecrement(&route->listener_count);
 
-        if (!stop && !socket_prepare(proxy->logger, proxy->parameters.paths.unix_socket_path, &conn->socket))
-            stop = true;
+    if (error == ERROR_OPERATION_ABORTED || InterlockedRead(&conn->closing))
+        return;
 
-        if (!stop && !connection_prepare_threads(conn))
+    if (error != ERROR_SUCCESS && error != ERROR_PIPE_CONNECTED)
+    {
+        LOG_ERROR(proxy->logger, (_T("Error %d while waiting for connection"), error));
+        connection_close(conn);
+    }
+    else
+    {
+        QueryPerformanceCounter(&conn->accepted_at);
+        LOG_INFO(proxy->logger, (_T("Pipe client connected to %s"), route->paths.named_pipe_path));
+        InterlockedIncrement(&route->accepted);
+    }
+
+    /* Replace the instance first so that the next client doesn't have to wait for the server socket. */
+    if (!proxy_fill_listeners(route))
+    {
+        LOG_CRITICAL(proxy->logger, (_T("No pipe instance is waiting for clients of %s anymore"),
+                                     route->paths.named_pipe_path));
+        SetEvent(proxy->parameters.exit_event);
+    }
+
+    if (error != ERROR_SUCCESS && error != ERROR_PIPE_CONNECTED)
+        return;
+
+    proxy_connect_server(conn);
+}
+
+/* Sets up a connection for a client of a reverse route. The socket fd is owned by the connection afterwards. */
+static bool proxy_connect_pipe(proxy_route* const route, int const fd)
+{
+    proxy_data* const proxy = route->proxy;
+    logger_instance* const logger = proxy->logger;
+    connection_data* conn;
+
+    /* Connections that are added after the proxy has started stopping would never be closed. */
+    EnterCriticalSection(&proxy->listen_lock);
+    if (!proxy->accepting || !connection_list_allocate_entry(logger, &proxy->conn_list, &conn))
+    {
+        LeaveCriticalSection(&proxy->listen_lock);
+        socket_close_handle_fd(fd);
+        return false;
+    }
+    connection_initialize(proxy, conn);
+    conn->route = route;
+    LeaveCriticalSection(&proxy->listen_lock);
+    QueryPerformanceCounter(&conn->accepted_at);
+
+    if (!socket_prepare_accepted(logger, &conn->socket, fd) ||
+        !pipe_open_client(logger, &conn->pipe, route->paths.named_pipe_path, route->pipe_message_mode) ||
+        !pipe_prepare(logger, &conn->pipe, &proxy->parameters.tuning, route->pipe_buffer_size) ||
+        !io_engine_associate(logger, &proxy->engine, conn->pipe.handle, (ULONG_PTR)conn) ||
+        InterlockedRead(&conn->closing) || !connection_start(conn))
+    {
+        connection_close(conn);
+        return false;
+    }
+
+    LOG_INFO(logger, (_T("Connected to pipe server %s"), route->paths.named_pipe_path));
+
+    return true;
+}
+
+/* Upper bound of the clients accepted per readiness report, so that one busy route can't hold a worker forever. */
+#define ACCEPT_BATCH_SIZE 16
+
+void proxy_socket_acceptable(connection_data* const listener)
+{
+    proxy_data* const proxy = listener->proxy;
+    proxy_route* const route = listener->route;
+    unsigned int i;
+
+    if (InterlockedRead(&listener->closing))
+        return;
+
+    for (i = 0; i < ACCEPT_BATCH_SIZE; ++i)
+    {
+        int fd;
+
+        if (!socket_accept(proxy->logger, &listener->socket, &fd))
         {
-            socket_disconnect(proxy->logger, &conn->socket);
-            stop = true;
+            LOG_CRITICAL(proxy->logger, (_T("No socket is accepting clients for %s anymore"),
+                                         route->paths.named_pipe_path));
+            InterlockedDecrement(&route->listener_count);
+            connection_close(listener);
+            SetEvent(proxy->parameters.exit_event);
+            return;
         }
+        if (fd == -1)
+            break;
 
-        if (stop)
-        {
-            if (is_async) CancelIoEx(conn->pipe.handle, &proxy->accept_overlapped);
-            pipe_close_server(proxy->logger, &conn->pipe);
-            connection_list_deallocate_entry(proxy->logger, &proxy->conn_list, conn);
+        LOG_INFO(proxy->logger, (_T("Socket client connected for %s"), route->paths.named_pipe_path));
+        InterlockedIncrement(&route->accepted);
+
+        /* Only this client is affected if the pipe server isn't available right now. */
+        proxy_connect_pipe(route, fd);
+    }
+
+    io_engine_arm(proxy->logger, &proxy->engine, &listener->socket.watch, REACTOR_EVENT_READABLE);
+}
+
+static void log_frame_counts(proxy_data* const proxy, proxy_route const* const route, TCHAR const* const source,
+                             LONG volatile* const counters)
+{
+    unsigned long counts[SOCKET_FRAME_OPCODE_COUNT + 1];
+    unsigned long total;
+    unsigned int i;
+
+    total = 0;
+    for (i = 0; i <= SOCKET_FRAME_OPCODE_COUNT; ++i)
+    {
+        counts[i] = (unsigned long)InterlockedRead(&counters[i]);
+        total += counts[i];
+    }
+    if (!total)
+        return;
+
+    LOG_INFO(proxy->logger, (
+        _T("Route %s: frames from %s: %lu handshake, %lu frame, %lu close, %lu ping, %lu pong, %lu unknown"),
+        route->paths.named_pipe_path,
+        source,
+        counts[0], counts[1], counts[2], counts[3], counts[4], counts[5]
+    ));
+}
+
+static void log_buffer_stats(proxy_data* const proxy, proxy_route* const route, TCHAR const* const kind,
+                             buffer_sizer_stats* const stats)
+{
+    unsigned long const grows = (unsigned long)InterlockedRead(&stats->grows);
+    unsigned long const shrinks = (unsigned long)InterlockedRead(&stats->shrinks);
+
+    if (!grows && !shrinks)
+        return;
+
+    LOG_INFO(proxy->logger, (
+        _T("Route %s: %s buffers grew %lu times and shrank %lu times, largest %lu bytes"),
+        route->paths.named_pipe_path,
+        kind,
+        grows,
+        shrinks,
+        (unsigned long)InterlockedRead(&stats->peak_size)
+    ));
+}
+
+static void log_forwarding_stats(proxy_data* const proxy)
+{
+    unsigned long messages, syscalls, hundredths, first_count, first_max_us, pool_hits, pool_misses, pool_stale;
+    LONGLONG first_total_us;
+    unsigned int i;
+
+    messages = 0;
+    first_count = 0;
+    first_total_us = 0;
+    first_max_us = 0;
+    pool_hits = 0;
+    pool_misses = 0;
+    pool_stale = 0;
+    for (i = 0; i < proxy->route_count; ++i)
+    {
+        proxy_route* const route = &proxy->routes[i];
+        /* The connections have been cleaned up by now, so the counters of the closed ones are complete. */
+        unsigned long const route_messages =
+            (unsigned long)InterlockedRead(&route->metrics.closed.messages[METRICS_DIRECTION_PIPE_TO_SOCKET]) +
+            (unsigned long)InterlockedRead(&route->metrics.closed.messages[METRICS_DIRECTION_SOCKET_TO_PIPE]);
+        unsigned long const route_max_us = (unsigned long)InterlockedRead(&route->first_message_max_us);
+
+        unsigned long const connects = (unsigned long)InterlockedRead(&route->connects);
+        unsigned long const connect_failures = (unsigned long)InterlockedRead(&route->connect_failures);
+        unsigned long const connect_timeouts = (unsigned long)InterlockedRead(&route->connect_timeouts);
+        unsigned long const reconnects = (unsigned long)InterlockedRead(&route->reconnects);
+        unsigned long const reconnect_failures = (unsigned long)InterlockedRead(&route->reconnect_failures);
+
+        if (proxy->route_count > 1)
+            LOG_INFO(proxy->logger, (
+                _T("Route %s: %lu clients, %lu messages"),
+                route->paths.named_pipe_path,
+                (unsigned long)InterlockedRead(&route->accepted),
+                route_messages
+            ));
+        messages += route_messages;
+
+        if (connects || connect_failures || connect_timeouts)
+            LOG_INFO(proxy->logger, (
+                _T("Route %s: %lu server connects (%lu us average, %lu us maximum), %lu failed, %lu timed out"),
+                route->paths.named_pipe_path,
+                connects,
+                connects ? (unsigned long)(InterlockedExchangeAdd64(&route->connect_total_us, 0) / connects) : 0UL,
+                (unsigned long)InterlockedRead(&route->connect_max_us),
+                connect_failures,
+                connect_timeouts
+            ));
+
+        if (reconnects || reconnect_failures)
+            LOG_INFO(proxy->logger, (
+                _T("Route %s: %lu clients reconnected to a restarted server, %lu gave up"),
+                route->paths.named_pipe_path,
+                reconnects,
+                reconnect_failures
+            ));
+
+        if (InterlockedRead(&route->activities_forwarded) || InterlockedRead(&route->activities_coalesced))
+            LOG_INFO(proxy->logger, (
+                _T("Route %s: %lu activity updates sent, %lu replaced by newer ones"),
+                route->paths.named_pipe_path,
+                (unsigned long)InterlockedRead(&route->activities_forwarded),
+                (unsigned long)InterlockedRead(&route->activities_coalesced)
+            ));
+
+        log_buffer_stats(proxy, route, _T("Pipe read"), &route->pipe_buffers);
+        log_buffer_stats(proxy, route, _T("Socket receive"), &route->socket_buffers);
+
+        log_frame_counts(proxy, route, _T("socket"), route->frames_from_socket);
+        log_frame_counts(proxy, route, _T("pipe"), route->frames_from_pipe);
+
+        first_count += (unsigned long)InterlockedRead(&route->first_message_count);
+        first_total_us += InterlockedExchangeAdd64(&route->first_message_total_us, 0);
+        if (route_max_us > first_max_us)
+            first_max_us = route_max_us;
+
+        pool_hits += (unsigned long)InterlockedRead(&route->socket_pool.hits);
+        pool_misses += (unsigned long)InterlockedRead(&route->socket_pool.misses);
+        pool_stale += (unsigned long)InterlockedRead(&route->socket_pool.stale);
+    }
+
+    if (pool_hits || pool_misses)
+        LOG_INFO(proxy->logger, (
+            _T("Socket pool: %lu clients served from the pool, %lu connected on demand, %lu stale sockets dropped"),
+            pool_hits, pool_misses, pool_stale
+        ));
+
+    if (first_count)
+        LOG_INFO(proxy->logger, (
+            _T("Time from client connect to first forwarded message: %lu us average, %lu us maximum"),
+            (unsigned long)(first_total_us / first_count), first_max_us
+        ));
+
+    if (!messages)
+        return;
+
+    syscalls = socket_get_syscall_count();
+    hundredths = (unsigned long)((double)syscalls * 100.0 / (double)messages + 0.5);
+    LOG_INFO(proxy->logger, (
+        _T("Forwarded %lu messages using %lu socket syscalls (%lu.%02lu per message)"),
+        messages, syscalls, hundredths / 100, hundredths % 100
+    ));
+    LOG_INFO(proxy->logger, (
+        _T("Deepest pipe write queue: %lu writes"),
+        (unsigned long)InterlockedCompareExchange(&proxy->peak_write_queue_depth, 0, 0)
+    ));
+}
+
+void proxy_enter_loop(proxy_data* const proxy)
+{
+    PROXY_STATE state;
+    connection_list_entry* entry, * next_entry;
+    bool engine_started;
+    DWORD wait_result, stop_timeout;
+    unsigned int i;
+
+    state = PROXY_STATE_CREATED;
+
+    if (InterlockedCompareExchange(&proxy->is_running, TRUE, FALSE) != FALSE)
+    {
+        LOG_CRITICAL(proxy->logger, (_T("Refusing to start proxy loop twice")));
+        return;
+    }
+
+    if (proxy->parameters.state_change_callback)
+    {
+        proxy->parameters.state_change_callback(proxy->logger, proxy, state, PROXY_STATE_STARTING);
+        state = PROXY_STATE_STARTING;
+    }
+
+    LOG_TRACE(proxy->logger, (_T("Starting proxy loop")));
+
+    engine_started = io_engine_start(proxy->logger, &proxy->engine);
+
+    if (engine_started)
+    {
+        EnterCriticalSection(&proxy->listen_lock);
+        proxy->accepting = true;
+        LeaveCriticalSection(&proxy->listen_lock);
+    }
+
+    /* Connected instances are handed over and replaced by the I/O workers, this thread only waits for the exit
+       signal. */
+    for (i = 0; engine_started && i < proxy->route_count; ++i)
+        if (!proxy_fill_listeners(&proxy->routes[i]))
             break;
-        }
 
-        if (first_loop)
-        {
-            first_loop = false;
-
-            if (proxy->parameters.state_change_callback)
-            {
-                proxy->parameters.state_change_callback(proxy->logger, proxy, state, PROXY_STATE_RUNNING);
-                state = PROXY_STATE_RUNNING;
-            }
-            LOG_INFO(proxy->logger, (_T("Started proxy loop")));
-        }
+    /* A server that isn't running yet is tried again when the first client connects. */
+    if (engine_started && i == proxy->route_count)
+        for (i = 0; i < proxy->route_count; ++i)
+            socket_pool_fill(proxy->logger, &proxy->routes[i].socket_pool);
+
+    /* The proxy works without the stats endpoint, so failing to create it isn't fatal. */
+    if (engine_started && i == proxy->route_count && proxy->parameters.tuning.metrics_socket_path &&
+        !metrics_listen(proxy, proxy->parameters.tuning.metrics_socket_path))
+        LOG_ERROR(proxy->logger, (_T("Could not create the stats socket")));
 
-        if (is_async)
+    if (engine_started && i == proxy->route_count)
+    {
+        if (proxy->parameters.state_change_callback)
         {
-            if (!pipe_server_wait_accept(proxy->logger, &conn->pipe, proxy->parameters.exit_event,
-                                         &proxy->accept_overlapped))
-            {
-                /*if (is_async)*/ CancelIoEx(conn->pipe.handle, &proxy->accept_overlapped);
-                connection_close(conn);
-                break;
-            }
+            proxy->parameters.state_change_callback(proxy->logger, proxy, state, PROXY_STATE_RUNNING);
+            state = PROXY_STATE_RUNNING;
         }
+        LOG_INFO(proxy->logger, (_T("Started proxy loop")));
+
+        do {
+            wait_result = WaitForSingleObject(proxy->parameters.exit_event, INFINITE);
+        } while (wait_result == WAIT_TIMEOUT);
+
+        if (wait_result == WAIT_OBJECT_0)
+            LOG_TRACE(proxy->logger, (_T("Received exit signal")));
+        else if (wait_result == WAIT_FAILED)
+            LOG_ERROR(proxy->logger, (_T("WaitForSingleObject failed: Error %d"), GetLastError()));
+        else
+            LOG_ERROR(proxy->logger, (_T("Unexpected WaitForSingleObject return value: %d"), wait_result));
     }
 
     if (proxy->parameters.state_change_callback)
@@ -207,12 +930,36 @@ void proxy_enter_loop(proxy_data* const proxy)
         state = PROXY_STATE_STOPPING;
     }
 
-    while (proxy->conn_list.end)
+    /* No new instances are created after this, so every connection that exists is closed below. */
+    EnterCriticalSection(&proxy->listen_lock);
+    proxy->accepting = false;
+    LeaveCriticalSection(&proxy->listen_lock);
+
+    connection_list_lock(&proxy->conn_list);
+    for (entry = connection_list_start(&proxy->conn_list); entry; entry = next_entry)
     {
-        SetEvent(proxy->parameters.exit_event);
-        Sleep(1);
+        next_entry = connection_list_next(entry);
+        connection_close(&entry->connection);
+    }
+    connection_list_unlock(&proxy->conn_list);
+
+    stop_timeout = proxy->parameters.tuning.stop_timeout ? proxy->parameters.tuning.stop_timeout
+                                                         : DEFAULT_STOP_TIMEOUT;
+    if (!connection_list_wait_empty(proxy->logger, &proxy->conn_list, stop_timeout))
+    {
+        LOG_WARNING(proxy->logger, (
+            _T("Abandoning %u connections that were not cleaned up within %lu ms"),
+            connection_list_count(&proxy->conn_list),
+            (unsigned long)stop_timeout
+        ));
     }
 
+    if (engine_started)
+        io_engine_stop(proxy->logger, &proxy->engine);
+
+    log_forwarding_stats(proxy);
+    buffer_pool_log_stats(proxy->logger);
+
     LOG_INFO(proxy->logger, (_T("Stopped proxy loop")));
 
     InterlockedExchange(&proxy->is_running, FALSE);
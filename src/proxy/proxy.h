@@ -12,10 +12,13 @@
 #ifndef __WINESTREAMPROXY_PROXY_PROXY_H__
 #define __WINESTREAMPROXY_PROXY_PROXY_H__
 
+#include "data/connection_data.h"
 #include "data/proxy_data.h"
 #include <winestreamproxy/logger.h>
 #include <winestreamproxy/winestreamproxy.h>
 
+#include <windef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* defined(__cplusplus) */
@@ -24,6 +27,19 @@ extern BOOL proxy_create(logger_instance* logger, proxy_parameters parameters, p
 extern void proxy_enter_loop(proxy_data* proxy);
 extern void proxy_destroy(proxy_data* proxy);
 
+/* Hands a connected pipe instance over to the I/O engine and replaces it with a new listening one. */
+extern void proxy_accept_completed(connection_data* conn, DWORD error);
+/* Connects the clients waiting on the listening socket of a reverse route to the pipe. */
+extern void proxy_socket_acceptable(connection_data* listener);
+/* Continues connecting to the server after the retry delay has passed. */
+extern void proxy_connect_retry(connection_data* conn);
+/* Cancels a pending retry and waits for a running timer callback. Called when the connection is closed. */
+extern void proxy_cancel_connect_retry(connection_data* conn);
+extern void proxy_connect_finalize(connection_data* conn);
+/* Called by the socket reader when the server has closed the connection. Reconnects if the route is configured to,
+   otherwise closes the connection. */
+extern void proxy_server_lost(connection_data* conn);
+
 #ifdef __cplusplus
 }
 #endif /* defined(__cplusplus) */
@@ -8,12 +8,15 @@
  *   E-Mail address: openglfreak@googlemail.com
  *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
 
+#include "buffer_pool.h"
+#include "buffer_sizer.h"
 #include "connection.h"
-#include "connection_list.h"
+#include "io_engine.h"
+#include "metrics.h"
 #include "misc.h"
 #include "pipe.h"
+#include "proxy.h"
 #include "socket.h"
-#include "thread.h"
 #include "../proxy_unixlib/socket.h"
 #include <winestreamproxy/logger.h>
 
@@ -64,294 +67,1163 @@ bool socket_init_unixlib(void)
     return !!InitOnceExecuteOnce(&unixlib_initonce, socket_init_unixlib_once, 0, 0);
 }
 
-bool socket_prepare(logger_instance* const logger, char const* const unix_socket_path, socket_data* const _socket)
+#define STARTING_BUFFER_SIZE 1024
+
+/* The pipe reader is paused once the send queue is full, and resumed when no more than SEND_QUEUE_LOW_WATERMARK
+   messages are left. Only one pipe read is in flight at a time, so the queue can't overflow. Connections that
+   reconnect pause earlier, to leave room for the replayed messages. */
+#define SEND_QUEUE_DEPTH 16
+#define SEND_QUEUE_LOW_WATERMARK 4
+
+#define DEFAULT_MAX_FRAME_SIZE (4 * 1024 * 1024)
+
+void* socket_make_address(logger_instance* const logger, char const* const unix_socket_path)
 {
     size_t socket_path_len;
-    int error;
-
-    LOG_TRACE(logger, (_T("Preparing socket")));
+    void* address;
 
     socket_path_len = strlen(unix_socket_path);
     if (socket_path_len > unixlib_funcs.get_max_path_length())
     {
         LOG_CRITICAL(logger, (_T("Socket path too long")));
-        return false;
+        return 0;
     }
 
-    _socket->address = HeapAlloc(GetProcessHeap(), 0, unixlib_funcs.get_address_struct_size());
-    if (!_socket->address)
+    address = HeapAlloc(GetProcessHeap(), 0, unixlib_funcs.get_address_struct_size());
+    if (!address)
     {
         LOG_CRITICAL(logger, (_T("Failed to allocate %lu bytes"), (unsigned long)unixlib_funcs.get_address_struct_size()));
-        return false;
+        return 0;
     }
-    unixlib_funcs.init_address(_socket->address, unix_socket_path, socket_path_len);
+    unixlib_funcs.init_address(address, unix_socket_path, socket_path_len);
 
-    error = unixlib_funcs.create_thread_exit_event(&_socket->event);
-    if (error)
+    return address;
+}
+
+static bool socket_prepare_buffers(logger_instance* const logger, socket_data* const _socket)
+{
+    _socket->readable_op.type = IO_OPERATION_TYPE_SOCKET_READABLE;
+    _socket->writable_op.type = IO_OPERATION_TYPE_SOCKET_WRITABLE;
+    _socket->connect_op.type = IO_OPERATION_TYPE_SOCKET_CONNECT;
+
+    _socket->recv_buffer = buffer_pool_alloc(logger, STARTING_BUFFER_SIZE, &_socket->recv_buffer_size);
+    if (!_socket->recv_buffer)
+        return false;
+    _socket->recv_busy = FALSE;
+
+    _socket->send_queue = (socket_send_chunk*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+                                                        sizeof(socket_send_chunk) * SEND_QUEUE_DEPTH);
+    if (!_socket->send_queue)
     {
-        LOG_CRITICAL(logger, (_T("Failed to create thread exit event: Error %d"), error));
-        HeapFree(GetProcessHeap(), 0, _socket->address);
+        LOG_CRITICAL(logger, (
+            _T("Failed to allocate %lu bytes"),
+            (unsigned long)(sizeof(socket_send_chunk) * SEND_QUEUE_DEPTH)
+        ));
         return false;
     }
+    InitializeCriticalSection(&_socket->send_lock);
+    _socket->send_head = 0;
+    _socket->send_count = 0;
+    _socket->pipe_reader_paused = false;
+    _socket->send_limit = SEND_QUEUE_DEPTH;
+    _socket->reconnect = false;
+    _socket->lost = false;
+    _socket->reconnecting = false;
+    _socket->replay_limit = 0;
+    _socket->replay_count = 0;
+    _socket->replay_written = 0;
+    _socket->framing = false;
+    _socket->frame_buffer = 0;
+    _socket->frame_length = 0;
+    _socket->frame_received = 0;
+
+    return true;
+}
+
+void socket_enable_reconnect(socket_data* const socket, unsigned int const replay_messages)
+{
+    socket->reconnect = true;
+    socket->replay_limit = replay_messages < SOCKET_MAX_REPLAY_MESSAGES ? replay_messages
+                                                                         : SOCKET_MAX_REPLAY_MESSAGES;
+    socket->send_limit = SEND_QUEUE_DEPTH - socket->replay_limit;
+}
+
+void socket_enable_framing(socket_data* const socket, size_t const max_frame_size)
+{
+    socket->framing = true;
+    socket->max_frame_size = max_frame_size ? max_frame_size : DEFAULT_MAX_FRAME_SIZE;
+}
+
+/* Drops a partially received frame. */
+static void socket_reset_frame(socket_data* const socket)
+{
+    if (socket->frame_buffer)
+    {
+        buffer_pool_free(socket->frame_buffer);
+        socket->frame_buffer = 0;
+    }
+    socket->frame_length = 0;
+    socket->frame_received = 0;
+}
+
+bool socket_prepare(logger_instance* const logger, char const* const unix_socket_path, socket_data* const _socket)
+{
+    LOG_TRACE(logger, (_T("Preparing socket")));
+
+    _socket->address = socket_make_address(logger, unix_socket_path);
+    if (!_socket->address || !socket_prepare_buffers(logger, _socket))
+        return false;
+
+    LOG_TRACE(logger, (_T("Prepared socket")));
+
+    return true;
+}
+
+bool socket_prepare_accepted(logger_instance* const logger, socket_data* const _socket, int const fd)
+{
+    LOG_TRACE(logger, (_T("Preparing accepted socket")));
+
+    _socket->fd = fd;
+    if (!socket_prepare_buffers(logger, _socket))
+        return false;
+
+    LOG_TRACE(logger, (_T("Prepared accepted socket")));
+
+    return true;
+}
+
+bool socket_listen(logger_instance* const logger, char const* const unix_socket_path, socket_data* const _socket)
+{
+    int error;
+
+    LOG_TRACE(logger, (_T("Creating listening socket")));
+
+    _socket->address = socket_make_address(logger, unix_socket_path);
+    if (!_socket->address)
+        return false;
+    _socket->readable_op.type = IO_OPERATION_TYPE_SOCKET_ACCEPT;
 
     error = unixlib_funcs.create(&_socket->fd);
     if (error)
     {
         LOG_CRITICAL(logger, (_T("Failed to create socket: Error %d"), error));
-        unixlib_funcs.close_thread_exit_event(_socket->event);
-        HeapFree(GetProcessHeap(), 0, _socket->address);
+        _socket->fd = -1;
         return false;
     }
 
-    LOG_TRACE(logger, (_T("Prepared socket")));
+    error = unixlib_funcs.listen(_socket->fd, _socket->address);
+    if (error)
+    {
+        LOG_CRITICAL(logger, (_T("Failed to listen on socket: Error %d"), error));
+        return false;
+    }
+    _socket->listening = true;
+
+    LOG_TRACE(logger, (_T("Created listening socket")));
 
     return true;
 }
 
-bool socket_connect(logger_instance* const logger, socket_data* const socket)
+bool socket_accept(logger_instance* const logger, socket_data* const _socket, int* const out_fd)
 {
     int error;
 
-    LOG_TRACE(logger, (_T("Connecting socket")));
+    error = unixlib_funcs.accept(_socket->fd, out_fd);
+    if (error)
+    {
+        LOG_ERROR(logger, (_T("Failed to accept socket connection: Error %d"), error));
+        return false;
+    }
 
-    error = unixlib_funcs.connect(socket->fd, socket->address);
+    return true;
+}
+
+bool socket_connect_address(logger_instance* const logger, void const* const address, int* const out_fd)
+{
+    int fd, connected, error;
+
+    error = unixlib_funcs.create(&fd);
     if (error)
     {
-        LOG_ERROR(logger, (_T("Failed to connect to socket: Error %d"), error));
+        LOG_ERROR(logger, (_T("Failed to create socket: Error %d"), error));
         return false;
     }
 
-    LOG_TRACE(logger, (_T("Connected socket")));
+    error = unixlib_funcs.connect(fd, address, &connected);
+    if (error || !connected)
+    {
+        if (error)
+            LOG_ERROR(logger, (_T("Failed to connect to socket: Error %d"), error));
+        else
+            LOG_DEBUG(logger, (_T("Server is busy, not connecting another socket")));
+        unixlib_funcs.close(fd);
+        return false;
+    }
+
+    *out_fd = fd;
+    return true;
+}
+
+bool socket_connect_step(logger_instance* const logger, socket_data* const socket, bool* const out_connected)
+{
+    int connected, error;
+
+    if (socket->fd == -1)
+    {
+        error = unixlib_funcs.create(&socket->fd);
+        if (error)
+        {
+            LOG_ERROR(logger, (_T("Failed to create socket: Error %d"), error));
+            socket->fd = -1;
+            return false;
+        }
+    }
+
+    error = unixlib_funcs.connect(socket->fd, socket->address, &connected);
+    if (error)
+    {
+        /* The server is expected to be gone for a while when reconnecting. */
+        if (socket->reconnecting)
+            LOG_DEBUG(logger, (_T("Failed to connect to socket: Error %d"), error));
+        else
+            LOG_ERROR(logger, (_T("Failed to connect to socket: Error %d"), error));
+        /* A failed socket can't be connected again, the next attempt starts with a new one. */
+        unixlib_funcs.close(socket->fd);
+        socket->fd = -1;
+        return false;
+    }
+
+    *out_connected = !!connected;
+    return true;
+}
+
+bool socket_probe(logger_instance* const logger, int const fd)
+{
+    int alive;
+    int error;
+
+    error = unixlib_funcs.probe(fd, &alive);
+    if (error)
+    {
+        LOG_DEBUG(logger, (_T("Probing socket failed: Error %d"), error));
+        return false;
+    }
+
+    return !!alive;
+}
+
+bool socket_send_nonblocking(logger_instance* const logger, int const fd, unsigned char const* const data,
+                             size_t const length, size_t* const out_written)
+{
+    int error;
+
+    error = unixlib_funcs.send(fd, data, length, out_written);
+    if (error)
+    {
+        LOG_DEBUG(logger, (_T("Writing to socket failed: Error %d"), error));
+        return false;
+    }
 
     return true;
 }
 
+void socket_set_buffer_size(logger_instance* const logger, int const fd, int const size)
+{
+    int error;
+
+    /* The defaults still work, so a refused size is not worth dropping the connection for. */
+    error = unixlib_funcs.set_buffer_size(fd, size);
+    if (error)
+        LOG_WARNING(logger, (_T("Could not set socket buffer size to %d bytes: Error %d"), size, error));
+}
+
 bool socket_disconnect(logger_instance* const logger, socket_data* const socket)
 {
     LOG_TRACE(logger, (_T("Closing socket")));
 
-    unixlib_funcs.close(socket->fd);
-    unixlib_funcs.close_thread_exit_event(socket->event);
-    HeapFree(GetProcessHeap(), 0, socket->address);
+    if (socket->fd != -1)
+    {
+        /* Remove the socket file so that clients fail right away instead of connecting to a dead address. */
+        if (socket->listening)
+            unixlib_funcs.unlink(socket->address);
+        unixlib_funcs.close(socket->fd);
+        socket->fd = -1;
+    }
+    if (socket->address)
+    {
+        HeapFree(GetProcessHeap(), 0, socket->address);
+        socket->address = 0;
+    }
+    if (socket->recv_buffer)
+    {
+        buffer_pool_free(socket->recv_buffer);
+        socket->recv_buffer = 0;
+    }
+    socket_reset_frame(socket);
+    if (socket->send_queue)
+    {
+        unsigned int i;
+
+        for (i = 0; i < socket->send_count; ++i)
+            buffer_pool_free(socket->send_queue[(socket->send_head + i) % SEND_QUEUE_DEPTH].buffer);
+        for (i = 0; i < socket->replay_count; ++i)
+            buffer_pool_free(socket->replay[i].buffer);
+        socket->replay_count = 0;
+        DeleteCriticalSection(&socket->send_lock);
+        HeapFree(GetProcessHeap(), 0, socket->send_queue);
+        socket->send_queue = 0;
+    }
+    if (socket->splice)
+    {
+        socket_splice_close(socket->splice);
+        socket->splice = 0;
+    }
 
     LOG_TRACE(logger, (_T("Closed socket")));
 
     return true;
 }
 
-void socket_cleanup(logger_instance* const logger, connection_data* const conn)
+bool socket_reactor_create(logger_instance* const logger, reactor** const out_reactor)
 {
-    LOG_TRACE(logger, (_T("Cleaning up after socket thread")));
+    int error;
 
-    if (InterlockedIncrement(&conn->do_cleanup) >= 2)
+    error = unixlib_funcs.reactor_create(out_reactor);
+    if (error)
     {
-        LOG_DEBUG(logger, (_T("Pipe thread exited, closing socket")));
-        pipe_close_server(logger, &conn->pipe);
-        socket_disconnect(logger, &conn->socket);
-        connection_list_deallocate_entry(logger, &conn->proxy->conn_list, conn);
+        LOG_CRITICAL(logger, (_T("Failed to create socket reactor: Error %d"), error));
+        return false;
     }
-    else
+
+    return true;
+}
+
+void socket_reactor_destroy(logger_instance* const logger, reactor* const reactor)
+{
+    (void)logger;
+
+    unixlib_funcs.reactor_destroy(reactor);
+}
+
+bool socket_reactor_add(logger_instance* const logger, reactor* const reactor, int const fd, int const events,
+                        void* const data)
+{
+    int error;
+
+    error = unixlib_funcs.reactor_add(reactor, fd, events, data);
+    if (error)
     {
-        LOG_DEBUG(logger, (_T("Pipe thread is still running, not closing socket")));
-        thread_dispose(logger, &pipe_thread_description, &conn->pipe.thread);
+        LOG_ERROR(logger, (_T("Failed to add socket to reactor: Error %d"), error));
+        return false;
     }
 
-    LOG_TRACE(logger, (_T("Cleaned up after socket thread")));
+    return true;
 }
 
-bool socket_stop_thread(logger_instance* const logger, socket_data* const socket)
+bool socket_reactor_rearm(logger_instance* const logger, reactor* const reactor, int const fd, int const events,
+                          void* const data)
 {
-    bool ret = true;
+    int error;
 
-    LOG_TRACE(logger, (_T("Stopping socket thread")));
+    error = unixlib_funcs.reactor_rearm(reactor, fd, events, data);
+    if (error)
+    {
+        LOG_ERROR(logger, (_T("Failed to rearm socket in reactor: Error %d"), error));
+        return false;
+    }
+
+    return true;
+}
 
-    if (unixlib_funcs.send_thread_exit_event(socket->event))
-        ret = false;
-    else if (!thread_wait(logger, &socket_thread_description, &socket->thread))
-        ret = false;
+bool socket_reactor_remove(logger_instance* const logger, reactor* const reactor, int const fd)
+{
+    int error;
 
-    LOG_TRACE(logger, (_T("Stopped socket thread")));
+    error = unixlib_funcs.reactor_remove(reactor, fd);
+    if (error)
+    {
+        LOG_ERROR(logger, (_T("Failed to remove socket from reactor: Error %d"), error));
+        return false;
+    }
 
-    return ret;
+    return true;
 }
 
-#define STARTING_BUFFER_SIZE 1024
+bool socket_reactor_wait(logger_instance* const logger, reactor* const reactor, reactor_event* const events,
+                         size_t const max_events, int const timeout_ms, size_t* const out_count)
+{
+    int error;
 
-typedef enum SOCKET_RECV_MSG_RET {
-    SOCKET_RECV_MSG_RET_SUCCESS,
-    SOCKET_RECV_MSG_RET_FAILURE,
-    SOCKET_RECV_MSG_RET_SHUTDOWN,
-    SOCKET_RECV_MSG_RET_EXIT
-} SOCKET_RECV_MSG_RET;
+    error = unixlib_funcs.reactor_wait(reactor, events, max_events, timeout_ms, out_count);
+    if (error)
+    {
+        LOG_ERROR(logger, (_T("Waiting for socket events failed: Error %d"), error));
+        return false;
+    }
 
-static SOCKET_RECV_MSG_RET socket_receive_message(logger_instance* const logger, socket_data* const socket,
-                                                  unsigned char** const inout_buffer, size_t* const inout_buffer_size,
-                                                  size_t* const out_message_length)
+    return true;
+}
+
+bool socket_reactor_wake(logger_instance* const logger, reactor* const reactor)
 {
-    poll_status pstatus;
     int error;
 
-    LOG_TRACE(logger, (_T("Waiting for message from socket")));
+    error = unixlib_funcs.reactor_wake(reactor);
+    if (error)
+    {
+        LOG_ERROR(logger, (_T("Failed to wake socket reactor: Error %d"), error));
+        return false;
+    }
 
-    if (!*inout_buffer)
+    return true;
+}
+
+bool socket_get_handle_fd(logger_instance* const logger, HANDLE const handle, int* const out_fd,
+                          bool* const out_message_mode)
+{
+    int message_mode;
+    int error;
+
+    error = unixlib_funcs.get_handle_fd((void*)handle, out_fd, &message_mode);
+    if (error)
     {
-        *inout_buffer_size = STARTING_BUFFER_SIZE;
-        *inout_buffer = (unsigned char*)HeapAlloc(GetProcessHeap(), 0, sizeof(unsigned char) * STARTING_BUFFER_SIZE);
-        if (!*inout_buffer)
-        {
-            LOG_ERROR(logger, (
-                _T("Failed to allocate %lu bytes"),
-                (unsigned long)(sizeof(unsigned char) * STARTING_BUFFER_SIZE)
-            ));
-            return SOCKET_RECV_MSG_RET_FAILURE;
-        }
+        LOG_DEBUG(logger, (_T("Could not get host fd of handle: Error %d"), error));
+        return false;
     }
 
-    error = unixlib_funcs.poll(socket->fd, socket->event, &pstatus);
+    *out_message_mode = !!message_mode;
+    return true;
+}
+
+bool socket_splice_open(logger_instance* const logger, int const from_fd, int const to_fd, bool const keep_boundaries,
+                        splice_channel** const out_channel)
+{
+    int error;
+
+    error = unixlib_funcs.splice_open(from_fd, to_fd, keep_boundaries, out_channel);
     if (error)
     {
-        LOG_ERROR(logger, (_T("Call to poll() failed: Error %d"), error));
-        return SOCKET_RECV_MSG_RET_FAILURE;
+        LOG_ERROR(logger, (_T("Failed to open splice channel: Error %d"), error));
+        return false;
     }
 
-    switch (pstatus)
+    return true;
+}
+
+void socket_close_handle_fd(int const fd)
+{
+    unixlib_funcs.close(fd);
+}
+
+void socket_splice_close(splice_channel* const channel)
+{
+    unixlib_funcs.splice_close(channel);
+}
+
+bool socket_splice_transfer(logger_instance* const logger, splice_channel* const channel, bool* const out_closed,
+                            bool* const out_blocked, size_t* const out_transferred)
+{
+    recv_status rstatus;
+    int error;
+
+    /* EAGAIN has the same value in msvcrt and on Linux. */
+    error = unixlib_funcs.splice_transfer(channel, &rstatus, out_transferred);
+    if (error && error != EAGAIN)
     {
-        case POLL_STATUS_SUCCESS:
-            break;
-        case POLL_STATUS_EXIT_SIGNALED:
-            LOG_DEBUG(logger, (_T("Socket thread: Received exit event")));
-            return SOCKET_RECV_MSG_RET_EXIT;
-        case POLL_STATUS_CLOSED_CONNECTION:
-            LOG_INFO(logger, (_T("Server closed connection")));
-            return SOCKET_RECV_MSG_RET_SHUTDOWN;
-        case POLL_STATUS_INVALID_MESSAGE_FLAGS:
-            LOG_ERROR(logger, (_T("Unhandled flags returned from poll")));
-            return SOCKET_RECV_MSG_RET_FAILURE;
+        LOG_ERROR(logger, (_T("Splicing data failed: Error %d"), error));
+        return false;
     }
 
+    *out_closed = rstatus == RECV_STATUS_CLOSED;
+    *out_blocked = error == EAGAIN;
+    return true;
+}
+
+typedef enum SOCKET_RECV_MSG_RET {
+    SOCKET_RECV_MSG_RET_SUCCESS,
+    SOCKET_RECV_MSG_RET_FAILURE,
+    SOCKET_RECV_MSG_RET_SHUTDOWN,
+    SOCKET_RECV_MSG_RET_INVALID     /* The peer sent data that can't be forwarded. */
+} SOCKET_RECV_MSG_RET;
+
+static SOCKET_RECV_MSG_RET socket_receive_message(logger_instance* const logger, connection_data* const conn,
+                                                  size_t* const out_message_length)
+{
+    socket_data* const socket = &conn->socket;
+    size_t message_length;
+    int error;
+
+    LOG_TRACE(logger, (_T("Reading message from socket")));
+
+    message_length = 0;
     while (true)
     {
-        size_t msg_len;
+        size_t received, pending;
         recv_status rstatus;
         size_t new_buffer_size;
         unsigned char* new_buffer;
 
-        LOG_TRACE(logger, (_T("Reading message from socket")));
-
-        error = unixlib_funcs.recv(socket->fd, *inout_buffer, *inout_buffer_size, &rstatus, &msg_len);
+        error = unixlib_funcs.recv(socket->fd, &socket->recv_buffer[message_length],
+                                   socket->recv_buffer_size - message_length, &rstatus, &received, &pending);
         if (error)
         {
             LOG_ERROR(logger, (_T("Reading from socket failed: Error %d"), error));
             return SOCKET_RECV_MSG_RET_FAILURE;
         }
+        message_length += received;
 
-        if (rstatus != RECV_STATUS_INSUFFICIENT_BUFFER)
+        if (rstatus == RECV_STATUS_CLOSED)
         {
-            if (rstatus == RECV_STATUS_DISCARDED_DATA)
-                LOG_ERROR(logger, (_T("Discarded socket data")));
-            else
-                assert(rstatus == RECV_STATUS_SUCCESS);
-            *out_message_length = msg_len;
-            break;
+            /* Pass on what has been read so far, the closed connection is reported again on the next read. */
+            if (message_length)
+                break;
+            LOG_INFO(logger, (_T("Server closed connection")));
+            return SOCKET_RECV_MSG_RET_SHUTDOWN;
         }
 
-        new_buffer_size = msg_len + 1; /* message length + 1, to be safe. */
-        new_buffer = (unsigned char*)HeapReAlloc(GetProcessHeap(), 0, *inout_buffer,
-                                                 sizeof(unsigned char) * new_buffer_size);
+        if (rstatus == RECV_STATUS_SUCCESS)
+            break;
+
+        assert(rstatus == RECV_STATUS_MORE_DATA);
+        /* Only the first read of a message reports that it didn't fit. */
+        if (message_length == received)
+            metrics_count_more_data(conn);
+        metrics_count_reallocation(conn);
+
+        new_buffer_size = buffer_sizer_grow(&socket->recv_sizer, socket->recv_buffer_size, message_length + pending);
+        new_buffer = buffer_pool_realloc(logger, socket->recv_buffer, message_length, new_buffer_size,
+                                         &new_buffer_size);
         if (!new_buffer)
         {
             LOG_ERROR(logger, (
                 _T("Failed to resize incoming socket data buffer from %lu to %lu bytes"),
-                (unsigned long)*inout_buffer_size,
+                (unsigned long)socket->recv_buffer_size,
                 (unsigned long)(sizeof(unsigned char) * new_buffer_size)
             ));
             return SOCKET_RECV_MSG_RET_FAILURE;
         }
-        *inout_buffer_size = new_buffer_size;
-        *inout_buffer = new_buffer;
+        socket->recv_buffer_size = new_buffer_size;
+        socket->recv_buffer = new_buffer;
     }
 
+    *out_message_length = message_length;
+
     LOG_TRACE(logger, (_T("Read message from socket")));
 
     return SOCKET_RECV_MSG_RET_SUCCESS;
 }
 
-bool socket_handler(logger_instance* const logger, connection_data* const conn)
+unsigned long socket_frame_read_u32(unsigned char const* const bytes)
 {
-    unsigned char* buffer;
-    size_t buffer_size;
-    bool ret;
+    return (unsigned long)bytes[0] | ((unsigned long)bytes[1] << 8) | ((unsigned long)bytes[2] << 16) |
+           ((unsigned long)bytes[3] << 24);
+}
 
-    LOG_TRACE(logger, (_T("Entering socket handler loop")));
+static void socket_count_frame(LONG volatile* const counters, unsigned char const* const frame, size_t const length)
+{
+    unsigned long opcode;
 
-    buffer = 0;
-    buffer_size = 0;
-    while (true)
+    if (length < SOCKET_FRAME_HEADER_SIZE)
+        return;
+    opcode = socket_frame_read_u32(frame);
+    InterlockedIncrement(&counters[opcode < SOCKET_FRAME_OPCODE_COUNT ? opcode : SOCKET_FRAME_OPCODE_COUNT]);
+}
+
+/* Receives one part of the current frame. out_complete is false if less than length bytes were available. */
+static SOCKET_RECV_MSG_RET socket_receive_frame_part(logger_instance* const logger, socket_data* const socket,
+                                                     unsigned char* const buffer, size_t const length,
+                                                     bool* const out_complete)
+{
+    recv_status rstatus;
+    size_t received;
+    int error;
+
+    error = unixlib_funcs.recv_part(socket->fd, buffer, length, &rstatus, &received);
+    if (error)
+    {
+        LOG_ERROR(logger, (_T("Reading from socket failed: Error %d"), error));
+        return SOCKET_RECV_MSG_RET_FAILURE;
+    }
+
+    if (rstatus == RECV_STATUS_CLOSED)
+    {
+        if (socket->frame_received)
+            LOG_WARNING(logger, (_T("Server closed connection in the middle of a frame")));
+        else
+            LOG_INFO(logger, (_T("Server closed connection")));
+        return SOCKET_RECV_MSG_RET_SHUTDOWN;
+    }
+
+    socket->frame_received += received;
+    *out_complete = received == length;
+    return SOCKET_RECV_MSG_RET_SUCCESS;
+}
+
+/* Receives as much of the current frame as is available, without reading past its end. out_frame_length stays 0
+   until the frame is complete, it is in frame_buffer then. A short read means that the socket is drained, so no
+   call is made just to find that out. */
+static SOCKET_RECV_MSG_RET socket_receive_frame(logger_instance* const logger, socket_data* const socket,
+                                                size_t* const out_frame_length)
+{
+    SOCKET_RECV_MSG_RET ret;
+    bool complete;
+
+    *out_frame_length = 0;
+
+    if (socket->frame_received < SOCKET_FRAME_HEADER_SIZE)
+    {
+        ret = socket_receive_frame_part(logger, socket, &socket->frame_header[socket->frame_received],
+                                        SOCKET_FRAME_HEADER_SIZE - socket->frame_received, &complete);
+        if (ret != SOCKET_RECV_MSG_RET_SUCCESS || !complete)
+            return ret;
+    }
+
+    if (!socket->frame_buffer)
     {
-        size_t message_length;
-        SOCKET_RECV_MSG_RET recv_ret;
+        unsigned long const opcode = socket_frame_read_u32(&socket->frame_header[0]);
+        unsigned long const payload_length = socket_frame_read_u32(&socket->frame_header[4]);
+        size_t capacity;
 
-        recv_ret = socket_receive_message(logger, &conn->socket, &buffer, &buffer_size, &message_length);
-        if (recv_ret != SOCKET_RECV_MSG_RET_SUCCESS)
+        /* Checked before allocating, so that a corrupt header can't make the proxy allocate gigabytes. */
+        if (payload_length > socket->max_frame_size)
         {
-            ret = recv_ret != SOCKET_RECV_MSG_RET_FAILURE;
-            break;
+            LOG_ERROR(logger, (
+                _T("Frame with opcode %lu and %lu bytes of payload exceeds the limit of %lu bytes"),
+                opcode,
+                payload_length,
+                (unsigned long)socket->max_frame_size
+            ));
+            return SOCKET_RECV_MSG_RET_INVALID;
         }
 
-        if (LOG_IS_ENABLED(logger, LOG_LEVEL_DEBUG))
+        socket->frame_length = SOCKET_FRAME_HEADER_SIZE + (size_t)payload_length;
+        socket->frame_buffer = buffer_pool_alloc(logger, socket->frame_length, &capacity);
+        if (!socket->frame_buffer)
+            return SOCKET_RECV_MSG_RET_INVALID;
+        RtlCopyMemory(socket->frame_buffer, socket->frame_header, SOCKET_FRAME_HEADER_SIZE);
+    }
+
+    if (socket->frame_received < socket->frame_length)
+    {
+        ret = socket_receive_frame_part(logger, socket, &socket->frame_buffer[socket->frame_received],
+                                        socket->frame_length - socket->frame_received, &complete);
+        if (ret != SOCKET_RECV_MSG_RET_SUCCESS || !complete)
+            return ret;
+    }
+
+    *out_frame_length = socket->frame_length;
+    return SOCKET_RECV_MSG_RET_SUCCESS;
+}
+
+/* Writes every frame to the pipe as one message, so that the client reads exactly one frame per read. */
+static void socket_forward_frame(logger_instance* const logger, connection_data* const conn)
+{
+    socket_data* const socket = &conn->socket;
+    unsigned char* frame;
+    size_t frame_length;
+
+    switch (socket_receive_frame(logger, socket, &frame_length))
+    {
+        case SOCKET_RECV_MSG_RET_SUCCESS:
+            break;
+        case SOCKET_RECV_MSG_RET_INVALID:
+            metrics_count_discarded(conn, 1);
+            connection_close(conn);
+            return;
+        default:
+            proxy_server_lost(conn);
+            return;
+    }
+
+    if (!frame_length)
+    {
+        io_engine_arm(logger, &conn->proxy->engine, &socket->watch, REACTOR_EVENT_READABLE);
+        return;
+    }
+
+    /* The buffer is owned by the pipe write from now on. */
+    frame = socket->frame_buffer;
+    socket->frame_buffer = 0;
+    socket_reset_frame(socket);
+
+    socket_count_frame(conn->route->frames_from_socket, frame, frame_length);
+    if (LOG_IS_ENABLED(logger, LOG_LEVEL_DEBUG))
+    {
+        LOG_DEBUG(logger, (
+            _T("Passing frame with opcode %lu and %lu bytes from socket to pipe"),
+            socket_frame_read_u32(frame),
+            (unsigned long)frame_length
+        ));
+        dbg_output_bytes(logger, _T("Frame from socket: "), frame, frame_length);
+    }
+
+    if (!pipe_send_message(logger, conn, frame, frame_length))
+    {
+        buffer_pool_free(frame);
+        connection_close(conn);
+        return;
+    }
+
+    connection_count_message(conn, METRICS_DIRECTION_SOCKET_TO_PIPE, frame_length);
+}
+
+void socket_readable(logger_instance* const logger, connection_data* const conn)
+{
+    unsigned char* buffer;
+    size_t message_length, next_buffer_size;
+
+    if (InterlockedRead(&conn->closing))
+        return;
+
+    if (conn->socket.splice)
+    {
+        bool closed, blocked;
+
+        if (!socket_splice_transfer(logger, conn->socket.splice, &closed, &blocked, &message_length))
         {
-            LOG_DEBUG(logger, (_T("Passing %lu bytes from socket to pipe"), message_length));
-            dbg_output_bytes(logger, _T("Message from socket: "), buffer, message_length);
+            connection_close(conn);
+            return;
+        }
+        if (closed)
+        {
+            LOG_INFO(logger, (_T("Server closed connection")));
+            connection_close(conn);
+            return;
         }
 
-        if (!pipe_send_message(logger, &conn->pipe, buffer, message_length))
+        if (message_length)
         {
-            ret = InterlockedRead(&conn->pipe.thread.status) >= THREAD_STATUS_STOPPING;
-            break;
+            LOG_DEBUG(logger, (_T("Spliced %lu bytes from socket to pipe"), (unsigned long)message_length));
+            connection_count_message(conn, METRICS_DIRECTION_SOCKET_TO_PIPE, message_length);
         }
+
+        /* The socket isn't read again until the pipe has taken the rest, pipe_writable continues then. */
+        if (blocked)
+            io_engine_arm(logger, &conn->proxy->engine, &conn->pipe.watch, REACTOR_EVENT_WRITABLE);
+        else
+            io_engine_arm(logger, &conn->proxy->engine, &conn->socket.watch, REACTOR_EVENT_READABLE);
+        return;
     }
 
-    if (buffer)
-        HeapFree(GetProcessHeap(), 0, buffer);
+    if (conn->socket.framing)
+    {
+        socket_forward_frame(logger, conn);
+        return;
+    }
 
-    LOG_TRACE(logger, (_T("Exited socket handler loop")));
+    /* The idle check is swapping the receive buffer, the data is read once the watch reports it again. */
+    if (InterlockedCompareExchange(&conn->socket.recv_busy, TRUE, FALSE))
+    {
+        io_engine_arm(logger, &conn->proxy->engine, &conn->socket.watch, REACTOR_EVENT_READABLE);
+        return;
+    }
 
-    return ret;
+    if (socket_receive_message(logger, conn, &message_length) != SOCKET_RECV_MSG_RET_SUCCESS)
+    {
+        InterlockedExchange(&conn->socket.recv_busy, FALSE);
+        proxy_server_lost(conn);
+        return;
+    }
+
+    /* The socket is non-blocking, so a readiness report doesn't guarantee that there is data. */
+    if (!message_length)
+    {
+        InterlockedExchange(&conn->socket.recv_busy, FALSE);
+        io_engine_arm(logger, &conn->proxy->engine, &conn->socket.watch, REACTOR_EVENT_READABLE);
+        return;
+    }
+
+    if (LOG_IS_ENABLED(logger, LOG_LEVEL_DEBUG))
+    {
+        LOG_DEBUG(logger, (_T("Passing %lu bytes from socket to pipe"), (unsigned long)message_length));
+        dbg_output_bytes(logger, _T("Message from socket: "), conn->socket.recv_buffer, message_length);
+    }
+
+    /* The buffer is owned by the pipe write from now on, so keep receiving into a fresh one. */
+    buffer = conn->socket.recv_buffer;
+    next_buffer_size = buffer_sizer_record(&conn->socket.recv_sizer, message_length, conn->socket.recv_buffer_size);
+    if (next_buffer_size != conn->socket.recv_buffer_size)
+        metrics_count_reallocation(conn);
+    conn->socket.recv_buffer = buffer_pool_alloc(logger, next_buffer_size, &conn->socket.recv_buffer_size);
+    InterlockedExchange(&conn->socket.recv_busy, FALSE);
+    if (!conn->socket.recv_buffer)
+    {
+        buffer_pool_free(buffer);
+        connection_close(conn);
+        return;
+    }
+
+    if (!pipe_send_message(logger, conn, buffer, message_length))
+    {
+        buffer_pool_free(buffer);
+        connection_close(conn);
+        return;
+    }
+
+    connection_count_message(conn, METRICS_DIRECTION_SOCKET_TO_PIPE, message_length);
+}
+
+void socket_shrink_idle_buffer(logger_instance* const logger, connection_data* const conn)
+{
+    socket_data* const socket = &conn->socket;
+    unsigned char* new_buffer;
+    size_t new_size;
+
+    if (socket->splice || socket->framing || !buffer_sizer_idle(&socket->recv_sizer))
+        return;
+
+    /* A reader that is busy with the buffer isn't idle, so it is left alone until the next check. */
+    if (InterlockedCompareExchange(&socket->recv_busy, TRUE, FALSE))
+        return;
+
+    new_size = buffer_sizer_shrink_idle(&socket->recv_sizer, socket->recv_buffer_size);
+    if (new_size != socket->recv_buffer_size && (new_buffer = buffer_pool_alloc(logger, new_size, &new_size)))
+    {
+        LOG_DEBUG(logger, (
+            _T("Resizing idle socket receive buffer from %lu to %lu bytes"),
+            (unsigned long)socket->recv_buffer_size,
+            (unsigned long)new_size
+        ));
+        buffer_pool_free(socket->recv_buffer);
+        socket->recv_buffer = new_buffer;
+        socket->recv_buffer_size = new_size;
+        metrics_count_reallocation(conn);
+    }
+
+    InterlockedExchange(&socket->recv_busy, FALSE);
 }
 
-bool socket_send_message(logger_instance* const logger, socket_data* const socket, unsigned char const* const message,
-                         size_t const message_length)
+unsigned long socket_get_syscall_count(void)
 {
-    size_t bytes_written;
+    return unixlib_funcs.get_syscall_count();
+}
+
+/* Keeps track of the kept messages that the server has received, which are the first ones written. */
+static void socket_count_written(socket_data* const socket)
+{
+    if (socket->replay_written < socket->replay_limit)
+        ++socket->replay_written;
+}
+
+/* Keeps a copy of one of the first messages of the client. Must be called with the send lock held. */
+static void socket_keep_for_replay(logger_instance* const logger, socket_data* const socket,
+                                   unsigned char const* const buffer, size_t const message_length)
+{
+    socket_send_chunk* const chunk = &socket->replay[socket->replay_count];
+    size_t capacity;
+
+    chunk->buffer = buffer_pool_alloc(logger, message_length, &capacity);
+    if (!chunk->buffer)
+    {
+        /* Replaying only some of the messages would confuse the server, so the later ones are not kept either. */
+        LOG_WARNING(logger, (_T("Could not keep message for replaying, keeping %u messages"), socket->replay_count));
+        socket->replay_limit = socket->replay_count;
+        return;
+    }
+    RtlCopyMemory(chunk->buffer, buffer, message_length);
+    chunk->offset = 0;
+    chunk->length = message_length;
+    ++socket->replay_count;
+}
+
+/* Writes as much of the queue as the socket accepts. Must be called with the send lock held. */
+static bool socket_flush_send_queue(logger_instance* const logger, socket_data* const socket)
+{
+    socket_buffer buffers[SEND_QUEUE_DEPTH];
+    size_t written;
+    unsigned int i;
     int error;
 
-    LOG_TRACE(logger, (_T("Sending message to socket")));
+    if (!socket->send_count)
+        return true;
 
-    if (InterlockedRead(&socket->thread.status) >= THREAD_STATUS_STOPPING)
+    for (i = 0; i < socket->send_count; ++i)
     {
-        LOG_ERROR(logger, (_T("Can't send message to closed socket")));
-        return false;
+        socket_send_chunk const* const chunk = &socket->send_queue[(socket->send_head + i) % SEND_QUEUE_DEPTH];
+        buffers[i].data = &chunk->buffer[chunk->offset];
+        buffers[i].length = chunk->length - chunk->offset;
     }
 
-    error = unixlib_funcs.send(socket->fd, message, message_length, &bytes_written);
+    error = unixlib_funcs.writev(socket->fd, buffers, socket->send_count, &written);
     if (error)
     {
         LOG_ERROR(logger, (_T("Error %d while writing to socket"), error));
         return false;
     }
-    else if (bytes_written != message_length)
+
+    /* Release the chunks that have been written completely and remember how far the next one got. */
+    while (socket->send_count)
     {
-        LOG_ERROR(logger, (
-            bytes_written < message_length
-            ? _T("Partial write to socket: %lu < %lu")
-            : _T("Invalid return value from write: %lu > %lu"),
-            (unsigned long)bytes_written,
-            (unsigned long)message_length
-        ));
+        socket_send_chunk* const chunk = &socket->send_queue[socket->send_head];
+        size_t const remaining = chunk->length - chunk->offset;
+
+        if (written < remaining)
+        {
+            chunk->offset += written;
+            break;
+        }
+        written -= remaining;
+
+        buffer_pool_free(chunk->buffer);
+        chunk->buffer = 0;
+        socket->send_head = (socket->send_head + 1) % SEND_QUEUE_DEPTH;
+        --socket->send_count;
+        socket_count_written(socket);
+    }
+
+    return true;
+}
+
+/* Messages that don't come from the pipe reader never pause it. They are only taken while there is room for them
+   and for the message of a pipe read that may be in flight, so that the reader can't overflow the queue. */
+static SOCKET_SEND_RET socket_send_or_queue(logger_instance* const logger, connection_data* const conn,
+                                            unsigned char** const inout_buffer, size_t* const inout_buffer_size,
+                                            size_t const message_length, bool const from_pipe_reader)
+{
+    socket_data* const socket = &conn->socket;
+    socket_send_chunk* chunk;
+    unsigned char* new_buffer;
+    size_t new_buffer_size, written;
+    SOCKET_SEND_RET ret;
+    int error;
+
+    LOG_TRACE(logger, (_T("Sending message to socket")));
+
+    EnterCriticalSection(&socket->send_lock);
+
+    if (!from_pipe_reader && socket->send_count + 1 >= socket->send_limit)
+    {
+        LeaveCriticalSection(&socket->send_lock);
+        LOG_TRACE(logger, (_T("No room for message in socket send queue")));
+        return SOCKET_SEND_RET_BLOCKED;
+    }
+
+    if (socket->framing)
+        socket_count_frame(conn->route->frames_from_pipe, *inout_buffer, message_length);
+    if (socket->replay_count < socket->replay_limit)
+        socket_keep_for_replay(logger, socket, *inout_buffer, message_length);
+
+    /* Write directly if nothing is queued. The message is only queued if the socket doesn't take all of it. */
+    written = 0;
+    if (!socket->send_count && !socket->lost)
+    {
+        error = unixlib_funcs.send(socket->fd, *inout_buffer, message_length, &written);
+        if (error && socket->reconnect)
+        {
+            /* The socket reader notices the closed connection and reconnects, until then the message waits. */
+            LOG_DEBUG(logger, (_T("Error %d while writing to socket, queueing until reconnected"), error));
+            socket->lost = true;
+            written = 0;
+        }
+        else if (error)
+        {
+            LeaveCriticalSection(&socket->send_lock);
+            LOG_ERROR(logger, (_T("Error %d while writing to socket"), error));
+            return SOCKET_SEND_RET_FAILURE;
+        }
+        if (written > message_length)
+        {
+            LeaveCriticalSection(&socket->send_lock);
+            LOG_ERROR(logger, (
+                _T("Invalid return value from write: %lu > %lu"),
+                (unsigned long)written,
+                (unsigned long)message_length
+            ));
+            return SOCKET_SEND_RET_FAILURE;
+        }
+        if (written == message_length)
+        {
+            socket_count_written(socket);
+            LeaveCriticalSection(&socket->send_lock);
+            LOG_TRACE(logger, (_T("Sent message to socket")));
+            return SOCKET_SEND_RET_SENT;
+        }
+    }
+
+    if (socket->send_count == SEND_QUEUE_DEPTH)
+    {
+        LeaveCriticalSection(&socket->send_lock);
+        LOG_ERROR(logger, (_T("Socket send queue is full")));
+        return SOCKET_SEND_RET_FAILURE;
+    }
+
+    /* The queue takes over the buffer, the caller continues with a new one. */
+    new_buffer = buffer_pool_alloc(logger, *inout_buffer_size, &new_buffer_size);
+    if (!new_buffer)
+    {
+        LeaveCriticalSection(&socket->send_lock);
+        return SOCKET_SEND_RET_FAILURE;
+    }
+
+    chunk = &socket->send_queue[(socket->send_head + socket->send_count) % SEND_QUEUE_DEPTH];
+    chunk->buffer = *inout_buffer;
+    chunk->offset = written;
+    chunk->length = message_length;
+    ++socket->send_count;
+    *inout_buffer = new_buffer;
+    *inout_buffer_size = new_buffer_size;
+
+    if (from_pipe_reader && socket->send_count >= socket->send_limit)
+    {
+        socket->pipe_reader_paused = true;
+        ret = SOCKET_SEND_RET_BLOCKED;
+    }
+    else
+        ret = SOCKET_SEND_RET_QUEUED;
+
+    if (socket->send_count == 1 && !socket->lost)
+        io_engine_arm(logger, &conn->proxy->engine, &socket->watch, REACTOR_EVENT_WRITABLE);
+
+    LOG_TRACE(logger, (_T("Queued message for socket, %u messages waiting"), socket->send_count));
+
+    LeaveCriticalSection(&socket->send_lock);
+
+    return ret;
+}
+
+SOCKET_SEND_RET socket_send_message(logger_instance* const logger, connection_data* const conn,
+                                    unsigned char** const inout_buffer, size_t* const inout_buffer_size,
+                                    size_t const message_length)
+{
+    return socket_send_or_queue(logger, conn, inout_buffer, inout_buffer_size, message_length, true);
+}
+
+SOCKET_SEND_RET socket_send_extra_message(logger_instance* const logger, connection_data* const conn,
+                                          unsigned char** const inout_buffer, size_t* const inout_buffer_size,
+                                          size_t const message_length)
+{
+    return socket_send_or_queue(logger, conn, inout_buffer, inout_buffer_size, message_length, false);
+}
+
+void socket_writable(logger_instance* const logger, connection_data* const conn)
+{
+    socket_data* const socket = &conn->socket;
+    bool resume;
+
+    if (InterlockedRead(&conn->closing))
+        return;
+
+    /* Spliced pipe data is waiting for room in the socket. The send queue isn't used while splicing. */
+    if (conn->pipe.splice)
+    {
+        pipe_readable(logger, conn);
+        return;
+    }
+
+    EnterCriticalSection(&socket->send_lock);
+
+    /* The queue is flushed again once the socket has been replaced. */
+    if (socket->lost)
+    {
+        LeaveCriticalSection(&socket->send_lock);
+        return;
+    }
+
+    if (!socket_flush_send_queue(logger, socket))
+    {
+        if (socket->reconnect)
+        {
+            socket->lost = true;
+            LeaveCriticalSection(&socket->send_lock);
+            return;
+        }
+        LeaveCriticalSection(&socket->send_lock);
+        connection_close(conn);
+        return;
+    }
+
+    if (socket->send_count)
+        io_engine_arm(logger, &conn->proxy->engine, &socket->watch, REACTOR_EVENT_WRITABLE);
+
+    resume = socket->pipe_reader_paused && socket->send_count <= SEND_QUEUE_LOW_WATERMARK;
+    if (resume)
+        socket->pipe_reader_paused = false;
+
+    LeaveCriticalSection(&socket->send_lock);
+
+    if (resume)
+    {
+        LOG_DEBUG(logger, (_T("Resuming pipe reader")));
+        if (!pipe_start_read(logger, conn))
+            connection_close(conn);
+    }
+}
+
+void socket_detach(logger_instance* const logger, connection_data* const conn)
+{
+    socket_data* const socket = &conn->socket;
+
+    LOG_TRACE(logger, (_T("Detaching lost socket")));
+
+    EnterCriticalSection(&socket->send_lock);
+    socket->lost = true;
+    LeaveCriticalSection(&socket->send_lock);
+
+    /* Only the socket reader calls this, and the writers leave the fd alone once it is marked as lost. */
+    io_engine_move_watch(logger, &conn->proxy->engine, &socket->watch, -1, 0);
+    unixlib_funcs.close(socket->fd);
+    socket->fd = -1;
+
+    /* The new server starts a new stream. */
+    socket_reset_frame(socket);
+}
+
+bool socket_attach(logger_instance* const logger, connection_data* const conn)
+{
+    socket_data* const socket = &conn->socket;
+    unsigned int replay, i;
+    int events;
+
+    LOG_TRACE(logger, (_T("Attaching reconnected socket")));
+
+    EnterCriticalSection(&socket->send_lock);
+
+    /* The new server hasn't seen any part of the queued messages. */
+    if (socket->send_count)
+        socket->send_queue[socket->send_head].offset = 0;
+
+    /* Kept messages that are still queued are sent anyway, so only the written ones are put in front of them. The
+       send limit keeps enough slots free. */
+    replay = socket->replay_written < socket->replay_count ? socket->replay_written : socket->replay_count;
+    for (i = replay; i-- > 0;)
+    {
+        socket_send_chunk* chunk;
+        unsigned char* buffer;
+        size_t capacity;
+
+        buffer = buffer_pool_alloc(logger, socket->replay[i].length, &capacity);
+        if (!buffer)
+        {
+            LeaveCriticalSection(&socket->send_lock);
+            return false;
+        }
+        RtlCopyMemory(buffer, socket->replay[i].buffer, socket->replay[i].length);
+
+        socket->send_head = (socket->send_head + SEND_QUEUE_DEPTH - 1) % SEND_QUEUE_DEPTH;
+        ++socket->send_count;
+        chunk = &socket->send_queue[socket->send_head];
+        chunk->buffer = buffer;
+        chunk->offset = 0;
+        chunk->length = socket->replay[i].length;
+    }
+    if (replay)
+        LOG_DEBUG(logger, (_T("Replaying %u messages to the server"), replay));
+    /* The replayed messages are the first ones written to the new server. */
+    socket->replay_written = 0;
+
+    socket->lost = false;
+    events = REACTOR_EVENT_READABLE;
+    if (socket->send_count)
+        events |= REACTOR_EVENT_WRITABLE;
+    if (!io_engine_move_watch(logger, &conn->proxy->engine, &socket->watch, socket->fd, events))
+    {
+        LeaveCriticalSection(&socket->send_lock);
         return false;
     }
 
-    LOG_TRACE(logger, (_T("Sent message to socket")));
+    LeaveCriticalSection(&socket->send_lock);
+
+    LOG_TRACE(logger, (_T("Attached reconnected socket")));
 
     return true;
 }
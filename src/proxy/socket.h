@@ -19,22 +19,91 @@
 
 #include <stddef.h>
 
+#include <windef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* defined(__cplusplus) */
 
 extern bool socket_init_unixlib(void);
 
+/* Returns an address for the unixlib, to be freed with HeapFree. */
+extern void* socket_make_address(logger_instance* logger, char const* unix_socket_path);
+/* Creates a non-blocking socket that is connected to the address. Fails instead of waiting if the server is busy. */
+extern bool socket_connect_address(logger_instance* logger, void const* address, int* out_fd);
+/* Returns false if the peer of the socket has hung up. */
+extern bool socket_probe(logger_instance* logger, int fd);
+extern void socket_set_buffer_size(logger_instance* logger, int fd, int size);
+/* Writes once to a non-blocking socket. out_written is less than the length if the socket is full. */
+extern bool socket_send_nonblocking(logger_instance* logger, int fd, unsigned char const* data, size_t length,
+                                    size_t* out_written);
+
+/* The socket itself is only created when connecting, unless a connected one is put into the fd field. */
 extern bool socket_prepare(logger_instance* logger, char const* unix_socket_path, socket_data* socket);
-extern bool socket_connect(logger_instance* logger, socket_data* socket);
+/* Makes one connection attempt without blocking. If out_connected is false, the attempt has to be repeated later. */
+extern bool socket_connect_step(logger_instance* logger, socket_data* socket, bool* out_connected);
+/* Takes ownership of an fd returned by socket_accept. */
+extern bool socket_prepare_accepted(logger_instance* logger, socket_data* socket, int fd);
+/* A listening socket reports new clients through an IO_OPERATION_TYPE_SOCKET_ACCEPT operation instead of data. */
+extern bool socket_listen(logger_instance* logger, char const* unix_socket_path, socket_data* socket);
+/* out_fd is -1 if no client is waiting. */
+extern bool socket_accept(logger_instance* logger, socket_data* socket, int* out_fd);
 extern bool socket_disconnect(logger_instance* logger, socket_data* socket);
-extern void socket_cleanup(logger_instance* logger, connection_data* conn);
 
-extern bool socket_stop_thread(logger_instance* logger, socket_data* socket); /* Only called if thread is running. */
-extern bool socket_handler(logger_instance* logger, connection_data* conn);
+/* Splits the data from the socket into Discord IPC frames, which are passed to the pipe one per message. */
+extern void socket_enable_framing(socket_data* socket, size_t max_frame_size);
+/* Keeps the connection usable while the server is gone. The first replay_messages client messages are kept to be
+   sent again after reconnecting. */
+extern void socket_enable_reconnect(socket_data* socket, unsigned int replay_messages);
+/* Closes the socket of a lost server. Client messages are queued until socket_attach is called with a new fd. */
+extern void socket_detach(logger_instance* logger, connection_data* conn);
+extern bool socket_attach(logger_instance* logger, connection_data* conn);
+
+extern bool socket_reactor_create(logger_instance* logger, reactor** out_reactor);
+extern void socket_reactor_destroy(logger_instance* logger, reactor* reactor);
+extern bool socket_reactor_add(logger_instance* logger, reactor* reactor, int fd, int events, void* data);
+extern bool socket_reactor_rearm(logger_instance* logger, reactor* reactor, int fd, int events, void* data);
+extern bool socket_reactor_remove(logger_instance* logger, reactor* reactor, int fd);
+extern bool socket_reactor_wait(logger_instance* logger, reactor* reactor, reactor_event* events, size_t max_events,
+                                int timeout_ms, size_t* out_count);
+extern bool socket_reactor_wake(logger_instance* logger, reactor* reactor);
+
+/* Splicing moves data between the socket and the host fd of the pipe inside the unixlib. */
+extern bool socket_get_handle_fd(logger_instance* logger, HANDLE handle, int* out_fd, bool* out_message_mode);
+extern void socket_close_handle_fd(int fd);
+extern bool socket_splice_open(logger_instance* logger, int from_fd, int to_fd, bool keep_boundaries,
+                               splice_channel** out_channel);
+extern void socket_splice_close(splice_channel* channel);
+/* out_blocked is set if the destination fd is full. The rest of the data is written by the next transfer, which must
+   wait until the destination is writable. */
+extern bool socket_splice_transfer(logger_instance* logger, splice_channel* channel, bool* out_closed,
+                                   bool* out_blocked, size_t* out_transferred);
+
+extern void socket_readable(logger_instance* logger, connection_data* conn);
+/* Called by the idle check. Replaces the receive buffer with a smaller one if it has been bigger than needed for a
+   while. */
+extern void socket_shrink_idle_buffer(logger_instance* logger, connection_data* conn);
+/* Reads the opcode or length field of a frame header. */
+extern unsigned long socket_frame_read_u32(unsigned char const* bytes);
+
+extern unsigned long socket_get_syscall_count(void);
+
+typedef enum SOCKET_SEND_RET {
+    SOCKET_SEND_RET_SENT,       /* Written completely, the caller keeps its buffer. */
+    SOCKET_SEND_RET_QUEUED,     /* The buffer was taken over by the send queue and replaced with a new one. */
+    SOCKET_SEND_RET_BLOCKED,    /* Like SOCKET_SEND_RET_QUEUED, but the pipe must not be read until the queue has
+                                   drained. socket_writable starts the next pipe read then. */
+    SOCKET_SEND_RET_FAILURE
+} SOCKET_SEND_RET;
 
-extern bool socket_send_message(logger_instance* logger, socket_data* socket, unsigned char const* message,
-                                size_t message_length);
+extern SOCKET_SEND_RET socket_send_message(logger_instance* logger, connection_data* conn, unsigned char** inout_buffer,
+                                           size_t* inout_buffer_size, size_t message_length);
+/* Sends a message that the pipe reader didn't read, e.g. one that was held back. SOCKET_SEND_RET_BLOCKED means that
+   the queue has no room and the buffer wasn't taken, the message has to be sent again later. */
+extern SOCKET_SEND_RET socket_send_extra_message(logger_instance* logger, connection_data* conn,
+                                                 unsigned char** inout_buffer, size_t* inout_buffer_size,
+                                                 size_t message_length);
+extern void socket_writable(logger_instance* logger, connection_data* conn);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,131 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#include "socket.h"
+#include "socket_pool.h"
+#include <winestreamproxy/logger.h>
+
+#include <tchar.h>
+#include <windef.h>
+#include <winbase.h>
+#include <winnt.h>
+
+bool socket_pool_initialize(logger_instance* const logger, socket_pool* const pool, char const* const unix_socket_path,
+                            unsigned int const size)
+{
+    pool->size = 0;
+    pool->head = 0;
+    pool->count = 0;
+    pool->filling = false;
+    pool->hits = 0;
+    pool->misses = 0;
+    pool->stale = 0;
+
+    if (!size)
+        return true;
+
+    pool->address = socket_make_address(logger, unix_socket_path);
+    if (!pool->address)
+        return false;
+
+    pool->fds = (int*)HeapAlloc(GetProcessHeap(), 0, sizeof(int) * size);
+    if (!pool->fds)
+    {
+        LOG_CRITICAL(logger, (_T("Failed to allocate %lu bytes"), (unsigned long)(sizeof(int) * size)));
+        HeapFree(GetProcessHeap(), 0, pool->address);
+        return false;
+    }
+
+    InitializeCriticalSection(&pool->lock);
+    pool->size = size;
+
+    return true;
+}
+
+void socket_pool_finalize(socket_pool* const pool)
+{
+    if (!pool->size)
+        return;
+
+    while (pool->count)
+    {
+        socket_close_handle_fd(pool->fds[pool->head]);
+        pool->head = (pool->head + 1) % pool->size;
+        --pool->count;
+    }
+
+    DeleteCriticalSection(&pool->lock);
+    HeapFree(GetProcessHeap(), 0, pool->fds);
+    HeapFree(GetProcessHeap(), 0, pool->address);
+    pool->size = 0;
+}
+
+int socket_pool_take(logger_instance* const logger, socket_pool* const pool)
+{
+    int fd = -1;
+
+    if (!pool->size)
+        return -1;
+
+    EnterCriticalSection(&pool->lock);
+    while (pool->count)
+    {
+        fd = pool->fds[pool->head];
+        pool->head = (pool->head + 1) % pool->size;
+        --pool->count;
+
+        /* The server may have dropped the connection while it was idle. */
+        if (socket_probe(logger, fd))
+            break;
+
+        LOG_DEBUG(logger, (_T("Dropping pooled socket that was closed by the server")));
+        socket_close_handle_fd(fd);
+        InterlockedIncrement(&pool->stale);
+        fd = -1;
+    }
+    LeaveCriticalSection(&pool->lock);
+
+    InterlockedIncrement(fd == -1 ? &pool->misses : &pool->hits);
+
+    return fd;
+}
+
+void socket_pool_fill(logger_instance* const logger, socket_pool* const pool)
+{
+    if (!pool->size)
+        return;
+
+    EnterCriticalSection(&pool->lock);
+    if (pool->filling)
+    {
+        LeaveCriticalSection(&pool->lock);
+        return;
+    }
+    pool->filling = true;
+
+    /* Other threads only take sockets out while the lock is released, so there is always room for the new one. */
+    while (pool->count < pool->size)
+    {
+        bool connected;
+        int fd;
+
+        LeaveCriticalSection(&pool->lock);
+        connected = socket_connect_address(logger, pool->address, &fd);
+        EnterCriticalSection(&pool->lock);
+        if (!connected)
+            break;
+
+        pool->fds[(pool->head + pool->count) % pool->size] = fd;
+        ++pool->count;
+    }
+
+    pool->filling = false;
+    LeaveCriticalSection(&pool->lock);
+}
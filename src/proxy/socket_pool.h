@@ -0,0 +1,36 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#pragma once
+#ifndef __WINESTREAMPROXY_PROXY_SOCKET_POOL_H__
+#define __WINESTREAMPROXY_PROXY_SOCKET_POOL_H__
+
+#include "data/socket_pool_data.h"
+#include "../bool.h"
+#include <winestreamproxy/logger.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/* A size of 0 leaves the pool disabled, every client connects its own socket then. */
+extern bool socket_pool_initialize(logger_instance* logger, socket_pool* pool, char const* unix_socket_path,
+                                   unsigned int size);
+extern void socket_pool_finalize(socket_pool* pool);
+/* Returns a connected socket whose peer hasn't hung up, or -1 if the pool is empty. */
+extern int socket_pool_take(logger_instance* logger, socket_pool* pool);
+/* Connects sockets until the pool is full. Returns immediately if another thread is already doing so. */
+extern void socket_pool_fill(logger_instance* logger, socket_pool* pool);
+
+#ifdef __cplusplus
+}
+#endif /* defined(__cplusplus) */
+
+#endif /* !defined(__WINESTREAMPROXY_PROXY_SOCKET_POOL_H__) */
@@ -82,8 +82,6 @@ DWORD CALLBACK WINAPI dummy_thread_proc(LPVOID const voidp_tpdata)
 
     InterlockedExchange(&tpdata.data->status, THREAD_STATUS_STOPPING);
     tpdata.desc->cleanup_func(tpdata.logger, tpdata.data, tpdata.thread_proc_param);
-    CloseHandle(tpdata.data->handle);
-    CloseHandle(tpdata.data->trigger_event);
     InterlockedExchange(&tpdata.data->status, THREAD_STATUS_STOPPED);
 
     return ret;
@@ -202,25 +200,16 @@ bool thread_stop(logger_instance* const logger, thread_description* const desc,
 
 bool thread_wait(logger_instance* const logger, thread_description* const desc, thread_data* const data)
 {
-    HANDLE thread_handle;
     DWORD wait_result;
 
     (void)desc;
 
     LOG_TRACE(logger, (_T("Waiting for thread to exit")));
 
-    if (!DuplicateHandle(GetCurrentProcess(), data->handle, GetCurrentProcess(), &thread_handle, SYNCHRONIZE, FALSE, 0))
-    {
-        LOG_ERROR(logger, (_T("Could not duplicate thread handle: Error %d"), GetLastError()));
-        return false;
-    }
-
     do {
-        wait_result = WaitForSingleObject(thread_handle, INFINITE);
+        wait_result = WaitForSingleObject(data->handle, INFINITE);
     } while (wait_result == WAIT_TIMEOUT);
 
-    CloseHandle(thread_handle);
-
     switch (wait_result)
     {
         case WAIT_OBJECT_0:
@@ -241,3 +230,22 @@ bool thread_wait(logger_instance* const logger, thread_description* const desc,
 
     return true;
 }
+
+bool thread_dispose(logger_instance* const logger, thread_description* const desc, thread_data* const data)
+{
+    bool ret = true;
+
+    LOG_TRACE(logger, (_T("Disposing thread")));
+
+    if (!thread_stop(logger, desc, data))
+        ret = false;
+    else if (!thread_wait(logger, desc, data))
+        ret = false;
+
+    CloseHandle(data->handle);
+    CloseHandle(data->trigger_event);
+
+    LOG_TRACE(logger, (_T("Disposed thread")));
+
+    return ret;
+}
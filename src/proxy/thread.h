@@ -34,8 +34,9 @@ extern bool thread_prepare(logger_instance* logger, thread_description* desc, th
                            void* thread_proc_param);
 extern THREAD_RUN_ERROR thread_run(logger_instance* logger, thread_description* desc, thread_data* data);
 extern bool thread_stop(logger_instance* logger, thread_description* desc, thread_data* data);
-#define thread_dispose thread_stop
 extern bool thread_wait(logger_instance* logger, thread_description* desc, thread_data* data);
+/* Stops the thread, waits for it to exit and closes its handles. */
+extern bool thread_dispose(logger_instance* logger, thread_description* desc, thread_data* data);
 
 #ifdef __cplusplus
 }
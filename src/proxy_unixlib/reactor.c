@@ -0,0 +1,475 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#ifdef __linux__
+#define reactor_use_epoll
+#define reactor_use_eventfd
+#endif
+
+#include "reactor.h"
+#include "socket.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#ifdef reactor_use_epoll
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#include <pthread.h>
+#endif
+#ifdef reactor_use_eventfd
+#include <sys/eventfd.h>
+#endif
+#include <unistd.h>
+
+/* Maximum number of events returned by one call to reactor_wait. */
+#define REACTOR_MAX_EVENTS 64
+
+/* Shared with socket.c so that readiness waits and wakeups show up in the syscall statistics. */
+extern unsigned long volatile socket_syscall_count;
+#define reactor_count_syscall() ((void)__sync_fetch_and_add(&socket_syscall_count, 1))
+
+/* Used to interrupt a thread waiting in reactor_wait. */
+typedef struct reactor_wake_event {
+    int fds[2];
+} reactor_wake_event;
+
+static int reactor_create_wake_pipe(reactor_wake_event* const out_event)
+{
+    int pfds[2];
+
+    if (pipe(pfds) != -1)
+    {
+        fcntl(pfds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(pfds[1], F_SETFD, FD_CLOEXEC);
+        fcntl(pfds[0], F_SETFL, O_NONBLOCK);
+        fcntl(pfds[1], F_SETFL, O_NONBLOCK);
+        out_event->fds[0] = pfds[0];
+        out_event->fds[1] = pfds[1];
+        return 0;
+    }
+    return errno ? errno : -1;
+}
+
+static int reactor_create_wake_event(reactor_wake_event* const out_event)
+{
+#ifdef reactor_use_eventfd
+    int const efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (efd != -1)
+    {
+        out_event->fds[0] = efd;
+        out_event->fds[1] = efd;
+        return 0;
+    }
+#endif
+    return reactor_create_wake_pipe(out_event);
+}
+
+static void reactor_close_wake_event(reactor_wake_event const event)
+{
+    close(event.fds[0]);
+    if (event.fds[1] != event.fds[0])
+        close(event.fds[1]);
+}
+
+static int reactor_signal_wake_event(reactor_wake_event const event)
+{
+    static char one[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    /* A full pipe means that the event is already signaled. */
+    reactor_count_syscall();
+    if (write(event.fds[1], one, sizeof(one)) <= 0 && errno != EAGAIN)
+        return errno ? errno : -1;
+    return 0;
+}
+
+static void reactor_reset_wake_event(reactor_wake_event const event)
+{
+    char drain[64];
+    ssize_t drained;
+
+    do {
+        reactor_count_syscall();
+        drained = read(event.fds[0], drain, sizeof(drain));
+    } while (drained > 0);
+}
+
+#ifdef reactor_use_epoll
+
+struct reactor {
+    int                 epoll_fd;
+    reactor_wake_event  wake_event;
+};
+
+int SOCKUNIXAPI reactor_create(reactor** const out_reactor)
+{
+    struct epoll_event event;
+    reactor* r;
+    int error;
+
+    r = (reactor*)malloc(sizeof(reactor));
+    if (!r)
+        return ENOMEM;
+
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epoll_fd == -1)
+    {
+        error = errno ? errno : -1;
+        free(r);
+        return error;
+    }
+
+    error = reactor_create_wake_event(&r->wake_event);
+    if (error)
+    {
+        close(r->epoll_fd);
+        free(r);
+        return error;
+    }
+
+    /* The wake event is level-triggered and identified by a null data pointer. */
+    event.events = EPOLLIN;
+    event.data.ptr = 0;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_event.fds[0], &event) != 0)
+    {
+        error = errno ? errno : -1;
+        reactor_close_wake_event(r->wake_event);
+        close(r->epoll_fd);
+        free(r);
+        return error;
+    }
+
+    *out_reactor = r;
+    return 0;
+}
+
+void SOCKUNIXAPI reactor_destroy(reactor* const reactor)
+{
+    reactor_close_wake_event(reactor->wake_event);
+    close(reactor->epoll_fd);
+    free(reactor);
+}
+
+static int reactor_ctl(reactor* const reactor, int const op, int const socket, int const events, void* const data)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLONESHOT;
+    if (events & REACTOR_EVENT_READABLE)
+        event.events |= EPOLLIN | EPOLLRDHUP;
+    if (events & REACTOR_EVENT_WRITABLE)
+        event.events |= EPOLLOUT;
+    event.data.ptr = data;
+    reactor_count_syscall();
+    if (epoll_ctl(reactor->epoll_fd, op, socket, &event) != 0)
+        return errno ? errno : -1;
+    return 0;
+}
+
+int SOCKUNIXAPI reactor_add(reactor* const reactor, int const socket, int const events, void* const data)
+{
+    return reactor_ctl(reactor, EPOLL_CTL_ADD, socket, events, data);
+}
+
+int SOCKUNIXAPI reactor_rearm(reactor* const reactor, int const socket, int const events, void* const data)
+{
+    return reactor_ctl(reactor, EPOLL_CTL_MOD, socket, events, data);
+}
+
+int SOCKUNIXAPI reactor_remove(reactor* const reactor, int const socket)
+{
+    return reactor_ctl(reactor, EPOLL_CTL_DEL, socket, 0, 0);
+}
+
+int SOCKUNIXAPI reactor_wait(reactor* const reactor, reactor_event* const events, size_t max_events,
+                             int const timeout_ms, size_t* const out_count)
+{
+    struct epoll_event epoll_events[REACTOR_MAX_EVENTS];
+    size_t count;
+    int nfds, i;
+
+    if (max_events > REACTOR_MAX_EVENTS)
+        max_events = REACTOR_MAX_EVENTS;
+
+    do {
+        reactor_count_syscall();
+        nfds = epoll_wait(reactor->epoll_fd, epoll_events, (int)max_events, timeout_ms);
+    } while (nfds == -1 && errno == EINTR);
+    if (nfds == -1)
+        return errno ? errno : -1;
+
+    count = 0;
+    for (i = 0; i < nfds; ++i)
+    {
+        uint32_t const revents = epoll_events[i].events;
+
+        if (!epoll_events[i].data.ptr)
+        {
+            reactor_reset_wake_event(reactor->wake_event);
+            continue;
+        }
+        events[count].data = epoll_events[i].data.ptr;
+        events[count].events = ((revents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) ? REACTOR_EVENT_READABLE : 0) |
+                               ((revents & (EPOLLOUT | EPOLLHUP | EPOLLERR)) ? REACTOR_EVENT_WRITABLE : 0);
+        ++count;
+    }
+
+    *out_count = count;
+    return 0;
+}
+
+#else /* !defined(reactor_use_epoll) */
+
+/* Fallback for systems without epoll. Only one thread may wait on a reactor at a time. */
+
+typedef struct reactor_entry {
+    int     socket;
+    void*   data;
+    int     events; /* The events the socket is armed for, 0 after it has been reported. */
+} reactor_entry;
+
+struct reactor {
+    pthread_mutex_t     lock;
+    reactor_entry*      entries;
+    size_t              entry_count;
+    size_t              entry_capacity;
+    struct pollfd*      poll_fds;       /* Only used by the waiting thread. */
+    void**              poll_data;
+    size_t              poll_capacity;
+    reactor_wake_event  wake_event;
+};
+
+int SOCKUNIXAPI reactor_create(reactor** const out_reactor)
+{
+    reactor* r;
+    int error;
+
+    r = (reactor*)calloc(1, sizeof(reactor));
+    if (!r)
+        return ENOMEM;
+
+    error = pthread_mutex_init(&r->lock, 0);
+    if (error)
+    {
+        free(r);
+        return error;
+    }
+
+    error = reactor_create_wake_event(&r->wake_event);
+    if (error)
+    {
+        pthread_mutex_destroy(&r->lock);
+        free(r);
+        return error;
+    }
+
+    *out_reactor = r;
+    return 0;
+}
+
+void SOCKUNIXAPI reactor_destroy(reactor* const reactor)
+{
+    reactor_close_wake_event(reactor->wake_event);
+    pthread_mutex_destroy(&reactor->lock);
+    free(reactor->entries);
+    free(reactor->poll_fds);
+    free(reactor->poll_data);
+    free(reactor);
+}
+
+static reactor_entry* reactor_find_entry(reactor* const reactor, int const socket)
+{
+    size_t i;
+
+    for (i = 0; i < reactor->entry_count; ++i)
+        if (reactor->entries[i].socket == socket)
+            return &reactor->entries[i];
+    return 0;
+}
+
+int SOCKUNIXAPI reactor_add(reactor* const reactor, int const socket, int const events, void* const data)
+{
+    reactor_entry* entry;
+
+    pthread_mutex_lock(&reactor->lock);
+
+    if (reactor_find_entry(reactor, socket))
+    {
+        pthread_mutex_unlock(&reactor->lock);
+        return EEXIST;
+    }
+
+    if (reactor->entry_count == reactor->entry_capacity)
+    {
+        size_t const new_capacity = reactor->entry_capacity ? reactor->entry_capacity * 2 : 16;
+        reactor_entry* const new_entries = \
+            (reactor_entry*)realloc(reactor->entries, sizeof(reactor_entry) * new_capacity);
+        if (!new_entries)
+        {
+            pthread_mutex_unlock(&reactor->lock);
+            return ENOMEM;
+        }
+        reactor->entries = new_entries;
+        reactor->entry_capacity = new_capacity;
+    }
+
+    entry = &reactor->entries[reactor->entry_count++];
+    entry->socket = socket;
+    entry->data = data;
+    entry->events = events;
+
+    pthread_mutex_unlock(&reactor->lock);
+
+    return reactor_signal_wake_event(reactor->wake_event);
+}
+
+int SOCKUNIXAPI reactor_rearm(reactor* const reactor, int const socket, int const events, void* const data)
+{
+    reactor_entry* entry;
+
+    pthread_mutex_lock(&reactor->lock);
+
+    entry = reactor_find_entry(reactor, socket);
+    if (!entry)
+    {
+        pthread_mutex_unlock(&reactor->lock);
+        return ENOENT;
+    }
+    entry->data = data;
+    entry->events = events;
+
+    pthread_mutex_unlock(&reactor->lock);
+
+    return reactor_signal_wake_event(reactor->wake_event);
+}
+
+int SOCKUNIXAPI reactor_remove(reactor* const reactor, int const socket)
+{
+    reactor_entry* entry;
+
+    pthread_mutex_lock(&reactor->lock);
+
+    entry = reactor_find_entry(reactor, socket);
+    if (!entry)
+    {
+        pthread_mutex_unlock(&reactor->lock);
+        return ENOENT;
+    }
+    *entry = reactor->entries[--reactor->entry_count];
+
+    pthread_mutex_unlock(&reactor->lock);
+
+    /* The socket may still be in the set of the waiting thread, so make it rebuild the set. */
+    return reactor_signal_wake_event(reactor->wake_event);
+}
+
+int SOCKUNIXAPI reactor_wait(reactor* const reactor, reactor_event* const events, size_t max_events,
+                             int const timeout_ms, size_t* const out_count)
+{
+    size_t poll_count, count, i;
+    int nfds;
+
+    pthread_mutex_lock(&reactor->lock);
+
+    if (reactor->entry_count + 1 > reactor->poll_capacity)
+    {
+        size_t const new_capacity = reactor->entry_capacity + 1;
+        struct pollfd* const new_fds = (struct pollfd*)realloc(reactor->poll_fds, sizeof(struct pollfd) * new_capacity);
+        void** new_data;
+
+        if (!new_fds)
+        {
+            pthread_mutex_unlock(&reactor->lock);
+            return ENOMEM;
+        }
+        reactor->poll_fds = new_fds;
+
+        new_data = (void**)realloc(reactor->poll_data, sizeof(void*) * new_capacity);
+        if (!new_data)
+        {
+            pthread_mutex_unlock(&reactor->lock);
+            return ENOMEM;
+        }
+        reactor->poll_data = new_data;
+
+        reactor->poll_capacity = new_capacity;
+    }
+
+    reactor->poll_fds[0].fd = reactor->wake_event.fds[0];
+    reactor->poll_fds[0].events = POLLIN;
+    reactor->poll_fds[0].revents = 0;
+    poll_count = 1;
+    for (i = 0; i < reactor->entry_count; ++i)
+    {
+        if (!reactor->entries[i].events)
+            continue;
+        reactor->poll_fds[poll_count].fd = reactor->entries[i].socket;
+        reactor->poll_fds[poll_count].events = 0;
+        if (reactor->entries[i].events & REACTOR_EVENT_READABLE)
+            reactor->poll_fds[poll_count].events |= POLLIN | POLLPRI;
+        if (reactor->entries[i].events & REACTOR_EVENT_WRITABLE)
+            reactor->poll_fds[poll_count].events |= POLLOUT;
+        reactor->poll_fds[poll_count].revents = 0;
+        reactor->poll_data[poll_count] = reactor->entries[i].data;
+        ++poll_count;
+    }
+
+    pthread_mutex_unlock(&reactor->lock);
+
+    do {
+        reactor_count_syscall();
+        nfds = poll(reactor->poll_fds, poll_count, timeout_ms);
+    } while (nfds == -1 && (errno == EAGAIN || errno == EINTR));
+    if (nfds == -1)
+        return errno ? errno : -1;
+
+    if (reactor->poll_fds[0].revents)
+        reactor_reset_wake_event(reactor->wake_event);
+
+    if (max_events > REACTOR_MAX_EVENTS)
+        max_events = REACTOR_MAX_EVENTS;
+
+    pthread_mutex_lock(&reactor->lock);
+
+    count = 0;
+    for (i = 1; i < poll_count && count < max_events; ++i)
+    {
+        short const revents = reactor->poll_fds[i].revents;
+        reactor_entry* entry;
+
+        if (!revents)
+            continue;
+
+        /* Skip sockets that were removed or already reported while polling. */
+        entry = reactor_find_entry(reactor, reactor->poll_fds[i].fd);
+        if (!entry || !entry->events || entry->data != reactor->poll_data[i])
+            continue;
+
+        entry->events = 0;
+        events[count].data = entry->data;
+        events[count].events = ((revents & (POLLIN | POLLPRI | POLLHUP | POLLERR)) ? REACTOR_EVENT_READABLE : 0) |
+                               ((revents & (POLLOUT | POLLHUP | POLLERR)) ? REACTOR_EVENT_WRITABLE : 0);
+        ++count;
+    }
+
+    pthread_mutex_unlock(&reactor->lock);
+
+    *out_count = count;
+    return 0;
+}
+
+#endif /* !defined(reactor_use_epoll) */
+
+int SOCKUNIXAPI reactor_wake(reactor* const reactor)
+{
+    return reactor_signal_wake_event(reactor->wake_event);
+}
@@ -0,0 +1,36 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#pragma once
+#ifndef __WINESTREAMPROXY_PROXY_UNIXLIB_REACTOR_H__
+#define __WINESTREAMPROXY_PROXY_UNIXLIB_REACTOR_H__
+
+#include "socket.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+extern int SOCKUNIXAPI reactor_create(reactor** out_reactor);
+extern void SOCKUNIXAPI reactor_destroy(reactor* reactor);
+extern int SOCKUNIXAPI reactor_add(reactor* reactor, int socket, int events, void* data);
+extern int SOCKUNIXAPI reactor_rearm(reactor* reactor, int socket, int events, void* data);
+extern int SOCKUNIXAPI reactor_remove(reactor* reactor, int socket);
+extern int SOCKUNIXAPI reactor_wait(reactor* reactor, reactor_event* events, size_t max_events, int timeout_ms,
+                                    size_t* out_count);
+extern int SOCKUNIXAPI reactor_wake(reactor* reactor);
+
+#ifdef __cplusplus
+}
+#endif /* defined(__cplusplus) */
+
+#endif /* !defined(__WINESTREAMPROXY_PROXY_UNIXLIB_REACTOR_H__) */
@@ -8,25 +8,25 @@
  *   E-Mail address: openglfreak@googlemail.com
  *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
 
-#ifdef __linux__
-#define socket_use_eventfd
-#endif
-
+#include "reactor.h"
 #include "socket.h"
+#include "splice.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <poll.h>
-#ifdef socket_use_eventfd
-#include <sys/eventfd.h>
-#endif
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
-#include <fcntl.h>
+
+unsigned long volatile socket_syscall_count = 0;
+#define socket_count_syscall() ((void)__sync_fetch_and_add(&socket_syscall_count, 1))
 
 size_t SOCKUNIXAPI socket_get_address_struct_size(void)
 {
@@ -61,115 +61,257 @@ void SOCKUNIXAPI socket_close(int const socket)
     close(socket);
 }
 
-int SOCKUNIXAPI socket_create_thread_exit_event(thread_exit_event* const out_event)
+/* Sends are queued by the caller instead of blocking the I/O worker. */
+static int socket_set_nonblocking(int const socket)
+{
+    int flags;
+
+    flags = fcntl(socket, F_GETFL);
+    if (flags == -1 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) == -1)
+        return errno ? errno : -1;
+    return 0;
+}
+
+int SOCKUNIXAPI socket_connect(int const socket, void const* const address_struct, int* const out_connected)
 {
-    int pfds[2];
-#ifdef socket_use_eventfd
-    int const efd = eventfd(0, EFD_CLOEXEC);
-    if (efd != -1)
+    int error;
+
+    error = socket_set_nonblocking(socket);
+    if (error)
+        return error;
+
+    if (connect(socket, (struct sockaddr const*)address_struct, sizeof(struct sockaddr_un)) == 0 || errno == EISCONN)
     {
-        out_event->fds[0] = efd;
-        out_event->fds[1] = efd;
+        *out_connected = 1;
         return 0;
     }
-#endif
-    if (pipe(pfds) != -1)
+
+    /* Unix sockets don't report readiness for pending connects, they fail with EAGAIN while the backlog is full. */
+    if (errno == EAGAIN || errno == EINPROGRESS || errno == EALREADY || errno == EINTR)
     {
-        fcntl(pfds[0], F_SETFD, FD_CLOEXEC);
-        fcntl(pfds[0], F_SETFD, FD_CLOEXEC);
-        out_event->fds[0] = pfds[0];
-        out_event->fds[1] = pfds[1];
+        *out_connected = 0;
         return 0;
     }
+
     return errno ? errno : -1;
 }
 
-void SOCKUNIXAPI socket_close_thread_exit_event(thread_exit_event const event)
+/* Checks whether a server still accepts connections on the address. */
+static int socket_address_in_use(struct sockaddr_un const* const addr)
 {
-    close(event.fds[0]);
-    if (event.fds[1] != event.fds[0])
-        close(event.fds[1]);
+    int probe, in_use;
+
+    probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe == -1)
+        return 1;
+    in_use = connect(probe, (struct sockaddr const*)addr, sizeof(*addr)) == 0 || errno != ECONNREFUSED;
+    close(probe);
+    return in_use;
 }
 
-int SOCKUNIXAPI socket_send_thread_exit_event(thread_exit_event const event)
+int SOCKUNIXAPI socket_listen(int const listen_socket, void const* const address_struct)
 {
-    static char one[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
-    if (write(event.fds[1], one, sizeof(one)) <= 0)
+    struct sockaddr_un const* const addr = (struct sockaddr_un const*)address_struct;
+
+    if (bind(listen_socket, (struct sockaddr const*)addr, sizeof(*addr)) != 0)
+    {
+        if (errno != EADDRINUSE || !addr->sun_path[0])
+            return errno ? errno : -1;
+
+        /* Left behind by a previous instance that didn't exit cleanly. */
+        if (socket_address_in_use(addr))
+            return EADDRINUSE;
+        if (unlink(addr->sun_path) != 0 && errno != ENOENT)
+            return errno ? errno : -1;
+        if (bind(listen_socket, (struct sockaddr const*)addr, sizeof(*addr)) != 0)
+            return errno ? errno : -1;
+    }
+
+    if (listen(listen_socket, SOMAXCONN) != 0)
         return errno ? errno : -1;
-    return 0;
+
+    return socket_set_nonblocking(listen_socket);
 }
 
-int SOCKUNIXAPI socket_connect(int const socket, void const* const address_struct)
+int SOCKUNIXAPI socket_accept(int const listen_socket, int* const out_socket)
 {
-    if (connect(socket, (struct sockaddr const*)address_struct, sizeof(struct sockaddr_un)) != 0)
+    int s, error;
+
+    do {
+        s = accept(listen_socket, 0, 0);
+    } while (s == -1 && (errno == EINTR || errno == ECONNABORTED));
+    if (s == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            *out_socket = -1;
+            return 0;
+        }
         return errno ? errno : -1;
+    }
+
+    if (fcntl(s, F_SETFD, FD_CLOEXEC) == -1 || socket_set_nonblocking(s) != 0)
+    {
+        error = errno ? errno : -1;
+        close(s);
+        return error;
+    }
+
+    *out_socket = s;
     return 0;
 }
 
-int SOCKUNIXAPI socket_poll(int const socket, thread_exit_event const event, poll_status* const out_status)
+void SOCKUNIXAPI socket_unlink(void const* const address_struct)
 {
-    struct pollfd fds[2];
-    int nfds;
+    struct sockaddr_un const* const addr = (struct sockaddr_un const*)address_struct;
+
+    /* Abstract addresses have no file. */
+    if (addr->sun_path[0])
+        unlink(addr->sun_path);
+}
 
-    fds[0].fd = socket;
-    fds[0].events = POLLIN | POLLPRI | POLLHUP;
-    fds[0].revents = 0;
-    fds[1].fd = event.fds[0];
-    fds[1].events = POLLIN | POLLPRI | POLLHUP;
-    fds[1].revents = 0;
-    while ((nfds = poll(fds, sizeof(fds) / sizeof(fds[0]), -1)) == 0 ||
-           (nfds == -1 && (errno == EAGAIN || errno == EINTR)));
-    if (nfds == -1)
+int SOCKUNIXAPI socket_probe(int const socket, int* const out_alive)
+{
+    struct pollfd pfd;
+    int ret;
+
+    /* Pending data doesn't mean anything here, it is forwarded once the socket is in use. */
+    pfd.fd = socket;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    do {
+        socket_count_syscall();
+        ret = poll(&pfd, 1, 0);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1)
         return errno ? errno : -1;
 
-    if (fds[1].revents)
-        *out_status = POLL_STATUS_EXIT_SIGNALED;
-    else if (fds[0].revents)
-    {
-        if (fds[0].revents & POLLHUP)
-            *out_status = POLL_STATUS_CLOSED_CONNECTION;
-        if (!(fds[0].revents & (POLLIN | POLLPRI)))
-            *out_status = POLL_STATUS_INVALID_MESSAGE_FLAGS;
-    }
-    else
-        *out_status = POLL_STATUS_SUCCESS;
+    *out_alive = !(pfd.revents & (POLLHUP | POLLERR | POLLNVAL));
+    return 0;
+}
 
+int SOCKUNIXAPI socket_set_buffer_size(int const socket, int const size)
+{
+    if (setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) != 0 ||
+        setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) != 0)
+        return errno ? errno : -1;
     return 0;
 }
 
 int SOCKUNIXAPI socket_recv(int const socket, unsigned char* const buffer, size_t const buffer_size,
-                            recv_status* const out_status, size_t* const out_message_length)
+                            recv_status* const out_status, size_t* const out_received, size_t* const out_pending)
 {
-    ssize_t recv_ret = recv(socket, buffer, buffer_size, MSG_PEEK);
+    ssize_t recv_ret;
+    int pending;
+
+    socket_count_syscall();
+    recv_ret = recv(socket, buffer, buffer_size, 0);
+    if (recv_ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        *out_status = RECV_STATUS_SUCCESS;
+        *out_received = 0;
+        *out_pending = 0;
+        return 0;
+    }
     if (recv_ret == -1)
         return errno ? errno : -1;
 
-    if ((size_t)recv_ret >= buffer_size)
+    *out_received = (size_t)recv_ret;
+    *out_pending = 0;
+
+    if (recv_ret == 0)
     {
-        *out_status = RECV_STATUS_INSUFFICIENT_BUFFER;
-        *out_message_length = (size_t)recv_ret;
+        *out_status = RECV_STATUS_CLOSED;
         return 0;
     }
 
+    /* Only ask for the remaining length if the buffer was too small, which is rare. */
+    if ((size_t)recv_ret == buffer_size)
+    {
+        socket_count_syscall();
+        if (ioctl(socket, FIONREAD, &pending) == 0 && pending > 0)
+        {
+            *out_status = RECV_STATUS_MORE_DATA;
+            *out_pending = (size_t)pending;
+            return 0;
+        }
+    }
+
+    *out_status = RECV_STATUS_SUCCESS;
+    return 0;
+}
+
+int SOCKUNIXAPI socket_recv_part(int const socket, unsigned char* const buffer, size_t const buffer_size,
+                                 recv_status* const out_status, size_t* const out_received)
+{
+    ssize_t recv_ret;
+
+    socket_count_syscall();
     recv_ret = recv(socket, buffer, buffer_size, 0);
-    if (recv_ret == -1)
+    if (recv_ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        recv_ret = 0;
+    else if (recv_ret == -1)
         return errno ? errno : -1;
+    else if (recv_ret == 0)
+    {
+        *out_status = RECV_STATUS_CLOSED;
+        *out_received = 0;
+        return 0;
+    }
 
-    *out_status = (size_t)recv_ret >= buffer_size ? RECV_STATUS_DISCARDED_DATA : RECV_STATUS_SUCCESS;
-    *out_message_length = (size_t)recv_ret;
+    *out_status = RECV_STATUS_SUCCESS;
+    *out_received = (size_t)recv_ret;
     return 0;
 }
 
 int SOCKUNIXAPI socket_send(int const socket, unsigned char const* const message, size_t const message_length,
                             size_t* const written)
 {
-    ssize_t bytes_written = write(socket, message, message_length);
-    if (bytes_written == -1)
+    ssize_t bytes_written;
+
+    socket_count_syscall();
+    bytes_written = write(socket, message, message_length);
+    if (bytes_written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        bytes_written = 0;
+    else if (bytes_written == -1)
+        return errno ? errno : -1;
+    *written = (size_t)bytes_written;
+    return 0;
+}
+
+/* More buffers than this are written in several calls by the caller. */
+#define SOCKET_MAX_WRITEV_BUFFERS 64
+
+int SOCKUNIXAPI socket_writev(int const socket, socket_buffer const* const buffers, size_t buffer_count,
+                              size_t* const written)
+{
+    struct iovec iov[SOCKET_MAX_WRITEV_BUFFERS];
+    ssize_t bytes_written;
+    size_t i;
+
+    if (buffer_count > SOCKET_MAX_WRITEV_BUFFERS)
+        buffer_count = SOCKET_MAX_WRITEV_BUFFERS;
+    for (i = 0; i < buffer_count; ++i)
+    {
+        iov[i].iov_base = (void*)buffers[i].data;
+        iov[i].iov_len = buffers[i].length;
+    }
+
+    socket_count_syscall();
+    bytes_written = writev(socket, iov, (int)buffer_count);
+    if (bytes_written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        bytes_written = 0;
+    else if (bytes_written == -1)
         return errno ? errno : -1;
     *written = (size_t)bytes_written;
     return 0;
 }
 
+unsigned long SOCKUNIXAPI socket_get_syscall_count(void)
+{
+    return __sync_fetch_and_add(&socket_syscall_count, 0);
+}
+
 #ifdef __cplusplus
 extern "C"
 #endif /* defined(__cplusplus) */
@@ -180,12 +322,27 @@ int SOCKUNIXAPI socket_unix_init(socket_unix_funcs* const out_funcs)
     out_funcs->init_address = socket_init_address;
     out_funcs->create = socket_create;
     out_funcs->close = socket_close;
-    out_funcs->create_thread_exit_event = socket_create_thread_exit_event;
-    out_funcs->close_thread_exit_event = socket_close_thread_exit_event;
-    out_funcs->send_thread_exit_event = socket_send_thread_exit_event;
     out_funcs->connect = socket_connect;
-    out_funcs->poll = socket_poll;
+    out_funcs->listen = socket_listen;
+    out_funcs->accept = socket_accept;
+    out_funcs->unlink = socket_unlink;
+    out_funcs->probe = socket_probe;
+    out_funcs->set_buffer_size = socket_set_buffer_size;
     out_funcs->recv = socket_recv;
+    out_funcs->recv_part = socket_recv_part;
     out_funcs->send = socket_send;
+    out_funcs->writev = socket_writev;
+    out_funcs->get_syscall_count = socket_get_syscall_count;
+    out_funcs->reactor_create = reactor_create;
+    out_funcs->reactor_destroy = reactor_destroy;
+    out_funcs->reactor_add = reactor_add;
+    out_funcs->reactor_rearm = reactor_rearm;
+    out_funcs->reactor_remove = reactor_remove;
+    out_funcs->reactor_wait = reactor_wait;
+    out_funcs->reactor_wake = reactor_wake;
+    out_funcs->get_handle_fd = splice_get_handle_fd;
+    out_funcs->splice_open = splice_open;
+    out_funcs->splice_transfer = splice_transfer;
+    out_funcs->splice_close = splice_close;
     return 0;
 }
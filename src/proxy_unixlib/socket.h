@@ -18,21 +18,31 @@
 extern "C" {
 #endif /* defined(__cplusplus) */
 
-typedef struct thread_exit_event {
-    int fds[2];
-} thread_exit_event;
+/* Multiplexes readiness of many sockets onto one waiting thread. Sockets are registered one-shot: After a socket
+   has been reported as ready (or closed), it is not reported again until it is rearmed. */
+typedef struct reactor reactor;
 
-typedef enum poll_status {
-    POLL_STATUS_SUCCESS,
-    POLL_STATUS_EXIT_SIGNALED,
-    POLL_STATUS_CLOSED_CONNECTION,
-    POLL_STATUS_INVALID_MESSAGE_FLAGS
-} poll_status;
+#define REACTOR_EVENT_READABLE 0x1
+#define REACTOR_EVENT_WRITABLE 0x2
+
+typedef struct reactor_event {
+    void*   data;   /* The value passed when the socket was registered. */
+    int     events; /* REACTOR_EVENT_* flags. Errors and hangups are reported as both. */
+} reactor_event;
+
+/* A buffer passed to writev. */
+typedef struct socket_buffer {
+    unsigned char const*    data;
+    size_t                  length;
+} socket_buffer;
+
+/* Moves data between two fds without passing it through the caller. */
+typedef struct splice_channel splice_channel;
 
 typedef enum recv_status {
     RECV_STATUS_SUCCESS,
-    RECV_STATUS_INSUFFICIENT_BUFFER,
-    RECV_STATUS_DISCARDED_DATA
+    RECV_STATUS_MORE_DATA,  /* The buffer was filled and more data is pending. */
+    RECV_STATUS_CLOSED
 } recv_status;
 
 #define SOCKUNIXAPI __stdcall
@@ -45,15 +55,49 @@ typedef struct socket_unix_funcs {
     int SOCKUNIXAPI (*create)(int* out_socket);
     void SOCKUNIXAPI (*close)(int socket);
 
-    int SOCKUNIXAPI (*create_thread_exit_event)(thread_exit_event* out_event);
-    void SOCKUNIXAPI (*close_thread_exit_event)(thread_exit_event event);
-    int SOCKUNIXAPI (*send_thread_exit_event)(thread_exit_event event);
-
-    int SOCKUNIXAPI (*connect)(int socket, void const* address_struct);
-    int SOCKUNIXAPI (*poll)(int socket, thread_exit_event event, poll_status* out_status);
+    /* Connects without blocking, the socket stays non-blocking. out_connected is 0 if the server's backlog is full or
+       the connection is still in progress, connect has to be called again later then. */
+    int SOCKUNIXAPI (*connect)(int socket, void const* address_struct, int* out_connected);
+    /* Binds the socket and listens on it, it is non-blocking afterwards. A socket file that nobody accepts
+       connections on anymore is replaced. */
+    int SOCKUNIXAPI (*listen)(int socket, void const* address_struct);
+    /* The accepted socket is non-blocking. out_socket is -1 if no connection is pending. */
+    int SOCKUNIXAPI (*accept)(int listen_socket, int* out_socket);
+    void SOCKUNIXAPI (*unlink)(void const* address_struct);
+    /* Checks without blocking whether the peer of a connected socket has hung up. */
+    int SOCKUNIXAPI (*probe)(int socket, int* out_alive);
+    /* Sets SO_SNDBUF and SO_RCVBUF, the kernel may round the size or cap it at its limit. */
+    int SOCKUNIXAPI (*set_buffer_size)(int socket, int size);
     int SOCKUNIXAPI (*recv)(int socket, unsigned char* buffer, size_t buffer_size, recv_status* out_status,
-                            size_t* out_message_length);
+                            size_t* out_received, size_t* out_pending);
+    /* Like recv, but never asks how much data is left, for callers that know the length they expect. out_status is
+       never RECV_STATUS_MORE_DATA. */
+    int SOCKUNIXAPI (*recv_part)(int socket, unsigned char* buffer, size_t buffer_size, recv_status* out_status,
+                                 size_t* out_received);
+    /* The socket is non-blocking once connected. A send that would block writes 0 bytes instead of failing. */
     int SOCKUNIXAPI (*send)(int socket, unsigned char const* message, size_t message_length, size_t* written);
+    int SOCKUNIXAPI (*writev)(int socket, socket_buffer const* buffers, size_t buffer_count, size_t* written);
+    unsigned long SOCKUNIXAPI (*get_syscall_count)(void); /* Number of syscalls made by this library. */
+
+    int SOCKUNIXAPI (*reactor_create)(reactor** out_reactor);
+    void SOCKUNIXAPI (*reactor_destroy)(reactor* reactor);
+    int SOCKUNIXAPI (*reactor_add)(reactor* reactor, int socket, int events, void* data);
+    int SOCKUNIXAPI (*reactor_rearm)(reactor* reactor, int socket, int events, void* data);
+    int SOCKUNIXAPI (*reactor_remove)(reactor* reactor, int socket);
+    /* Waits until at least one socket is ready, the reactor is woken up or the timeout (-1 for none) expires. */
+    int SOCKUNIXAPI (*reactor_wait)(reactor* reactor, reactor_event* events, size_t max_events, int timeout_ms,
+                                    size_t* out_count);
+    int SOCKUNIXAPI (*reactor_wake)(reactor* reactor);
+
+    /* Gets a private copy of the host fd backing a Wine handle. Fails if Wine doesn't expose one. */
+    int SOCKUNIXAPI (*get_handle_fd)(void* handle, int* out_fd, int* out_message_mode);
+    /* With keep_boundaries, every message is moved with a single write instead of being spliced. */
+    int SOCKUNIXAPI (*splice_open)(int from_fd, int to_fd, int keep_boundaries, splice_channel** out_channel);
+    /* Moves the data that is available on from_fd without blocking. Transferring nothing is not an error. Returns
+       EAGAIN if to_fd didn't take everything, the rest is kept and written first by the next call, which should
+       wait until to_fd is writable. out_transferred counts the data taken from from_fd either way. */
+    int SOCKUNIXAPI (*splice_transfer)(splice_channel* channel, recv_status* out_status, size_t* out_transferred);
+    void SOCKUNIXAPI (*splice_close)(splice_channel* channel);
 } socket_unix_funcs;
 
 typedef int SOCKUNIXAPI (*socket_unix_init_t)(socket_unix_funcs* out_funcs);
@@ -0,0 +1,371 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#ifdef __linux__
+#define splice_use_splice
+#endif
+
+#include "splice.h"
+#include "socket.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#ifdef splice_use_splice
+#include <sys/syscall.h>
+#endif
+#include <sys/types.h>
+#include <unistd.h>
+
+/* The native benchmark builds this file without Wine, it cannot map Wine handles then. */
+#ifndef WINESTREAMPROXY_UNIXLIB_NATIVE
+#include <windef.h>
+#include <winbase.h>
+#include <winternl.h>
+#include <wine/server.h>
+#endif
+
+#ifdef splice_use_splice
+/* The glibc wrapper is only declared with _GNU_SOURCE, which is too late to define in the unity build. */
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#endif
+#ifndef SPLICE_F_NONBLOCK
+#define SPLICE_F_NONBLOCK 2
+#endif
+#define splice_syscall(fd_in, fd_out, len, flags) \
+    ((ssize_t)syscall(__NR_splice, (fd_in), (loff_t*)0, (fd_out), (loff_t*)0, (size_t)(len), (unsigned int)(flags)))
+#endif
+
+/* Upper bound of the data moved per readiness event, the default capacity of a Linux pipe. */
+#define SPLICE_CHUNK_SIZE 65536
+#define SPLICE_MIN_BUFFER_SIZE 1024
+
+#define splice_count_syscall() ((void)__sync_fetch_and_add(&socket_syscall_count, 1))
+
+/* Moves data from one fd to another. Stream channels use a relay pipe so that the data never leaves the kernel,
+   message channels move every message with one read and one write to keep the boundaries intact. Data that the
+   destination didn't take yet stays in the relay pipe or the buffer until the next transfer. */
+struct splice_channel {
+    int             from_fd;
+    int             to_fd;
+    int             from_is_message;    /* Whether one recv returns exactly one message. */
+    int             relay_fds[2];       /* -1 if the channel copies. */
+    size_t          relay_pending;      /* Bytes in the relay pipe that haven't been written yet. */
+    unsigned char*  buffer;
+    size_t          buffer_size;
+    size_t          buffer_offset;      /* Start of the bytes in the buffer that haven't been written yet... */
+    size_t          buffer_pending;     /* ...and their number. */
+};
+
+static int splice_is_message_socket(int const fd)
+{
+    int type;
+    socklen_t len = sizeof(type);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) != 0)
+        return 0;
+    return type == SOCK_SEQPACKET || type == SOCK_DGRAM;
+}
+
+#ifdef WINESTREAMPROXY_UNIXLIB_NATIVE
+int SOCKUNIXAPI splice_get_handle_fd(void* const handle, int* const out_fd, int* const out_message_mode)
+{
+    (void)handle;
+    (void)out_fd;
+    (void)out_message_mode;
+    return ENOTSUP;
+}
+#else
+int SOCKUNIXAPI splice_get_handle_fd(void* const handle, int* const out_fd, int* const out_message_mode)
+{
+    NTSTATUS status;
+    int fd, dup_fd;
+
+    status = wine_server_handle_to_fd((HANDLE)handle, FILE_READ_DATA | FILE_WRITE_DATA, &fd, NULL);
+    if (status != STATUS_SUCCESS)
+        return ENOTSUP;
+
+    /* The fd returned by Wine may be cached, so keep a private copy that can be closed independently. */
+    dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    wine_server_release_fd((HANDLE)handle, fd);
+    if (dup_fd == -1)
+        return errno ? errno : -1;
+
+    *out_fd = dup_fd;
+    *out_message_mode = splice_is_message_socket(dup_fd);
+    return 0;
+}
+#endif
+
+int SOCKUNIXAPI splice_open(int const from_fd, int const to_fd, int const keep_boundaries,
+                            splice_channel** const out_channel)
+{
+    splice_channel* const channel = (splice_channel*)malloc(sizeof(splice_channel));
+    if (!channel)
+        return ENOMEM;
+
+    channel->from_fd = from_fd;
+    channel->to_fd = to_fd;
+    channel->from_is_message = splice_is_message_socket(from_fd);
+    channel->relay_fds[0] = -1;
+    channel->relay_fds[1] = -1;
+    channel->relay_pending = 0;
+    channel->buffer = 0;
+    channel->buffer_size = 0;
+    channel->buffer_offset = 0;
+    channel->buffer_pending = 0;
+
+    /* Writes must not block the calling I/O worker, the caller waits for the destination to become writable
+       instead. Wine waits for readiness itself when its own I/O on the pipe handle gets EAGAIN. */
+    {
+        int const flags = fcntl(to_fd, F_GETFL);
+        if (flags != -1 && !(flags & O_NONBLOCK))
+            fcntl(to_fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+#ifdef splice_use_splice
+    if (!keep_boundaries && pipe(channel->relay_fds) == 0)
+    {
+        fcntl(channel->relay_fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(channel->relay_fds[1], F_SETFD, FD_CLOEXEC);
+    }
+    else
+    {
+        channel->relay_fds[0] = -1;
+        channel->relay_fds[1] = -1;
+    }
+#else
+    (void)keep_boundaries;
+#endif
+
+    *out_channel = channel;
+    return 0;
+}
+
+void SOCKUNIXAPI splice_close(splice_channel* const channel)
+{
+    if (channel->relay_fds[0] != -1)
+    {
+        close(channel->relay_fds[0]);
+        close(channel->relay_fds[1]);
+    }
+    free(channel->buffer);
+    free(channel);
+}
+
+static int splice_reserve_buffer(splice_channel* const channel, size_t const size)
+{
+    unsigned char* new_buffer;
+
+    if (channel->buffer_size >= size)
+        return 0;
+
+    new_buffer = (unsigned char*)realloc(channel->buffer, size);
+    if (!new_buffer)
+        return ENOMEM;
+    channel->buffer = new_buffer;
+    channel->buffer_size = size;
+    return 0;
+}
+
+/* Writes the rest of the buffer. Returns EAGAIN if the destination is full. */
+static int splice_write_pending(splice_channel* const channel)
+{
+    while (channel->buffer_pending)
+    {
+        ssize_t written;
+
+        splice_count_syscall();
+        written = write(channel->to_fd, channel->buffer + channel->buffer_offset, channel->buffer_pending);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return EAGAIN;
+            return errno ? errno : -1;
+        }
+        channel->buffer_offset += (size_t)written;
+        channel->buffer_pending -= (size_t)written;
+    }
+    return 0;
+}
+
+static int splice_copy(splice_channel* const channel, recv_status* const out_status, size_t* const out_transferred)
+{
+    ssize_t pending, received;
+    int available;
+
+    /* Message sockets report the full length of the next message, stream sockets the number of queued bytes. */
+    splice_count_syscall();
+    if (channel->from_is_message)
+        pending = recv(channel->from_fd, 0, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+    else
+        pending = ioctl(channel->from_fd, FIONREAD, &available) == 0 ? (ssize_t)available : -1;
+    if (pending == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return errno ? errno : -1;
+    }
+    if (pending < SPLICE_MIN_BUFFER_SIZE)
+        pending = SPLICE_MIN_BUFFER_SIZE;
+
+    if (splice_reserve_buffer(channel, (size_t)pending))
+        return ENOMEM;
+
+    splice_count_syscall();
+    received = recv(channel->from_fd, channel->buffer, channel->buffer_size, MSG_DONTWAIT);
+    if (received == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return errno ? errno : -1;
+    }
+    if (received == 0)
+    {
+        *out_status = RECV_STATUS_CLOSED;
+        return 0;
+    }
+
+    *out_transferred = (size_t)received;
+    channel->buffer_offset = 0;
+    channel->buffer_pending = (size_t)received;
+    return splice_write_pending(channel);
+}
+
+#ifdef splice_use_splice
+/* Switches the channel to copying. Bytes that are still in the relay pipe are moved into the buffer first. */
+static int splice_stop_relay(splice_channel* const channel)
+{
+    int error = 0;
+
+    if (channel->relay_pending)
+    {
+        error = splice_reserve_buffer(channel, channel->relay_pending);
+        channel->buffer_offset = 0;
+        channel->buffer_pending = 0;
+        while (!error && channel->buffer_pending < channel->relay_pending)
+        {
+            ssize_t received;
+
+            splice_count_syscall();
+            received = read(channel->relay_fds[0], channel->buffer + channel->buffer_pending,
+                            channel->relay_pending - channel->buffer_pending);
+            if (received > 0)
+                channel->buffer_pending += (size_t)received;
+            else if (received == 0)
+                error = EIO;
+            else if (errno != EINTR)
+                error = errno ? errno : -1;
+        }
+        channel->relay_pending = 0;
+    }
+
+    close(channel->relay_fds[0]);
+    close(channel->relay_fds[1]);
+    channel->relay_fds[0] = -1;
+    channel->relay_fds[1] = -1;
+    return error;
+}
+
+/* Writes the rest of the relay pipe. Returns EAGAIN if the destination is full. */
+static int splice_drain_relay(splice_channel* const channel)
+{
+    while (channel->relay_pending)
+    {
+        ssize_t drained;
+
+        splice_count_syscall();
+        drained = splice_syscall(channel->relay_fds[0], channel->to_fd, channel->relay_pending,
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (drained == -1)
+        {
+            int error;
+
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return EAGAIN;
+            if (errno != EINVAL)
+                return errno ? errno : -1;
+
+            /* The destination doesn't support splicing. Write what has been moved already the usual way. */
+            error = splice_stop_relay(channel);
+            if (error)
+                return error;
+            return splice_write_pending(channel);
+        }
+        channel->relay_pending -= (size_t)drained;
+    }
+    return 0;
+}
+
+static int splice_relay(splice_channel* const channel, recv_status* const out_status, size_t* const out_transferred)
+{
+    ssize_t moved;
+
+    splice_count_syscall();
+    moved = splice_syscall(channel->from_fd, channel->relay_fds[1], SPLICE_CHUNK_SIZE,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno != EINVAL)
+            return errno ? errno : -1;
+
+        /* The source doesn't support splicing. Nothing has been moved, so copy from now on. */
+        splice_stop_relay(channel);
+        return splice_copy(channel, out_status, out_transferred);
+    }
+    if (moved == 0)
+    {
+        *out_status = RECV_STATUS_CLOSED;
+        return 0;
+    }
+
+    *out_transferred = (size_t)moved;
+    channel->relay_pending = (size_t)moved;
+    return splice_drain_relay(channel);
+}
+#endif
+
+int SOCKUNIXAPI splice_transfer(splice_channel* const channel, recv_status* const out_status,
+                                size_t* const out_transferred)
+{
+    int error;
+
+    *out_status = RECV_STATUS_SUCCESS;
+    *out_transferred = 0;
+
+    /* Nothing new is taken from the source before the data of the last transfer has been written. */
+#ifdef splice_use_splice
+    if (channel->relay_fds[0] != -1)
+    {
+        error = splice_drain_relay(channel);
+        if (error)
+            return error;
+    }
+#endif
+    error = splice_write_pending(channel);
+    if (error)
+        return error;
+
+#ifdef splice_use_splice
+    if (channel->relay_fds[0] != -1)
+        return splice_relay(channel, out_status, out_transferred);
+#endif
+    return splice_copy(channel, out_status, out_transferred);
+}
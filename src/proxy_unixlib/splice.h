@@ -0,0 +1,35 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+#pragma once
+#ifndef __WINESTREAMPROXY_PROXY_UNIXLIB_SPLICE_H__
+#define __WINESTREAMPROXY_PROXY_UNIXLIB_SPLICE_H__
+
+#include "socket.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/* Shared with socket.c so that transfers show up in the syscall statistics. */
+extern unsigned long volatile socket_syscall_count;
+
+extern int SOCKUNIXAPI splice_get_handle_fd(void* handle, int* out_fd, int* out_message_mode);
+extern int SOCKUNIXAPI splice_open(int from_fd, int to_fd, int keep_boundaries, splice_channel** out_channel);
+extern int SOCKUNIXAPI splice_transfer(splice_channel* channel, recv_status* out_status, size_t* out_transferred);
+extern void SOCKUNIXAPI splice_close(splice_channel* channel);
+
+#ifdef __cplusplus
+}
+#endif /* defined(__cplusplus) */
+
+#endif /* !defined(__WINESTREAMPROXY_PROXY_UNIXLIB_SPLICE_H__) */
@@ -0,0 +1,542 @@
+/* Copyright (C) 2021 Torge Matthies
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * Author contact info:
+ *   E-Mail address: openglfreak@googlemail.com
+ *   PGP key fingerprint: 0535 3830 2F11 C888 9032 FAD2 7C95 CD70 C9E8 438D */
+
+/* winestreamproxy-tracedump: Prints the messages of binary trace files written with --trace-file as text, in the
+   order they were logged. Runs natively, the trace files are read wherever they ended up. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../logger/trace_format.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* 100 ns intervals between 1601-01-01 and 1970-01-01. */
+#define TRACEDUMP_FILETIME_UNIX_EPOCH 116444736000000000ULL
+
+typedef struct tracedump_site {
+    unsigned long   line;
+    unsigned char   level;
+    unsigned char   arg_count;
+    unsigned int    flags;
+    char*           file;
+    char*           format;
+} tracedump_site;
+
+typedef struct tracedump_file {
+    char const*         path;
+    unsigned char*      data;
+    size_t              size;
+    unsigned long long  counter_frequency;
+    unsigned long long  counter_start;
+    unsigned long long  time_start;
+    tracedump_site**    sites;      /* Indexed by site id. */
+    size_t              site_count;
+} tracedump_file;
+
+typedef struct tracedump_event {
+    unsigned long long      time;   /* FILETIME */
+    size_t                  order;  /* Keeps events with the same time in file order. */
+    tracedump_file const*   file;
+    tracedump_site const*   site;
+    unsigned long           thread_id;
+    unsigned char const*    args;
+    size_t                  args_size;
+} tracedump_event;
+
+static char const* const tracedump_level_prefixes[] = {
+    "TRACE   ",
+    "DEBUG   ",
+    "INFO    ",
+    "WARNING ",
+    "ERROR   ",
+    "CRITICAL"
+};
+
+static tracedump_event* tracedump_events;
+static size_t tracedump_event_count;
+static size_t tracedump_event_capacity;
+
+static unsigned long tracedump_get_u16(unsigned char const* const p)
+{
+    return (unsigned long)p[0] | (unsigned long)p[1] << 8;
+}
+
+static unsigned long tracedump_get_u32(unsigned char const* const p)
+{
+    return tracedump_get_u16(p) | tracedump_get_u16(p + 2) << 16;
+}
+
+static unsigned long long tracedump_get_u64(unsigned char const* const p)
+{
+    return (unsigned long long)tracedump_get_u32(p) | (unsigned long long)tracedump_get_u32(p + 4) << 32;
+}
+
+static char* tracedump_copy_string(unsigned char const* const text, size_t const len)
+{
+    char* const copy = (char*)malloc(len + 1);
+
+    if (copy)
+    {
+        memcpy(copy, text, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+static int tracedump_read_file(tracedump_file* const file)
+{
+    FILE* const stream = fopen(file->path, "rb");
+    size_t capacity = 65536;
+
+    if (!stream)
+    {
+        fprintf(stderr, "%s: %s\n", file->path, strerror(errno));
+        return 0;
+    }
+
+    file->data = 0;
+    file->size = 0;
+    for (;;)
+    {
+        unsigned char* const new_data = (unsigned char*)realloc(file->data, capacity);
+        if (!new_data)
+        {
+            fprintf(stderr, "%s: Out of memory\n", file->path);
+            fclose(stream);
+            return 0;
+        }
+        file->data = new_data;
+        file->size += fread(file->data + file->size, 1, capacity - file->size, stream);
+        if (file->size < capacity)
+            break;
+        capacity *= 2;
+    }
+
+    if (ferror(stream))
+    {
+        fprintf(stderr, "%s: Read error\n", file->path);
+        fclose(stream);
+        return 0;
+    }
+    fclose(stream);
+    return 1;
+}
+
+static int tracedump_add_site(tracedump_file* const file, unsigned char const* const block, size_t const size)
+{
+    unsigned long id, file_len, format_len;
+    tracedump_site* site;
+
+    if (size < TRACE_SITE_HEADER_SIZE)
+        return 0;
+    id = tracedump_get_u32(block);
+    file_len = tracedump_get_u16(block + 10);
+    format_len = tracedump_get_u16(block + 12);
+    if (id == 0 || size != TRACE_SITE_HEADER_SIZE + block[9] + file_len + format_len)
+        return 0;
+
+    if (id >= file->site_count)
+    {
+        size_t const new_count = id + 1;
+        tracedump_site** const new_sites = (tracedump_site**)realloc(file->sites, sizeof(tracedump_site*) * new_count);
+        if (!new_sites)
+            return 0;
+        memset(new_sites + file->site_count, 0, sizeof(tracedump_site*) * (new_count - file->site_count));
+        file->sites = new_sites;
+        file->site_count = new_count;
+    }
+
+    site = (tracedump_site*)malloc(sizeof(tracedump_site));
+    if (!site)
+        return 0;
+    site->line = tracedump_get_u32(block + 4);
+    site->level = block[8];
+    site->arg_count = block[9];
+    site->flags = (unsigned int)tracedump_get_u16(block + 14);
+    site->file = tracedump_copy_string(block + TRACE_SITE_HEADER_SIZE + site->arg_count, file_len);
+    site->format = tracedump_copy_string(block + TRACE_SITE_HEADER_SIZE + site->arg_count + file_len, format_len);
+    if (!site->file || !site->format)
+        return 0;
+
+    /* Sites are defined again after the file was rotated, the definitions are the same. */
+    free(file->sites[id]);
+    file->sites[id] = site;
+    return 1;
+}
+
+/* Converts a timestamp to a FILETIME without overflowing for long runs. */
+static unsigned long long tracedump_event_time(tracedump_file const* const file, unsigned long long const counter)
+{
+    unsigned long long const frequency = file->counter_frequency ? file->counter_frequency : 1;
+    unsigned long long const ticks = counter - file->counter_start;
+
+    return file->time_start + ticks / frequency * 10000000ULL + ticks % frequency * 10000000ULL / frequency;
+}
+
+static int tracedump_add_events(tracedump_file* const file, unsigned char const* const block, size_t const size)
+{
+    unsigned long thread_id;
+    size_t pos;
+
+    if (size < TRACE_EVENTS_HEADER_SIZE)
+        return 0;
+    thread_id = tracedump_get_u32(block);
+
+    for (pos = TRACE_EVENTS_HEADER_SIZE; pos < size;)
+    {
+        tracedump_event* event;
+        unsigned long site_id;
+        size_t args_size;
+
+        if (size - pos < TRACE_EVENT_HEADER_SIZE)
+            return 0;
+        site_id = tracedump_get_u32(block + pos);
+        args_size = tracedump_get_u32(block + pos + 4);
+        if (size - pos - TRACE_EVENT_HEADER_SIZE < args_size || site_id >= file->site_count ||
+            !file->sites[site_id])
+            return 0;
+
+        if (tracedump_event_count == tracedump_event_capacity)
+        {
+            size_t const new_capacity = tracedump_event_capacity ? tracedump_event_capacity * 2 : 4096;
+            tracedump_event* const new_events = (tracedump_event*)realloc(tracedump_events,
+                                                                          sizeof(tracedump_event) * new_capacity);
+            if (!new_events)
+                return 0;
+            tracedump_events = new_events;
+            tracedump_event_capacity = new_capacity;
+        }
+
+        event = &tracedump_events[tracedump_event_count];
+        event->time = tracedump_event_time(file, tracedump_get_u64(block + pos + 8));
+        event->order = tracedump_event_count;
+        event->file = file;
+        event->site = file->sites[site_id];
+        event->thread_id = thread_id;
+        event->args = block + pos + TRACE_EVENT_HEADER_SIZE;
+        event->args_size = args_size;
+        ++tracedump_event_count;
+
+        pos += TRACE_EVENT_HEADER_SIZE + args_size;
+    }
+
+    return 1;
+}
+
+static int tracedump_load(tracedump_file* const file)
+{
+    size_t pos;
+
+    if (!tracedump_read_file(file))
+        return 0;
+
+    if (file->size < TRACE_FILE_HEADER_SIZE || memcmp(file->data, TRACE_FILE_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "%s: Not a winestreamproxy trace file\n", file->path);
+        return 0;
+    }
+    file->counter_frequency = tracedump_get_u64(file->data + 8);
+    file->counter_start = tracedump_get_u64(file->data + 16);
+    file->time_start = tracedump_get_u64(file->data + 24);
+
+    for (pos = TRACE_FILE_HEADER_SIZE; pos < file->size;)
+    {
+        unsigned char const* const block = file->data + pos;
+        unsigned long type;
+        size_t size;
+        int ok = 1;
+
+        if (file->size - pos < TRACE_BLOCK_HEADER_SIZE)
+            ok = 0;
+        else
+        {
+            type = tracedump_get_u32(block);
+            size = tracedump_get_u32(block + 4);
+            if (file->size - pos - TRACE_BLOCK_HEADER_SIZE < size)
+                ok = 0;
+            else if (type == TRACE_BLOCK_SITE)
+                ok = tracedump_add_site(file, block + TRACE_BLOCK_HEADER_SIZE, size);
+            else if (type == TRACE_BLOCK_EVENTS)
+                ok = tracedump_add_events(file, block + TRACE_BLOCK_HEADER_SIZE, size);
+        }
+
+        /* The process may have died in the middle of writing a block, the blocks before it are still good. */
+        if (!ok)
+        {
+            fprintf(stderr, "%s: Ignoring damaged data at offset %lu\n", file->path, (unsigned long)pos);
+            break;
+        }
+        pos += TRACE_BLOCK_HEADER_SIZE + size;
+    }
+
+    return 1;
+}
+
+static int tracedump_compare_events(void const* const a, void const* const b)
+{
+    tracedump_event const* const left = (tracedump_event const*)a;
+    tracedump_event const* const right = (tracedump_event const*)b;
+
+    if (left->time != right->time)
+        return left->time < right->time ? -1 : 1;
+    return left->order < right->order ? -1 : left->order > right->order;
+}
+
+/* Turns a character code into UTF-8. */
+static void tracedump_encode_char(unsigned long const code, char out[5])
+{
+    if (code < 0x80)
+    {
+        out[0] = (char)code;
+        out[1] = '\0';
+    }
+    else if (code < 0x800)
+    {
+        out[0] = (char)(0xC0 | code >> 6);
+        out[1] = (char)(0x80 | (code & 0x3F));
+        out[2] = '\0';
+    }
+    else if (code < 0x10000)
+    {
+        out[0] = (char)(0xE0 | code >> 12);
+        out[1] = (char)(0x80 | (code >> 6 & 0x3F));
+        out[2] = (char)(0x80 | (code & 0x3F));
+        out[3] = '\0';
+    }
+    else
+    {
+        out[0] = (char)(0xF0 | (code >> 18 & 0x07));
+        out[1] = (char)(0x80 | (code >> 12 & 0x3F));
+        out[2] = (char)(0x80 | (code >> 6 & 0x3F));
+        out[3] = (char)(0x80 | (code & 0x3F));
+        out[4] = '\0';
+    }
+}
+
+/* Builds a format for one conversion with the width and precision filled in and the given length and conversion. */
+static void tracedump_build_spec(char const* const format, trace_format_spec const* const spec, long const width,
+                                 long const precision, char const* const suffix, char* const out, size_t const out_size)
+{
+    size_t i = spec->start + 1, len = 1;
+    int seen_dot = 0;
+
+    out[0] = '%';
+    if (spec->width_arg && width < 0)
+        out[len++] = '-';
+    for (; i < spec->length_start && len < out_size - 48; ++i)
+    {
+        if (format[i] == '.')
+        {
+            seen_dot = 1;
+            /* A negative precision argument means that there is no precision. */
+            if (spec->precision_arg && precision < 0)
+            {
+                ++i;
+                continue;
+            }
+        }
+        if (format[i] == '*')
+            len += (size_t)sprintf(out + len, "%ld", seen_dot ? precision : width < 0 ? -width : width);
+        else
+            out[len++] = format[i];
+    }
+    out[len] = '\0';
+    strcat(out, suffix);
+}
+
+static int tracedump_print_message(FILE* const out, tracedump_site const* const site, unsigned char const* args,
+                                   size_t args_size)
+{
+    char const* const format = site->format;
+    trace_format_spec spec;
+    size_t pos = 0, literal = 0;
+    int ret;
+
+    while ((ret = trace_format_next(format, &pos, site->flags & TRACE_SITE_WIDE, &spec)) == 1)
+    {
+        unsigned char const type = spec.type & ~TRACE_ARG_SIGNED;
+        long width = 0, precision = -1;
+        unsigned long long value = 0;
+        char native_spec[64];
+
+        fwrite(format + literal, 1, spec.start - literal, out);
+        literal = spec.end;
+
+        if (spec.conversion == '%')
+        {
+            fputc('%', out);
+            continue;
+        }
+
+        if (spec.width_arg)
+        {
+            if (args_size < 8)
+                return 0;
+            width = (long)(int)tracedump_get_u64(args);
+            args += 8;
+            args_size -= 8;
+        }
+        if (spec.precision_arg)
+        {
+            if (args_size < 8)
+                return 0;
+            precision = (long)(int)tracedump_get_u64(args);
+            args += 8;
+            args_size -= 8;
+        }
+
+        if (type == TRACE_ARG_STRING || type == TRACE_ARG_WIDE_STRING)
+        {
+            unsigned long len;
+            char* text;
+
+            if (args_size < 4)
+                return 0;
+            len = tracedump_get_u32(args);
+            args += 4;
+            args_size -= 4;
+            if (len == TRACE_NULL_STRING)
+                text = tracedump_copy_string((unsigned char const*)"(null)", 6);
+            else
+            {
+                if (args_size < len)
+                    return 0;
+                text = tracedump_copy_string(args, len);
+                args += len;
+                args_size -= len;
+            }
+            if (!text)
+                return 0;
+
+            tracedump_build_spec(format, &spec, width, precision, "s", native_spec, sizeof(native_spec));
+            fprintf(out, native_spec, text);
+            free(text);
+            continue;
+        }
+
+        if (args_size < 8)
+            return 0;
+        value = tracedump_get_u64(args);
+        args += 8;
+        args_size -= 8;
+
+        switch (spec.conversion)
+        {
+            case 'c':
+            case 'C':
+            {
+                char text[5];
+
+                tracedump_encode_char((unsigned long)(value & 0x1FFFFF), text);
+                tracedump_build_spec(format, &spec, width, -1, "s", native_spec, sizeof(native_spec));
+                fprintf(out, native_spec, text);
+                break;
+            }
+            case 'p':
+                /* Like msvcrt, which pads pointers to their full width. */
+                fprintf(out, "%016llX", value);
+                break;
+            case 'd':
+            case 'i':
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+            {
+                char suffix[4];
+
+                suffix[0] = 'l';
+                suffix[1] = 'l';
+                suffix[2] = spec.conversion;
+                suffix[3] = '\0';
+                tracedump_build_spec(format, &spec, width, precision, suffix, native_spec, sizeof(native_spec));
+                if (spec.type & TRACE_ARG_SIGNED)
+                    fprintf(out, native_spec, (long long)value);
+                else
+                    fprintf(out, native_spec, value);
+                break;
+            }
+            default:
+            {
+                char suffix[2];
+                double number;
+
+                memcpy(&number, &value, sizeof(number));
+                suffix[0] = spec.conversion;
+                suffix[1] = '\0';
+                tracedump_build_spec(format, &spec, width, precision, suffix, native_spec, sizeof(native_spec));
+                fprintf(out, native_spec, number);
+                break;
+            }
+        }
+    }
+
+    fputs(format + literal, out);
+    return ret == 0;
+}
+
+static void tracedump_print_event(FILE* const out, tracedump_event const* const event)
+{
+    tracedump_site const* const site = event->site;
+    unsigned long long const unix_time = event->time - TRACEDUMP_FILETIME_UNIX_EPOCH;
+    time_t const seconds = (time_t)(unix_time / 10000000ULL);
+    unsigned long const microseconds = (unsigned long)(unix_time % 10000000ULL / 10);
+    char time_text[32];
+    struct tm tm;
+
+    if (!localtime_r(&seconds, &tm) || !strftime(time_text, sizeof(time_text), "%Y-%m-%d %H:%M:%S", &tm))
+        strcpy(time_text, "0000-00-00 00:00:00");
+
+    fprintf(out, "%s.%06lu %s[%08lx]: ", time_text, microseconds,
+            site->level <= 5 ? tracedump_level_prefixes[site->level] : "UNKNOWN ", event->thread_id);
+    if (!tracedump_print_message(out, site, event->args, event->args_size))
+        fputs(" <damaged arguments>", out);
+    fprintf(out, "\n%47sAt %s:%lu\n", "", site->file, site->line);
+}
+
+int main(int const argc, char** const argv)
+{
+    tracedump_file* files;
+    int i, failed = 0;
+    size_t j;
+
+    if (argc < 2 || strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0)
+    {
+        fprintf(stderr, "Usage: %s <trace file>...\n"
+                        "Prints the messages of winestreamproxy trace files in the order they were logged.\n"
+                        "Pass <path>.old before <path> to include the messages from before the last rotation.\n",
+                argv[0]);
+        return argc < 2 ? 2 : 0;
+    }
+
+    files = (tracedump_file*)calloc((size_t)argc - 1, sizeof(tracedump_file));
+    if (!files)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (i = 1; i < argc; ++i)
+    {
+        files[i - 1].path = argv[i];
+        if (!tracedump_load(&files[i - 1]))
+            failed = 1;
+    }
+
+    qsort(tracedump_events, tracedump_event_count, sizeof(tracedump_event), tracedump_compare_events);
+    for (j = 0; j < tracedump_event_count; ++j)
+        tracedump_print_event(stdout, &tracedump_events[j]);
+
+    return failed;
+}